@@ -0,0 +1,217 @@
+#include "compress.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+
+/* The last bytes are always literals, and no match starts this close to the
+ * end, so the matcher can read whole words without checking bounds. */
+#define LZ_LAST_LITERALS (5)
+#define LZ_MATCH_FIND_LIMIT (12)
+
+#define LZ_HASH_LOG (12)
+
+/* Lengths of 15 or more spill out of their token nibble */
+#define LZ_NIBBLE_MAX (15)
+
+static inline uint32_t read32(unsigned char const *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static unsigned char *write_extra_length(unsigned char *op, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+/* Writes literal_length literals followed by a match (none if match_length
+ * is 0). Returns false if it doesn't fit before end. */
+static bool write_sequence(unsigned char **op, unsigned char const *end,
+                           unsigned char const *literals,
+                           size_t literal_length, size_t offset,
+                           size_t match_length) {
+    unsigned char *o = *op;
+
+    const size_t worst = 1 + literal_length / 255 + 1 + literal_length + 2 +
+                         match_length / 255 + 1;
+    if ((size_t)(end - o) < worst) {
+        return false;
+    }
+
+    const size_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH
+                                               : 0;
+
+    unsigned char *const token = o++;
+    *token = (unsigned char)(
+        (literal_length < LZ_NIBBLE_MAX ? literal_length : LZ_NIBBLE_MAX)
+        << 4);
+    if (literal_length >= LZ_NIBBLE_MAX) {
+        o = write_extra_length(o, literal_length - LZ_NIBBLE_MAX);
+    }
+
+    memcpy(o, literals, literal_length);
+    o += literal_length;
+
+    if (match_length > 0) {
+        *token |= (unsigned char)(match_code < LZ_NIBBLE_MAX ? match_code
+                                                             : LZ_NIBBLE_MAX);
+        *o++ = (unsigned char)(offset & 0xff);
+        *o++ = (unsigned char)(offset >> 8);
+        if (match_code >= LZ_NIBBLE_MAX) {
+            o = write_extra_length(o, match_code - LZ_NIBBLE_MAX);
+        }
+    }
+
+    *op = o;
+    return true;
+}
+
+size_t lz_compress(void const *src, size_t src_size, void *dst,
+                   size_t capacity) {
+    unsigned char const *const in = src;
+    unsigned char const *const in_end = in + src_size;
+    unsigned char *const out = dst;
+    unsigned char *op = out;
+    unsigned char const *const out_end = out + capacity;
+
+    unsigned char const *ip = in;
+    unsigned char const *anchor = in;
+
+    /* Last position where each hashed 4 byte sequence was seen */
+    uint32_t table[1 << LZ_HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    if (src_size > LZ_MATCH_FIND_LIMIT) {
+        unsigned char const *const find_limit = in_end - LZ_MATCH_FIND_LIMIT;
+        unsigned char const *const match_limit = in_end - LZ_LAST_LITERALS;
+
+        while (ip < find_limit) {
+            const uint32_t sequence = read32(ip);
+            const uint32_t h = hash32(sequence);
+            unsigned char const *ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+                read32(ref) != sequence) {
+                /* Skip faster through data that doesn't compress */
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            unsigned char const *end = ip + LZ_MIN_MATCH;
+            unsigned char const *ref_end = ref + LZ_MIN_MATCH;
+            while (end < match_limit && *end == *ref_end) {
+                end++;
+                ref_end++;
+            }
+
+            if (!write_sequence(&op, out_end, anchor, (size_t)(ip - anchor),
+                                (size_t)(ip - ref), (size_t)(end - ip))) {
+                return 0;
+            }
+
+            ip = anchor = end;
+        }
+    }
+
+    if (!write_sequence(&op, out_end, anchor, (size_t)(in_end - anchor), 0,
+                        0)) {
+        return 0;
+    }
+
+    return (size_t)(op - out);
+}
+
+static int read_extra_length(unsigned char const **ip,
+                             unsigned char const *end, size_t *length) {
+    unsigned char byte;
+    do {
+        if (*ip == end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+ssize_t lz_decompress(void const *src, size_t src_size, void *dst,
+                      size_t capacity) {
+    unsigned char const *ip = src;
+    unsigned char const *const in_end = ip + src_size;
+    unsigned char *const out = dst;
+    unsigned char *op = out;
+    unsigned char const *const out_end = out + capacity;
+
+    while (ip < in_end) {
+        const unsigned token = *ip++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == LZ_NIBBLE_MAX &&
+            read_extra_length(&ip, in_end, &literal_length) == -1) {
+            return -1;
+        }
+
+        if (literal_length > (size_t)(in_end - ip) ||
+            literal_length > (size_t)(out_end - op)) {
+            return -1;
+        }
+
+        memcpy(op, ip, literal_length);
+        op += literal_length;
+        ip += literal_length;
+
+        /* The last sequence has no match */
+        if (ip == in_end) {
+            break;
+        }
+
+        if (in_end - ip < 2) {
+            return -1;
+        }
+        const size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+
+        size_t match_length = token & 0xf;
+        if (match_length == LZ_NIBBLE_MAX &&
+            read_extra_length(&ip, in_end, &match_length) == -1) {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(op - out) ||
+            match_length > (size_t)(out_end - op)) {
+            return -1;
+        }
+
+        unsigned char const *match = op - offset;
+        if (offset >= match_length) {
+            memcpy(op, match, match_length);
+        } else {
+            /* Overlapping match: repeats the last offset bytes */
+            for (size_t i = 0; i < match_length; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += match_length;
+    }
+
+    return op - out;
+}
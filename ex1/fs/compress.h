@@ -0,0 +1,24 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * LZ4-style block codec: a sequence of literals followed by a match of at
+ * least four bytes within the previous 64 KiB, repeated, with the data ending
+ * in literals.
+ */
+
+/* Compresses src_size bytes of src into dst.
+ * Returns: the compressed size, or 0 if it doesn't fit in capacity bytes */
+size_t lz_compress(void const *src, size_t src_size, void *dst,
+                   size_t capacity);
+
+/* Decompresses src_size bytes of src into dst.
+ * Returns: the decompressed size, -1 if src is malformed or the result
+ * doesn't fit in capacity bytes */
+ssize_t lz_decompress(void const *src, size_t src_size, void *dst,
+                      size_t capacity);
+
+#endif // COMPRESS_H
@@ -13,8 +13,32 @@
 
 #define DELAY (5000)
 
+/* Per-object locks are padded to this size to avoid false sharing */
+#define CACHE_LINE_SIZE (64)
+
 #define UNALLOCATED_BLOCK (-1)
 
+/* Copies of file data at least this large use non-temporal stores, so a big
+ * sequential transfer doesn't evict the rest of the cache */
+#define NT_COPY_THRESHOLD (64 * 1024)
+
+/* Files up to this size are kept inside the i-node, without data blocks, in
+ * the room of its block pointers (so the i-node stays one cache line) */
+#define INODE_INLINE_DATA_SIZE                                                 \
+    (sizeof(int) * (MAX_DIRECT_DATA_BLOCKS_PER_FILE + 1))
+
+/* Files opened with TFS_O_COMPRESS keep their contents in clusters of this
+ * many blocks, each compressed on its own */
+#define CLUSTER_BLOCKS (4)
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+/* Snapshots of the file system kept at the same time */
+#define MAX_SNAPSHOTS (4)
+
+/* Free space is summarized by counting runs of free blocks in classes of
+ * 1, 2-3, 4-7, ... blocks: floor(log2(DATA_BLOCKS)) + 1 of them */
+#define FREE_RUN_CLASSES (11)
+
 #define BLOCK_SIZEOF(x) (((x) + (BLOCK_SIZE - 1)) / BLOCK_SIZE)
 
 #define BLOCK_CURRENT(x) ((x) / BLOCK_SIZE)
@@ -0,0 +1,494 @@
+#include "kernels.h"
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Implementations of the kernels for one instruction set. Pattern fill is
+ * built on top of copy, so it needs no implementation of its own.
+ */
+typedef struct {
+    char const *name;
+    void (*zero)(void *dest, size_t n);
+    void (*copy)(void *dest, void const *src, size_t n);
+    int (*compare)(void const *a, void const *b, size_t n);
+    uint32_t (*crc32c)(uint32_t crc, void const *data, size_t n);
+    void (*block_crc32c)(void const *data, size_t count, uint32_t *crcs);
+} kernel_ops_t;
+
+/* CRC32C polynomial, bit reversed */
+#define CRC32C_POLY (0x82f63b78u)
+
+/* Byte at a time CRC32C table, filled by kernels_init */
+static uint32_t crc32c_table[256];
+
+static void crc32c_table_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+static void zero_scalar(void *dest, size_t n) { memset(dest, 0, n); }
+
+static void copy_scalar(void *dest, void const *src, size_t n) {
+    memcpy(dest, src, n);
+}
+
+static int compare_scalar(void const *a, void const *b, size_t n) {
+    return memcmp(a, b, n);
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, void const *data, size_t n) {
+    unsigned char const *p = data;
+
+    crc = ~crc;
+    for (; n > 0; n--, p++) {
+        crc = crc32c_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static void block_crc32c_scalar(void const *data, size_t count,
+                                uint32_t *crcs) {
+    char const *block = data;
+
+    for (size_t i = 0; i < count; i++, block += BLOCK_SIZE) {
+        crcs[i] = crc32c_scalar(0, block, BLOCK_SIZE);
+    }
+}
+
+#ifdef KERNELS_X86
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, void const *data, size_t n) {
+    unsigned char const *p = data;
+    uint64_t crc64 = ~crc;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = (uint32_t)crc64;
+    for (; n > 0; n--, p++) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+
+    return ~crc;
+}
+
+/* The crc32 instruction takes 3 cycles but a new one can start every cycle,
+ * so three blocks are checksummed together to keep it busy. */
+__attribute__((target("sse4.2"))) static void
+block_crc32c_sse42(void const *data, size_t count, uint32_t *crcs) {
+    char const *block = data;
+
+    for (; count >= 3; count -= 3, block += 3 * BLOCK_SIZE, crcs += 3) {
+        uint64_t a = 0xffffffffu, b = 0xffffffffu, c = 0xffffffffu;
+
+        for (size_t i = 0; i < BLOCK_SIZE; i += 8) {
+            uint64_t x, y, z;
+            memcpy(&x, block + i, sizeof(x));
+            memcpy(&y, block + BLOCK_SIZE + i, sizeof(y));
+            memcpy(&z, block + 2 * BLOCK_SIZE + i, sizeof(z));
+            a = _mm_crc32_u64(a, x);
+            b = _mm_crc32_u64(b, y);
+            c = _mm_crc32_u64(c, z);
+        }
+
+        crcs[0] = ~(uint32_t)a;
+        crcs[1] = ~(uint32_t)b;
+        crcs[2] = ~(uint32_t)c;
+    }
+
+    for (; count > 0; count--, block += BLOCK_SIZE, crcs++) {
+        *crcs = crc32c_sse42(0, block, BLOCK_SIZE);
+    }
+}
+
+/* Bytes to skip until dest is aligned to a given power of two. */
+static inline size_t misalignment(void const *dest, size_t alignment) {
+    return (size_t)(-(uintptr_t)dest & (alignment - 1));
+}
+
+__attribute__((target("avx2"))) static void zero_avx2(void *dest, size_t n) {
+    char *d = dest;
+    const __m256i zero = _mm256_setzero_si256();
+
+    if (n >= NT_COPY_THRESHOLD) {
+        const size_t head = misalignment(d, 32);
+        memset(d, 0, head);
+        d += head;
+        n -= head;
+
+        for (; n >= 128; n -= 128, d += 128) {
+            _mm256_stream_si256((__m256i *)d, zero);
+            _mm256_stream_si256((__m256i *)(d + 32), zero);
+            _mm256_stream_si256((__m256i *)(d + 64), zero);
+            _mm256_stream_si256((__m256i *)(d + 96), zero);
+        }
+        _mm_sfence();
+    }
+
+    for (; n >= 32; n -= 32, d += 32) {
+        _mm256_storeu_si256((__m256i *)d, zero);
+    }
+    memset(d, 0, n);
+}
+
+__attribute__((target("avx2"))) static void
+copy_avx2(void *dest, void const *src, size_t n) {
+    char *d = dest;
+    char const *s = src;
+
+    if (n >= NT_COPY_THRESHOLD) {
+        const size_t head = misalignment(d, 32);
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+
+        for (; n >= 128; n -= 128, d += 128, s += 128) {
+            const __m256i v0 = _mm256_loadu_si256((__m256i const *)s);
+            const __m256i v1 = _mm256_loadu_si256((__m256i const *)(s + 32));
+            const __m256i v2 = _mm256_loadu_si256((__m256i const *)(s + 64));
+            const __m256i v3 = _mm256_loadu_si256((__m256i const *)(s + 96));
+            _mm256_stream_si256((__m256i *)d, v0);
+            _mm256_stream_si256((__m256i *)(d + 32), v1);
+            _mm256_stream_si256((__m256i *)(d + 64), v2);
+            _mm256_stream_si256((__m256i *)(d + 96), v3);
+        }
+        _mm_sfence();
+    }
+
+    for (; n >= 128; n -= 128, d += 128, s += 128) {
+        const __m256i v0 = _mm256_loadu_si256((__m256i const *)s);
+        const __m256i v1 = _mm256_loadu_si256((__m256i const *)(s + 32));
+        const __m256i v2 = _mm256_loadu_si256((__m256i const *)(s + 64));
+        const __m256i v3 = _mm256_loadu_si256((__m256i const *)(s + 96));
+        _mm256_storeu_si256((__m256i *)d, v0);
+        _mm256_storeu_si256((__m256i *)(d + 32), v1);
+        _mm256_storeu_si256((__m256i *)(d + 64), v2);
+        _mm256_storeu_si256((__m256i *)(d + 96), v3);
+    }
+    for (; n >= 32; n -= 32, d += 32, s += 32) {
+        _mm256_storeu_si256((__m256i *)d,
+                            _mm256_loadu_si256((__m256i const *)s));
+    }
+    memcpy(d, s, n);
+}
+
+__attribute__((target("avx2"))) static int
+compare_avx2(void const *a, void const *b, size_t n) {
+    char const *x = a;
+    char const *y = b;
+
+    for (; n >= 64; n -= 64, x += 64, y += 64) {
+        const __m256i eq0 =
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i const *)x),
+                              _mm256_loadu_si256((__m256i const *)y));
+        const __m256i eq1 =
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i const *)(x + 32)),
+                              _mm256_loadu_si256((__m256i const *)(y + 32)));
+        if ((unsigned)_mm256_movemask_epi8(_mm256_and_si256(eq0, eq1)) !=
+            0xffffffffu) {
+            return memcmp(x, y, 64);
+        }
+    }
+    for (; n >= 32; n -= 32, x += 32, y += 32) {
+        const __m256i eq =
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i const *)x),
+                              _mm256_loadu_si256((__m256i const *)y));
+        if ((unsigned)_mm256_movemask_epi8(eq) != 0xffffffffu) {
+            return memcmp(x, y, 32);
+        }
+    }
+
+    return memcmp(x, y, n);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+zero_avx512(void *dest, size_t n) {
+    char *d = dest;
+    const __m512i zero = _mm512_setzero_si512();
+
+    if (n >= NT_COPY_THRESHOLD) {
+        const size_t head = misalignment(d, 64);
+        memset(d, 0, head);
+        d += head;
+        n -= head;
+
+        for (; n >= 256; n -= 256, d += 256) {
+            _mm512_stream_si512((__m512i *)d, zero);
+            _mm512_stream_si512((__m512i *)(d + 64), zero);
+            _mm512_stream_si512((__m512i *)(d + 128), zero);
+            _mm512_stream_si512((__m512i *)(d + 192), zero);
+        }
+        _mm_sfence();
+    }
+
+    for (; n >= 64; n -= 64, d += 64) {
+        _mm512_storeu_si512(d, zero);
+    }
+    memset(d, 0, n);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+copy_avx512(void *dest, void const *src, size_t n) {
+    char *d = dest;
+    char const *s = src;
+
+    if (n >= NT_COPY_THRESHOLD) {
+        const size_t head = misalignment(d, 64);
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+
+        for (; n >= 256; n -= 256, d += 256, s += 256) {
+            const __m512i v0 = _mm512_loadu_si512(s);
+            const __m512i v1 = _mm512_loadu_si512(s + 64);
+            const __m512i v2 = _mm512_loadu_si512(s + 128);
+            const __m512i v3 = _mm512_loadu_si512(s + 192);
+            _mm512_stream_si512((__m512i *)d, v0);
+            _mm512_stream_si512((__m512i *)(d + 64), v1);
+            _mm512_stream_si512((__m512i *)(d + 128), v2);
+            _mm512_stream_si512((__m512i *)(d + 192), v3);
+        }
+        _mm_sfence();
+    }
+
+    for (; n >= 256; n -= 256, d += 256, s += 256) {
+        const __m512i v0 = _mm512_loadu_si512(s);
+        const __m512i v1 = _mm512_loadu_si512(s + 64);
+        const __m512i v2 = _mm512_loadu_si512(s + 128);
+        const __m512i v3 = _mm512_loadu_si512(s + 192);
+        _mm512_storeu_si512(d, v0);
+        _mm512_storeu_si512(d + 64, v1);
+        _mm512_storeu_si512(d + 128, v2);
+        _mm512_storeu_si512(d + 192, v3);
+    }
+    for (; n >= 64; n -= 64, d += 64, s += 64) {
+        _mm512_storeu_si512(d, _mm512_loadu_si512(s));
+    }
+    memcpy(d, s, n);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static int
+compare_avx512(void const *a, void const *b, size_t n) {
+    unsigned char const *x = a;
+    unsigned char const *y = b;
+
+    for (; n >= 64; n -= 64, x += 64, y += 64) {
+        const __mmask64 ne = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(x),
+                                                     _mm512_loadu_si512(y));
+        if (ne != 0) {
+            const int i = __builtin_ctzll(ne);
+            return x[i] - y[i];
+        }
+    }
+
+    return memcmp(x, y, n);
+}
+
+static kernel_ops_t const kernel_ops[KERNEL_ISA_COUNT] = {
+    [KERNEL_ISA_SCALAR] = {"scalar", zero_scalar, copy_scalar, compare_scalar,
+                           crc32c_scalar, block_crc32c_scalar},
+    [KERNEL_ISA_AVX2] = {"avx2", zero_avx2, copy_avx2, compare_avx2,
+                         crc32c_sse42, block_crc32c_sse42},
+    [KERNEL_ISA_AVX512] = {"avx512", zero_avx512, copy_avx512, compare_avx512,
+                           crc32c_sse42, block_crc32c_sse42},
+};
+
+static bool isa_supported(kernel_isa_t isa) {
+    __builtin_cpu_init();
+
+    switch (isa) {
+    case KERNEL_ISA_SCALAR:
+        return true;
+    case KERNEL_ISA_AVX2:
+        return __builtin_cpu_supports("avx2") &&
+               __builtin_cpu_supports("sse4.2");
+    case KERNEL_ISA_AVX512:
+        return __builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("sse4.2");
+    case KERNEL_ISA_COUNT:
+    default:
+        return false;
+    }
+}
+
+#else
+
+static kernel_ops_t const kernel_ops[KERNEL_ISA_COUNT] = {
+    [KERNEL_ISA_SCALAR] = {"scalar", zero_scalar, copy_scalar, compare_scalar,
+                           crc32c_scalar, block_crc32c_scalar},
+    [KERNEL_ISA_AVX2] = {"avx2", zero_scalar, copy_scalar, compare_scalar,
+                         crc32c_scalar, block_crc32c_scalar},
+    [KERNEL_ISA_AVX512] = {"avx512", zero_scalar, copy_scalar, compare_scalar,
+                           crc32c_scalar, block_crc32c_scalar},
+};
+
+static bool isa_supported(kernel_isa_t isa) {
+    return isa == KERNEL_ISA_SCALAR;
+}
+
+#endif
+
+/* Selected implementation; the scalar one until kernels_init is called */
+static kernel_isa_t selected_isa = KERNEL_ISA_SCALAR;
+static kernel_ops_t const *ops = &kernel_ops[KERNEL_ISA_SCALAR];
+
+void kernels_init() {
+    crc32c_table_init();
+
+    for (int isa = KERNEL_ISA_COUNT - 1; isa >= 0; isa--) {
+        if (kernels_set_isa((kernel_isa_t)isa) == 0) {
+            return;
+        }
+    }
+}
+
+int kernels_set_isa(kernel_isa_t isa) {
+    if (isa >= KERNEL_ISA_COUNT || !isa_supported(isa)) {
+        return -1;
+    }
+
+    selected_isa = isa;
+    ops = &kernel_ops[isa];
+    return 0;
+}
+
+kernel_isa_t kernels_isa() { return selected_isa; }
+
+char const *kernels_isa_name(kernel_isa_t isa) {
+    if (isa >= KERNEL_ISA_COUNT) {
+        return NULL;
+    }
+
+    return kernel_ops[isa].name;
+}
+
+void block_zero(void *dest, size_t n) { ops->zero(dest, n); }
+
+void block_copy(void *dest, void const *src, size_t n) {
+    ops->copy(dest, src, n);
+}
+
+int block_compare(void const *a, void const *b, size_t n) {
+    return ops->compare(a, b, n);
+}
+
+uint32_t crc32c(uint32_t crc, void const *data, size_t n) {
+    return ops->crc32c(crc, data, n);
+}
+
+void block_crc32c(void const *data, size_t count, uint32_t *crcs) {
+    ops->block_crc32c(data, count, crcs);
+}
+
+void block_fill_pattern(void *dest, size_t n, void const *pattern,
+                        size_t pattern_size) {
+    if (pattern_size == 0) {
+        return;
+    }
+
+    char *d = dest;
+    size_t filled = pattern_size < n ? pattern_size : n;
+    memcpy(d, pattern, filled);
+
+    /* Doubles the filled prefix until it covers dest, so the work is done by
+     * a few large copies whatever the pattern size is. */
+    while (filled < n) {
+        const size_t chunk = filled < n - filled ? filled : n - filled;
+        ops->copy(d + filled, d, chunk);
+        filled += chunk;
+    }
+}
+
+/* MurmurHash3 (x64, 128 bit variant) constants */
+#define HASH128_C1 (0x87c37b91114253d5ull)
+#define HASH128_C2 (0x4cf5ad432745937full)
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint64_t mix_k1(uint64_t k1) {
+    return rotl64(k1 * HASH128_C1, 31) * HASH128_C2;
+}
+
+static inline uint64_t mix_k2(uint64_t k2) {
+    return rotl64(k2 * HASH128_C2, 33) * HASH128_C1;
+}
+
+void hash128(void const *data, size_t n, uint64_t hash[2]) {
+    unsigned char const *p = data;
+    const size_t blocks = n / 16;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+
+    for (size_t i = 0; i < blocks; i++, p += 16) {
+        uint64_t k1;
+        uint64_t k2;
+        memcpy(&k1, p, sizeof(k1));
+        memcpy(&k2, p + 8, sizeof(k2));
+
+        h1 ^= mix_k1(k1);
+        h1 = (rotl64(h1, 27) + h2) * 5 + 0x52dce729;
+        h2 ^= mix_k2(k2);
+        h2 = (rotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+
+    /* Tail of less than 16 bytes, little endian */
+    const size_t tail = n % 16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    for (size_t i = tail; i > 8; i--) {
+        k2 = k2 << 8 | p[i - 1];
+    }
+    for (size_t i = tail < 8 ? tail : 8; i > 0; i--) {
+        k1 = k1 << 8 | p[i - 1];
+    }
+    if (tail > 8) {
+        h2 ^= mix_k2(k2);
+    }
+    if (tail > 0) {
+        h1 ^= mix_k1(k1);
+    }
+
+    h1 ^= (uint64_t)n;
+    h2 ^= (uint64_t)n;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    hash[0] = h1;
+    hash[1] = h2;
+}
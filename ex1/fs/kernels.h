@@ -0,0 +1,56 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Instruction sets the block kernels are implemented with
+ */
+typedef enum {
+    KERNEL_ISA_SCALAR,
+    KERNEL_ISA_AVX2,
+    KERNEL_ISA_AVX512,
+    KERNEL_ISA_COUNT
+} kernel_isa_t;
+
+/* Selects the best implementation the CPU supports. Must be called before
+ * the kernels are used. */
+void kernels_init();
+
+/* Selects a given implementation (e.g. to benchmark it).
+ * Returns: 0 if the CPU supports it, -1 otherwise */
+int kernels_set_isa(kernel_isa_t isa);
+kernel_isa_t kernels_isa();
+char const *kernels_isa_name(kernel_isa_t isa);
+
+/* Sets n bytes of dest to zero. */
+void block_zero(void *dest, size_t n);
+
+/* Copies n bytes from src to dest; they must not overlap. Copies of at least
+ * NT_COPY_THRESHOLD bytes don't keep dest in the cache. */
+void block_copy(void *dest, void const *src, size_t n);
+
+/* Compares n bytes of a and b.
+ * Returns: 0 if equal, otherwise the sign of the first differing byte as in
+ * memcmp */
+int block_compare(void const *a, void const *b, size_t n);
+
+/* Fills n bytes of dest with copies of a pattern of pattern_size bytes (the
+ * last one may be cut short). */
+void block_fill_pattern(void *dest, size_t n, void const *pattern,
+                        size_t pattern_size);
+
+/* Extends a CRC32C (Castagnoli) checksum with n more bytes; start with 0. */
+uint32_t crc32c(uint32_t crc, void const *data, size_t n);
+
+/* Stores in crcs the CRC32C of each of count consecutive blocks of
+ * BLOCK_SIZE bytes. Independent blocks are checksummed at the same time, so
+ * this is faster than calling crc32c on each one. */
+void block_crc32c(void const *data, size_t count, uint32_t *crcs);
+
+/* Stores in hash a 128 bit hash (MurmurHash3) of n bytes of data, good
+ * enough to tell blocks of different contents apart. */
+void hash128(void const *data, size_t n, uint64_t hash[2]);
+
+#endif // KERNELS_H
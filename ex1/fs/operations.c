@@ -1,8 +1,11 @@
 #include "operations.h"
+#include "kernels.h"
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 int tfs_init() {
     state_init();
@@ -21,6 +24,7 @@ int tfs_init() {
 }
 
 int tfs_destroy() {
+    tfs_defrag_stop();
     state_destroy();
     return 0;
 }
@@ -40,7 +44,7 @@ int tfs_lookup(char const *name) {
     return find_in_dir(ROOT_DIR_INUM, name);
 }
 
-int tfs_open(char const *name, int flags) {
+static int open_file(char const *name, int flags) {
     int inum;
     size_t offset;
 
@@ -52,23 +56,45 @@ int tfs_open(char const *name, int flags) {
     inum = tfs_lookup(name);
     if (inum >= 0) {
         /* The file already exists */
-        pthread_rwlock_wrlock(&inode_rw_locks[inum]);
+        /* Truncating drops every block of the file, so no read or write may
+         * be copying data in the meantime. */
+        const int range =
+            inode_range_lock(inum, RANGE_WHOLE_FILE_START, RANGE_WHOLE_FILE_END,
+                             (flags & TFS_O_TRUNC) ? RANGE_EXCLUSIVE
+                                                   : RANGE_SHARED);
+        if (range == -1) {
+            return -1;
+        }
+
+        pthread_rwlock_wrlock(inode_rw_lock(inum));
 
         inode_t *inode = inode_get(inum);
         /* Null inode / deleted meanwhile ---> not successful open. */
         if (inode == NULL || inode->i_node_type == T_PREV_USED) {
-            pthread_rwlock_unlock(&inode_rw_locks[inum]);
+            pthread_rwlock_unlock(inode_rw_lock(inum));
+            inode_range_unlock(inum, range);
             return -1;
         }
 
         /* Trucate (if requested) */
         if (flags & TFS_O_TRUNC) {
             if (inode->i_size > 0) {
+                if (inode_preserve(inum) == -1) {
+                    pthread_rwlock_unlock(inode_rw_lock(inum));
+                    inode_range_unlock(inum, range);
+                    return -1;
+                }
+
+                inode_write_begin(inum);
                 if (data_inode_blocks_free(inode) == -1) {
-                    pthread_rwlock_unlock(&inode_rw_locks[inum]);
+                    inode_write_end(inum);
+                    pthread_rwlock_unlock(inode_rw_lock(inum));
+                    inode_range_unlock(inum, range);
                     return -1;
                 }
                 inode->i_size = 0;
+                inode_data_reset(inode);
+                inode_write_end(inum);
             }
         }
         /* Determine initial offset */
@@ -78,7 +104,14 @@ int tfs_open(char const *name, int flags) {
             offset = 0;
         }
 
-        pthread_rwlock_unlock(&inode_rw_locks[inum]);
+        /* Whether the file is compressed was decided when it was created */
+        flags &= ~TFS_O_COMPRESS;
+        if (inode->i_compressed) {
+            flags |= TFS_O_COMPRESS;
+        }
+
+        pthread_rwlock_unlock(inode_rw_lock(inum));
+        inode_range_unlock(inum, range);
     } else if (flags & TFS_O_CREAT) {
         /* The file doesn't exist; the flags specify that it should be created*/
         /* Create inode */
@@ -87,6 +120,18 @@ int tfs_open(char const *name, int flags) {
             return -1;
         }
 
+        if (flags & TFS_O_COMPRESS) {
+            pthread_rwlock_wrlock(inode_rw_lock(inum));
+            inode_t *inode = inode_get(inum);
+            if (inode != NULL) {
+                inode_write_begin(inum);
+                inode->i_compressed = true;
+                inode_data_reset(inode);
+                inode_write_end(inum);
+            }
+            pthread_rwlock_unlock(inode_rw_lock(inum));
+        }
+
         /* Add entry in the root directory */
         if (add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
             inode_delete(inum);
@@ -100,271 +145,981 @@ int tfs_open(char const *name, int flags) {
 
     /* Finally, add entry to the open file table and
      * return the corresponding handle */
-    return add_to_open_file_table(inum, offset);
+    return add_to_open_file_table(inum, offset, flags, -1);
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
      * opened but it remains created */
 }
 
-int tfs_close(int fhandle) {
-    /* Since writes are individual, we use it to close as well. */
-    pthread_rwlock_wrlock(&open_file_entries_rw_locks[fhandle]);
-    const int rc = remove_from_open_file_table(fhandle);
-    pthread_rwlock_unlock(&open_file_entries_rw_locks[fhandle]);
+int tfs_open(char const *name, int flags) {
+    /* Creating or truncating the file must not overlap a new snapshot */
+    const int gate = write_gate_enter();
+    const int rc = open_file(name, flags);
+    write_gate_exit(gate);
 
     return rc;
 }
 
-static ssize_t read_impl(size_t of_offset, inode_t *inode, void *buffer,
-                         size_t to_read) {
-    if (to_read == 0) {
+/* Locks the whole range of the source (shared) and of the destination
+ * (exclusive) of a clone, and the rwlocks of both for writing (the source
+ * may be preserved for a snapshot, and its blocks get references), always
+ * in inumber order. */
+static void clone_lock(int source, int dest, int *source_range,
+                       int *dest_range) {
+    const int first = source < dest ? source : dest;
+    const int second = source < dest ? dest : source;
+
+    int ranges[2];
+    ranges[0] = inode_range_lock(first, RANGE_WHOLE_FILE_START,
+                                 RANGE_WHOLE_FILE_END,
+                                 first == dest ? RANGE_EXCLUSIVE
+                                               : RANGE_SHARED);
+    ranges[1] = inode_range_lock(second, RANGE_WHOLE_FILE_START,
+                                 RANGE_WHOLE_FILE_END,
+                                 second == dest ? RANGE_EXCLUSIVE
+                                                : RANGE_SHARED);
+    *source_range = ranges[first == dest];
+    *dest_range = ranges[first == source];
+
+    pthread_rwlock_wrlock(inode_rw_lock(first));
+    pthread_rwlock_wrlock(inode_rw_lock(second));
+}
+
+static void clone_unlock(int source, int dest, int source_range,
+                         int dest_range) {
+    pthread_rwlock_unlock(inode_rw_lock(source));
+    pthread_rwlock_unlock(inode_rw_lock(dest));
+    inode_range_unlock(source, source_range);
+    inode_range_unlock(dest, dest_range);
+}
+
+static int clone_file(char const *source_path, char const *dest_path) {
+    if (!valid_pathname(source_path) || !valid_pathname(dest_path)) {
+        return -1;
+    }
+
+    const int source = tfs_lookup(source_path);
+    if (source == -1) {
+        return -1;
+    }
+
+    /* A file is already a clone of itself (and truncating it first would
+     * lose its contents) */
+    if (tfs_lookup(dest_path) == source) {
         return 0;
     }
 
-    if (of_offset > inode->i_size) {
+    const int fhandle = open_file(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    if (fhandle == -1) {
         return -1;
     }
+    const int dest = get_open_file_entry(fhandle)->of_inumber;
+    tfs_close(fhandle);
+
+    /* Both inumbers are valid, so locking their ranges can't fail */
+    int source_range, dest_range;
+    clone_lock(source, dest, &source_range, &dest_range);
+    const int rc = inode_clone(source, dest);
+    clone_unlock(source, dest, source_range, dest_range);
+
+    return rc;
+}
+
+int tfs_clone(char const *source_path, char const *dest_path) {
+    /* The clone must be entirely in a new snapshot or not at all */
+    const int gate = write_gate_enter();
+    const int rc = clone_file(source_path, dest_path);
+    write_gate_exit(gate);
+
+    return rc;
+}
+
+/* Checks every path of a batch, and points to the names in the root
+ * directory (without the initial '/').
+ * Returns: the names (freed by the caller), NULL if some path is invalid */
+static char const **batch_names(char const *const *paths, int count) {
+    if (paths == NULL || count < 1) {
+        return NULL;
+    }
 
-    int starting_block_to_read = current_block(of_offset);
-    int last_block_to_read = final_block(of_offset, to_read);
-    size_t block_offset = BLOCK_OFFSET(of_offset);
+    char const **names = malloc((size_t)count * sizeof(*names));
+    if (names == NULL) {
+        return NULL;
+    }
 
-    // reads the first
-    int block_number = get_block_number(inode, starting_block_to_read);
-    if (block_number == -1) {
+    for (int i = 0; i < count; i++) {
+        if (!valid_pathname(paths[i])) {
+            free(names);
+            return NULL;
+        }
+        names[i] = paths[i] + 1;
+    }
+
+    return names;
+}
+
+static int create_many(char const *const *names, int count, int flags,
+                       int *inumbers) {
+    if (find_many_in_dir(ROOT_DIR_INUM, count, names, inumbers) == -1) {
         return -1;
     }
-    void *real_block = data_block_get(block_number);
-    if (real_block == NULL) {
+
+    int missing = 0;
+    for (int i = 0; i < count; i++) {
+        missing += inumbers[i] == -1;
+    }
+    if (missing == 0) {
+        return 0;
+    }
+
+    int *const created = malloc((size_t)missing * sizeof(*created));
+    if (created == NULL) {
         return -1;
     }
 
-    if (starting_block_to_read == last_block_to_read) {
-        memcpy(buffer, real_block + block_offset, to_read);
-        return (ssize_t)to_read;
+    /* Names beyond the i-nodes left aren't created */
+    const int taken =
+        inode_create_many(missing, (flags & TFS_O_COMPRESS) != 0, created);
+    for (int i = 0, next = 0; i < count; i++) {
+        if (inumbers[i] == -1 && next < taken) {
+            inumbers[i] = created[next++];
+        }
     }
 
-    memcpy(buffer, real_block + block_offset, BLOCK_SIZE - block_offset);
+    if (add_dir_entries(ROOT_DIR_INUM, count, inumbers, names) == -1) {
+        for (int i = 0; i < count; i++) {
+            inumbers[i] = -1;
+        }
+    }
 
-    // reads medium blocks
-    size_t buffer_offset = BLOCK_SIZE - block_offset;
-    for (int block = starting_block_to_read + 1; block < last_block_to_read;
-         block++) {
-        block_number = get_block_number(inode, block);
-        if (block_number == -1) {
-            return -1;
+    /* Other threads may have created some of the files meanwhile (or the
+     * batch may repeat a name): those i-nodes go unused */
+    for (int next = 0; next < taken; next++) {
+        bool used = false;
+        for (int i = 0; i < count && !used; i++) {
+            used = inumbers[i] == created[next];
+        }
+        if (!used) {
+            inode_delete(created[next]);
         }
+    }
+    free(created);
 
-        real_block = data_block_get(block_number);
-        if (real_block == NULL) {
+    for (int i = 0; i < count; i++) {
+        if (inumbers[i] == -1) {
             return -1;
         }
-        memcpy(buffer + buffer_offset, real_block, BLOCK_SIZE);
-        buffer_offset += BLOCK_SIZE;
     }
 
-    // reads last block
-    block_number = get_block_number(inode, last_block_to_read);
-    if (block_number == -1) {
+    return 0;
+}
+
+int tfs_create_many(char const *const *paths, int count, int flags,
+                    int *inumbers) {
+    char const **names = batch_names(paths, count);
+    if (names == NULL || inumbers == NULL) {
+        free(names);
         return -1;
     }
 
-    real_block = data_block_get(block_number);
-    if (real_block == NULL) {
+    /* Creating the files must not overlap a new snapshot */
+    const int gate = write_gate_enter();
+    const int rc = create_many(names, count, flags, inumbers);
+    write_gate_exit(gate);
+
+    free(names);
+    return rc;
+}
+
+int tfs_stat_many(char const *const *paths, int count, tfs_stat_t *stats) {
+    char const **names = batch_names(paths, count);
+    if (names == NULL) {
         return -1;
     }
 
-    size_t last_read = to_read - buffer_offset;
-    memcpy(buffer + buffer_offset, real_block, last_read);
+    int *inumbers = malloc((size_t)count * sizeof(*inumbers));
+    if (inumbers == NULL || stats == NULL ||
+        find_many_in_dir(ROOT_DIR_INUM, count, names, inumbers) == -1) {
+        free(names);
+        free(inumbers);
+        return -1;
+    }
 
-    return (ssize_t)to_read;
+    int rc = 0;
+    for (int i = 0; i < count; i++) {
+        inode_t inode;
+        if (inumbers[i] == -1 || inode_snapshot(inumbers[i], &inode) == -1 ||
+            inode.i_node_type != T_FILE) {
+            /* Missing, or deleted since it was looked up */
+            stats[i].st_inumber = -1;
+            stats[i].st_size = 0;
+            stats[i].st_compressed = false;
+            rc = -1;
+            continue;
+        }
+
+        stats[i].st_inumber = inumbers[i];
+        stats[i].st_size = inode.i_size;
+        stats[i].st_compressed = inode.i_compressed;
+    }
+
+    free(names);
+    free(inumbers);
+    return rc;
 }
 
-static ssize_t write_impl(size_t of_offset, inode_t *inode, void const *buffer,
-                          size_t to_write) {
-    if (to_write == 0)
+int tfs_snapshot_create() { return snapshot_create(); }
+
+int tfs_snapshot_open(int snapshot, char const *name) {
+    if (!valid_pathname(name) || snapshot_acquire(snapshot) == -1) {
+        return -1;
+    }
+
+    inode_t inode;
+    const int inum = snapshot_find_in_dir(snapshot, name + 1);
+    if (inum == -1 || snapshot_inode_get(snapshot, inum, &inode) == -1 ||
+        inode.i_node_type != T_FILE) {
+        snapshot_release(snapshot);
+        return -1;
+    }
+
+    const int fhandle = add_to_open_file_table(inum, 0, 0, snapshot);
+    if (fhandle == -1) {
+        snapshot_release(snapshot);
+    }
+
+    return fhandle;
+}
+
+int tfs_snapshot_delete(int snapshot) { return snapshot_delete(snapshot); }
+
+int tfs_close(int fhandle) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    /* Since writes are individual, we use it to close as well. */
+    pthread_rwlock_wrlock(open_file_entry_rw_lock(fhandle));
+    const int snapshot = file->of_snapshot;
+    const int rc = remove_from_open_file_table(fhandle);
+    pthread_rwlock_unlock(open_file_entry_rw_lock(fhandle));
+
+    if (rc == 0 && snapshot != -1) {
+        snapshot_release(snapshot);
+    }
+
+    return rc;
+}
+
+/* Length of a cluster of a file of a given size. */
+static size_t cluster_length(size_t size, int cluster) {
+    const size_t start = (size_t)cluster * CLUSTER_SIZE;
+    if (size <= start) {
         return 0;
+    }
 
-    int last_block_to_write = final_block(of_offset, to_write);
-    int starting_block = current_block(of_offset);
-    size_t block_offset = BLOCK_OFFSET(of_offset);
-    ssize_t rc = 0;
+    return size - start < CLUSTER_SIZE ? size - start : CLUSTER_SIZE;
+}
 
-    // makes the memory necessary to make the writing possible
-    const int prev = last_block_to_write;
-    if ((last_block_to_write = allocate_blocks(inode, of_offset, to_write)) !=
-        prev) {
-        /* We'll still write until where we can, but we fail anyway. */
-        to_write =
-            (size_t)(last_block_to_write - starting_block + 1) * BLOCK_SIZE;
-        rc = -1;
+/* Last block (relative to the inode) of a cluster. */
+static int cluster_last_block(int cluster) {
+    const int last = (cluster + 1) * CLUSTER_BLOCKS - 1;
+    return last < (int)MAX_BLOCKS ? last : (int)MAX_BLOCKS - 1;
+}
+
+/* Reads from a compressed file, decompressing each cluster read. */
+static ssize_t read_clusters(size_t offset, inode_t *inode, void *buffer,
+                             size_t to_read) {
+    const int last_cluster = (int)((offset + to_read - 1) / CLUSTER_SIZE);
+    block_map_t map;
+    if (block_map_init(&map, inode, cluster_last_block(last_cluster)) == -1) {
+        return -1;
+    }
+
+    char cluster[CLUSTER_SIZE];
+    size_t buffer_offset = 0;
+    for (int c = (int)(offset / CLUSTER_SIZE); c <= last_cluster; c++) {
+        if (cluster_load(&map, c, cluster, cluster_length(inode->i_size, c)) ==
+            -1) {
+            return -1;
+        }
+
+        const size_t from = (offset + buffer_offset) % CLUSTER_SIZE;
+        size_t to_copy = CLUSTER_SIZE - from;
+        if (to_copy > to_read - buffer_offset) {
+            to_copy = to_read - buffer_offset;
+        }
+
+        memcpy(buffer + buffer_offset, cluster + from, to_copy);
+        buffer_offset += to_copy;
     }
 
-    // writes in the first block
-    int block_number = get_block_number(inode, starting_block);
-    if (block_number == -1) {
+    return (ssize_t)to_read;
+}
+
+/* Writes to a compressed file a cluster at a time; clusters only partly
+ * written are read back first. Compressing happens holding the inode rwlock,
+ * since storing a cluster changes its block map slots and allocates blocks.
+ * Must be called holding the rwlock and the range of the clusters written.
+ * Returns 0 if successful, -1 otherwise. */
+static int write_clusters(int inumber, inode_t *inode, void const *buffer,
+                          size_t offset, size_t to_write) {
+    const size_t end = offset + to_write;
+    const int last_cluster = (int)((end - 1) / CLUSTER_SIZE);
+    block_map_t map;
+    if (block_map_init(&map, inode, cluster_last_block(last_cluster)) == -1) {
         return -1;
     }
 
-    if (starting_block == last_block_to_write) {
-        // changes the meta data of the file
-        if (rc == -1 ||
-            fill_block(block_number, buffer, block_offset, to_write) == -1) {
+    char cluster[CLUSTER_SIZE];
+    for (int c = (int)(offset / CLUSTER_SIZE); c <= last_cluster; c++) {
+        const size_t start = (size_t)c * CLUSTER_SIZE;
+        const size_t from = offset > start ? offset - start : 0;
+        const size_t to = end - start < CLUSTER_SIZE ? end - start
+                                                     : CLUSTER_SIZE;
+
+        const size_t old_length = cluster_length(inode->i_size, c);
+        const size_t length = to > old_length ? to : old_length;
+
+        if (from > 0 || to < length) {
+            if (cluster_load(&map, c, cluster, old_length) == -1) {
+                return -1;
+            }
+            block_zero(cluster + old_length, length - old_length);
+        }
+
+        memcpy(cluster + from, buffer + (start + from - offset), to - from);
+
+        if (cluster_store(inumber, &map, c, cluster, length) == -1) {
             return -1;
         }
+    }
+
+    if (end > inode->i_size) {
+        inode_write_begin(inumber);
+        inode->i_size = end;
+        inode_write_end(inumber);
+    }
+
+    return 0;
+}
 
+static ssize_t read_impl(size_t of_offset, inode_t *inode, void *buffer,
+                         size_t to_read) {
+    if (to_read == 0) {
         return 0;
     }
 
-    if (fill_block(block_number, buffer, block_offset,
-                   BLOCK_SIZE - block_offset) == -1) {
+    if (of_offset > inode->i_size) {
         return -1;
     }
 
-    size_t buffer_offset = BLOCK_SIZE - block_offset;
+    if (inode->i_inline) {
+        memcpy(buffer, inode->i_inline_data + of_offset, to_read);
+        return (ssize_t)to_read;
+    }
 
-    // writes mid blocks
-    for (int block = starting_block + 1; block < last_block_to_write; block++) {
-        block_number = get_block_number(inode, block);
-        if (block_number == -1) {
+    if (inode->i_compressed) {
+        return read_clusters(of_offset, inode, buffer, to_read);
+    }
+
+    const int last_block = final_block(of_offset, to_read);
+    block_map_t map;
+    if (block_map_init(&map, inode, last_block) == -1) {
+        return -1;
+    }
+
+    // reads a run of physically contiguous blocks at a time
+    size_t buffer_offset = 0;
+    for (int block = current_block(of_offset); block <= last_block;) {
+        int block_number;
+        const int count = block_map_run(&map, block, last_block, &block_number);
+        if (count == -1) {
             return -1;
         }
-        if (fill_block(block_number, buffer + buffer_offset, 0, BLOCK_SIZE)) {
+
+        const size_t run_offset = BLOCK_OFFSET(of_offset + buffer_offset);
+        size_t to_copy = (size_t)count * BLOCK_SIZE - run_offset;
+        if (to_copy > to_read - buffer_offset) {
+            to_copy = to_read - buffer_offset;
+        }
+
+        if (read_run(block_number, count, buffer + buffer_offset, run_offset,
+                     to_copy) == -1) {
             return -1;
         }
-        buffer_offset += BLOCK_SIZE;
+
+        buffer_offset += to_copy;
+        block += count;
     }
 
-    // writes last block
-    block_number = get_block_number(inode, last_block_to_write);
-    if (block_number == -1) {
+    return (ssize_t)to_read;
+}
+
+static ssize_t write_impl(size_t of_offset, inode_t *inode, void const *buffer,
+                          size_t to_write) {
+    if (to_write == 0)
+        return 0;
+
+    const int last_block = final_block(of_offset, to_write);
+    block_map_t map;
+    if (block_map_init(&map, inode, last_block) == -1) {
         return -1;
     }
 
-    const size_t total_write = to_write - buffer_offset;
-    if (fill_block(block_number, buffer + buffer_offset, 0, total_write)) {
+    // writes a run of physically contiguous blocks at a time
+    size_t buffer_offset = 0;
+    for (int block = current_block(of_offset); block <= last_block;) {
+        int block_number;
+        const int count = block_map_run(&map, block, last_block, &block_number);
+        if (count == -1) {
+            return -1;
+        }
+
+        const size_t run_offset = BLOCK_OFFSET(of_offset + buffer_offset);
+        size_t to_copy = (size_t)count * BLOCK_SIZE - run_offset;
+        if (to_copy > to_write - buffer_offset) {
+            to_copy = to_write - buffer_offset;
+        }
+
+        if (fill_run(block_number, count, buffer + buffer_offset, run_offset,
+                     to_copy) == -1) {
+            return -1;
+        }
+
+        buffer_offset += to_copy;
+        block += count;
+    }
+
+    return 0;
+}
+
+/* Makes room in a file for to_write bytes at offset: allocates the blocks
+ * needed (those found in the deduplication index are shared instead, see
+ * allocate_blocks) and grows the file. Writes that leave the file small
+ * enough to be kept inside the inode are done right here, since they are
+ * cheaper than taking the range lock for the copy. Must be called between
+ * inode_write_begin and inode_write_end.
+ * Returns 1 if the contents were already written, 0 if they must still be
+ * copied to the blocks, -1 otherwise. */
+static int write_prepare(inode_t *inode, void const *buffer, size_t offset,
+                         size_t to_write, dedup_hashes_t *hashes) {
+    const size_t end = offset + to_write;
+
+    if (inode->i_inline) {
+        if (end <= INODE_INLINE_DATA_SIZE) {
+            /* Bytes skipped past the old end of the file read as zeros */
+            if (offset > inode->i_size) {
+                block_zero(inode->i_inline_data + inode->i_size,
+                           offset - inode->i_size);
+            }
+
+            memcpy(inode->i_inline_data + offset, buffer, to_write);
+            if (end > inode->i_size) {
+                inode->i_size = end;
+            }
+
+            return 1;
+        }
+
+        if (inode_inline_spill(inode) == -1) {
+            return -1;
+        }
+    }
+
+    // makes the memory necessary to make the writing possible
+    if (allocate_blocks(inode, offset, to_write, hashes) !=
+        final_block(offset, to_write)) {
         return -1;
     }
 
-    return rc;
+    /* Readers of the new bytes wait for our range, so the size is published
+     * before the contents are copied. */
+    if (end > inode->i_size) {
+        inode->i_size = end;
+    }
+
+    return 0;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
+/* Copies the contents of a write to the blocks of a file one block at a
+ * time, so whole blocks can be shared with other files and shared blocks are
+ * copied before being changed (see fill_block_cow). Blocks that were pointed
+ * to an indexed block when they were allocated already hold their contents.
+ * Blocks are replaced in the block map, so the inode rwlock must be held.
+ * Returns 0 if success, -1 otherwise. */
+static int write_cow(int inumber, inode_t *inode, void const *buffer,
+                     size_t offset, size_t to_write,
+                     dedup_hashes_t const *hashes) {
+    const int last_block = final_block(offset, to_write);
+    block_map_t map;
+    if (block_map_init(&map, inode, last_block) == -1) {
+        return -1;
+    }
+
+    size_t buffer_offset = 0;
+    for (int block = current_block(offset); block <= last_block; block++) {
+        const size_t block_offset = BLOCK_OFFSET(offset + buffer_offset);
+        size_t to_copy = BLOCK_SIZE - block_offset;
+        if (to_copy > to_write - buffer_offset) {
+            to_copy = to_write - buffer_offset;
+        }
+
+        if (!dedup_hashes_found(hashes, block) &&
+            fill_block_cow(inumber, &map, block, buffer + buffer_offset,
+                           block_offset, to_copy,
+                           dedup_hashes_fingerprint(hashes, block)) == -1) {
+            return -1;
+        }
+
+        buffer_offset += to_copy;
+    }
+
+    return 0;
+}
 
-    if (file == NULL || !is_taken_open_file_table(fhandle)) {
+/* The part of a write done with the inode rwlock held: keeps the file as it
+ * was for the newest snapshot, then writes the contents right away if the
+ * file is compressed, small enough to be kept inside the inode or may share
+ * blocks, or otherwise makes room for them.
+ * Returns 1 if the contents were already written, 0 if they must still be
+ * copied to the blocks, -1 otherwise. */
+static int write_locked(int inumber, inode_t *inode, void const *buffer,
+                        size_t offset, size_t to_write) {
+    if (inode_preserve(inumber) == -1) {
         return -1;
     }
 
-    pthread_rwlock_wrlock(&open_file_entries_rw_locks[fhandle]);
+    if (inode->i_compressed) {
+        return write_clusters(inumber, inode, buffer, offset, to_write) == -1
+                   ? -1
+                   : 1;
+    }
 
-    /* In the meantime, tfs_close might have been executed, so we double check.
-     */
-    ssize_t rc = -1;
-    if (is_taken_open_file_table(fhandle)) {
-        const int of_inumber = file->of_inumber;
+    /* Hashed before inode_write_begin, so readers don't retry meanwhile */
+    dedup_hashes_t hashes;
+    dedup_hash_write(&hashes, buffer, offset, to_write);
 
-        pthread_rwlock_wrlock(&inode_rw_locks[of_inumber]);
+    inode_write_begin(inumber);
+    int prepared = write_prepare(inode, buffer, offset, to_write, &hashes);
+    inode_write_end(inumber);
+
+    if (prepared == 0 &&
+        (dedup_in_use() || inode_blocks_shared(inode, offset, to_write))) {
+        prepared =
+            write_cow(inumber, inode, buffer, offset, to_write, &hashes) == -1
+                ? -1
+                : 1;
+    }
 
-        /* From the open file table entry, we get the inode */
-        inode_t *inode = inode_get(of_inumber);
+    return prepared;
+}
+
+/* Checks if an inode still holds a file (used for empty reads and writes,
+ * which don't lock any range). */
+static bool inode_usable(int inumber) {
+    inode_t inode;
+    return inode_snapshot(inumber, &inode) != -1 &&
+           inode.i_node_type != T_PREV_USED;
+}
+
+/* Blocks are checksummed (and clusters of compressed files rewritten) as a
+ * whole, so byte ranges are locked a whole block (or cluster) at a time:
+ * operations on different bytes of the same block would race to update (or
+ * find stale) its checksum. */
+static size_t range_unit(bool compressed) {
+    return compressed ? CLUSTER_SIZE : BLOCK_SIZE;
+}
+
+static size_t range_start(size_t offset, bool compressed) {
+    return offset - offset % range_unit(compressed);
+}
+
+static size_t range_end(size_t end, bool compressed) {
+    const size_t unit = range_unit(compressed);
+    return (end + unit - 1) / unit * unit;
+}
+
+/* Writes to a file at a given offset.
+ * Only the byte range being written is locked while the data is copied; the
+ * inode itself is locked just to allocate blocks and grow the file.
+ * Returns the number of bytes written, -1 otherwise. */
+static ssize_t write_at(int inumber, void const *buffer, size_t to_write,
+                        size_t offset, bool compressed) {
+    if (offset > MAX_FILE_SIZE) {
+        return -1;
+    }
+
+    /* Determine how many bytes to write */
+    if (to_write > MAX_FILE_SIZE - offset) {
+        to_write = MAX_FILE_SIZE - offset;
+    }
+
+    if (to_write == 0) {
+        return inode_usable(inumber) ? 0 : -1;
+    }
+
+    const int range = inode_range_lock(inumber, range_start(offset, compressed),
+                                       range_end(offset + to_write, compressed),
+                                       RANGE_EXCLUSIVE);
+    if (range == -1) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(inode_rw_lock(inumber));
+
+    inode_t *inode = inode_get(inumber);
+
+    /* Null inode / deleted meanwhile ---> not successful open. */
+    if (inode == NULL || inode->i_node_type == T_PREV_USED ||
+        inode->i_compressed != compressed) {
+        pthread_rwlock_unlock(inode_rw_lock(inumber));
+        inode_range_unlock(inumber, range);
+        return -1;
+    }
+
+    const int prepared = write_locked(inumber, inode, buffer, offset, to_write);
+
+    pthread_rwlock_unlock(inode_rw_lock(inumber));
+
+    /* The blocks of the range can't be freed while we hold it. */
+    ssize_t rc = prepared;
+    if (prepared == 0) {
+        rc = write_impl(offset, inode, buffer, to_write);
+    }
+
+    inode_range_unlock(inumber, range);
+
+    return rc == -1 ? -1 : (ssize_t)to_write;
+}
+
+/* Appends to a file. The range at the end of the file is reserved (the size
+ * grows by to_write at once) in a short critical section on the inode, and the
+ * data is copied afterwards, so appenders only serialize on the reservation.
+ * Input:
+ *  - end: where the offset right after the appended bytes is stored
+ * Returns the number of bytes written, -1 otherwise. */
+static ssize_t append_at_end(int inumber, void const *buffer, size_t to_write,
+                             size_t *end, bool compressed) {
+    while (true) {
+        pthread_rwlock_wrlock(inode_rw_lock(inumber));
+
+        inode_t *inode = inode_get(inumber);
 
         /* Null inode / deleted meanwhile ---> not successful open. */
-        if (inode == NULL || inode->i_node_type == T_PREV_USED) {
-            pthread_rwlock_unlock(&inode_rw_locks[of_inumber]);
-            pthread_rwlock_unlock(&open_file_entries_rw_locks[fhandle]);
+        if (inode == NULL || inode->i_node_type == T_PREV_USED ||
+            inode->i_compressed != compressed) {
+            pthread_rwlock_unlock(inode_rw_lock(inumber));
             return -1;
         }
 
+        const size_t offset = inode->i_size;
+
         /* Determine how many bytes to write */
-        if (to_write + file->of_offset > MAX_FILE_SIZE) {
-            to_write = MAX_FILE_SIZE - file->of_offset;
+        if (to_write > MAX_FILE_SIZE - offset) {
+            to_write = MAX_FILE_SIZE - offset;
         }
 
-        if (to_write > 0) {
-            if (write_impl(file->of_offset, inode, buffer, to_write) == -1) {
-                pthread_rwlock_unlock(&inode_rw_locks[of_inumber]);
-                pthread_rwlock_unlock(&open_file_entries_rw_locks[fhandle]);
-                return -1;
-            }
+        *end = offset + to_write;
 
-            /* The offset associated with the file handle is
-             * incremented accordingly */
-            file->of_offset += to_write;
-            if (file->of_offset > inode->i_size) {
-                inode->i_size = file->of_offset;
-            }
+        if (to_write == 0) {
+            pthread_rwlock_unlock(inode_rw_lock(inumber));
+            return 0;
+        }
+
+        /* Only operations past the end of the file (or on its last block)
+         * may hold this range. They don't need the inode lock to finish, but
+         * we can't wait for them while holding it. */
+        unsigned long generation;
+        const int range = inode_range_trylock(
+            inumber, range_start(offset, compressed),
+            range_end(offset + to_write, compressed), RANGE_EXCLUSIVE,
+            &generation);
+        if (range == -1) {
+            pthread_rwlock_unlock(inode_rw_lock(inumber));
+            inode_range_wait(inumber, generation);
+            continue;
+        }
+
+        const int prepared =
+            write_locked(inumber, inode, buffer, offset, to_write);
+
+        pthread_rwlock_unlock(inode_rw_lock(inumber));
+
+        ssize_t rc = prepared;
+        if (prepared == 0) {
+            rc = write_impl(offset, inode, buffer, to_write);
         }
 
-        pthread_rwlock_unlock(&inode_rw_locks[of_inumber]);
-        rc = (ssize_t)to_write;
+        inode_range_unlock(inumber, range);
+
+        return rc == -1 ? -1 : (ssize_t)to_write;
     }
+}
 
-    pthread_rwlock_unlock(&open_file_entries_rw_locks[fhandle]);
-    return rc;
+/* What read_optimistic returns when a writer may have changed what it read */
+#define READ_RACED (-2)
+
+/* Reads from a file at a given offset without locking anything: copies the
+ * inode and then the contents, and checks no writer took a range meanwhile.
+ * Blocks freed and reused in between are only ever read, never trusted.
+ * Returns the number of bytes read, -1 if failed, READ_RACED if the read
+ * must be done again with the range locked. */
+static ssize_t read_optimistic(int inumber, void *buffer, size_t len,
+                               size_t offset) {
+    unsigned long ticket;
+    if (!inode_data_read_begin(inumber, &ticket)) {
+        return READ_RACED;
+    }
+
+    inode_t inode;
+    if (inode_snapshot(inumber, &inode) == -1 ||
+        inode.i_node_type == T_PREV_USED || inode.i_compressed) {
+        return -1;
+    }
+
+    size_t to_read = offset < inode.i_size ? inode.i_size - offset : 0;
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    const ssize_t rc =
+        to_read > 0 ? read_impl(offset, &inode, buffer, to_read) : 0;
+
+    /* A failure may just be a block changed under us (its checksum is off) */
+    return inode_data_read_end(inumber, ticket) ? rc : READ_RACED;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
+/* Reads from a file at a given offset. Reads go without locking unless they
+ * race with a writer, and then lock only the byte range read; compressed
+ * files are always read locked (decompressing a cluster being rewritten
+ * isn't worth guarding against).
+ * Returns the number of bytes read, -1 otherwise. */
+static ssize_t read_at(int inumber, void *buffer, size_t len, size_t offset,
+                       bool compressed) {
+    if (offset >= MAX_FILE_SIZE) {
+        len = 0;
+    } else if (len > MAX_FILE_SIZE - offset) {
+        len = MAX_FILE_SIZE - offset;
+    }
 
-    if (file == NULL || !is_taken_open_file_table(fhandle)) {
+    if (len == 0) {
+        return inode_usable(inumber) ? 0 : -1;
+    }
+
+    if (!compressed) {
+        const ssize_t rc = read_optimistic(inumber, buffer, len, offset);
+        if (rc != READ_RACED) {
+            return rc;
+        }
+    }
+
+    const int range = inode_range_lock(inumber, range_start(offset, compressed),
+                                       range_end(offset + len, compressed),
+                                       RANGE_SHARED);
+    if (range == -1) {
         return -1;
     }
 
-    pthread_rwlock_wrlock(&open_file_entries_rw_locks[fhandle]);
+    /* Writers only change the block map outside our range (or wait for it),
+     * so a consistent copy of the inode is all we need. */
+    inode_t inode;
+
+    /* Null inode / deleted meanwhile ---> not successful open. */
+    if (inode_snapshot(inumber, &inode) == -1 ||
+        inode.i_node_type == T_PREV_USED || inode.i_compressed != compressed) {
+        inode_range_unlock(inumber, range);
+        return -1;
+    }
+
+    /* Determine how many bytes to read */
+    size_t to_read = offset < inode.i_size ? inode.i_size - offset : 0;
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    ssize_t rc = (ssize_t)to_read;
+    if (to_read > 0) {
+        rc = read_impl(offset, &inode, buffer, to_read);
+    }
+
+    inode_range_unlock(inumber, range);
+
+    return rc;
+}
+
+/* Reads from a file of a snapshot at a given offset. Its blocks never change,
+ * so nothing is locked.
+ * Returns the number of bytes read, -1 otherwise. */
+static ssize_t snapshot_read_at(int snapshot, int inumber, void *buffer,
+                                size_t len, size_t offset) {
+    inode_t inode;
+    if (snapshot_inode_get(snapshot, inumber, &inode) == -1 ||
+        inode.i_node_type != T_FILE) {
+        return -1;
+    }
+
+    size_t to_read = offset < inode.i_size ? inode.i_size - offset : 0;
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    return to_read > 0 ? read_impl(offset, &inode, buffer, to_read) : 0;
+}
+
+static bool compressed(open_file_entry_t const *file) {
+    return (file->of_flags & TFS_O_COMPRESS) != 0;
+}
+
+/* Reads through a file handle, from the live file or from a snapshot. */
+static ssize_t read_file(open_file_entry_t const *file, void *buffer,
+                         size_t len, size_t offset) {
+    if (file->of_snapshot != -1) {
+        return snapshot_read_at(file->of_snapshot, file->of_inumber, buffer,
+                                len, offset);
+    }
+
+    return read_at(file->of_inumber, buffer, len, offset, compressed(file));
+}
+
+/* Writes through a file handle, at its offset or at the end of the file. */
+static ssize_t write_file(int fhandle, open_file_entry_t *file,
+                          void const *buffer, size_t to_write) {
+    if (file->of_flags & TFS_O_APPEND) {
+        /* Appends don't use the offset of the handle to know where to write,
+         * so they may go on at the same time through the same handle. */
+        pthread_rwlock_rdlock(open_file_entry_rw_lock(fhandle));
+
+        ssize_t rc = -1;
+        if (is_taken_open_file_table(fhandle)) {
+            size_t end;
+            rc = append_at_end(file->of_inumber, buffer, to_write, &end,
+                               compressed(file));
+
+            /* The offset is left right after the appended bytes */
+            if (rc > 0) {
+                __atomic_store_n(&file->of_offset, end, __ATOMIC_RELAXED);
+            }
+        }
+
+        pthread_rwlock_unlock(open_file_entry_rw_lock(fhandle));
+        return rc;
+    }
+
+    pthread_rwlock_wrlock(open_file_entry_rw_lock(fhandle));
 
     /* In the meantime, tfs_close might have been executed, so we double check.
      */
     ssize_t rc = -1;
-    size_t increment = 0;
     if (is_taken_open_file_table(fhandle)) {
-        const int of_inumber = file->of_inumber;
+        rc = write_at(file->of_inumber, buffer, to_write,
+                      __atomic_load_n(&file->of_offset, __ATOMIC_RELAXED),
+                      compressed(file));
+
+        /* The offset associated with the file handle is incremented
+         * accordingly (readers through the handle move it without locking) */
+        if (rc > 0) {
+            __atomic_fetch_add(&file->of_offset, (size_t)rc,
+                               __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_rwlock_unlock(open_file_entry_rw_lock(fhandle));
+    return rc;
+}
 
-        /* From the open file table entry, we get the inode */
-        pthread_rwlock_rdlock(&inode_rw_locks[of_inumber]);
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
 
-        inode_t *inode = inode_get(of_inumber);
+    /* Files of snapshots are read-only */
+    if (file == NULL || !is_taken_open_file_table(fhandle) ||
+        file->of_snapshot != -1) {
+        return -1;
+    }
 
-        /* Null inode / deleted meanwhile ---> not successful open. */
-        if (inode == NULL || inode->i_node_type == T_PREV_USED) {
-            pthread_rwlock_unlock(&inode_rw_locks[of_inumber]);
-            pthread_rwlock_unlock(&open_file_entries_rw_locks[fhandle]);
-            return -1;
-        }
+    const int gate = write_gate_enter();
+    const ssize_t rc = write_file(fhandle, file, buffer, to_write);
+    write_gate_exit(gate);
 
-        /* Determine how many bytes to read */
-        size_t to_read = inode->i_size - file->of_offset;
-        if (to_read > len) {
-            to_read = len;
-        }
+    return rc;
+}
 
-        if (to_read > 0) {
-            const ssize_t read_res =
-                read_impl(file->of_offset, inode, buffer, to_read);
-            if (read_res == -1) {
-                pthread_rwlock_unlock(&inode_rw_locks[of_inumber]);
-                pthread_rwlock_unlock(&open_file_entries_rw_locks[fhandle]);
-                return -1;
-            }
+/* Reads through a copy of a file handle, so the handle isn't locked. If it
+ * was closed meanwhile, what was read may be of a file it was reused for.
+ * Returns the number of bytes read, -1 otherwise. */
+static ssize_t read_handle(int fhandle, open_file_entry_t const *file,
+                           unsigned int ticket, void *buffer, size_t len,
+                           size_t offset) {
+    const ssize_t rc = read_file(file, buffer, len, offset);
+    return open_file_entry_unchanged(fhandle, ticket) ? rc : -1;
+}
 
-            to_read = (size_t)read_res;
-            /* The offset associated with the file handle is
-             * incremented accordingly */
-            increment = to_read;
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    open_file_entry_t file;
+    unsigned int ticket;
+    if (!open_file_entry_snapshot(fhandle, &file, &ticket)) {
+        return -1;
+    }
+
+    size_t *const offset = &get_open_file_entry(fhandle)->of_offset;
+    size_t from = __atomic_load_n(offset, __ATOMIC_RELAXED);
+    while (true) {
+        const ssize_t rc = read_handle(fhandle, &file, ticket, buffer, len,
+                                       from);
+        if (rc <= 0) {
+            return rc;
         }
 
-        pthread_rwlock_unlock(&inode_rw_locks[of_inumber]);
-        rc = (ssize_t)to_read;
+        /* The offset associated with the file handle is incremented
+         * accordingly, unless another read or write through the handle moved
+         * it meanwhile: then we read again from where that one left it */
+        if (__atomic_compare_exchange_n(offset, &from, from + (size_t)rc,
+                                        false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            return rc;
+        }
     }
+}
 
-    if (increment != 0) {
-        file->of_offset += increment;
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+
+    if (file == NULL || !is_taken_open_file_table(fhandle) ||
+        file->of_snapshot != -1) {
+        return -1;
     }
-    pthread_rwlock_unlock(&open_file_entries_rw_locks[fhandle]);
+
+    const int gate = write_gate_enter();
+
+    /* The offset of the handle is left untouched, so many threads may use the
+     * handle at the same time (only tfs_close must be kept out). */
+    pthread_rwlock_rdlock(open_file_entry_rw_lock(fhandle));
+
+    ssize_t rc = -1;
+    if (is_taken_open_file_table(fhandle)) {
+        rc = write_at(file->of_inumber, buffer, len, offset, compressed(file));
+    }
+
+    pthread_rwlock_unlock(open_file_entry_rw_lock(fhandle));
+    write_gate_exit(gate);
     return rc;
 }
 
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    open_file_entry_t file;
+    unsigned int ticket;
+    if (!open_file_entry_snapshot(fhandle, &file, &ticket)) {
+        return -1;
+    }
+
+    return read_handle(fhandle, &file, ticket, buffer, len, offset);
+}
+
+void tfs_set_dedup(bool enabled) { dedup_enable(enabled); }
+
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
     const int f = tfs_open(source_path, 0);
     if (f == -1)
@@ -399,3 +1154,281 @@ int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
 
     return fclose(fd);
 }
+
+/* State shared by the threads of a scrub */
+typedef struct {
+    atomic_int next_inumber;
+    atomic_int corrupted;
+    atomic_bool failed;
+} scrub_t;
+
+/* Checks every block of a file against its checksum, holding the whole file
+ * so no write changes a block meanwhile.
+ * Returns the number of corrupted blocks, -1 otherwise. */
+static int scrub_inode(int inumber) {
+    const int range = inode_range_lock(inumber, RANGE_WHOLE_FILE_START,
+                                       RANGE_WHOLE_FILE_END, RANGE_SHARED);
+    if (range == -1) {
+        return -1;
+    }
+
+    inode_t inode;
+    int corrupted = 0;
+    if (inode_snapshot(inumber, &inode) == 0 && inode.i_node_type == T_FILE) {
+        const int last_block = blocks_allocated(&inode) - 1;
+
+        block_map_t map;
+        if (last_block >= 0 && block_map_init(&map, &inode, last_block) == -1) {
+            corrupted = -1;
+        }
+
+        for (int block = 0; corrupted != -1 && block <= last_block;) {
+            int block_number;
+            const int count =
+                block_map_run(&map, block, last_block, &block_number);
+            if (count == -1 && inode.i_compressed) {
+                /* Unallocated slot, or the size of a compressed cluster */
+                block++;
+                continue;
+            }
+
+            const int bad = count == -1 ? -1 : verify_run(block_number, count);
+            if (bad == -1) {
+                corrupted = -1;
+            } else {
+                corrupted += bad;
+                block += count;
+            }
+        }
+    }
+
+    inode_range_unlock(inumber, range);
+    return corrupted;
+}
+
+static void *scrub_worker(void *arg) {
+    scrub_t *scrub = arg;
+
+    int inumber;
+    while ((inumber = atomic_fetch_add(&scrub->next_inumber, 1)) <
+           INODE_TABLE_SIZE) {
+        const int corrupted = scrub_inode(inumber);
+        if (corrupted == -1) {
+            atomic_store(&scrub->failed, true);
+        } else {
+            atomic_fetch_add(&scrub->corrupted, corrupted);
+        }
+    }
+
+    return NULL;
+}
+
+int tfs_scrub(int threads) {
+    if (threads < 1) {
+        return -1;
+    }
+
+    if (threads > INODE_TABLE_SIZE) {
+        threads = INODE_TABLE_SIZE;
+    }
+
+    scrub_t scrub;
+    atomic_init(&scrub.next_inumber, 0);
+    atomic_init(&scrub.corrupted, 0);
+    atomic_init(&scrub.failed, false);
+
+    /* The calling thread scrubs too; if some helper can't be created, the
+     * others take its share of the files. */
+    pthread_t helpers[INODE_TABLE_SIZE];
+    int started = 0;
+    while (started < threads - 1 &&
+           pthread_create(&helpers[started], NULL, scrub_worker, &scrub) == 0) {
+        started++;
+    }
+
+    scrub_worker(&scrub);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+
+    return atomic_load(&scrub.failed) ? -1 : atomic_load(&scrub.corrupted);
+}
+
+/* Moves the blocks of a file to a single run. The blocks are copied without
+ * locking the file, and the copy is dropped if the file changed meanwhile;
+ * only pointing the block map to the copy locks the whole file, so reads and
+ * writes wait at most for that, never for the copy, and the defragmenter
+ * never waits for them.
+ * Returns 1 if the blocks were moved, 0 if not, -1 otherwise. */
+static int defragment_file(int inumber) {
+    defrag_copy_t copy;
+    if (inode_defragment_copy(inumber, &copy) == 0) {
+        return 0;
+    }
+
+    /* Moving blocks must not overlap a new snapshot */
+    const int gate = write_gate_enter();
+
+    unsigned long generation;
+    const int range =
+        inode_range_trylock(inumber, RANGE_WHOLE_FILE_START,
+                            RANGE_WHOLE_FILE_END, RANGE_EXCLUSIVE, &generation);
+    if (range == -1) {
+        write_gate_exit(gate);
+        inode_defragment_drop(&copy);
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(inode_rw_lock(inumber));
+    const int rc = inode_defragment_swap(inumber, &copy);
+    pthread_rwlock_unlock(inode_rw_lock(inumber));
+
+    inode_range_unlock(inumber, range);
+    write_gate_exit(gate);
+
+    return rc;
+}
+
+int tfs_defragment() {
+    int moved = 0;
+    bool failed = false;
+
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        const int rc = defragment_file(inumber);
+        if (rc == -1) {
+            failed = true;
+        } else {
+            moved += rc;
+        }
+    }
+
+    return failed ? -1 : moved;
+}
+
+/* Background defragmenter */
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_stopping = PTHREAD_COND_INITIALIZER;
+static pthread_t defrag_thread;
+static bool defrag_running;
+static unsigned int defrag_interval_ms;
+
+static void *defrag_worker(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&defrag_lock);
+    while (defrag_running) {
+        pthread_mutex_unlock(&defrag_lock);
+        tfs_defragment();
+        pthread_mutex_lock(&defrag_lock);
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += defrag_interval_ms / 1000;
+        until.tv_nsec += (long)(defrag_interval_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+
+        while (defrag_running &&
+               pthread_cond_timedwait(&defrag_stopping, &defrag_lock,
+                                      &until) == 0) {
+        }
+    }
+    pthread_mutex_unlock(&defrag_lock);
+
+    return NULL;
+}
+
+int tfs_defrag_start(unsigned int interval_ms) {
+    pthread_mutex_lock(&defrag_lock);
+    if (defrag_running) {
+        pthread_mutex_unlock(&defrag_lock);
+        return -1;
+    }
+
+    defrag_running = true;
+    defrag_interval_ms = interval_ms;
+    if (pthread_create(&defrag_thread, NULL, defrag_worker, NULL) != 0) {
+        defrag_running = false;
+        pthread_mutex_unlock(&defrag_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&defrag_lock);
+
+    return 0;
+}
+
+int tfs_defrag_stop() {
+    pthread_mutex_lock(&defrag_lock);
+    if (!defrag_running) {
+        pthread_mutex_unlock(&defrag_lock);
+        return -1;
+    }
+
+    defrag_running = false;
+    pthread_cond_signal(&defrag_stopping);
+    pthread_mutex_unlock(&defrag_lock);
+
+    pthread_join(defrag_thread, NULL);
+    return 0;
+}
+
+int tfs_fragmentation(tfs_fragmentation_t *report) {
+    if (report == NULL) {
+        return -1;
+    }
+
+    memset(report, 0, sizeof(*report));
+
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        pthread_rwlock_rdlock(inode_rw_lock(inumber));
+        int blocks;
+        const int runs = inode_runs(inode_get(inumber), &blocks);
+        pthread_rwlock_unlock(inode_rw_lock(inumber));
+
+        if (runs == -1) {
+            return -1;
+        }
+
+        if (blocks > 0) {
+            report->files++;
+            report->file_blocks += blocks;
+            report->file_runs += runs;
+            if (runs > 1) {
+                report->fragmented_files++;
+            }
+        }
+    }
+
+    free_space_t free_space;
+    free_space_get(&free_space);
+    report->free_blocks = free_space.free_blocks;
+    report->free_runs = free_space.free_runs;
+    report->largest_free_run = free_space.largest_free_run;
+
+    return 0;
+}
+
+int tfs_statfs(tfs_statfs_t *stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+
+    free_space_t free_space;
+    free_space_get(&free_space);
+
+    stats->blocks = DATA_BLOCKS;
+    stats->free_blocks = free_space.free_blocks;
+    stats->used_blocks = DATA_BLOCKS - free_space.free_blocks;
+    stats->inodes = INODE_TABLE_SIZE;
+    stats->free_inodes = free_space.free_inodes;
+    stats->used_inodes = INODE_TABLE_SIZE - free_space.free_inodes;
+    stats->free_runs = free_space.free_runs;
+    stats->largest_free_run = free_space.largest_free_run;
+    memcpy(stats->free_run_classes, free_space.free_run_classes,
+           sizeof(stats->free_run_classes));
+
+    return 0;
+}
@@ -9,6 +9,7 @@ enum {
     TFS_O_CREAT = 0b001,
     TFS_O_TRUNC = 0b010,
     TFS_O_APPEND = 0b100,
+    TFS_O_COMPRESS = 0b1000,
 };
 
 /*
@@ -43,9 +44,13 @@ int tfs_lookup(char const *name);
  * Input:
  *  - name: absolute path name
  *  - flags: can be a combination (with bitwise or) of the following flags:
- *    - append mode (TFS_O_APPEND)
+ *    - append mode (TFS_O_APPEND): every write atomically goes to the end of
+ *      the file, even with many writers at once
  *    - truncate file contents (TFS_O_TRUNC)
  *    - create file if it does not exist (TFS_O_CREAT)
+ *    - compress the contents of the file (TFS_O_COMPRESS), in clusters of
+ *      CLUSTER_BLOCKS blocks; only applies when the file is created, other
+ *      handles to it compress as well
  */
 int tfs_open(char const *name, int flags);
 
@@ -77,6 +82,108 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes to an open file, starting at a given offset (the offset of the file
+ * handle is not used nor changed)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset of the file where the contents are written
+ * 	Returns the number of bytes that were written (can be lower than
+ * 	'len' if the maximum file size is exceeded), or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/* Reads from an open file, starting at a given offset (the offset of the file
+ * handle is not used nor changed)
+ * * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset of the file where the read starts
+ * 	Returns the number of bytes that were copied from the file to the buffer
+ * 	(can be lower than 'len' if the file size was reached), or -1 in case of
+ * error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/* Turns block deduplication on or off. While on, every whole block written
+ * to a file (other than compressed ones) that has the same contents as a
+ * block already written is not stored again: both files share it, and it is
+ * copied once one of them changes it. Turning it off only stops looking for
+ * duplicates; blocks already shared stay so.
+ * Input:
+ *      - whether to deduplicate
+ */
+void tfs_set_dedup(bool enabled);
+
+/* Makes a file a copy of another one without copying its contents: both
+ * share every block, which is only copied once one of them writes to it, so
+ * cloning takes the same time whatever the size of the file.
+ * Input:
+ *      - source_path: absolute path name of an existing file
+ *      - dest_path: absolute path name of the copy (created if it doesn't
+ *        exist, its previous contents lost otherwise)
+ *      Returns 0 if successful, -1 otherwise.
+ */
+int tfs_clone(char const *source_path, char const *dest_path);
+
+/* Creates many files at once, going through the root directory and the
+ * i-node table once for all of them. Files that already exist are left as
+ * they are.
+ * Input:
+ *      - paths: absolute path names of the files
+ *      - count: number of path names
+ *      - flags: TFS_O_COMPRESS, or 0
+ *      - inumbers: where to store the inumber of each file (-1 for those
+ *        that couldn't be created)
+ *      Returns 0 if every file exists, -1 otherwise.
+ */
+int tfs_create_many(char const *const *paths, int count, int flags,
+                    int *inumbers);
+
+/*
+ * Attributes of a file
+ */
+typedef struct {
+    int st_inumber; /* -1 if there is no such file */
+    size_t st_size;
+    bool st_compressed;
+} tfs_stat_t;
+
+/* Looks up many files at once, going through the root directory once for
+ * all of them, and reports their attributes.
+ * Input:
+ *      - paths: absolute path names of the files
+ *      - count: number of path names
+ *      - stats: where to store the attributes of each file
+ *      Returns 0 if every file exists, -1 otherwise.
+ */
+int tfs_stat_many(char const *const *paths, int count, tfs_stat_t *stats);
+
+/* Takes a snapshot of the whole file system, as it is once the operations
+ * changing it in flight are done. Taking it copies nothing: files are copied
+ * (an inode and then each block written) as they change afterwards.
+ *      Returns the snapshot's identifier, -1 if MAX_SNAPSHOTS exist.
+ */
+int tfs_snapshot_create();
+
+/* Opens a file, read-only, as it was when a snapshot was taken. Reads of it
+ * never wait for writers of the live file, nor make them wait.
+ * Input:
+ *      - snapshot identifier (obtained from tfs_snapshot_create)
+ *      - name: absolute path name
+ *      Returns a file handle (closed with tfs_close), -1 if unsuccessful
+ */
+int tfs_snapshot_open(int snapshot, char const *name);
+
+/* Deletes a snapshot, freeing the blocks only it kept.
+ * Input:
+ *      - snapshot identifier, with no files of it open
+ *      Returns 0 if successful, -1 otherwise.
+ */
+int tfs_snapshot_delete(int snapshot);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * Devolve 0 em caso de sucesso, -1 em caso de erro.
@@ -88,4 +195,83 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
 
+/* Checks the contents of every file against the checksums of its blocks,
+ * without stopping reads and writes to other files. Files are split among
+ * the threads, so each file is checked by one of them.
+ * Input:
+ *      - number of threads to use (including the calling one)
+ *      Returns the number of corrupted blocks found, -1 otherwise.
+ */
+int tfs_scrub(int threads);
+
+/* Moves the blocks of each file stored in more than one run of consecutive
+ * blocks to a single run, so it can be read and written a run at a time.
+ * Files being written, files sharing blocks (with clones, snapshots or
+ * through deduplication) and files no run of free blocks fits are left as
+ * they are.
+ *      Returns the number of files moved, -1 otherwise.
+ */
+int tfs_defragment();
+
+/* Starts defragmenting in the background: a thread runs tfs_defragment,
+ * sleeps and repeats, until tfs_defrag_stop (or tfs_destroy). It never waits
+ * for reads and writes, skipping the files they change until its next pass,
+ * and they only wait for it while it points a file to its moved blocks.
+ * Input:
+ *      - time, in milliseconds, between passes
+ *      Returns 0 if successful, -1 otherwise (or if already running).
+ */
+int tfs_defrag_start(unsigned int interval_ms);
+
+/* Stops the background defragmenter, waiting for its pass to finish.
+ *      Returns 0 if successful, -1 if it wasn't running.
+ */
+int tfs_defrag_stop();
+
+/*
+ * Fragmentation of the files and of the free space
+ */
+typedef struct {
+    int files;            /* files with data blocks */
+    int fragmented_files; /* files stored in more than one run */
+    int file_blocks;      /* data blocks of the files */
+    int file_runs;        /* runs of consecutive blocks they are stored in */
+    int free_blocks;
+    int free_runs;        /* runs of consecutive free blocks */
+    int largest_free_run; /* blocks in the longest one */
+} tfs_fragmentation_t;
+
+/* Reports how fragmented the files and the free space are.
+ * Input:
+ *      - where to store the report
+ *      Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fragmentation(tfs_fragmentation_t *report);
+
+/*
+ * Usage of the file system's data blocks and inodes
+ */
+typedef struct {
+    int blocks;
+    int free_blocks;
+    int used_blocks;
+    int inodes;
+    int free_inodes;
+    int used_inodes;
+    int free_runs;        /* runs of consecutive free data blocks */
+    int largest_free_run; /* blocks in the longest one */
+    /* Runs of 2^i to 2^(i + 1) - 1 free blocks */
+    int free_run_classes[FREE_RUN_CLASSES];
+} tfs_statfs_t;
+
+/* Reports how many data blocks and inodes are free, and how the free blocks
+ * are spread. The allocators keep these up to date, so this takes the same
+ * (short) time however full the file system is, and takes no lock: while
+ * files change, the values may come from slightly different moments.
+ * Input:
+ *      - where to store the statistics
+ *      Returns 0 if successful, -1 otherwise.
+ */
+int tfs_statfs(tfs_statfs_t *stats);
+
 #endif // OPERATIONS_H
@@ -1,6 +1,11 @@
 #include "state.h"
+#include "compress.h"
+#include "kernels.h"
 
 #include <errno.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,38 +15,168 @@
 /* Persistent FS state  (in reality, it should be maintained in secondary
  * memory; for simplicity, this project maintains it in primary memory) */
 
+/*
+ * I-node table entry: the i-node together with the locks that protect it,
+ * padded to whole cache lines so unrelated files never share one.
+ */
+typedef struct {
+    alignas(CACHE_LINE_SIZE) inode_t inode;
+    /* Sequence counter, odd while a writer (holding rw_lock) is changing the
+     * inode. Readers snapshot the inode without locking and retry if the
+     * counter moved. */
+    atomic_uint seq;
+    pthread_rwlock_t rw_lock;
+    /* Taken before rw_lock. The rwlock only guards the inode metadata, the
+     * range lock guards the file contents. */
+    range_lock_t range_lock;
+    /* Exclusive ranges taken and released so far: they differ while a writer
+     * may be changing the contents or the blocks of the file. Readers copy
+     * the contents without locking and check these didn't move (see
+     * inode_data_read_begin). */
+    atomic_ulong data_changes_begun;
+    atomic_ulong data_changes_ended;
+    /* Last snapshot taken before the inode was created: that one and older
+     * ones can't see it */
+    unsigned long created_epoch;
+} inode_table_entry_t;
+
+/* Inline data takes no more room than the block pointers it stands in for */
+_Static_assert(sizeof(inode_t) <= CACHE_LINE_SIZE,
+               "an i-node must fit in a cache line");
+
 /* I-node table */
-static inode_t inode_table[INODE_TABLE_SIZE];
+static inode_table_entry_t inode_table[INODE_TABLE_SIZE];
 static char freeinode_ts[INODE_TABLE_SIZE];
 
 /* Data blocks */
 static char fs_data[BLOCK_SIZE * DATA_BLOCKS];
-static char free_blocks[DATA_BLOCKS];
+
+/* CRC32C of each data block holding file contents. Directory and indirect
+ * blocks are changed in place, so only blocks filled through fill_block or
+ * fill_run have a checksum (block_checksummed). */
+static uint32_t block_checksums[DATA_BLOCKS];
+static bool block_checksummed[DATA_BLOCKS];
+
+/* Number of block map slots (of files, snapshots of files and inodes) that
+ * point to each data block; free blocks have none. */
+static int block_refs[DATA_BLOCKS];
+
+/* Summary of the free space, kept up to date by the allocators so it is read
+ * without scanning block_refs or freeinode_ts. Each run of consecutive free
+ * blocks has its length stored at its first and last block; runs are counted
+ * by length and by class (see FREE_RUN_CLASSES). The run summary changes
+ * with file_allocation_lock held, and everything read through
+ * free_space_get is atomic, so reading takes no lock. */
+_Static_assert((1 << (FREE_RUN_CLASSES - 1)) <= DATA_BLOCKS &&
+                   DATA_BLOCKS < (1 << FREE_RUN_CLASSES),
+               "FREE_RUN_CLASSES must be floor(log2(DATA_BLOCKS)) + 1");
+static int free_run_length[DATA_BLOCKS];
+static int free_runs_of_length[DATA_BLOCKS + 1];
+static atomic_int free_run_classes[FREE_RUN_CLASSES];
+static atomic_int free_runs;
+static atomic_int largest_free_run;
+static atomic_int free_block_count;
+static atomic_int free_inode_count;
+
+/* Content-addressed index of data blocks: the 128 bit hash of whole blocks
+ * written while deduplication is on, chained in buckets by hash. Only blocks
+ * whose contents won't change without first leaving the index are in it. */
+#define FINGERPRINT_BUCKETS (DATA_BLOCKS)
+
+static fingerprint_t block_fingerprints[DATA_BLOCKS];
+static bool block_indexed[DATA_BLOCKS];
+static int fingerprint_next[DATA_BLOCKS];
+static int fingerprint_buckets[FINGERPRINT_BUCKETS];
+
+/* New whole blocks are looked up in (and added to) the index */
+static atomic_bool dedup_enabled;
+/* Deduplication was turned on at some point, so blocks may be shared or
+ * indexed and every write must go through fill_block_cow */
+static atomic_bool dedup_used;
+
+/*
+ * Snapshot of the file system: the inodes as they were when it was taken.
+ * Inodes are only copied (preserved) the first time they change after the
+ * newest snapshot was taken, into that snapshot; the blocks they point to get
+ * one more reference and are copied by writers before being changed.
+ * An inode not preserved in a snapshot is found in the next newer snapshot
+ * that preserved it or, if none did, in the live inode table.
+ */
+typedef struct {
+    bool taken;
+    /* Snapshots are numbered in the order they were taken */
+    unsigned long epoch;
+    int open_handles;
+    bool preserved[INODE_TABLE_SIZE];
+    inode_t inodes[INODE_TABLE_SIZE];
+} snapshot_t;
+
+static snapshot_t snapshots[MAX_SNAPSHOTS];
+/* Number of snapshots taken so far */
+static unsigned long snapshot_epoch;
+static int newest_snapshot;
 
 /* Volatile FS state */
 
-static open_file_entry_t open_file_table[MAX_OPEN_FILES];
-static char free_open_file_entries[MAX_OPEN_FILES];
+/*
+ * Open file table entry: the open file with the rwlock of its file handle,
+ * padded to whole cache lines.
+ */
+typedef struct {
+    alignas(CACHE_LINE_SIZE) pthread_rwlock_t rw_lock;
+    /* Odd while the handle is open: bumped when it's opened and when it's
+     * closed, so readers use the entry without locking and notice it was
+     * closed meanwhile (see open_file_entry_snapshot). Changed only with
+     * open_file_table_lock held. */
+    atomic_uint generation;
+    open_file_entry_t entry;
+} open_file_table_entry_t;
+
+static open_file_table_entry_t open_file_table[MAX_OPEN_FILES];
+
+/*
+ * Write gate: every operation that may change the file system holds it open
+ * (see write_gate_enter), and snapshots are taken with it closed, so they
+ * never see half of a write. Writers count themselves in one of several
+ * counters, picked per thread, so they don't all bounce the same cache line.
+ */
+#define WRITE_GATE_SHARDS (16)
+
+typedef struct {
+    alignas(CACHE_LINE_SIZE) atomic_int writers;
+} write_gate_shard_t;
 
-/* Rwlock for file handles. */
-pthread_rwlock_t open_file_entries_rw_locks[MAX_OPEN_FILES];
+static write_gate_shard_t write_gate[WRITE_GATE_SHARDS];
+static atomic_bool write_gate_closed;
+static atomic_int write_gate_next_shard;
+static _Thread_local int write_gate_shard = -1;
+static pthread_mutex_t write_gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t write_gate_opened = PTHREAD_COND_INITIALIZER;
 
-/* Single mutex to synchronize accesses to free_blocks. */
+/* Single mutex to synchronize accesses to block_refs. */
 pthread_mutex_t file_allocation_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Single mutex to synchronize accesses to the fingerprint index (and to
+ * share indexed blocks). Taken before file_allocation_lock. */
+pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Single mutex to synchronize accesses to the snapshot inodes. Snapshots
+ * are only taken or deleted with the write gate closed. */
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Single mutex to serialize taking and deleting snapshots. */
+static pthread_mutex_t snapshot_admin_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Single mutex to synchronize accesses to the main dir entries. */
 pthread_mutex_t dir_entry_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Single mutex to synchronize accesses to free_open_file_entries table. */
+/* Single mutex to synchronize opening and closing file handles. */
 pthread_mutex_t open_file_table_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Single mutex to synchronize access to the buffer used for
  * tfs_copy_to_external_fs. */
 pthread_mutex_t aux_buffer_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-/* Rwlock for inodes. */
-pthread_rwlock_t inode_rw_locks[INODE_TABLE_SIZE];
-
 /* Single mutex to synchronize accesses to freeinode_ts table. */
 pthread_mutex_t freeinode_ts_lock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -87,34 +222,166 @@ static void insert_delay() {
     }
 }
 
+/* Class of a run of free blocks: floor(log2(length)) */
+static int free_run_class(int length) {
+    int run_class = 0;
+    while (length >>= 1) {
+        run_class++;
+    }
+    return run_class;
+}
+
+/* Must be called with file_allocation_lock held.
+ * Counts (delta 1) or stops counting (delta -1) a run of free blocks. */
+static void free_run_count(int length, int delta) {
+    free_runs_of_length[length] += delta;
+    atomic_fetch_add(&free_run_classes[free_run_class(length)], delta);
+    atomic_fetch_add(&free_runs, delta);
+
+    int largest = atomic_load(&largest_free_run);
+    if (delta > 0 && length > largest) {
+        atomic_store(&largest_free_run, length);
+    } else if (delta < 0 && length == largest &&
+               free_runs_of_length[length] == 0) {
+        /* Only ever scans lengths between the two longest runs */
+        while (largest > 0 && free_runs_of_length[largest] == 0) {
+            largest--;
+        }
+        atomic_store(&largest_free_run, largest);
+    }
+}
+
+/* Must be called with file_allocation_lock held.
+ * Records a run of free blocks. */
+static void free_run_add(int first, int length) {
+    free_run_length[first] = length;
+    free_run_length[first + length - 1] = length;
+    free_run_count(length, 1);
+}
+
+/* Must be called with file_allocation_lock held.
+ * Takes count blocks from the start of a run of free blocks. */
+static void free_runs_take(int first, int count) {
+    /* What is left of the run is counted first, so finding the longest run
+     * if it was this one stops there */
+    const int length = free_run_length[first];
+    if (length > count) {
+        free_run_add(first + count, length - count);
+    }
+    free_run_count(length, -1);
+    atomic_fetch_sub(&free_block_count, count);
+}
+
+/* Must be called with file_allocation_lock held.
+ * Adds a block just freed to the runs of free blocks next to it. */
+static void free_runs_release(int block_number) {
+    const int left = block_number > 0 && block_refs[block_number - 1] == 0
+                         ? free_run_length[block_number - 1]
+                         : 0;
+    const int right = block_number + 1 < DATA_BLOCKS &&
+                              block_refs[block_number + 1] == 0
+                          ? free_run_length[block_number + 1]
+                          : 0;
+
+    /* The merged run is counted first (see free_runs_take) */
+    free_run_add(block_number - left, left + 1 + right);
+    if (left > 0) {
+        free_run_count(left, -1);
+    }
+    if (right > 0) {
+        free_run_count(right, -1);
+    }
+    atomic_fetch_add(&free_block_count, 1);
+}
+
+/* Every block starts free, in a single run. */
+static void free_runs_init() {
+    for (int length = 0; length <= DATA_BLOCKS; length++) {
+        free_runs_of_length[length] = 0;
+    }
+    for (int i = 0; i < FREE_RUN_CLASSES; i++) {
+        atomic_store(&free_run_classes[i], 0);
+    }
+    atomic_store(&free_runs, 0);
+    atomic_store(&largest_free_run, 0);
+
+    free_run_add(0, DATA_BLOCKS);
+    atomic_store(&free_block_count, DATA_BLOCKS);
+}
+
+/*
+ * Reads the summary of the free space, without locking: while blocks are
+ * allocated and freed, the values may come from slightly different moments.
+ * Input:
+ *  - where to store the summary
+ */
+void free_space_get(free_space_t *free_space) {
+    free_space->free_blocks = atomic_load(&free_block_count);
+    free_space->free_inodes = atomic_load(&free_inode_count);
+    free_space->free_runs = atomic_load(&free_runs);
+    free_space->largest_free_run = atomic_load(&largest_free_run);
+    for (int i = 0; i < FREE_RUN_CLASSES; i++) {
+        free_space->free_run_classes[i] = atomic_load(&free_run_classes[i]);
+    }
+}
+
 /*
  * Initializes FS state
  */
 void state_init() {
+    kernels_init();
 
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
         freeinode_ts[i] = FREE;
     }
+    atomic_store(&free_inode_count, INODE_TABLE_SIZE);
 
     for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+        block_refs[i] = 0;
+        block_indexed[i] = false;
+    }
+    free_runs_init();
+
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++) {
+        snapshots[i].taken = false;
+    }
+    snapshot_epoch = 0;
+    newest_snapshot = -1;
+
+    for (size_t i = 0; i < FINGERPRINT_BUCKETS; i++) {
+        fingerprint_buckets[i] = -1;
     }
+    atomic_store(&dedup_enabled, false);
+    atomic_store(&dedup_used, false);
 
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+        atomic_store(&open_file_table[i].generation, 0);
     }
 }
 
 void state_destroy() {}
 
-static inline void initializes_file_data_blocks(inode_t *inode) {
-    // puts directs blocks to UNALLOCATED_BLOCK (start at 0)
-    // will slide UNALLOCATED_BLOCK through them to detect when we need to
-    // allocate
-    inode->i_direct_data_blocks[0] = UNALLOCATED_BLOCK;
+/* This function is not synchronized and may need synchronization
+ * from outside.
+ * Leaves a file without contents (its blocks must have been freed).
+ * Input:
+ *  - pointer to an inode
+ */
+void inode_data_reset(inode_t *inode) {
+    if (inode->i_compressed) {
+        // compressed clusters are always in data blocks, found through every
+        // slot of the block map
+        inode->i_inline = false;
+        for (int i = 0; i < MAX_DIRECT_DATA_BLOCKS_PER_FILE; i++) {
+            inode->i_direct_data_blocks[i] = UNALLOCATED_BLOCK;
+        }
+        inode->i_indirect_data_block = UNALLOCATED_BLOCK;
+        return;
+    }
 
-    // puts indirect block to UNALLOCATED_BLOCK
-    inode->i_indirect_data_block = UNALLOCATED_BLOCK;
+    // new files start with their (empty) contents inside the inode
+    inode->i_inline = true;
+    block_zero(inode->i_inline_data, INODE_INLINE_DATA_SIZE);
 }
 
 /*
@@ -122,15 +389,31 @@ static inline void initializes_file_data_blocks(inode_t *inode) {
  */
 int init_locks() {
     for (int i = 0; i < INODE_TABLE_SIZE; ++i) {
-        inode_rw_locks[i] = g_rw_init;
-        if (pthread_rwlock_init(&inode_rw_locks[i], NULL) != 0) {
+        inode_table[i].rw_lock = g_rw_init;
+        if (pthread_rwlock_init(&inode_table[i].rw_lock, NULL) != 0) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < INODE_TABLE_SIZE; ++i) {
+        range_lock_t *const range_lock = &inode_table[i].range_lock;
+        if (pthread_mutex_init(&range_lock->mutex, NULL) != 0) {
             return -1;
         }
+
+        if (pthread_cond_init(&range_lock->released, NULL) != 0) {
+            return -1;
+        }
+
+        for (int j = 0; j < MAX_INODE_RANGES; ++j) {
+            range_lock->ranges[j].r_taken = false;
+        }
+        range_lock->generation = 0;
     }
 
     for (int i = 0; i < MAX_OPEN_FILES; ++i) {
-        open_file_entries_rw_locks[i] = g_rw_init;
-        if (pthread_rwlock_init(&open_file_entries_rw_locks[i], NULL) != 0) {
+        open_file_table[i].rw_lock = g_rw_init;
+        if (pthread_rwlock_init(&open_file_table[i].rw_lock, NULL) != 0) {
             return -1;
         }
     }
@@ -141,6 +424,21 @@ int init_locks() {
     if (pthread_mutex_init(&freeinode_ts_lock, NULL) != 0)
         return -1;
 
+    if (pthread_mutex_init(&dedup_lock, NULL) != 0)
+        return -1;
+
+    if (pthread_mutex_init(&snapshot_lock, NULL) != 0)
+        return -1;
+
+    if (pthread_mutex_init(&snapshot_admin_lock, NULL) != 0)
+        return -1;
+
+    if (pthread_mutex_init(&write_gate_lock, NULL) != 0)
+        return -1;
+
+    if (pthread_cond_init(&write_gate_opened, NULL) != 0)
+        return -1;
+
     if (pthread_mutex_init(&dir_entry_lock, NULL) != 0)
         return -1;
 
@@ -153,6 +451,194 @@ int init_locks() {
     return 0;
 }
 
+static inline bool ranges_conflict(range_t const *range, size_t start,
+                                   size_t end, range_mode_t mode) {
+    if (range->r_mode == RANGE_SHARED && mode == RANGE_SHARED) {
+        return false;
+    }
+
+    return range->r_start < end && start < range->r_end;
+}
+
+/* Takes the range if nothing conflicts with it. Must be called with the range
+ * lock mutex held. Returns the range identifier, -1 otherwise. */
+static int range_take(range_lock_t *range_lock, size_t start, size_t end,
+                      range_mode_t mode) {
+    int free_range = -1;
+
+    for (int i = 0; i < MAX_INODE_RANGES; i++) {
+        range_t const *range = &range_lock->ranges[i];
+        if (!range->r_taken) {
+            if (free_range == -1) {
+                free_range = i;
+            }
+        } else if (ranges_conflict(range, start, end, mode)) {
+            return -1;
+        }
+    }
+
+    if (free_range != -1) {
+        range_t *const range = &range_lock->ranges[free_range];
+        range->r_start = start;
+        range->r_end = end;
+        range->r_mode = mode;
+        range->r_taken = true;
+    }
+
+    return free_range;
+}
+
+/* Counts a writer in before it changes anything in its exclusive range. */
+static void data_change_begin(int inumber) {
+    atomic_fetch_add_explicit(&inode_table[inumber].data_changes_begun, 1,
+                              memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/*
+ * Starts reading the contents of an i-node without locking them, which is
+ * only worth it if no writer holds an exclusive range. Nothing shared is
+ * written, so readers of a hot file don't contend with each other.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - ticket: where to store the value to pass to inode_data_read_end
+ * Returns: true if no writer is changing the file
+ */
+bool inode_data_read_begin(int inumber, unsigned long *ticket) {
+    if (!valid_inumber(inumber)) {
+        return false;
+    }
+
+    inode_table_entry_t *const entry = &inode_table[inumber];
+    const unsigned long ended =
+        atomic_load_explicit(&entry->data_changes_ended, memory_order_acquire);
+    *ticket =
+        atomic_load_explicit(&entry->data_changes_begun, memory_order_acquire);
+    return *ticket == ended;
+}
+
+/*
+ * Ends a read started with inode_data_read_begin.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - ticket: value stored by inode_data_read_begin
+ * Returns: true if no writer took an exclusive range meanwhile, so what was
+ * read (blocks that may have been freed and reused included) is consistent
+ */
+bool inode_data_read_end(int inumber, unsigned long ticket) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&inode_table[inumber].data_changes_begun,
+                                memory_order_relaxed) == ticket;
+}
+
+/*
+ * Locks the byte range [start, end) of an inode, waiting for every
+ * conflicting range to be released.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - start, end: bounds of the range
+ *  - mode: RANGE_SHARED for readers, RANGE_EXCLUSIVE for writers
+ * Returns: the range identifier to pass to inode_range_unlock, -1 if failed
+ */
+int inode_range_lock(int inumber, size_t start, size_t end, range_mode_t mode) {
+    if (!valid_inumber(inumber) || start >= end) {
+        return -1;
+    }
+
+    range_lock_t *const range_lock = &inode_table[inumber].range_lock;
+
+    pthread_mutex_lock(&range_lock->mutex);
+
+    int range;
+    while ((range = range_take(range_lock, start, end, mode)) == -1) {
+        pthread_cond_wait(&range_lock->released, &range_lock->mutex);
+    }
+    if (mode == RANGE_EXCLUSIVE) {
+        data_change_begin(inumber);
+    }
+
+    pthread_mutex_unlock(&range_lock->mutex);
+    return range;
+}
+
+/*
+ * Locks the byte range [start, end) of an inode only if that can be done
+ * without waiting. Used by callers that already hold the inode rwlock, which
+ * must not wait for a range while holding it.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - start, end: bounds of the range
+ *  - mode: RANGE_SHARED for readers, RANGE_EXCLUSIVE for writers
+ *  - generation: on failure, where to store the value to pass to
+ *    inode_range_wait
+ * Returns: the range identifier to pass to inode_range_unlock, -1 if failed
+ */
+int inode_range_trylock(int inumber, size_t start, size_t end,
+                        range_mode_t mode, unsigned long *generation) {
+    if (!valid_inumber(inumber) || start >= end) {
+        return -1;
+    }
+
+    range_lock_t *const range_lock = &inode_table[inumber].range_lock;
+
+    pthread_mutex_lock(&range_lock->mutex);
+
+    const int range = range_take(range_lock, start, end, mode);
+    *generation = range_lock->generation;
+    if (range != -1 && mode == RANGE_EXCLUSIVE) {
+        data_change_begin(inumber);
+    }
+
+    pthread_mutex_unlock(&range_lock->mutex);
+    return range;
+}
+
+/*
+ * Waits until some range of the inode is released after a failed
+ * inode_range_trylock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - generation: value stored by inode_range_trylock
+ */
+void inode_range_wait(int inumber, unsigned long generation) {
+    if (!valid_inumber(inumber)) {
+        return;
+    }
+
+    range_lock_t *const range_lock = &inode_table[inumber].range_lock;
+
+    pthread_mutex_lock(&range_lock->mutex);
+    while (range_lock->generation == generation) {
+        pthread_cond_wait(&range_lock->released, &range_lock->mutex);
+    }
+    pthread_mutex_unlock(&range_lock->mutex);
+}
+
+/*
+ * Releases a range previously taken with inode_range_lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - range: identifier returned by inode_range_lock
+ */
+void inode_range_unlock(int inumber, int range) {
+    if (!valid_inumber(inumber) || range < 0 || range >= MAX_INODE_RANGES) {
+        return;
+    }
+
+    range_lock_t *const range_lock = &inode_table[inumber].range_lock;
+
+    pthread_mutex_lock(&range_lock->mutex);
+    if (range_lock->ranges[range].r_mode == RANGE_EXCLUSIVE) {
+        atomic_fetch_add_explicit(
+            &inode_table[inumber].data_changes_ended, 1,
+            memory_order_release);
+    }
+    range_lock->ranges[range].r_taken = false;
+    range_lock->generation++;
+    pthread_cond_broadcast(&range_lock->released);
+    pthread_mutex_unlock(&range_lock->mutex);
+}
+
 /*
  * Creates a new i-node in the i-node table.
  * Input:
@@ -167,7 +653,7 @@ int inode_create(inode_type n_type) {
         }
 
         /* Modifying inode. */
-        pthread_rwlock_wrlock(&inode_rw_locks[inumber]);
+        pthread_rwlock_wrlock(&inode_table[inumber].rw_lock);
 
         /* The inode is being created, so we don't check if it could have been
          * deleted meanwhile... */
@@ -179,11 +665,19 @@ int inode_create(inode_type n_type) {
         if (freeinode_ts[inumber] == FREE) {
             /* Found a free entry, so takes it for the new i-node*/
             freeinode_ts[inumber] = TAKEN;
+            atomic_fetch_sub(&free_inode_count, 1);
 
             insert_delay(); // simulate storage access delay (to i-node)
 
-            inode_table[inumber].i_node_type = n_type;
-            inode_table[inumber].i_indirect_data_block = UNALLOCATED_BLOCK;
+            inode_write_begin(inumber);
+
+            inode_t *const inode = &inode_table[inumber].inode;
+
+            inode->i_node_type = n_type;
+            inode->i_inline = false;
+            inode->i_compressed = false;
+            inode->i_indirect_data_block = UNALLOCATED_BLOCK;
+            inode_table[inumber].created_epoch = snapshot_epoch;
 
             if (n_type == T_DIRECTORY) {
                 /* Initializes directory (filling its block with empty
@@ -191,38 +685,44 @@ int inode_create(inode_type n_type) {
                 int b = data_block_alloc();
                 if (b == -1) {
                     freeinode_ts[inumber] = FREE;
+                    atomic_fetch_add(&free_inode_count, 1);
 
+                    inode_write_end(inumber);
                     pthread_mutex_unlock(&freeinode_ts_lock);
-                    pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+                    pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
                     return -1;
                 }
 
-                inode_table[inumber].i_size = BLOCK_SIZE;
-                inode_table[inumber].i_direct_data_blocks[0] = b;
+                inode->i_size = BLOCK_SIZE;
+                inode->i_direct_data_blocks[0] = b;
 
                 dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
                 if (dir_entry == NULL) {
                     freeinode_ts[inumber] = FREE;
+                    atomic_fetch_add(&free_inode_count, 1);
 
+                    inode_write_end(inumber);
                     pthread_mutex_unlock(&freeinode_ts_lock);
-                    pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+                    pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
                     return -1;
                 }
 
+                inode_write_end(inumber);
                 pthread_mutex_unlock(&freeinode_ts_lock);
-                pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+                pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
 
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
+                const dir_entry_t empty = {.d_name = "", .d_inumber = -1};
+                block_fill_pattern(dir_entry, MAX_DIR_ENTRIES * sizeof(empty),
+                                   &empty, sizeof(empty));
             } else {
                 /* In case of a new file, simply sets its size to 0 */
                 pthread_mutex_unlock(&freeinode_ts_lock);
 
-                inode_table[inumber].i_size = 0;
-                initializes_file_data_blocks(&inode_table[inumber]);
+                inode->i_size = 0;
+                inode_data_reset(inode);
 
-                pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+                inode_write_end(inumber);
+                pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
             }
 
             return inumber;
@@ -230,11 +730,64 @@ int inode_create(inode_type n_type) {
             pthread_mutex_unlock(&freeinode_ts_lock);
 
         /* Release current inode and continue this loop. */
-        pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+        pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
     }
     return -1;
 }
 
+/*
+ * Creates i-nodes for count new (empty) files, looking for free entries of
+ * the i-node table once for all of them.
+ * Input:
+ *  - count: number of files
+ *  - compressed: whether the files keep their contents compressed
+ *  - inumbers: where to store the new i-nodes' numbers
+ * Returns: the number of i-nodes created (less than count if the table is
+ * full)
+ */
+int inode_create_many(int count, bool compressed, int *inumbers) {
+    int created = 0;
+
+    /* The entries are taken first, so no other thread initializes them */
+    pthread_mutex_lock(&freeinode_ts_lock);
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE && created < count;
+         inumber++) {
+        if ((inumber * (int)sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
+            insert_delay(); // simulate storage access delay (to freeinode_ts)
+        }
+
+        if (freeinode_ts[inumber] == FREE) {
+            freeinode_ts[inumber] = TAKEN;
+            inumbers[created++] = inumber;
+        }
+    }
+    atomic_fetch_sub(&free_inode_count, created);
+    pthread_mutex_unlock(&freeinode_ts_lock);
+
+    for (int i = 0; i < created; i++) {
+        const int inumber = inumbers[i];
+        pthread_rwlock_wrlock(&inode_table[inumber].rw_lock);
+
+        insert_delay(); // simulate storage access delay (to i-node)
+
+        inode_write_begin(inumber);
+
+        inode_t *const inode = &inode_table[inumber].inode;
+        inode->i_node_type = T_FILE;
+        inode->i_inline = false;
+        inode->i_compressed = compressed;
+        inode->i_indirect_data_block = UNALLOCATED_BLOCK;
+        inode->i_size = 0;
+        inode_data_reset(inode);
+        inode_table[inumber].created_epoch = snapshot_epoch;
+
+        inode_write_end(inumber);
+        pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
+    }
+
+    return created;
+}
+
 /*
  * Deletes the i-node.
  * Input:
@@ -250,24 +803,31 @@ int inode_delete(int inumber) {
         return -1;
 
     /* Inode operation, aquire imediately. */
-    pthread_rwlock_wrlock(&inode_rw_locks[inumber]);
+    pthread_rwlock_wrlock(&inode_table[inumber].rw_lock);
 
     /* Inode is being deleted. Following operations in the rw won't
      * work except creating a new inode with the same inumber. */
 
     pthread_mutex_lock(&freeinode_ts_lock);
 
-    if (freeinode_ts[inumber] == FREE) {
+    if (freeinode_ts[inumber] == FREE ||
+        inode_preserve(inumber) == -1) {
+        pthread_mutex_unlock(&freeinode_ts_lock);
+        pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
         return -1;
     }
 
     freeinode_ts[inumber] = FREE;
+    atomic_fetch_add(&free_inode_count, 1);
+
+    inode_write_begin(inumber);
 
-    inode_t *const inode = &inode_table[inumber];
+    inode_t *const inode = &inode_table[inumber].inode;
     if (inode->i_size > 0) {
         if (data_inode_blocks_free(inode) == -1) {
+            inode_write_end(inumber);
             pthread_mutex_unlock(&freeinode_ts_lock);
-            pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+            pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
             return -1;
         }
     }
@@ -276,9 +836,11 @@ int inode_delete(int inumber) {
      * another thread deleted the inode. */
     inode->i_node_type = T_PREV_USED;
 
-    initializes_file_data_blocks(inode);
+    inode->i_compressed = false;
+    inode_data_reset(inode);
+    inode_write_end(inumber);
     pthread_mutex_unlock(&freeinode_ts_lock);
-    pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+    pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
 
     return 0;
 }
@@ -297,7 +859,117 @@ inode_t *inode_get(int inumber) {
     }
 
     insert_delay(); // simulate storage access delay to i-node
-    return &inode_table[inumber];
+    return &inode_table[inumber].inode;
+}
+
+/*
+ * Returns the rwlock of an i-node (guarding its metadata).
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+pthread_rwlock_t *inode_rw_lock(int inumber) {
+    return &inode_table[inumber].rw_lock;
+}
+
+/*
+ * Marks the start of a change to an i-node. The caller must hold the
+ * i-node's rwlock for writing until the matching inode_write_end.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void inode_write_begin(int inumber) {
+    atomic_uint *const seq = &inode_table[inumber].seq;
+
+    const unsigned int cur = atomic_load_explicit(seq, memory_order_relaxed);
+
+    atomic_store_explicit(seq, cur + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/*
+ * Marks the end of a change to an i-node started with inode_write_begin.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void inode_write_end(int inumber) {
+    atomic_uint *const seq = &inode_table[inumber].seq;
+
+    const unsigned int cur = atomic_load_explicit(seq, memory_order_relaxed);
+
+    atomic_store_explicit(seq, cur + 1, memory_order_release);
+}
+
+/*
+ * Copies an i-node without locking it, retrying while a writer is changing
+ * it, so readers never touch the rwlock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - snapshot: where the copy is stored
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_snapshot(int inumber, inode_t *snapshot) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node
+
+    atomic_uint *const seq = &inode_table[inumber].seq;
+    unsigned int before;
+    do {
+        while ((before = atomic_load_explicit(seq, memory_order_acquire)) & 1) {
+            sched_yield();
+        }
+
+        memcpy(snapshot, &inode_table[inumber].inode, sizeof(inode_t));
+
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(seq, memory_order_relaxed) != before);
+
+    return 0;
+}
+
+static bool data_block_exclusive(int block_number);
+
+/*
+ * Must be called with dir_entry_lock held.
+ * Locates the block containing a directory's entries, to change them: a
+ * block shared with a snapshot is first replaced by a copy.
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ * Returns: pointer to the entries, NULL if failed
+ */
+static dir_entry_t *dir_entries_for_write(int inumber) {
+    pthread_rwlock_wrlock(&inode_table[inumber].rw_lock);
+
+    inode_t *const inode = &inode_table[inumber].inode;
+    if (inode->i_node_type != T_DIRECTORY || inode_preserve(inumber) == -1) {
+        pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
+        return NULL;
+    }
+
+    int block_number = inode->i_direct_data_blocks[0];
+    if (!data_block_exclusive(block_number)) {
+        const int copy = data_block_alloc();
+        if (copy == -1) {
+            pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
+            return NULL;
+        }
+
+        block_copy(data_block_get(copy), data_block_get(block_number),
+                   BLOCK_SIZE);
+
+        inode_write_begin(inumber);
+        inode->i_direct_data_blocks[0] = copy;
+        inode_write_end(inumber);
+
+        data_block_free(block_number);
+        block_number = copy;
+    }
+
+    pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
+
+    return (dir_entry_t *)data_block_get(block_number);
 }
 
 /*
@@ -313,36 +985,21 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
         return -1;
     }
 
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    /* Getting inode info. */
-    pthread_rwlock_rdlock(&inode_rw_locks[inumber]);
-
-    const inode_type cur_type = inode_table[inumber].i_node_type;
-
-    if (cur_type != T_DIRECTORY) {
-        pthread_rwlock_unlock(&inode_rw_locks[inumber]);
-        return -1;
-    }
-
     if (strlen(sub_name) == 0) {
-        pthread_rwlock_unlock(&inode_rw_locks[inumber]);
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(
-        inode_table[inumber].i_direct_data_blocks[0]);
+    insert_delay(); // simulate storage access delay to i-node with inumber
 
-    /* Done. */
-    pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+    /* Iterating the table. */
+    pthread_mutex_lock(&dir_entry_lock);
 
+    dir_entry_t *dir_entry = dir_entries_for_write(inumber);
     if (dir_entry == NULL) {
+        pthread_mutex_unlock(&dir_entry_lock);
         return -1;
     }
 
-    /* Iterating the table. */
-    pthread_mutex_lock(&dir_entry_lock);
-
     /* Finds and fills the first empty entry */
     for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
         if (dir_entry[i].d_inumber == -1) {
@@ -359,10 +1016,128 @@ int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
     return -1;
 }
 
-/* Looks for a given name inside a directory
- * Input:
- * 	- parent directory's i-node number
- * 	- name to search
+/* Must be called with dir_entry_lock held.
+ * Returns: the i-number a name is linked to in a directory's entries, -1 if
+ * none */
+static int dir_entries_find(dir_entry_t const *dir_entry,
+                            char const *sub_name) {
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (dir_entry[i].d_inumber != -1 &&
+            strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0) {
+            return dir_entry[i].d_inumber;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Adds entries to the i-node directory data, changing it once for all of
+ * them. Names already in the directory (including earlier ones of the same
+ * call) are left as they are.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - count: number of entries
+ *  - sub_inumbers: identifier of the sub i-node of each entry; for names
+ *    already in the directory, replaced by the one they have, and for those
+ *    with no room left, by -1
+ *  - sub_names: name of each entry
+ * Returns: the number of entries added, -1 if failed
+ */
+int add_dir_entries(int inumber, int count, int *sub_inumbers,
+                    char const *const *sub_names) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node with inumber
+
+    pthread_mutex_lock(&dir_entry_lock);
+
+    dir_entry_t *dir_entry = dir_entries_for_write(inumber);
+    if (dir_entry == NULL) {
+        pthread_mutex_unlock(&dir_entry_lock);
+        return -1;
+    }
+
+    int added = 0;
+    size_t empty = 0;
+    for (int n = 0; n < count; n++) {
+        const int existing = dir_entries_find(dir_entry, sub_names[n]);
+        if (existing != -1) {
+            sub_inumbers[n] = existing;
+            continue;
+        }
+
+        if (!valid_inumber(sub_inumbers[n]) || strlen(sub_names[n]) == 0) {
+            sub_inumbers[n] = -1;
+            continue;
+        }
+
+        /* No entry is emptied meanwhile, so the search for an empty one
+         * resumes where the last one ended */
+        while (empty < MAX_DIR_ENTRIES && dir_entry[empty].d_inumber != -1) {
+            empty++;
+        }
+        if (empty == MAX_DIR_ENTRIES) {
+            sub_inumbers[n] = -1;
+            continue;
+        }
+
+        dir_entry[empty].d_inumber = sub_inumbers[n];
+        strncpy(dir_entry[empty].d_name, sub_names[n], MAX_FILE_NAME - 1);
+        dir_entry[empty].d_name[MAX_FILE_NAME - 1] = 0;
+        added++;
+    }
+
+    pthread_mutex_unlock(&dir_entry_lock);
+    return added;
+}
+
+/* Looks for several names inside a directory, going through it once.
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- number of names, the names and where to store the i-number linked to
+ * 	  each (-1 if not found)
+ * 	Returns 0 if successful, -1 otherwise
+ */
+int find_many_in_dir(int inumber, int count, char const *const *sub_names,
+                     int *sub_inumbers) {
+    insert_delay(); // simulate storage access delay to i-node with inumber
+
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&inode_table[inumber].rw_lock);
+    const bool directory =
+        inode_table[inumber].inode.i_node_type == T_DIRECTORY;
+    pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
+    if (!directory) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dir_entry_lock);
+
+    dir_entry_t const *dir_entry = (dir_entry_t *)data_block_get(
+        inode_table[inumber].inode.i_direct_data_blocks[0]);
+    if (dir_entry == NULL) {
+        pthread_mutex_unlock(&dir_entry_lock);
+        return -1;
+    }
+
+    for (int n = 0; n < count; n++) {
+        sub_inumbers[n] = dir_entries_find(dir_entry, sub_names[n]);
+    }
+
+    pthread_mutex_unlock(&dir_entry_lock);
+    return 0;
+}
+
+/* Looks for a given name inside a directory
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
  * 	Returns i-number linked to the target name, -1 if not found
  */
 int find_in_dir(int inumber, char const *sub_name) {
@@ -372,26 +1147,27 @@ int find_in_dir(int inumber, char const *sub_name) {
         return -1;
 
     /* Getting inode info. */
-    pthread_rwlock_rdlock(&inode_rw_locks[inumber]);
-    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
-        pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+    pthread_rwlock_rdlock(&inode_table[inumber].rw_lock);
+    if (inode_table[inumber].inode.i_node_type != T_DIRECTORY) {
+        pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(
-        inode_table[inumber].i_direct_data_blocks[0]);
-
     /* Done. */
-    pthread_rwlock_unlock(&inode_rw_locks[inumber]);
+    pthread_rwlock_unlock(&inode_table[inumber].rw_lock);
+
+    /* Iterating the table. */
+    pthread_mutex_lock(&dir_entry_lock);
 
+    /* Locates the block containing the directory's entries (only replaced
+     * with dir_entry_lock held, see dir_entries_for_write) */
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(
+        inode_table[inumber].inode.i_direct_data_blocks[0]);
     if (dir_entry == NULL) {
+        pthread_mutex_unlock(&dir_entry_lock);
         return -1;
     }
 
-    /* Iterating the table. */
-    pthread_mutex_lock(&dir_entry_lock);
-
     /* Iterates over the directory entries looking for one that has the target
      * name */
     for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
@@ -414,13 +1190,20 @@ int data_block_alloc() {
     pthread_mutex_lock(&file_allocation_lock);
 
     for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
+        if (i * (int)sizeof(block_refs[0]) % BLOCK_SIZE == 0) {
+            insert_delay(); // simulate storage access delay to block_refs
         }
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
+        if (block_refs[i] == 0) {
+            /* The first free block starts a run */
+            block_refs[i] = 1;
+            free_runs_take(i, 1);
             pthread_mutex_unlock(&file_allocation_lock);
+
+            /* Parts of the block a write skips over must not show what a
+             * deleted file left there. */
+            block_zero(&fs_data[i * BLOCK_SIZE], BLOCK_SIZE);
+            block_checksummed[i] = false;
             return i;
         }
     }
@@ -429,25 +1212,167 @@ int data_block_alloc() {
     return -1;
 }
 
-/* Frees a data block
+/*
+ * Allocates a run of consecutive data blocks, the first one that fits
+ * Input:
+ *  - number of blocks in the run
+ * Returns: index of the run's first block if successful, -1 otherwise
+ */
+static int data_run_alloc(int count) {
+    if (count < 1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&file_allocation_lock);
+
+    int free_run = 0;
+    for (int i = 0; i < DATA_BLOCKS; i++) {
+        if (i * (int)sizeof(block_refs[0]) % BLOCK_SIZE == 0) {
+            insert_delay(); // simulate storage access delay to block_refs
+        }
+
+        free_run = block_refs[i] == 0 ? free_run + 1 : 0;
+        if (free_run == count) {
+            const int first = i - count + 1;
+            for (int block_number = first; block_number <= i; block_number++) {
+                block_refs[block_number] = 1;
+                block_checksummed[block_number] = false;
+            }
+            free_runs_take(first, count);
+
+            pthread_mutex_unlock(&file_allocation_lock);
+            return first;
+        }
+    }
+
+    pthread_mutex_unlock(&file_allocation_lock);
+    return -1;
+}
+
+static void fingerprint_remove(int block_number);
+
+/* Frees a data block (once nothing else references it)
  * Input
  * 	- the block index
  * Returns: 0 if success, -1 otherwise
  */
 int data_block_free(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+
+    /* A block must leave the index before it can be taken again */
+    const bool dedup = atomic_load(&dedup_used);
+    if (dedup) {
+        pthread_mutex_lock(&dedup_lock);
+    }
     pthread_mutex_lock(&file_allocation_lock);
 
+    int rc = 0;
+    insert_delay(); // simulate storage access delay to block_refs
+    if (block_refs[block_number] == 0) {
+        rc = -1;
+    } else if (--block_refs[block_number] == 0) {
+        block_checksummed[block_number] = false;
+        free_runs_release(block_number);
+        if (dedup) {
+            fingerprint_remove(block_number);
+        }
+    }
+
+    pthread_mutex_unlock(&file_allocation_lock);
+    if (dedup) {
+        pthread_mutex_unlock(&dedup_lock);
+    }
+
+    return rc;
+}
+
+/* Adds a reference to a taken data block.
+ * Returns: 0 if success, -1 otherwise */
+static int data_block_ref(int block_number) {
     if (!valid_block_number(block_number)) {
-        pthread_mutex_unlock(&file_allocation_lock);
         return -1;
     }
 
-    insert_delay(); // simulate storage access delay to free_blocks
-    free_blocks[block_number] = FREE;
+    pthread_mutex_lock(&file_allocation_lock);
+    const int rc = block_refs[block_number] > 0 ? 0 : -1;
+    if (rc == 0) {
+        block_refs[block_number]++;
+    }
+    pthread_mutex_unlock(&file_allocation_lock);
+
+    return rc;
+}
 
+/* Checks if nothing but the caller's block map slot points to a block, so it
+ * may be changed in place. */
+static bool data_block_exclusive(int block_number) {
+    pthread_mutex_lock(&file_allocation_lock);
+    const bool exclusive = block_refs[block_number] == 1;
     pthread_mutex_unlock(&file_allocation_lock);
 
-    return 0;
+    return exclusive;
+}
+
+/* Cluster slot that, in a compressed cluster, holds the size of its
+ * compressed contents instead of a block (they never need every slot) */
+#define CLUSTER_MARKER_SLOT (CLUSTER_BLOCKS - 1)
+#define CLUSTER_MARKER(size) (UNALLOCATED_BLOCK - 1 - (int)(size))
+#define CLUSTER_MARKER_SIZE(marker) ((size_t)(UNALLOCATED_BLOCK - 1 - (marker)))
+#define IS_CLUSTER_MARKER(slot) ((slot) < UNALLOCATED_BLOCK)
+
+/* Number of block map slots of a cluster (the last cluster of the biggest
+ * file may have less than CLUSTER_BLOCKS) */
+static int cluster_slots(int cluster) {
+    const int left = (int)MAX_BLOCKS - cluster * CLUSTER_BLOCKS;
+    return left < CLUSTER_BLOCKS ? left : CLUSTER_BLOCKS;
+}
+
+static int block_map_get(block_map_t const *map, int block_order);
+
+/* Last block map slot of an inode that may point to a data block, -1 if it
+ * has none. Compressed files have unallocated slots and markers in between
+ * blocks, and the slots of their last cluster may go past the end of the
+ * file. */
+static int inode_last_slot(inode_t const *inode) {
+    if (inode->i_inline) {
+        return -1;
+    }
+
+    if (!inode->i_compressed) {
+        return blocks_allocated(inode) - 1;
+    }
+
+    const int clusters = (int)((inode->i_size + CLUSTER_SIZE - 1) /
+                               CLUSTER_SIZE);
+    const int last_block = clusters * CLUSTER_BLOCKS - 1;
+    return last_block < MAX_BLOCKS ? last_block : (int)MAX_BLOCKS - 1;
+}
+
+/* Frees the blocks of a compressed file (see inode_last_slot). */
+static int data_cluster_blocks_free(inode_t *inode) {
+    const int last_block = inode_last_slot(inode);
+
+    block_map_t map;
+    if (block_map_init(&map, inode, last_block) == -1) {
+        return -1;
+    }
+
+    int rc = 0;
+    for (int block = 0; block <= last_block; block++) {
+        const int block_number = block_map_get(&map, block);
+        if (block_number >= 0 && data_block_free(block_number) == -1) {
+            rc = -1;
+        }
+    }
+
+    if (inode->i_indirect_data_block != UNALLOCATED_BLOCK &&
+        data_block_free(inode->i_indirect_data_block) == -1) {
+        rc = -1;
+    }
+
+    return rc;
 }
 
 /* This function is not synchronized and may need synchronization
@@ -458,6 +1383,10 @@ int data_block_free(int block_number) {
  * Returns: 0 if success, -1 otherwise
  */
 int data_inode_blocks_free(inode_t *inode) {
+    if (inode->i_compressed) {
+        return data_cluster_blocks_free(inode);
+    }
+
     const int last_block_allocated = blocks_allocated(inode) - 1;
 
     int rc = 0;
@@ -481,6 +1410,40 @@ int data_inode_blocks_free(inode_t *inode) {
     return rc;
 }
 
+/* This function is not synchronized and may need synchronization
+ * from outside (the inode's rwlock held).
+ * Checks if a write to a file changes blocks shared with other files or
+ * snapshots, which it must copy first (see fill_block_cow). Until
+ * deduplication is used, references to the blocks of a file are only added
+ * with its rwlock held for writing, so the counts are read without
+ * file_allocation_lock: they may only have dropped meanwhile, and then a
+ * block is copied needlessly.
+ * Input:
+ *  - pointer to the inode, with its blocks for the write allocated
+ *  - where the write goes (offset, to_write)
+ */
+bool inode_blocks_shared(inode_t *inode, size_t offset, size_t to_write) {
+    if (inode->i_inline || to_write == 0) {
+        return false;
+    }
+
+    const int last_block = final_block(offset, to_write);
+    block_map_t map;
+    if (block_map_init(&map, inode, last_block) == -1) {
+        return true;
+    }
+
+    for (int block = current_block(offset); block <= last_block; block++) {
+        const int block_number = block_map_get(&map, block);
+        if (valid_block_number(block_number) &&
+            __atomic_load_n(&block_refs[block_number], __ATOMIC_RELAXED) > 1) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /* This function is not synchronized and may need synchronization
  * from outside.
  * Returns a pointer to the contents of a given block
@@ -497,9 +1460,12 @@ void *data_block_get(int block_number) {
     return &fs_data[block_number * BLOCK_SIZE];
 }
 
-static int allocate_per_block(int *block) {
-    int block_number = data_block_alloc();
-    if (block_number == -1) {
+static int dedup_hashes_share(dedup_hashes_t *hashes, int block_order);
+
+static int allocate_per_block(int *block, dedup_hashes_t *hashes,
+                              int block_order) {
+    int block_number = dedup_hashes_share(hashes, block_order);
+    if (block_number == -1 && (block_number = data_block_alloc()) == -1) {
         return -1;
     }
 
@@ -507,62 +1473,133 @@ static int allocate_per_block(int *block) {
     return block_number;
 }
 
-static int allocate_per_block_more(int indirect_block, int idx) {
+static int allocate_per_block_more(int indirect_block, int idx,
+                                   dedup_hashes_t *hashes) {
     int *indirect_data_block = (int *)data_block_get(indirect_block);
     if (indirect_data_block == NULL) {
         return -1;
     }
 
-    return allocate_per_block(&indirect_data_block[idx]);
+    return allocate_per_block(&indirect_data_block[idx], hashes,
+                              MAX_DIRECT_DATA_BLOCKS_PER_FILE + idx);
 }
 
 static int allocate_blocks_impl(inode_t *inode, int starting_block,
-                                int last_block) {
+                                int last_block, dedup_hashes_t *hashes) {
     for (int block = starting_block; block <= last_block; block++) {
         if (block < MAX_DIRECT_DATA_BLOCKS_PER_FILE) {
-            if (allocate_per_block(&inode->i_direct_data_blocks[block]) == -1) {
+            if (allocate_per_block(&inode->i_direct_data_blocks[block], hashes,
+                                   block) == -1) {
                 return block - 1;
             }
         }
 
         else if (block == MAX_DIRECT_DATA_BLOCKS_PER_FILE) {
             int block_number;
-            if ((block_number =
-                     allocate_per_block(&inode->i_indirect_data_block)) == -1) {
+            if ((block_number = allocate_per_block(
+                     &inode->i_indirect_data_block, NULL, -1)) == -1) {
                 return block - 1;
             }
 
-            if (allocate_per_block_more(block_number, 0) == -1)
+            if (allocate_per_block_more(block_number, 0, hashes) == -1)
                 return block - 1;
         }
 
         else if (allocate_per_block_more(
                      inode->i_indirect_data_block,
-                     block - MAX_DIRECT_DATA_BLOCKS_PER_FILE) == -1)
+                     block - MAX_DIRECT_DATA_BLOCKS_PER_FILE, hashes) == -1)
             return block - 1;
     }
 
     return last_block;
 }
 
+/* Frees the blocks allocated_blocks_impl took, from starting_block to
+ * last_block, when it couldn't take them all: the file's size doesn't cover
+ * them, so nothing else would. */
+static void allocate_blocks_undo(inode_t *inode, int starting_block,
+                                 int last_block) {
+    for (int block = starting_block; block <= last_block; block++) {
+        data_block_free(get_block_number(inode, block));
+    }
+
+    if (starting_block <= MAX_DIRECT_DATA_BLOCKS_PER_FILE &&
+        inode->i_indirect_data_block != UNALLOCATED_BLOCK) {
+        data_block_free(inode->i_indirect_data_block);
+        inode->i_indirect_data_block = UNALLOCATED_BLOCK;
+    }
+}
+
 /* This function is not synchronized and may need synchronization
  * from outside.
  * Tries to allocate all needed data blocks in an inode
- * according to file_offset and bytes needed (to_write).
+ * according to file_offset and bytes needed (to_write). If some can't be,
+ * none is. The slots the write will fill with the contents of an indexed
+ * block point to it instead, and take no new block.
  * Input
  * 	- pointer to an inode
- * Returns: 0 if success, -1 otherwise
+ * 	- hashes of the whole blocks written (see dedup_hash_write), or NULL
+ * Returns: the last block (relative to the inode) allocated if success, -1
+ * otherwise
  */
-int allocate_blocks(inode_t *inode, size_t file_offset, size_t to_write) {
+int allocate_blocks(inode_t *inode, size_t file_offset, size_t to_write,
+                    dedup_hashes_t *hashes) {
     const int block = final_block(file_offset, to_write);
     const int total = rw_total_blocks(file_offset, to_write);
-    if (blocks_allocated(inode) < total) {
-        return allocate_blocks_impl(inode, blocks_allocated(inode), block);
+    const int allocated = blocks_allocated(inode);
+    if (allocated < total) {
+        /* Files with no more than the direct blocks have no indirect one */
+        if (allocated <= MAX_DIRECT_DATA_BLOCKS_PER_FILE) {
+            inode->i_indirect_data_block = UNALLOCATED_BLOCK;
+        }
+
+        const int last =
+            allocate_blocks_impl(inode, allocated, block, hashes);
+        if (last != block) {
+            allocate_blocks_undo(inode, allocated, last);
+            return -1;
+        }
+        return last;
     }
 
     return total - 1;
 }
 
+/* This function is not synchronized and may need synchronization
+ * from outside.
+ * Moves the contents of a file kept inside its inode to a data block, so the
+ * file can grow past INODE_INLINE_DATA_SIZE.
+ * Input
+ * 	- pointer to an inode
+ * Returns: 0 if success, -1 otherwise
+ */
+int inode_inline_spill(inode_t *inode) {
+    if (!inode->i_inline) {
+        return 0;
+    }
+
+    const size_t size = inode->i_size;
+
+    /* An empty file needs no block yet. */
+    int block_number = UNALLOCATED_BLOCK;
+    if (size > 0) {
+        if ((block_number = data_block_alloc()) == -1) {
+            return -1;
+        }
+
+        if (fill_block(block_number, inode->i_inline_data, 0, size) == -1) {
+            data_block_free(block_number);
+            return -1;
+        }
+    }
+
+    inode->i_inline = false;
+    inode->i_indirect_data_block = UNALLOCATED_BLOCK;
+    inode->i_direct_data_blocks[0] = block_number;
+
+    return 0;
+}
+
 /* This function is not synchronized and may need synchronization
  * from outside.
  * Gets the FS number (index) of a block in an inode
@@ -591,6 +1628,49 @@ int get_block_number(inode_t *inode, int block_order) {
     return indirect_data_block[block_order - MAX_DIRECT_DATA_BLOCKS_PER_FILE];
 }
 
+/* Blocks checksummed at once when updating or verifying a run */
+#define CHECKSUM_BATCH (16)
+
+/* Recomputes the checksums of count blocks starting at block_number. */
+static void checksum_update(int block_number, int count) {
+    uint32_t crcs[CHECKSUM_BATCH];
+
+    for (int i = 0; i < count; i += CHECKSUM_BATCH) {
+        const int batch =
+            count - i < CHECKSUM_BATCH ? count - i : CHECKSUM_BATCH;
+        block_crc32c(&fs_data[(block_number + i) * BLOCK_SIZE],
+                     (size_t)batch, crcs);
+
+        for (int j = 0; j < batch; j++) {
+            block_checksums[block_number + i + j] = crcs[j];
+            block_checksummed[block_number + i + j] = true;
+        }
+    }
+}
+
+/* Returns the number of blocks, among the count starting at block_number,
+ * whose contents don't match their checksum. */
+static int checksum_verify(int block_number, int count) {
+    uint32_t crcs[CHECKSUM_BATCH];
+    int corrupted = 0;
+
+    for (int i = 0; i < count; i += CHECKSUM_BATCH) {
+        const int batch =
+            count - i < CHECKSUM_BATCH ? count - i : CHECKSUM_BATCH;
+        block_crc32c(&fs_data[(block_number + i) * BLOCK_SIZE],
+                     (size_t)batch, crcs);
+
+        for (int j = 0; j < batch; j++) {
+            const int b = block_number + i + j;
+            if (block_checksummed[b] && block_checksums[b] != crcs[j]) {
+                corrupted++;
+            }
+        }
+    }
+
+    return corrupted;
+}
+
 /* This function is not synchronized and may need synchronization
  * from outside.
  * Fils a block with the contents of a buffer.
@@ -608,78 +1688,1371 @@ int fill_block(int block_number, const void *buffer, size_t block_offset,
         return -1;
     }
 
-    memcpy(block + block_offset, buffer, to_write);
+    block_copy(block + block_offset, buffer, to_write);
+    checksum_update(block_number, 1);
 
     return 0;
 }
 
-/* Add new entry to the open file table
- * Inputs:
- * 	- I-node number of the file to open
- * 	- Initial offset
- * Returns: file handle if successful, -1 otherwise
+/* This function is not synchronized and may need synchronization
+ * from outside.
+ * Looks up the indirect block of an inode once, so the FS numbers of all the
+ * blocks a read or write touches are found without further storage accesses.
+ * Input:
+ * - pointer to the block map to fill, pointer to inode and the last block
+ *   (relative to the inode) that will be looked up.
+ * Returns: 0 if success, -1 otherwise
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-    pthread_mutex_lock(&open_file_table_lock);
-
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            pthread_mutex_unlock(&open_file_table_lock);
-            return i;
+int block_map_init(block_map_t *map, inode_t *inode, int last_block) {
+    map->inode = inode;
+    map->indirect = NULL;
+
+    /* Compressed files only get an indirect block when a cluster is stored
+     * in its slots; until then they read as unallocated. */
+    if (last_block >= MAX_DIRECT_DATA_BLOCKS_PER_FILE &&
+        !(inode->i_compressed &&
+          inode->i_indirect_data_block == UNALLOCATED_BLOCK)) {
+        map->indirect = (int *)data_block_get(inode->i_indirect_data_block);
+        if (map->indirect == NULL) {
+            return -1;
         }
     }
 
-    pthread_mutex_unlock(&open_file_table_lock);
-    return -1;
+    return 0;
 }
 
-/* Frees an entry from the open file table
- * Inputs:
- * 	- file handle to free/close
- * Returns 0 is success, -1 otherwise
- */
-int remove_from_open_file_table(int fhandle) {
-    if (!valid_file_handle(fhandle))
+static int block_map_get(block_map_t const *map, int block_order) {
+    if (block_order >= MAX_BLOCKS) {
         return -1;
+    }
 
-    pthread_mutex_lock(&open_file_table_lock);
+    if (block_order < MAX_DIRECT_DATA_BLOCKS_PER_FILE) {
+        return map->inode->i_direct_data_blocks[block_order];
+    }
 
-    if (free_open_file_entries[fhandle] != TAKEN) {
-        pthread_mutex_unlock(&open_file_table_lock);
+    if (map->indirect == NULL) {
         return -1;
     }
-    free_open_file_entries[fhandle] = FREE;
 
-    pthread_mutex_unlock(&open_file_table_lock);
-    return 0;
+    return map->indirect[block_order - MAX_DIRECT_DATA_BLOCKS_PER_FILE];
 }
 
 /* This function is not synchronized and may need synchronization
  * from outside.
- * Returns pointer to a given entry in the open file table
- * Inputs:
- * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
+ * Finds the run of blocks, starting at block_order, that are also stored one
+ * after the other in the FS.
+ * Input:
+ * - block map, first and last block of the run (relative to the inode).
+ * - where to store the FS index of the first block (block_number).
+ * Returns: number of blocks in the run, -1 otherwise
  */
-open_file_entry_t *get_open_file_entry(int fhandle) {
-    if (!valid_file_handle(fhandle)) {
+int block_map_run(block_map_t const *map, int block_order, int last_block,
+                  int *block_number) {
+    if ((*block_number = block_map_get(map, block_order)) < 0) {
+        return -1;
+    }
+
+    int count = 1;
+    while (block_order + count <= last_block &&
+           block_map_get(map, block_order + count) == *block_number + count) {
+        count++;
+    }
+
+    return count;
+}
+
+static void *data_run_get(int block_number, int count) {
+    if (count < 1 || !valid_block_number(block_number) ||
+        !valid_block_number(block_number + count - 1)) {
         return NULL;
     }
-    return &open_file_table[fhandle];
+
+    insert_delay(); // simulate storage access delay to the blocks
+    return &fs_data[block_number * BLOCK_SIZE];
 }
 
-/* This function indicates whether or not a file handle is taken
- * in the file handle table.
+/* This function is not synchronized and may need synchronization
+ * from outside.
+ * Fills a run of consecutive blocks with the contents of a buffer, in a
+ * single copy.
+ * Input:
+ * - FS index of the first block (block_number) and blocks in the run (count).
+ * - Buffer with the contents (buffer).
+ * - Offset in the run where we start filling (run_offset).
+ * - Amount of bytes to fill (to_write).
+ * Returns: 0 if success, -1 otherwise
+ */
+int fill_run(int block_number, int count, const void *buffer,
+             size_t run_offset, size_t to_write) {
+    char *run = data_run_get(block_number, count);
+    if (run == NULL || run_offset + to_write > (size_t)count * BLOCK_SIZE) {
+        return -1;
+    }
+
+    block_copy(run + run_offset, buffer, to_write);
+
+    if (to_write > 0) {
+        const int first = (int)(run_offset / BLOCK_SIZE);
+        const int last = (int)((run_offset + to_write - 1) / BLOCK_SIZE);
+        checksum_update(block_number + first, last - first + 1);
+    }
+
+    return 0;
+}
+
+/* This function is not synchronized and may need synchronization
+ * from outside.
+ * Copies the contents of a run of consecutive blocks to a buffer, in a
+ * single copy, after checking the blocks read against their checksums.
+ * Input:
+ * - FS index of the first block (block_number) and blocks in the run (count).
+ * - Buffer to copy to (buffer).
+ * - Offset in the run where we start reading (run_offset).
+ * - Amount of bytes to read (to_read).
+ * Returns: 0 if success, -1 otherwise
+ */
+int read_run(int block_number, int count, void *buffer, size_t run_offset,
+             size_t to_read) {
+    char const *run = data_run_get(block_number, count);
+    if (run == NULL || run_offset + to_read > (size_t)count * BLOCK_SIZE) {
+        return -1;
+    }
+
+    if (to_read > 0) {
+        const int first = (int)(run_offset / BLOCK_SIZE);
+        const int last = (int)((run_offset + to_read - 1) / BLOCK_SIZE);
+        if (checksum_verify(block_number + first, last - first + 1) != 0) {
+            return -1;
+        }
+    }
+
+    block_copy(buffer, run + run_offset, to_read);
+
+    return 0;
+}
+
+/* This function is not synchronized and may need synchronization
+ * from outside.
+ * Checks a run of consecutive blocks against their checksums.
+ * Input:
+ * - FS index of the first block (block_number) and blocks in the run (count).
+ * Returns: number of corrupted blocks, -1 otherwise
+ */
+int verify_run(int block_number, int count) {
+    if (data_run_get(block_number, count) == NULL) {
+        return -1;
+    }
+
+    return checksum_verify(block_number, count);
+}
+
+static int block_map_set(block_map_t const *map, int block_order,
+                         int block_number) {
+    if (block_order < MAX_DIRECT_DATA_BLOCKS_PER_FILE) {
+        map->inode->i_direct_data_blocks[block_order] = block_number;
+        return 0;
+    }
+
+    if (block_order >= MAX_BLOCKS || map->indirect == NULL) {
+        return -1;
+    }
+
+    map->indirect[block_order - MAX_DIRECT_DATA_BLOCKS_PER_FILE] = block_number;
+    return 0;
+}
+
+/* This function is not synchronized and may need synchronization
+ * from outside.
+ * Reads a cluster of a compressed file, decompressing it if needed.
+ * Input:
+ * - block map of the file and the cluster's index in it.
+ * - Buffer to copy to (buffer).
+ * - Length of the cluster in the file (length); what was never written
+ *   reads as zeros.
+ * Returns: 0 if success, -1 otherwise
+ */
+int cluster_load(block_map_t const *map, int cluster, void *buffer,
+                 size_t length) {
+    const int first = cluster * CLUSTER_BLOCKS;
+    const int slots = cluster_slots(cluster);
+    char *const out = buffer;
+
+    if (slots < 1 || length > (size_t)slots * BLOCK_SIZE) {
+        return -1;
+    }
+
+    const int marker =
+        slots == CLUSTER_BLOCKS
+            ? block_map_get(map, first + CLUSTER_MARKER_SLOT)
+            : UNALLOCATED_BLOCK;
+
+    if (IS_CLUSTER_MARKER(marker)) {
+        const size_t stored_size = CLUSTER_MARKER_SIZE(marker);
+        char stored[CLUSTER_SIZE];
+
+        const int last = first + (int)BLOCK_SIZEOF(stored_size) - 1;
+        for (int block = first; block <= last;) {
+            int block_number;
+            const int count = block_map_run(map, block, last, &block_number);
+            if (count == -1 ||
+                read_run(block_number, count,
+                         stored + (block - first) * BLOCK_SIZE, 0,
+                         (size_t)count * BLOCK_SIZE) == -1) {
+                return -1;
+            }
+            block += count;
+        }
+
+        const ssize_t size = lz_decompress(stored, stored_size, out, length);
+        if (size == -1) {
+            return -1;
+        }
+
+        block_zero(out + size, length - (size_t)size);
+        return 0;
+    }
+
+    /* Slots never written read as zeros */
+    const int last = first + (int)BLOCK_SIZEOF(length) - 1;
+    for (int block = first; block <= last;) {
+        const size_t offset = (size_t)(block - first) * BLOCK_SIZE;
+
+        int block_number;
+        const int count = block_map_run(map, block, last, &block_number);
+        if (count == -1) {
+            const size_t to_zero =
+                length - offset < BLOCK_SIZE ? length - offset : BLOCK_SIZE;
+            block_zero(out + offset, to_zero);
+            block++;
+            continue;
+        }
+
+        size_t to_read = (size_t)count * BLOCK_SIZE;
+        if (to_read > length - offset) {
+            to_read = length - offset;
+        }
+
+        if (read_run(block_number, count, out + offset, 0, to_read) == -1) {
+            return -1;
+        }
+        block += count;
+    }
+
+    return 0;
+}
+
+/* Gives a compressed file its indirect block, with every slot unallocated. */
+static int cluster_indirect_alloc(int inumber, block_map_t *map) {
+    const int block_number = data_block_alloc();
+    if (block_number == -1) {
+        return -1;
+    }
+
+    int *const indirect = (int *)data_block_get(block_number);
+    const int unallocated = UNALLOCATED_BLOCK;
+    block_fill_pattern(indirect, BLOCK_SIZE, &unallocated, sizeof(int));
+
+    inode_write_begin(inumber);
+    map->inode->i_indirect_data_block = block_number;
+    inode_write_end(inumber);
+
+    map->indirect = indirect;
+    return 0;
+}
+
+/* This function is not synchronized and may need synchronization
+ * from outside (the inode rwlock and the cluster's range).
+ * Stores a cluster of a compressed file. If compressing it saves at least one
+ * block, the compressed contents go in the first slots of the cluster and
+ * their size in its last slot (CLUSTER_MARKER); otherwise the cluster is
+ * stored as is. The blocks the cluster had are reused.
+ * Input:
+ * - inumber and block map of the file, and the cluster's index in it.
+ * - Buffer with the contents (buffer) and their length (length).
+ * Returns: 0 if success, -1 otherwise
+ */
+int cluster_store(int inumber, block_map_t *map, int cluster,
+                  void const *buffer, size_t length) {
+    const int first = cluster * CLUSTER_BLOCKS;
+    const int slots = cluster_slots(cluster);
+
+    if (slots < 1 || length == 0 || length > (size_t)slots * BLOCK_SIZE) {
+        return -1;
+    }
+
+    char stored[CLUSTER_SIZE];
+    size_t stored_size = 0;
+    if (slots == CLUSTER_BLOCKS) {
+        stored_size = lz_compress(buffer, length, stored,
+                                  CLUSTER_MARKER_SLOT * BLOCK_SIZE);
+        if (BLOCK_SIZEOF(stored_size) >= BLOCK_SIZEOF(length)) {
+            stored_size = 0;
+        }
+    }
+
+    const bool compressed = stored_size > 0;
+    if (!compressed) {
+        stored_size = length;
+        block_copy(stored, buffer, length);
+    }
+
+    /* The end of the last block reads as zeros if the cluster grows */
+    const int blocks = (int)BLOCK_SIZEOF(stored_size);
+    block_zero(stored + stored_size,
+               (size_t)blocks * BLOCK_SIZE - stored_size);
+
+    if (first + slots > MAX_DIRECT_DATA_BLOCKS_PER_FILE &&
+        map->indirect == NULL && cluster_indirect_alloc(inumber, map) == -1) {
+        return -1;
+    }
+
+    /* Blocks shared with a snapshot are left to it */
+    int old_blocks[CLUSTER_BLOCKS];
+    int old_count = 0;
+    int shared_blocks[CLUSTER_BLOCKS];
+    int shared_count = 0;
+    for (int i = 0; i < slots; i++) {
+        const int block_number = block_map_get(map, first + i);
+        if (block_number < 0) {
+            continue;
+        }
+
+        if (data_block_exclusive(block_number)) {
+            old_blocks[old_count++] = block_number;
+        } else {
+            shared_blocks[shared_count++] = block_number;
+        }
+    }
+
+    int new_blocks[CLUSTER_BLOCKS];
+    for (int i = 0; i < blocks; i++) {
+        if (i < old_count) {
+            new_blocks[i] = old_blocks[i];
+        } else if ((new_blocks[i] = data_block_alloc()) == -1) {
+            for (int j = old_count; j < i; j++) {
+                data_block_free(new_blocks[j]);
+            }
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < blocks; i++) {
+        if (fill_block(new_blocks[i], stored + i * BLOCK_SIZE, 0,
+                       BLOCK_SIZE) == -1) {
+            return -1;
+        }
+    }
+
+    inode_write_begin(inumber);
+    for (int i = 0; i < slots; i++) {
+        block_map_set(map, first + i,
+                      i < blocks ? new_blocks[i] : UNALLOCATED_BLOCK);
+    }
+    if (compressed) {
+        block_map_set(map, first + CLUSTER_MARKER_SLOT,
+                      CLUSTER_MARKER(stored_size));
+    }
+    inode_write_end(inumber);
+
+    for (int i = blocks; i < old_count; i++) {
+        data_block_free(old_blocks[i]);
+    }
+
+    for (int i = 0; i < shared_count; i++) {
+        data_block_free(shared_blocks[i]);
+    }
+
+    return 0;
+}
+
+void dedup_enable(bool enabled) {
+    if (enabled) {
+        atomic_store(&dedup_used, true);
+    }
+    atomic_store(&dedup_enabled, enabled);
+}
+
+bool dedup_in_use() { return atomic_load(&dedup_used); }
+
+static inline int fingerprint_bucket(fingerprint_t const *fingerprint) {
+    return (int)(fingerprint->hash[0] % FINGERPRINT_BUCKETS);
+}
+
+/* Must be called with dedup_lock held. */
+static void fingerprint_insert(int block_number,
+                               fingerprint_t const *fingerprint) {
+    const int bucket = fingerprint_bucket(fingerprint);
+    block_fingerprints[block_number] = *fingerprint;
+    block_indexed[block_number] = true;
+    fingerprint_next[block_number] = fingerprint_buckets[bucket];
+    fingerprint_buckets[bucket] = block_number;
+}
+
+/* Must be called with dedup_lock held. */
+static void fingerprint_remove(int block_number) {
+    if (!block_indexed[block_number]) {
+        return;
+    }
+
+    const int bucket = fingerprint_bucket(&block_fingerprints[block_number]);
+    int *link = &fingerprint_buckets[bucket];
+    while (*link != block_number) {
+        link = &fingerprint_next[*link];
+    }
+    *link = fingerprint_next[block_number];
+    block_indexed[block_number] = false;
+}
+
+/* Must be called with dedup_lock held.
+ * Returns: an indexed block with the same contents as buffer, -1 if none */
+static int fingerprint_find(fingerprint_t const *fingerprint,
+                            void const *buffer) {
+    const int bucket = fingerprint_bucket(fingerprint);
+    for (int block_number = fingerprint_buckets[bucket]; block_number != -1;
+         block_number = fingerprint_next[block_number]) {
+        fingerprint_t const *other = &block_fingerprints[block_number];
+        if (other->hash[0] != fingerprint->hash[0] ||
+            other->hash[1] != fingerprint->hash[1]) {
+            continue;
+        }
+
+        /* Hashes can collide: only the contents are trusted */
+        void const *block = data_block_get(block_number);
+        if (block != NULL && block_compare(block, buffer, BLOCK_SIZE) == 0) {
+            return block_number;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Hashes the blocks a write fills as a whole, if deduplication is on, so
+ * allocate_blocks and fill_block_cow look them up in the index without
+ * hashing them again.
+ * Input:
+ *  - where to store the hashes
+ *  - contents of the write (buffer), where they go (offset, to_write)
+ */
+void dedup_hash_write(dedup_hashes_t *hashes, void const *buffer,
+                      size_t offset, size_t to_write) {
+    const size_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const size_t end = BLOCK_CURRENT(offset + to_write);
+
+    hashes->first = (int)first;
+    hashes->count = 0;
+    if (!atomic_load(&dedup_enabled) || end <= first) {
+        return;
+    }
+
+    hashes->count = (int)(end - first);
+    hashes->contents = (char const *)buffer + (first * BLOCK_SIZE - offset);
+    for (int i = 0; i < hashes->count; i++) {
+        hash128((char const *)hashes->contents + (size_t)i * BLOCK_SIZE,
+                BLOCK_SIZE, hashes->fingerprints[i].hash);
+        hashes->found[i] = false;
+    }
+}
+
+/* The index of a block in hashes, -1 if it isn't one of them */
+static int dedup_hashes_index(dedup_hashes_t const *hashes, int block_order) {
+    if (hashes == NULL || block_order < hashes->first ||
+        block_order >= hashes->first + hashes->count) {
+        return -1;
+    }
+
+    return block_order - hashes->first;
+}
+
+/* Checks if allocate_blocks pointed a block of a write to an indexed block,
+ * which already has the contents it is written. */
+bool dedup_hashes_found(dedup_hashes_t const *hashes, int block_order) {
+    const int i = dedup_hashes_index(hashes, block_order);
+    return i != -1 && hashes->found[i];
+}
+
+/* The hash of a block of a write, NULL if it isn't written whole (or
+ * deduplication is off). */
+fingerprint_t const *dedup_hashes_fingerprint(dedup_hashes_t const *hashes,
+                                              int block_order) {
+    const int i = dedup_hashes_index(hashes, block_order);
+    return i == -1 ? NULL : &hashes->fingerprints[i];
+}
+
+/* Looks up a block of a write in the index before a block is allocated for
+ * it, and takes a reference to the one found.
+ * Returns: the indexed block, -1 if there is none */
+static int dedup_hashes_share(dedup_hashes_t *hashes, int block_order) {
+    const int i = dedup_hashes_index(hashes, block_order);
+    if (i == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dedup_lock);
+    const int shared =
+        fingerprint_find(&hashes->fingerprints[i],
+                         (char const *)hashes->contents +
+                             (size_t)i * BLOCK_SIZE);
+    if (shared != -1) {
+        pthread_mutex_lock(&file_allocation_lock);
+        block_refs[shared]++;
+        pthread_mutex_unlock(&file_allocation_lock);
+    }
+    pthread_mutex_unlock(&dedup_lock);
+
+    hashes->found[i] = shared != -1;
+    return shared;
+}
+
+/* Points a slot of a block map to another block and drops the reference to
+ * the block it had. */
+static int block_map_replace(int inumber, block_map_t const *map,
+                             int block_order, int old_block, int new_block) {
+    inode_write_begin(inumber);
+    const int rc = block_map_set(map, block_order, new_block);
+    inode_write_end(inumber);
+
+    if (rc == -1) {
+        return -1;
+    }
+
+    return data_block_free(old_block);
+}
+
+/* This function is not synchronized and may need synchronization
+ * from outside (the inode rwlock and the block's range).
+ * Fills a block of a file like fill_block, keeping blocks shared with other
+ * files or snapshots unchanged: a whole block written while deduplication is
+ * on becomes a reference to an indexed block with the same contents, if there
+ * is one, without copying anything; otherwise a shared block is first
+ * replaced by a copy of its own (copy-on-write).
+ * Input:
+ * - inumber and block map of the file, and the block's index in it.
+ * - Buffer with the contents (buffer).
+ * - Block offset where we start filling (block_offset).
+ * - Amount of bytes to fill (to_write).
+ * - Hash of the block, if it is written whole and was already hashed
+ *   (fingerprint), or NULL.
+ * Returns: 0 if success, -1 otherwise
+ */
+int fill_block_cow(int inumber, block_map_t const *map, int block_order,
+                   void const *buffer, size_t block_offset, size_t to_write,
+                   fingerprint_t const *fingerprint) {
+    int block_number = block_map_get(map, block_order);
+    if (!valid_block_number(block_number) ||
+        block_offset + to_write > BLOCK_SIZE) {
+        return -1;
+    }
+
+    const bool whole = block_offset == 0 && to_write == BLOCK_SIZE;
+    const bool index = whole && atomic_load(&dedup_enabled);
+    /* Until deduplication is used, nothing is indexed and only snapshots
+     * add references to the blocks of a file (with its rwlock held) */
+    const bool dedup = index || atomic_load(&dedup_used);
+
+    fingerprint_t hashed;
+    if (index && fingerprint == NULL) {
+        hash128(buffer, BLOCK_SIZE, hashed.hash);
+        fingerprint = &hashed;
+    }
+
+    if (dedup) {
+        pthread_mutex_lock(&dedup_lock);
+    }
+
+    if (index) {
+        const int shared = fingerprint_find(fingerprint, buffer);
+        if (shared == block_number) {
+            pthread_mutex_unlock(&dedup_lock);
+            return 0;
+        }
+
+        if (shared != -1) {
+            pthread_mutex_lock(&file_allocation_lock);
+            block_refs[shared]++;
+            pthread_mutex_unlock(&file_allocation_lock);
+            pthread_mutex_unlock(&dedup_lock);
+
+            return block_map_replace(inumber, map, block_order, block_number,
+                                     shared);
+        }
+    }
+
+    /* Other files only add references to indexed blocks (with dedup_lock
+     * held), so an exclusive block leaves the index before it changes */
+    const bool exclusive = data_block_exclusive(block_number);
+    if (dedup) {
+        if (exclusive) {
+            fingerprint_remove(block_number);
+        }
+        pthread_mutex_unlock(&dedup_lock);
+    }
+
+    /* Nobody changes a shared block in place, so it is copied unlocked */
+    if (!exclusive) {
+        const int copy = data_block_alloc();
+        if (copy == -1) {
+            return -1;
+        }
+
+        /* The part of the block not written is kept, if it is intact */
+        if (!whole) {
+            if (checksum_verify(block_number, 1) != 0) {
+                data_block_free(copy);
+                return -1;
+            }
+            block_copy(data_block_get(copy), data_block_get(block_number),
+                       BLOCK_SIZE);
+        }
+
+        if (block_map_replace(inumber, map, block_order, block_number, copy) ==
+            -1) {
+            return -1;
+        }
+        block_number = copy;
+    }
+
+    if (fill_block(block_number, buffer, block_offset, to_write) == -1) {
+        return -1;
+    }
+
+    if (index) {
+        pthread_mutex_lock(&dedup_lock);
+        fingerprint_insert(block_number, fingerprint);
+        pthread_mutex_unlock(&dedup_lock);
+    }
+
+    return 0;
+}
+
+/*
+ * Lets an operation that may change the file system in, waiting while a
+ * snapshot is being taken.
+ * Returns: the shard to pass to write_gate_exit
+ */
+int write_gate_enter() {
+    if (write_gate_shard == -1) {
+        write_gate_shard =
+            atomic_fetch_add(&write_gate_next_shard, 1) % WRITE_GATE_SHARDS;
+    }
+
+    atomic_int *const writers = &write_gate[write_gate_shard].writers;
+    while (true) {
+        atomic_fetch_add(writers, 1);
+        if (!atomic_load(&write_gate_closed)) {
+            return write_gate_shard;
+        }
+
+        atomic_fetch_sub(writers, 1);
+
+        pthread_mutex_lock(&write_gate_lock);
+        while (atomic_load(&write_gate_closed)) {
+            pthread_cond_wait(&write_gate_opened, &write_gate_lock);
+        }
+        pthread_mutex_unlock(&write_gate_lock);
+    }
+}
+
+void write_gate_exit(int shard) {
+    atomic_fetch_sub(&write_gate[shard].writers, 1);
+}
+
+/* Keeps new operations out and waits for the ones in flight to finish. */
+static void write_gate_close() {
+    atomic_store(&write_gate_closed, true);
+
+    for (int i = 0; i < WRITE_GATE_SHARDS; i++) {
+        while (atomic_load(&write_gate[i].writers) > 0) {
+            sched_yield();
+        }
+    }
+}
+
+static void write_gate_open() {
+    pthread_mutex_lock(&write_gate_lock);
+    atomic_store(&write_gate_closed, false);
+    pthread_cond_broadcast(&write_gate_opened);
+    pthread_mutex_unlock(&write_gate_lock);
+}
+
+/* Adds a reference to every data block of an inode. Its indirect block is
+ * left to the caller.
+ * Returns: 0 if success, -1 otherwise */
+static int inode_blocks_ref(inode_t *inode) {
+    const int last_block = inode_last_slot(inode);
+
+    block_map_t map;
+    if (block_map_init(&map, inode, last_block) == -1) {
+        return -1;
+    }
+
+    for (int block = 0; block <= last_block; block++) {
+        const int block_number = block_map_get(&map, block);
+        if (block_number >= 0 && data_block_ref(block_number) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Lets another inode have the same contents as a given one: adds a reference
+ * to each of its data blocks and makes a copy of its indirect block (block
+ * map slots of two inodes are never in the same block).
+ * Input:
+ *  - inode whose blocks are shared
+ *  - where to store the copy of the indirect block (UNALLOCATED_BLOCK if it
+ *    has none)
+ * Returns: 0 if success, -1 otherwise */
+static int inode_blocks_share(inode_t *inode, int *indirect_copy) {
+    *indirect_copy = UNALLOCATED_BLOCK;
+    if (inode->i_node_type == T_PREV_USED) {
+        return 0;
+    }
+
+    if (!inode->i_inline &&
+        inode->i_indirect_data_block != UNALLOCATED_BLOCK &&
+        inode_last_slot(inode) >= MAX_DIRECT_DATA_BLOCKS_PER_FILE) {
+        if ((*indirect_copy = data_block_alloc()) == -1) {
+            return -1;
+        }
+        block_copy(data_block_get(*indirect_copy),
+                   data_block_get(inode->i_indirect_data_block), BLOCK_SIZE);
+    }
+
+    if (inode_blocks_ref(inode) == -1) {
+        if (*indirect_copy != UNALLOCATED_BLOCK) {
+            data_block_free(*indirect_copy);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * This function is not synchronized and may need synchronization from
+ * outside (the inode's rwlock held for writing, inside the write gate).
+ * Must be called before an inode is changed. The first time the inode
+ * changes after a snapshot is taken, copies it to the snapshot: the copy
+ * keeps its blocks (the inode gets its own indirect block), and writes to
+ * the file copy each of them first.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_preserve(int inumber) {
+    if (newest_snapshot == -1) {
+        return 0;
+    }
+
+    snapshot_t *const snapshot = &snapshots[newest_snapshot];
+    if (snapshot->preserved[inumber] ||
+        snapshot->epoch <= inode_table[inumber].created_epoch) {
+        return 0;
+    }
+
+    inode_t *const inode = &inode_table[inumber].inode;
+    int indirect_copy;
+    if (inode_blocks_share(inode, &indirect_copy) == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    snapshot->inodes[inumber] = *inode;
+    snapshot->preserved[inumber] = true;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    if (indirect_copy != UNALLOCATED_BLOCK) {
+        inode_write_begin(inumber);
+        inode->i_indirect_data_block = indirect_copy;
+        inode_write_end(inumber);
+    }
+
+    return 0;
+}
+
+/* Finds the data blocks of an inode, in the order of its block map slots.
+ * Input:
+ *  - inode and its block map (up to inode_last_slot)
+ *  - where to store the slot of each block (may be NULL) and its FS index
+ * Returns: the number of blocks */
+static int inode_blocks_list(inode_t const *inode, block_map_t const *map,
+                             int *slots, int *blocks) {
+    const int last_slot = inode_last_slot(inode);
+
+    int count = 0;
+    for (int slot = 0; slot <= last_slot; slot++) {
+        const int block_number = block_map_get(map, slot);
+        if (block_number < 0) {
+            /* Unallocated slot, or the size of a compressed cluster */
+            continue;
+        }
+
+        if (slots != NULL) {
+            slots[count] = slot;
+        }
+        blocks[count++] = block_number;
+    }
+
+    return count;
+}
+
+/* Number of runs of consecutive blocks in a list of count blocks. */
+static int blocks_runs(int const *blocks, int count) {
+    int runs = 0;
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || blocks[i] != blocks[i - 1] + 1) {
+            runs++;
+        }
+    }
+
+    return runs;
+}
+
+/*
+ * This function is not synchronized and may need synchronization from
+ * outside (the inode's rwlock held).
+ * Counts the runs of consecutive data blocks a file is stored in.
  * Input:
- * - File handle (fhandle).
+ *  - pointer to the inode
+ *  - where to store the number of data blocks of the file
+ * Returns: the number of runs, -1 if failed
  */
-bool is_taken_open_file_table(int fhandle) {
+int inode_runs(inode_t *inode, int *blocks) {
+    *blocks = 0;
+    if (inode->i_node_type != T_FILE || inode_last_slot(inode) < 0) {
+        return 0;
+    }
+
+    block_map_t map;
+    if (block_map_init(&map, inode, inode_last_slot(inode)) == -1) {
+        return -1;
+    }
+
+    int block_numbers[MAX_BLOCKS];
+    *blocks = inode_blocks_list(inode, &map, NULL, block_numbers);
+    return blocks_runs(block_numbers, *blocks);
+}
+
+/*
+ * Copies the data blocks of a file stored in more than one run to a single
+ * run of free blocks, without locking the file: the copy is only used (see
+ * inode_defragment_swap) if nothing changed the file meanwhile. Files with
+ * blocks shared with other files or snapshots are left as they are (moving
+ * them would take a copy of each), as are files being written and those for
+ * which no run of free blocks is long enough.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - where to store the blocks copied and where to
+ * Returns: 1 if the blocks were copied, 0 if not
+ */
+int inode_defragment_copy(int inumber, defrag_copy_t *copy) {
+    inode_t inode;
+    if (!inode_data_read_begin(inumber, &copy->ticket) ||
+        inode_snapshot(inumber, &inode) == -1 ||
+        inode.i_node_type != T_FILE || inode_last_slot(&inode) < 0) {
+        return 0;
+    }
+
+    /* What is read before the file is checked unchanged may be stale,
+     * blocks freed and taken again included, but is never out of bounds */
+    block_map_t map;
+    if (block_map_init(&map, &inode, inode_last_slot(&inode)) == -1) {
+        return 0;
+    }
+    copy->count = inode_blocks_list(&inode, &map, copy->slots,
+                                    copy->old_blocks);
+    if (blocks_runs(copy->old_blocks, copy->count) <= 1) {
+        return 0;
+    }
+
+    for (int i = 0; i < copy->count; i++) {
+        if (!valid_block_number(copy->old_blocks[i]) ||
+            !data_block_exclusive(copy->old_blocks[i])) {
+            return 0;
+        }
+    }
+
+    if ((copy->first = data_run_alloc(copy->count)) == -1) {
+        return 0;
+    }
+
+    for (int i = 0; i < copy->count; i++) {
+        block_copy(data_block_get(copy->first + i),
+                   data_block_get(copy->old_blocks[i]), BLOCK_SIZE);
+    }
+
+    if (!inode_data_read_end(inumber, copy->ticket)) {
+        inode_defragment_drop(copy);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Frees the blocks a copy taken by inode_defragment_copy was put in.
+ * Input:
+ *  - the copy
+ */
+void inode_defragment_drop(defrag_copy_t const *copy) {
+    for (int i = 0; i < copy->count; i++) {
+        data_block_free(copy->first + i);
+    }
+}
+
+/*
+ * This function is not synchronized and may need synchronization from
+ * outside (the inode's rwlock held for writing and its whole range
+ * exclusive, inside the write gate).
+ * Points the block map of a file to the copy of its blocks taken by
+ * inode_defragment_copy, if the file didn't change since, and frees the
+ * blocks it had; otherwise frees the copy.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - the copy
+ * Returns: 1 if the blocks were moved, 0 if not, -1 if failed
+ */
+int inode_defragment_swap(int inumber, defrag_copy_t const *copy) {
+    /* The range held is the only one taken since the copy began */
+    if (atomic_load(&inode_table[inumber].data_changes_begun) !=
+        copy->ticket + 1) {
+        inode_defragment_drop(copy);
+        return 0;
+    }
+
+    inode_t *const inode = &inode_table[inumber].inode;
+    block_map_t map;
+    if (block_map_init(&map, inode, inode_last_slot(inode)) == -1) {
+        inode_defragment_drop(copy);
+        return -1;
+    }
+
+    /* The copies keep the checksums (and fingerprints) of the originals, so
+     * damage done to a block before it moved is still found */
+    for (int i = 0; i < copy->count; i++) {
+        block_checksums[copy->first + i] =
+            block_checksums[copy->old_blocks[i]];
+        block_checksummed[copy->first + i] =
+            block_checksummed[copy->old_blocks[i]];
+    }
+
+    if (atomic_load(&dedup_used)) {
+        pthread_mutex_lock(&dedup_lock);
+        for (int i = 0; i < copy->count; i++) {
+            if (block_indexed[copy->old_blocks[i]]) {
+                const fingerprint_t fingerprint =
+                    block_fingerprints[copy->old_blocks[i]];
+                fingerprint_remove(copy->old_blocks[i]);
+                fingerprint_insert(copy->first + i, &fingerprint);
+            }
+        }
+        pthread_mutex_unlock(&dedup_lock);
+    }
+
+    inode_write_begin(inumber);
+    for (int i = 0; i < copy->count; i++) {
+        block_map_set(&map, copy->slots[i], copy->first + i);
+    }
+    inode_write_end(inumber);
+
+    /* Others may have found a block in the index meanwhile and share it:
+     * then only this file's reference goes */
+    int rc = 1;
+    for (int i = 0; i < copy->count; i++) {
+        if (data_block_free(copy->old_blocks[i]) == -1) {
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * This function is not synchronized and may need synchronization from
+ * outside (the rwlocks of both inodes held for writing, the whole range of
+ * the source shared and of the destination exclusive, inside the write
+ * gate).
+ * Gives a file the contents of another one without copying them: both share
+ * every data block, and writes to either copy each block first.
+ * Input:
+ *  - source: identifier of the i-node cloned
+ *  - dest: identifier of the i-node that gets its contents (emptied)
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_clone(int source, int dest) {
+    if (!valid_inumber(source) || !valid_inumber(dest) || source == dest) {
+        return -1;
+    }
+
+    inode_t *const from = &inode_table[source].inode;
+    inode_t *const to = &inode_table[dest].inode;
+    if (from->i_node_type != T_FILE || to->i_node_type != T_FILE ||
+        inode_preserve(source) == -1 || inode_preserve(dest) == -1) {
+        return -1;
+    }
+
+    inode_write_begin(dest);
+    if (to->i_size > 0 && data_inode_blocks_free(to) == -1) {
+        inode_write_end(dest);
+        return -1;
+    }
+    to->i_size = 0;
+    inode_data_reset(to);
+    inode_write_end(dest);
+
+    int indirect_copy;
+    if (inode_blocks_share(from, &indirect_copy) == -1) {
+        return -1;
+    }
+
+    inode_write_begin(dest);
+    *to = *from;
+    if (indirect_copy != UNALLOCATED_BLOCK) {
+        to->i_indirect_data_block = indirect_copy;
+    }
+    inode_write_end(dest);
+
+    return 0;
+}
+
+/*
+ * Takes a snapshot of the file system, once the operations changing it in
+ * flight are done. Nothing is copied until files change.
+ * Returns: the snapshot's identifier, -1 if there is no room for it
+ */
+int snapshot_create() {
+    pthread_mutex_lock(&snapshot_admin_lock);
+
+    int free_snapshot = -1;
+    for (int i = 0; i < MAX_SNAPSHOTS && free_snapshot == -1; i++) {
+        if (!snapshots[i].taken) {
+            free_snapshot = i;
+        }
+    }
+
+    if (free_snapshot == -1) {
+        pthread_mutex_unlock(&snapshot_admin_lock);
+        return -1;
+    }
+
+    write_gate_close();
+
+    pthread_mutex_lock(&snapshot_lock);
+    snapshot_t *const snapshot = &snapshots[free_snapshot];
+    snapshot->taken = true;
+    snapshot->epoch = ++snapshot_epoch;
+    snapshot->open_handles = 0;
+    memset(snapshot->preserved, 0, sizeof(snapshot->preserved));
+    newest_snapshot = free_snapshot;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    write_gate_open();
+    pthread_mutex_unlock(&snapshot_admin_lock);
+
+    return free_snapshot;
+}
+
+/* Must be called with snapshot_lock held.
+ * Returns: the newest snapshot taken before a given one, -1 if none */
+static int snapshot_previous(snapshot_t const *snapshot) {
+    int previous = -1;
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (!snapshots[i].taken || snapshots[i].epoch >= snapshot->epoch) {
+            continue;
+        }
+
+        if (previous == -1 || snapshots[i].epoch > snapshots[previous].epoch) {
+            previous = i;
+        }
+    }
+
+    return previous;
+}
+
+/*
+ * Deletes a snapshot with no open files. Inodes it preserved that the
+ * previous snapshot still sees through it are handed over to that snapshot;
+ * the others drop their blocks.
+ * Input:
+ *  - snapshot: identifier of the snapshot
+ * Returns: 0 if successful, -1 if failed
+ */
+int snapshot_delete(int snapshot) {
+    if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&snapshot_admin_lock);
+    write_gate_close();
+
+    pthread_mutex_lock(&snapshot_lock);
+    snapshot_t *const deleted = &snapshots[snapshot];
+    if (!deleted->taken || deleted->open_handles > 0) {
+        pthread_mutex_unlock(&snapshot_lock);
+        write_gate_open();
+        pthread_mutex_unlock(&snapshot_admin_lock);
+        return -1;
+    }
+
+    const int previous = snapshot_previous(deleted);
+    bool dropped[INODE_TABLE_SIZE];
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        dropped[i] = false;
+        if (!deleted->preserved[i]) {
+            continue;
+        }
+
+        if (previous != -1 && !snapshots[previous].preserved[i]) {
+            snapshots[previous].inodes[i] = deleted->inodes[i];
+            snapshots[previous].preserved[i] = true;
+        } else {
+            dropped[i] = true;
+        }
+    }
+
+    deleted->taken = false;
+    if (newest_snapshot == snapshot) {
+        newest_snapshot = previous;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+
+    /* No reader can reach the inodes dropped (the snapshot is closed, and
+     * older ones have copies of their own), and the slot is only reused once
+     * snapshot_admin_lock is released */
+    int rc = 0;
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (dropped[i] && deleted->inodes[i].i_node_type != T_PREV_USED &&
+            data_inode_blocks_free(&deleted->inodes[i]) == -1) {
+            rc = -1;
+        }
+    }
+
+    write_gate_open();
+    pthread_mutex_unlock(&snapshot_admin_lock);
+
+    return rc;
+}
+
+/* Keeps a snapshot from being deleted while a file of it is open.
+ * Returns: 0 if successful, -1 if there is no such snapshot */
+int snapshot_acquire(int snapshot) {
+    if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    const int rc = snapshots[snapshot].taken ? 0 : -1;
+    if (rc == 0) {
+        snapshots[snapshot].open_handles++;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+
+    return rc;
+}
+
+void snapshot_release(int snapshot) {
+    pthread_mutex_lock(&snapshot_lock);
+    snapshots[snapshot].open_handles--;
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+/*
+ * Copies an inode as a snapshot (acquired by the caller) sees it. Its blocks
+ * don't change while the snapshot exists.
+ * Input:
+ *  - snapshot: identifier of the snapshot
+ *  - inumber: identifier of the i-node
+ *  - inode: where the copy is stored
+ * Returns: 0 if successful, -1 if failed
+ */
+int snapshot_inode_get(int snapshot, int inumber, inode_t *inode) {
+    if (snapshot < 0 || snapshot >= MAX_SNAPSHOTS || !valid_inumber(inumber)) {
+        return -1;
+    }
+
+    insert_delay(); // simulate storage access delay to i-node
+
+    pthread_mutex_lock(&snapshot_lock);
+
+    snapshot_t const *const wanted = &snapshots[snapshot];
+    int found = -1;
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snapshots[i].taken && snapshots[i].preserved[inumber] &&
+            snapshots[i].epoch >= wanted->epoch &&
+            (found == -1 || snapshots[i].epoch < snapshots[found].epoch)) {
+            found = i;
+        }
+    }
+
+    /* Unpreserved inodes don't change before we unlock: they would have to
+     * be preserved first */
+    int rc = 0;
+    if (!wanted->taken) {
+        rc = -1;
+    } else if (found != -1) {
+        *inode = snapshots[found].inodes[inumber];
+    } else {
+        rc = inode_snapshot(inumber, inode);
+    }
+
+    pthread_mutex_unlock(&snapshot_lock);
+    return rc;
+}
+
+/* Looks for a given name in the root directory of a snapshot (acquired by
+ * the caller)
+ * Input:
+ * 	- snapshot identifier
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int snapshot_find_in_dir(int snapshot, char const *sub_name) {
+    inode_t dir;
+    if (snapshot_inode_get(snapshot, ROOT_DIR_INUM, &dir) == -1 ||
+        dir.i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    dir_entry_t const *dir_entry =
+        (dir_entry_t const *)data_block_get(dir.i_direct_data_blocks[0]);
+    if (dir_entry == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if ((dir_entry[i].d_inumber != -1) &&
+            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+            return dir_entry[i].d_inumber;
+        }
+    }
+
+    return -1;
+}
+
+/* Add new entry to the open file table
+ * Inputs:
+ * 	- I-node number of the file to open
+ * 	- Initial offset
+ * 	- Flags the file was opened with
+ * 	- Snapshot the file is read from (-1 if none)
+ * Returns: file handle if successful, -1 otherwise
+ */
+int add_to_open_file_table(int inumber, size_t offset, int flags,
+                           int snapshot) {
+    pthread_mutex_lock(&open_file_table_lock);
+
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        atomic_uint *const generation = &open_file_table[i].generation;
+        const unsigned int closed =
+            atomic_load_explicit(generation, memory_order_relaxed);
+        if ((closed & 1) == 0) {
+            /* Readers that still use the entry see it was closed before it
+             * changes */
+            atomic_thread_fence(memory_order_release);
+            open_file_table[i].entry.of_inumber = inumber;
+            open_file_table[i].entry.of_offset = offset;
+            open_file_table[i].entry.of_flags = flags;
+            open_file_table[i].entry.of_snapshot = snapshot;
+            atomic_store_explicit(generation, closed + 1,
+                                  memory_order_release);
+            pthread_mutex_unlock(&open_file_table_lock);
+            return i;
+        }
+    }
+
+    pthread_mutex_unlock(&open_file_table_lock);
+    return -1;
+}
+
+/* Frees an entry from the open file table
+ * Inputs:
+ * 	- file handle to free/close
+ * Returns 0 is success, -1 otherwise
+ */
+int remove_from_open_file_table(int fhandle) {
+    if (!valid_file_handle(fhandle))
+        return -1;
+
     pthread_mutex_lock(&open_file_table_lock);
-    const bool res = free_open_file_entries[fhandle] == TAKEN;
+
+    atomic_uint *const generation = &open_file_table[fhandle].generation;
+    const unsigned int open =
+        atomic_load_explicit(generation, memory_order_relaxed);
+    if ((open & 1) == 0) {
+        pthread_mutex_unlock(&open_file_table_lock);
+        return -1;
+    }
+    atomic_store_explicit(generation, open + 1, memory_order_release);
+
     pthread_mutex_unlock(&open_file_table_lock);
+    return 0;
+}
+
+/* This function is not synchronized and may need synchronization
+ * from outside.
+ * Returns pointer to a given entry in the open file table
+ * Inputs:
+ * 	 - file handle
+ * Returns: pointer to the entry if sucessful, NULL otherwise
+ */
+open_file_entry_t *get_open_file_entry(int fhandle) {
+    if (!valid_file_handle(fhandle)) {
+        return NULL;
+    }
+    return &open_file_table[fhandle].entry;
+}
+
+/* Returns the rwlock of a file handle.
+ * Inputs:
+ * 	 - file handle
+ */
+pthread_rwlock_t *open_file_entry_rw_lock(int fhandle) {
+    return &open_file_table[fhandle].rw_lock;
+}
+
+/* This function indicates whether or not a file handle is taken
+ * in the file handle table.
+ * Input:
+ * - File handle (fhandle).
+ */
+bool is_taken_open_file_table(int fhandle) {
+    return (atomic_load_explicit(&open_file_table[fhandle].generation,
+                                 memory_order_acquire) &
+            1) != 0;
+}
+
+/* Copies an entry of the open file table without locking it, so readers
+ * through a handle write nothing shared.
+ * Inputs:
+ * 	 - file handle
+ * 	 - where to copy the entry to
+ * 	 - where to store the value to pass to open_file_entry_unchanged
+ * Returns: true if the handle is open
+ */
+bool open_file_entry_snapshot(int fhandle, open_file_entry_t *entry,
+                              unsigned int *ticket) {
+    if (!valid_file_handle(fhandle)) {
+        return false;
+    }
+
+    atomic_uint *const generation = &open_file_table[fhandle].generation;
+    *ticket = atomic_load_explicit(generation, memory_order_acquire);
+    if ((*ticket & 1) == 0) {
+        return false;
+    }
+
+    memcpy(entry, &open_file_table[fhandle].entry, sizeof(*entry));
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(generation, memory_order_relaxed) == *ticket;
+}
 
-    return res;
+/* Returns: whether a handle copied with open_file_entry_snapshot hasn't
+ * been closed since, so what was done through the copy stands. */
+bool open_file_entry_unchanged(int fhandle, unsigned int ticket) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&open_file_table[fhandle].generation,
+                                memory_order_relaxed) == ticket;
 }
@@ -5,6 +5,7 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -25,38 +26,137 @@ typedef enum { T_FILE, T_DIRECTORY, T_PREV_USED } inode_type;
  */
 typedef struct {
     inode_type i_node_type;
+    /* The contents are in i_inline_data instead of data blocks */
+    bool i_inline;
+    /* The contents are in compressed clusters (see cluster_store) */
+    bool i_compressed;
     size_t i_size;
-    int i_indirect_data_block;
-    int i_direct_data_blocks[MAX_DIRECT_DATA_BLOCKS_PER_FILE];
+    union {
+        struct {
+            int i_indirect_data_block;
+            int i_direct_data_blocks[MAX_DIRECT_DATA_BLOCKS_PER_FILE];
+        };
+        char i_inline_data[INODE_INLINE_DATA_SIZE];
+    };
     /* in a real FS, more fields would exist here */
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
+/*
+ * Block map of an i-node, with its indirect block already looked up
+ */
+typedef struct {
+    inode_t *inode;
+    int *indirect;
+} block_map_t;
+
+/*
+ * 128 bit hash of the contents of a whole data block
+ */
+typedef struct {
+    uint64_t hash[2];
+} fingerprint_t;
+
+/*
+ * The whole blocks a write fills, hashed before any block is allocated for
+ * it, so those already indexed are shared instead (see dedup_hash_write)
+ */
+typedef struct {
+    int first; /* block order of the first of them */
+    int count; /* 0 if deduplication is off */
+    void const *contents;
+    fingerprint_t fingerprints[MAX_BLOCKS];
+    /* The slot was pointed to an indexed block when it was allocated */
+    bool found[MAX_BLOCKS];
+} dedup_hashes_t;
+
+/*
+ * Copy of the blocks of a file in a single run, made without locking the
+ * file (see inode_defragment_copy)
+ */
+typedef struct {
+    int count;
+    int first; /* block the copy starts at */
+    int slots[MAX_BLOCKS];
+    int old_blocks[MAX_BLOCKS];
+    /* Changes to the file counted when the copy began (see
+     * inode_data_read_begin) */
+    unsigned long ticket;
+} defrag_copy_t;
+
 /*
  * Open file entry (in open file table)
  */
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    int of_flags;
+    /* Snapshot the file is read from, -1 for the live file system */
+    int of_snapshot;
 } open_file_entry_t;
 
-extern pthread_rwlock_t open_file_entries_rw_locks[MAX_OPEN_FILES];
+/* Byte range lock modes. */
+typedef enum { RANGE_SHARED, RANGE_EXCLUSIVE } range_mode_t;
+
+/* Range covering every byte a file can ever hold. */
+#define RANGE_WHOLE_FILE_START ((size_t)0)
+#define RANGE_WHOLE_FILE_END ((size_t)SIZE_MAX)
+
+/* Each holder of a range is an operation in flight through an open file
+ * handle, a truncation in tfs_open, a clone or a scrub. */
+#define MAX_INODE_RANGES (MAX_OPEN_FILES + 3)
+
+/*
+ * Byte range [r_start, r_end) held on an inode
+ */
+typedef struct {
+    size_t r_start;
+    size_t r_end;
+    range_mode_t r_mode;
+    bool r_taken;
+} range_t;
+
+/*
+ * Byte range lock of an inode: non-overlapping ranges (or overlapping shared
+ * ones) are held at the same time.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    range_t ranges[MAX_INODE_RANGES];
+    unsigned long generation;
+} range_lock_t;
+
+/*
+ * Summary of the free space (see free_space_get)
+ */
+typedef struct {
+    int free_blocks;
+    int free_inodes;
+    int free_runs;        /* runs of consecutive free data blocks */
+    int largest_free_run; /* blocks in the longest one */
+    /* Runs of 2^i to 2^(i + 1) - 1 free blocks */
+    int free_run_classes[FREE_RUN_CLASSES];
+} free_space_t;
+
 extern pthread_mutex_t file_allocation_lock;
 extern pthread_mutex_t dir_entry_lock;
 extern pthread_mutex_t open_file_table_lock;
 extern pthread_mutex_t aux_buffer_mtx;
 
-extern pthread_rwlock_t inode_rw_locks[INODE_TABLE_SIZE];
 extern pthread_mutex_t freeinode_ts_lock;
+extern pthread_mutex_t dedup_lock;
+extern pthread_mutex_t snapshot_lock;
 
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
 
 void state_init();
 void state_destroy();
+void free_space_get(free_space_t *free_space);
 
-inline int blocks_allocated(inode_t *inode) {
-    return (int)BLOCK_SIZEOF(inode->i_size);
+inline int blocks_allocated(inode_t const *inode) {
+    return inode->i_inline ? 0 : (int)BLOCK_SIZEOF(inode->i_size);
 }
 
 inline int rw_total_blocks(size_t offset, size_t to_rw) {
@@ -70,29 +170,95 @@ inline int final_block(size_t offset, size_t to_rw) {
 inline int current_block(size_t offset) { return (int)BLOCK_CURRENT(offset); }
 
 int init_locks();
+int inode_range_lock(int inumber, size_t start, size_t end, range_mode_t mode);
+int inode_range_trylock(int inumber, size_t start, size_t end,
+                        range_mode_t mode, unsigned long *generation);
+void inode_range_wait(int inumber, unsigned long generation);
+void inode_range_unlock(int inumber, int range);
+bool inode_data_read_begin(int inumber, unsigned long *ticket);
+bool inode_data_read_end(int inumber, unsigned long ticket);
 int inode_create(inode_type n_type);
+int inode_create_many(int count, bool compressed, int *inumbers);
 int inode_delete(int inumber);
+void inode_data_reset(inode_t *inode);
 inode_t *inode_get(int inumber);
+pthread_rwlock_t *inode_rw_lock(int inumber);
+void inode_write_begin(int inumber);
+void inode_write_end(int inumber);
+int inode_snapshot(int inumber, inode_t *snapshot);
 
 int clear_dir_entry(int inumber, int sub_inumber);
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
+int add_dir_entries(int inumber, int count, int *sub_inumbers,
+                    char const *const *sub_names);
 int find_in_dir(int inumber, char const *sub_name);
+int find_many_in_dir(int inumber, int count, char const *const *sub_names,
+                     int *sub_inumbers);
 
 int data_block_alloc();
 int data_block_free(int block_number);
 int data_inode_blocks_free(inode_t *inode);
+bool inode_blocks_shared(inode_t *inode, size_t offset, size_t to_write);
 void *data_block_get(int block_number);
 
-int allocate_blocks(inode_t *inode, size_t file_offset, size_t to_write);
+int allocate_blocks(inode_t *inode, size_t file_offset, size_t to_write,
+                    dedup_hashes_t *hashes);
+int inode_inline_spill(inode_t *inode);
 int get_block_number(inode_t *inode, int block_order);
 int fill_block(int block_number, const void *buffer, size_t block_offset,
                size_t to_write);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int block_map_init(block_map_t *map, inode_t *inode, int last_block);
+int block_map_run(block_map_t const *map, int block_order, int last_block,
+                  int *block_number);
+int fill_run(int block_number, int count, const void *buffer,
+             size_t run_offset, size_t to_write);
+int read_run(int block_number, int count, void *buffer, size_t run_offset,
+             size_t to_read);
+int verify_run(int block_number, int count);
+
+int cluster_load(block_map_t const *map, int cluster, void *buffer,
+                 size_t length);
+int cluster_store(int inumber, block_map_t *map, int cluster,
+                  void const *buffer, size_t length);
+
+void dedup_enable(bool enabled);
+bool dedup_in_use();
+void dedup_hash_write(dedup_hashes_t *hashes, void const *buffer,
+                      size_t offset, size_t to_write);
+bool dedup_hashes_found(dedup_hashes_t const *hashes, int block_order);
+fingerprint_t const *dedup_hashes_fingerprint(dedup_hashes_t const *hashes,
+                                              int block_order);
+int fill_block_cow(int inumber, block_map_t const *map, int block_order,
+                   void const *buffer, size_t block_offset, size_t to_write,
+                   fingerprint_t const *fingerprint);
+
+int write_gate_enter();
+void write_gate_exit(int shard);
+
+int inode_preserve(int inumber);
+int inode_clone(int source, int dest);
+int inode_runs(inode_t *inode, int *blocks);
+int inode_defragment_copy(int inumber, defrag_copy_t *copy);
+void inode_defragment_drop(defrag_copy_t const *copy);
+int inode_defragment_swap(int inumber, defrag_copy_t const *copy);
+int snapshot_create();
+int snapshot_delete(int snapshot);
+int snapshot_acquire(int snapshot);
+void snapshot_release(int snapshot);
+int snapshot_inode_get(int snapshot, int inumber, inode_t *inode);
+int snapshot_find_in_dir(int snapshot, char const *sub_name);
+
+int add_to_open_file_table(int inumber, size_t offset, int flags,
+                           int snapshot);
 int remove_from_open_file_table(int fhandle);
 
 bool is_taken_open_file_table(int fhandle);
+bool open_file_entry_snapshot(int fhandle, open_file_entry_t *entry,
+                              unsigned int *ticket);
+bool open_file_entry_unchanged(int fhandle, unsigned int ticket);
 
 open_file_entry_t *get_open_file_entry(int fhandle);
+pthread_rwlock_t *open_file_entry_rw_lock(int fhandle);
 
 #endif // STATE_H
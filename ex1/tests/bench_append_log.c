@@ -0,0 +1,113 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+   This benchmark has many threads appending fixed size records to the same
+   log file, first each through its own TFS_O_APPEND handle and then all
+   through one shared handle. Afterwards it checks no record was overwritten
+   or torn.
+ */
+
+#define THREADS 8
+#define RECORDS_PER_THREAD 500
+#define RECORD_SIZE 64
+
+typedef struct {
+    int fhandle;
+    int id;
+} writer_t;
+
+static void *append_records(void *arg) {
+    const writer_t *writer = (writer_t *)arg;
+
+    char record[RECORD_SIZE];
+    memset(record, 'a' + writer->id, RECORD_SIZE);
+
+    for (int i = 0; i < RECORDS_PER_THREAD; i++) {
+        assert(tfs_write(writer->fhandle, record, RECORD_SIZE) == RECORD_SIZE);
+    }
+
+    return NULL;
+}
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void check_log(char const *path) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+
+    int count[THREADS] = {0};
+    char record[RECORD_SIZE];
+
+    ssize_t r;
+    while ((r = tfs_read(fd, record, RECORD_SIZE)) == RECORD_SIZE) {
+        const int id = record[0] - 'a';
+        assert(id >= 0 && id < THREADS);
+        for (size_t i = 0; i < RECORD_SIZE; i++) {
+            assert(record[i] == record[0]);
+        }
+        count[id]++;
+    }
+    assert(r == 0);
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(count[i] == RECORDS_PER_THREAD);
+    }
+
+    assert(tfs_close(fd) != -1);
+}
+
+static void run(char const *label, char const *path, bool shared_handle) {
+    pthread_t tid[THREADS];
+    writer_t writers[THREADS];
+
+    int shared = tfs_open(path, TFS_O_CREAT | TFS_O_APPEND);
+    assert(shared != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < THREADS; i++) {
+        writers[i].id = i;
+        writers[i].fhandle =
+            shared_handle ? shared : tfs_open(path, TFS_O_APPEND);
+        assert(writers[i].fhandle != -1);
+        assert(pthread_create(&tid[i], NULL, append_records, &writers[i]) ==
+               0);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+        if (!shared_handle) {
+            assert(tfs_close(writers[i].fhandle) != -1);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    assert(tfs_close(shared) != -1);
+
+    check_log(path);
+
+    const double records = THREADS * RECORDS_PER_THREAD;
+    printf("%s: %.0f appends/s\n", label, records / elapsed(&start, &end));
+}
+
+int main() {
+    assert(tfs_init() != -1);
+
+    run("handle per thread", "/log1", false);
+    run("shared handle", "/log2", true);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+   This benchmark copies a file of the maximum size by reading it and
+   writing the copy, and by cloning it, and compares:
+   - the time each copy takes,
+   - the data blocks each copy takes,
+   - the time of the first write of a block to a clone (which copies it).
+ */
+
+#define REQUEST (16 * 1024)
+#define ROUNDS 50
+
+static char data[MAX_FILE_SIZE];
+static char buffer[REQUEST];
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Blocks not taken, counted by taking them and freeing them back */
+static int free_blocks() {
+    static int taken[DATA_BLOCKS];
+    int count = 0;
+    while ((taken[count] = data_block_alloc()) != -1) {
+        count++;
+    }
+    for (int i = 0; i < count; i++) {
+        data_block_free(taken[i]);
+    }
+    return count;
+}
+
+static void copy_by_read_write() {
+    const int source = tfs_open("/source", 0);
+    const int dest = tfs_open("/copy", TFS_O_CREAT | TFS_O_TRUNC);
+    assert(source != -1 && dest != -1);
+
+    ssize_t read;
+    while ((read = tfs_read(source, buffer, sizeof(buffer))) > 0) {
+        assert(tfs_write(dest, buffer, (size_t)read) == read);
+    }
+    assert(read == 0);
+
+    assert(tfs_close(source) != -1);
+    assert(tfs_close(dest) != -1);
+}
+
+static void check_copy() {
+    static char output[MAX_FILE_SIZE];
+    const int fd = tfs_open("/copy", 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, output, sizeof(output)) == MAX_FILE_SIZE);
+    assert(memcmp(output, data, MAX_FILE_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+static void remove_copy() {
+    const int fd = tfs_open("/copy", TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < MAX_FILE_SIZE; i++) {
+        data[i] = (char)rand();
+    }
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open("/source", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    const int before = free_blocks();
+    struct timespec start, end;
+
+    double copy_time = 0;
+    int copy_blocks = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        copy_by_read_write();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        copy_time += elapsed(&start, &end);
+
+        copy_blocks = before - free_blocks();
+        check_copy();
+        remove_copy();
+    }
+
+    double clone_time = 0, write_time = 0;
+    int clone_blocks = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        assert(tfs_clone("/source", "/copy") == 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        clone_time += elapsed(&start, &end);
+
+        clone_blocks = before - free_blocks();
+        check_copy();
+
+        fd = tfs_open("/copy", 0);
+        assert(fd != -1);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        assert(tfs_pwrite(fd, data, BLOCK_SIZE, 0) == BLOCK_SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        write_time += elapsed(&start, &end);
+        assert(tfs_close(fd) != -1);
+
+        remove_copy();
+    }
+
+    printf("read/write copy: %9.1f us, %4d data blocks\n",
+           copy_time / ROUNDS * 1e6, copy_blocks);
+    printf("clone:           %9.1f us, %4d data blocks "
+           "(first block write %.1f us)\n",
+           clone_time / ROUNDS * 1e6, clone_blocks, write_time / ROUNDS * 1e6);
+    printf("file of %zu bytes\n", (size_t)MAX_FILE_SIZE);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "fs/compress.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+   This benchmark compares compressed (TFS_O_COMPRESS) with plain files:
+   - the ratio the codec gets on each cluster of a log-like text,
+   - how many bytes of that text fit in the volume,
+   - sequential write and read throughput, for the text and for random bytes
+     (which don't compress and are stored as is).
+ */
+
+#define FILE_SIZE (64 * CLUSTER_SIZE)
+#define REQUEST (16 * 1024)
+#define ROUNDS 10
+
+static char text[FILE_SIZE];
+static char noise[FILE_SIZE];
+static char output[FILE_SIZE];
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void make_log() {
+    char line[128];
+    size_t done = 0;
+    for (int i = 0; done < FILE_SIZE; i++) {
+        const int len = snprintf(line, sizeof(line),
+                                 "2021-12-%02d 10:%02d:%02d INFO session %d "
+                                 "request %d done in %d us\n",
+                                 1 + i % 28, i / 60 % 60, i % 60, i % 20, i,
+                                 rand() % 1000);
+        const size_t to_copy = (size_t)len < FILE_SIZE - done
+                                   ? (size_t)len
+                                   : FILE_SIZE - done;
+        memcpy(text + done, line, to_copy);
+        done += to_copy;
+    }
+
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        noise[i] = (char)rand();
+    }
+}
+
+static void codec_ratio() {
+    char stored[CLUSTER_SIZE];
+    size_t total = 0;
+
+    for (size_t done = 0; done < FILE_SIZE; done += CLUSTER_SIZE) {
+        const size_t size =
+            lz_compress(text + done, CLUSTER_SIZE, stored, sizeof(stored));
+        assert(size > 0);
+        total += size;
+
+        char decompressed[CLUSTER_SIZE];
+        assert(lz_decompress(stored, size, decompressed, CLUSTER_SIZE) ==
+               CLUSTER_SIZE);
+        assert(memcmp(decompressed, text + done, CLUSTER_SIZE) == 0);
+    }
+
+    printf("codec ratio on %d KiB clusters: %.2f\n", CLUSTER_SIZE / 1024,
+           (double)FILE_SIZE / (double)total);
+}
+
+/* Fills a new volume with copies of the text; runs in a child process so
+ * each mode starts from an empty volume. */
+static void capacity(int flags, char const *mode) {
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid > 0) {
+        assert(waitpid(pid, NULL, 0) == pid);
+        return;
+    }
+
+    assert(tfs_init() != -1);
+
+    size_t stored = 0;
+    char path[16];
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        snprintf(path, sizeof(path), "/c%d", i);
+        const int fd = tfs_open(path, TFS_O_CREAT | flags);
+        if (fd == -1) {
+            break;
+        }
+
+        ssize_t written = 0;
+        for (size_t done = 0; done < FILE_SIZE; done += REQUEST) {
+            if ((written = tfs_write(fd, text + done, REQUEST)) != REQUEST) {
+                break;
+            }
+            stored += REQUEST;
+        }
+        assert(tfs_close(fd) != -1);
+
+        if (written != REQUEST) {
+            break;
+        }
+    }
+
+    printf("%-10s capacity: %6zu KiB of text\n", mode, stored / 1024);
+    exit(0);
+}
+
+static void throughput(int flags, char const *mode, char const *data,
+                       char const *kind) {
+    /* Compression is chosen when a file is created */
+    char const *path = (flags & TFS_O_COMPRESS) ? "/compressed" : "/plain";
+    double write_time = 0, read_time = 0;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        struct timespec start, end;
+
+        int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC | flags);
+        assert(fd != -1);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t done = 0; done < FILE_SIZE; done += REQUEST) {
+            assert(tfs_write(fd, data + done, REQUEST) == REQUEST);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        write_time += elapsed(&start, &end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t done = 0; done < FILE_SIZE; done += REQUEST) {
+            assert(tfs_pread(fd, output + done, REQUEST, done) == REQUEST);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        read_time += elapsed(&start, &end);
+
+        assert(memcmp(data, output, FILE_SIZE) == 0);
+        assert(tfs_close(fd) != -1);
+    }
+
+    const double mib = (double)FILE_SIZE * ROUNDS / (1024 * 1024);
+    printf("%-10s %-5s: write %7.1f MiB/s, read %7.1f MiB/s\n", mode, kind,
+           mib / write_time, mib / read_time);
+}
+
+int main() {
+    srand(34);
+    make_log();
+
+    codec_ratio();
+
+    capacity(0, "plain");
+    capacity(TFS_O_COMPRESS, "compressed");
+
+    assert(tfs_init() != -1);
+
+    throughput(0, "plain", text, "text");
+    throughput(0, "plain", noise, "noise");
+    throughput(TFS_O_COMPRESS, "compressed", text, "text");
+    throughput(TFS_O_COMPRESS, "compressed", noise, "noise");
+
+    printf("Successful test.\n");
+
+    return 0;
+}
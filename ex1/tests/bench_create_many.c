@@ -0,0 +1,76 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+   This benchmark fills the root directory with empty files, creating them
+   one at a time with tfs_open and in a single tfs_create_many, and then
+   looks them all up with tfs_lookup and with tfs_stat_many, comparing the
+   time per file.
+ */
+
+#define FILES ((int)MAX_DIR_ENTRIES - 1)
+#define ROUNDS 200
+
+static char names[FILES][16];
+static char const *paths[FILES];
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+    for (int i = 0; i < FILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "/file%d", i);
+        paths[i] = names[i];
+    }
+
+    double one_time = 0, many_time = 0, lookup_time = 0, stat_time = 0;
+    struct timespec start, end;
+    for (int round = 0; round < ROUNDS; round++) {
+        assert(tfs_init() != -1);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < FILES; i++) {
+            const int fd = tfs_open(paths[i], TFS_O_CREAT);
+            assert(fd != -1);
+            assert(tfs_close(fd) != -1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        one_time += elapsed(&start, &end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < FILES; i++) {
+            assert(tfs_lookup(paths[i]) != -1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        lookup_time += elapsed(&start, &end);
+        assert(tfs_destroy() != -1);
+
+        assert(tfs_init() != -1);
+        int inumbers[FILES];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        assert(tfs_create_many(paths, FILES, 0, inumbers) == 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        many_time += elapsed(&start, &end);
+
+        tfs_stat_t stats[FILES];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        assert(tfs_stat_many(paths, FILES, stats) == 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stat_time += elapsed(&start, &end);
+        assert(tfs_destroy() != -1);
+    }
+
+    const double files = (double)FILES * ROUNDS;
+    printf("create: tfs_open %8.2f us/file, tfs_create_many %8.2f us/file\n",
+           one_time / files * 1e6, many_time / files * 1e6);
+    printf("lookup: tfs_lookup %6.2f us/file, tfs_stat_many %10.2f us/file\n",
+           lookup_time / files * 1e6, stat_time / files * 1e6);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+   This benchmark writes a duplicate-heavy dataset (files made of blocks from
+   a few templates, plus zero filled blocks, as in copies of disk images) with
+   and without block deduplication, and compares:
+   - the data blocks used by the dataset,
+   - write and read throughput (reads of shared blocks, which are scattered
+     over the volume, can't be done a run of blocks at a time).
+ */
+
+#define FILES (12)
+#define FILE_BLOCKS (64)
+#define FILE_SIZE (FILE_BLOCKS * BLOCK_SIZE)
+#define TEMPLATES (8)
+#define REQUEST (16 * 1024)
+#define ROUNDS 5
+
+static char templates[TEMPLATES][BLOCK_SIZE];
+static char dataset[FILES][FILE_SIZE];
+static char output[FILE_SIZE];
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void make_dataset() {
+    for (int t = 0; t < TEMPLATES; t++) {
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            templates[t][i] = (char)rand();
+        }
+    }
+
+    /* A quarter of the blocks are zeros, the rest come from a template */
+    for (int f = 0; f < FILES; f++) {
+        for (int b = 0; b < FILE_BLOCKS; b++) {
+            char *block = dataset[f] + b * BLOCK_SIZE;
+            const int pick = rand() % (TEMPLATES + TEMPLATES / 3);
+            if (pick < TEMPLATES) {
+                memcpy(block, templates[pick], BLOCK_SIZE);
+            } else {
+                memset(block, 0, BLOCK_SIZE);
+            }
+        }
+    }
+}
+
+static void write_file(int f) {
+    char path[16];
+    snprintf(path, sizeof(path), "/d%d", f);
+    const int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    for (size_t done = 0; done < FILE_SIZE; done += REQUEST) {
+        assert(tfs_write(fd, dataset[f] + done, REQUEST) == REQUEST);
+    }
+    assert(tfs_close(fd) != -1);
+}
+
+static void read_file(int f) {
+    char path[16];
+    snprintf(path, sizeof(path), "/d%d", f);
+    const int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    for (size_t done = 0; done < FILE_SIZE; done += REQUEST) {
+        assert(tfs_read(fd, output + done, REQUEST) == REQUEST);
+    }
+    assert(memcmp(output, dataset[f], FILE_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+/* Distinct data blocks referenced by the files of the dataset */
+static int blocks_used() {
+    static char seen[DATA_BLOCKS];
+    memset(seen, 0, sizeof(seen));
+
+    int used = 0;
+    char path[16];
+    for (int f = 0; f < FILES; f++) {
+        snprintf(path, sizeof(path), "/d%d", f);
+        inode_t *inode = inode_get(tfs_lookup(path));
+        assert(inode != NULL);
+        for (int b = 0; b < FILE_BLOCKS; b++) {
+            const int block_number = get_block_number(inode, b);
+            assert(block_number >= 0);
+            if (!seen[block_number]) {
+                seen[block_number] = 1;
+                used++;
+            }
+        }
+    }
+
+    return used;
+}
+
+/* Runs in a child process so each mode starts from an empty volume. */
+static void run(bool dedup, char const *mode) {
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid > 0) {
+        assert(waitpid(pid, NULL, 0) == pid);
+        return;
+    }
+
+    assert(tfs_init() != -1);
+    tfs_set_dedup(dedup);
+
+    double write_time = 0, read_time = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int f = 0; f < FILES; f++) {
+            write_file(f);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        write_time += elapsed(&start, &end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int f = 0; f < FILES; f++) {
+            read_file(f);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        read_time += elapsed(&start, &end);
+    }
+
+    const int used = blocks_used();
+
+    const double mib = (double)FILE_SIZE * FILES * ROUNDS / (1024 * 1024);
+    printf("%-6s: %4d data blocks for %d, write %7.1f MiB/s, "
+           "read %7.1f MiB/s\n",
+           mode, used, FILES * FILE_BLOCKS, mib / write_time,
+           mib / read_time);
+    exit(0);
+}
+
+int main() {
+    srand(35);
+    make_dataset();
+
+    run(false, "plain");
+    run(true, "dedup");
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+   This benchmark fragments files the way logs written side by side are
+   (each file grows a block at a time, in turns with the others), and
+   compares sequential read throughput before and after defragmenting them,
+   along with the runs of blocks the files are stored in.
+ */
+
+#define FILES (4)
+#define FILE_BLOCKS (MAX_BLOCKS / 3)
+#define FILE_SIZE (FILE_BLOCKS * BLOCK_SIZE)
+#define REQUEST (64 * 1024)
+#define ROUNDS 20
+
+static char contents[FILES][FILE_SIZE];
+static char output[FILE_SIZE];
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double read_files() {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char path[16];
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int f = 0; f < FILES; f++) {
+            snprintf(path, sizeof(path), "/log%d", f);
+            const int fd = tfs_open(path, 0);
+            assert(fd != -1);
+            for (size_t done = 0; done < FILE_SIZE; done += REQUEST) {
+                const size_t len =
+                    FILE_SIZE - done < REQUEST ? FILE_SIZE - done : REQUEST;
+                assert(tfs_read(fd, output + done, len) == (ssize_t)len);
+            }
+            assert(tfs_close(fd) != -1);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)FILE_SIZE * FILES * ROUNDS / (1024 * 1024) /
+           elapsed(&start, &end);
+}
+
+static void report(char const *when, double throughput) {
+    tfs_fragmentation_t fragmentation;
+    assert(tfs_fragmentation(&fragmentation) == 0);
+    printf("%-6s: %4d blocks in %4d runs (%d of %d files fragmented), "
+           "read %7.1f MiB/s\n",
+           when, fragmentation.file_blocks, fragmentation.file_runs,
+           fragmentation.fragmented_files, fragmentation.files, throughput);
+}
+
+int main() {
+    for (int f = 0; f < FILES; f++) {
+        for (size_t i = 0; i < FILE_SIZE; i++) {
+            contents[f][i] = (char)rand();
+        }
+    }
+
+    assert(tfs_init() != -1);
+
+    int fds[FILES];
+    char path[16];
+    for (int f = 0; f < FILES; f++) {
+        snprintf(path, sizeof(path), "/log%d", f);
+        fds[f] = tfs_open(path, TFS_O_CREAT);
+        assert(fds[f] != -1);
+    }
+    for (int b = 0; b < FILE_BLOCKS; b++) {
+        for (int f = 0; f < FILES; f++) {
+            assert(tfs_write(fds[f], contents[f] + b * BLOCK_SIZE,
+                             BLOCK_SIZE) == BLOCK_SIZE);
+        }
+    }
+    for (int f = 0; f < FILES; f++) {
+        assert(tfs_close(fds[f]) != -1);
+    }
+
+    report("before", read_files());
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const int moved = tfs_defragment();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(moved > 0);
+    printf("defragmented %d files in %.1f ms\n", moved,
+           elapsed(&start, &end) * 1e3);
+
+    report("after", read_files());
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include "fs/operations.h"
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+   This benchmark counts cache misses (through the perf counters of the CPU)
+   while threads work on unrelated objects. It first runs threads that each
+   read and write their own file, whose locks live on their own cache lines in
+   the i-node and open file tables, and then compares a packed array of locks
+   with a padded one, which is how those tables were laid out before.
+   If the perf counters can't be opened only the time is reported.
+ */
+
+#define THREADS 8
+#define FS_OPS_PER_THREAD 2000
+#define LOCK_OPS_PER_THREAD 1000000
+
+static int perf_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+typedef struct {
+    int perf_fd;
+    struct timespec start;
+} measure_t;
+
+static void measure_start(measure_t *measure) {
+    measure->perf_fd = perf_open();
+    if (measure->perf_fd != -1) {
+        ioctl(measure->perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(measure->perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &measure->start);
+}
+
+static void measure_stop(measure_t *measure, char const *label, double ops) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    const double secs =
+        (double)(end.tv_sec - measure->start.tv_sec) +
+        (double)(end.tv_nsec - measure->start.tv_nsec) / 1e9;
+
+    if (measure->perf_fd == -1) {
+        printf("%-22s %8.1f ns/op, cache misses: unavailable\n", label,
+               secs * 1e9 / ops);
+        return;
+    }
+
+    ioctl(measure->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    long long misses = 0;
+    if (read(measure->perf_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+        misses = -1;
+    }
+    close(measure->perf_fd);
+
+    printf("%-22s %8.1f ns/op, %.3f cache misses/op\n", label,
+           secs * 1e9 / ops, (double)misses / ops);
+}
+
+static void run_threads(void *(*work)(void *), void *args, size_t arg_size) {
+    pthread_t tid[THREADS];
+
+    for (size_t i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, work,
+                              (char *)args + i * arg_size) == 0);
+    }
+
+    for (size_t i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+}
+
+static void *own_file(void *arg) {
+    const int fd = *(int *)arg;
+
+    char buffer[64];
+    memset(buffer, 'A', sizeof(buffer));
+
+    for (int i = 0; i < FS_OPS_PER_THREAD; i++) {
+        assert(tfs_pwrite(fd, buffer, sizeof(buffer), 0) == sizeof(buffer));
+        assert(tfs_pread(fd, buffer, sizeof(buffer), 0) == sizeof(buffer));
+    }
+
+    return NULL;
+}
+
+static pthread_mutex_t packed_locks[THREADS];
+
+typedef struct {
+    alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+} padded_lock_t;
+
+static padded_lock_t padded_locks[THREADS];
+
+static void *own_lock(void *arg) {
+    pthread_mutex_t *lock = *(pthread_mutex_t **)arg;
+
+    for (int i = 0; i < LOCK_OPS_PER_THREAD; i++) {
+        pthread_mutex_lock(lock);
+        pthread_mutex_unlock(lock);
+    }
+
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init() != -1);
+
+    int fds[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        char path[8];
+        snprintf(path, sizeof(path), "/f%d", i);
+        fds[i] = tfs_open(path, TFS_O_CREAT);
+        assert(fds[i] != -1);
+    }
+
+    measure_t measure;
+    measure_start(&measure);
+    run_threads(own_file, fds, sizeof(int));
+    measure_stop(&measure, "file per thread", THREADS * FS_OPS_PER_THREAD * 2);
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(tfs_close(fds[i]) != -1);
+    }
+
+    pthread_mutex_t *locks[THREADS];
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_mutex_init(&packed_locks[i], NULL) == 0);
+        locks[i] = &packed_locks[i];
+    }
+
+    measure_start(&measure);
+    run_threads(own_lock, locks, sizeof(pthread_mutex_t *));
+    measure_stop(&measure, "packed lock array", THREADS * LOCK_OPS_PER_THREAD);
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_mutex_init(&padded_locks[i].lock, NULL) == 0);
+        locks[i] = &padded_locks[i].lock;
+    }
+
+    measure_start(&measure);
+    run_threads(own_lock, locks, sizeof(pthread_mutex_t *));
+    measure_stop(&measure, "padded lock array", THREADS * LOCK_OPS_PER_THREAD);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+   This benchmark has 1 to 32 threads reading the same small hot file through
+   one shared handle with tfs_pread. Readers copy the handle, the inode and
+   the contents without locking and then check nothing moved, so they write
+   nothing shared and no cache line bounces between their cores.
+ */
+
+#define MAX_THREADS 32
+#define READS_PER_THREAD 2000
+#define SIZE 256
+
+static char input[SIZE];
+
+static void *read_hot(void *arg) {
+    const int fd = *(int *)arg;
+
+    char output[SIZE];
+    for (int i = 0; i < READS_PER_THREAD; i++) {
+        assert(tfs_pread(fd, output, SIZE, 0) == SIZE);
+        assert(memcmp(input, output, SIZE) == 0);
+    }
+
+    return NULL;
+}
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+    char *path = "/f1";
+
+    for (size_t i = 0; i < SIZE; i++) {
+        input[i] = (char)('A' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, input, SIZE) == SIZE);
+
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        pthread_t tid[MAX_THREADS];
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (int i = 0; i < threads; i++) {
+            assert(pthread_create(&tid[i], NULL, read_hot, &fd) == 0);
+        }
+
+        for (int i = 0; i < threads; i++) {
+            assert(pthread_join(tid[i], NULL) == 0);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        const double reads = (double)threads * READS_PER_THREAD;
+        printf("%2d thread(s): %.0f reads/s\n", threads,
+               reads / elapsed(&start, &end));
+    }
+
+    assert(tfs_close(fd) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "fs/config.h"
+#include "fs/kernels.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+   This benchmark times each block kernel (zero, copy, compare, pattern fill
+   and block CRC32C) with every implementation the CPU supports, on sizes
+   from one block to 256 KiB, and checks their results.
+ */
+
+#define MIN_SIZE (1024)
+#define MAX_SIZE (256 * 1024)
+#define BYTES_PER_RUN (256 * 1024 * 1024)
+
+/* A directory entry sized pattern, not a power of two */
+#define PATTERN_SIZE (44)
+
+static char src[MAX_SIZE];
+static char dest[MAX_SIZE];
+static char expected[MAX_SIZE];
+static char pattern[PATTERN_SIZE];
+static uint32_t crcs[MAX_SIZE / BLOCK_SIZE];
+
+typedef enum { ZERO, COPY, COMPARE, FILL, CRC32C, KERNELS } kernel_t;
+
+static char const *kernel_names[KERNELS] = {"zero", "copy", "compare", "fill",
+                                            "crc32c"};
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void run(kernel_t kernel, size_t size) {
+    switch (kernel) {
+    case ZERO:
+        block_zero(dest, size);
+        break;
+    case COPY:
+        block_copy(dest, src, size);
+        break;
+    case COMPARE:
+        assert(block_compare(dest, src, size) == 0);
+        break;
+    case FILL:
+        block_fill_pattern(dest, size, pattern, PATTERN_SIZE);
+        break;
+    case CRC32C:
+        block_crc32c(src, size / BLOCK_SIZE, crcs);
+        break;
+    case KERNELS:
+    default:
+        assert(0);
+    }
+}
+
+static void check(kernel_t kernel, size_t size) {
+    switch (kernel) {
+    case ZERO:
+        memset(expected, 0, size);
+        break;
+    case COPY:
+    case COMPARE:
+        memcpy(expected, src, size);
+        break;
+    case FILL:
+        for (size_t i = 0; i < size; i++) {
+            expected[i] = pattern[i % PATTERN_SIZE];
+        }
+        break;
+    case CRC32C:
+        for (size_t i = 0; i < size / BLOCK_SIZE; i++) {
+            assert(crcs[i] == crc32c(0, src + i * BLOCK_SIZE, BLOCK_SIZE));
+        }
+        return;
+    case KERNELS:
+    default:
+        assert(0);
+    }
+
+    assert(memcmp(dest, expected, size) == 0);
+}
+
+static void check_compare() {
+    block_copy(dest, src, MAX_SIZE);
+
+    /* Every position of the first difference, on both sides */
+    for (size_t i = 0; i < 300; i++) {
+        dest[i] = (char)(src[i] + 1);
+        assert(block_compare(dest, src, 300) > 0);
+        assert(block_compare(src, dest, 300) < 0);
+        assert(block_compare(dest, src, i) == 0);
+        dest[i] = src[i];
+    }
+}
+
+static void check_crc32c() {
+    /* Check value of the CRC32C (iSCSI) specification */
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+
+    /* Extending a checksum is the same as computing it at once */
+    const uint32_t half = crc32c(0, src, 1000);
+    assert(crc32c(half, src + 1000, 1001) == crc32c(0, src, 2001));
+}
+
+int main() {
+    for (size_t i = 0; i < MAX_SIZE; i++) {
+        src[i] = (char)('A' + i % 26);
+    }
+    for (size_t i = 0; i < PATTERN_SIZE; i++) {
+        pattern[i] = (char)('a' + i % 26);
+    }
+
+    kernels_init();
+    printf("selected: %s\n", kernels_isa_name(kernels_isa()));
+
+    for (kernel_isa_t isa = 0; isa < KERNEL_ISA_COUNT; isa++) {
+        if (kernels_set_isa(isa) == -1) {
+            printf("%s: unsupported\n", kernels_isa_name(isa));
+            continue;
+        }
+
+        check_compare();
+        check_crc32c();
+
+        for (kernel_t kernel = 0; kernel < KERNELS; kernel++) {
+            for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 4) {
+                const size_t runs = BYTES_PER_RUN / size;
+
+                memset(dest, 1, MAX_SIZE);
+                if (kernel == COMPARE) {
+                    memcpy(dest, src, size);
+                }
+
+                struct timespec start, end;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                for (size_t i = 0; i < runs; i++) {
+                    run(kernel, size);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+
+                check(kernel, size);
+
+                const double gib = (double)BYTES_PER_RUN / (1 << 30);
+                printf("%-6s %-7s %3zu KiB: %6.2f GiB/s\n",
+                       kernels_isa_name(isa), kernel_names[kernel],
+                       size / 1024, gib / elapsed(&start, &end));
+            }
+        }
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
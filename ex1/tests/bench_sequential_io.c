@@ -0,0 +1,81 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+   This benchmark writes and then reads back a whole file sequentially, with
+   request sizes from 4 KiB to 256 KiB. Blocks allocated one after the other
+   are contiguous in the FS, so each request is copied a run of blocks at a
+   time instead of block by block.
+ */
+
+#define MIN_REQUEST (4 * 1024)
+#define MAX_REQUEST (256 * 1024)
+#define ROUNDS 20
+
+static char input[MAX_FILE_SIZE];
+static char output[MAX_FILE_SIZE];
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+    char *path = "/f1";
+
+    for (size_t i = 0; i < sizeof(input); i++) {
+        input[i] = (char)('A' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    for (size_t request = MIN_REQUEST; request <= MAX_REQUEST; request *= 2) {
+        const size_t size = (MAX_FILE_SIZE / request) * request;
+        double write_time = 0, read_time = 0;
+
+        for (int round = 0; round < ROUNDS; round++) {
+            struct timespec start, end;
+
+            int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+            assert(fd != -1);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (size_t done = 0; done < size; done += request) {
+                assert(tfs_write(fd, input + done, request) ==
+                       (ssize_t)request);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            write_time += elapsed(&start, &end);
+
+            assert(tfs_close(fd) != -1);
+
+            fd = tfs_open(path, 0);
+            assert(fd != -1);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (size_t done = 0; done < size; done += request) {
+                assert(tfs_read(fd, output + done, request) ==
+                       (ssize_t)request);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            read_time += elapsed(&start, &end);
+
+            assert(tfs_close(fd) != -1);
+            assert(memcmp(input, output, size) == 0);
+        }
+
+        const double mib = (double)size * ROUNDS / (1024 * 1024);
+        printf("%3zu KiB requests: write %8.1f MiB/s, read %8.1f MiB/s\n",
+               request / 1024, mib / write_time, mib / read_time);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+   This benchmark has N threads writing disjoint stripes of the same file
+   through tfs_pwrite, then checks every stripe holds the bytes of its thread.
+   With byte range locks the stripes are written in parallel.
+ */
+
+#define MAX_THREADS 8
+#define ROUNDS 8
+
+typedef struct {
+    int fhandle;
+    size_t start;
+    size_t len;
+    char fill;
+} stripe_t;
+
+static void *write_stripe(void *arg) {
+    const stripe_t *stripe = (stripe_t *)arg;
+
+    char chunk[BLOCK_SIZE];
+    memset(chunk, stripe->fill, sizeof(chunk));
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (size_t done = 0; done < stripe->len; done += BLOCK_SIZE) {
+            assert(tfs_pwrite(stripe->fhandle, chunk, BLOCK_SIZE,
+                              stripe->start + done) == BLOCK_SIZE);
+        }
+    }
+
+    return NULL;
+}
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+    char *path = "/f1";
+
+    assert(tfs_init() != -1);
+
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(fd != -1);
+
+        const size_t stripe_len =
+            (MAX_FILE_SIZE / (size_t)threads) / BLOCK_SIZE * BLOCK_SIZE;
+
+        /* Allocate the whole file first so we only measure the copies. */
+        static char zeros[MAX_FILE_SIZE];
+        assert(tfs_pwrite(fd, zeros, stripe_len * (size_t)threads, 0) ==
+               stripe_len * (size_t)threads);
+
+        pthread_t tid[MAX_THREADS];
+        stripe_t stripes[MAX_THREADS];
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (int i = 0; i < threads; i++) {
+            stripes[i].fhandle = fd;
+            stripes[i].start = (size_t)i * stripe_len;
+            stripes[i].len = stripe_len;
+            stripes[i].fill = (char)('a' + i);
+            assert(pthread_create(&tid[i], NULL, write_stripe, &stripes[i]) ==
+                   0);
+        }
+
+        for (int i = 0; i < threads; i++) {
+            assert(pthread_join(tid[i], NULL) == 0);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        char output[BLOCK_SIZE];
+        for (int i = 0; i < threads; i++) {
+            for (size_t done = 0; done < stripe_len; done += BLOCK_SIZE) {
+                assert(tfs_pread(fd, output, BLOCK_SIZE,
+                                 stripes[i].start + done) == BLOCK_SIZE);
+                for (size_t j = 0; j < BLOCK_SIZE; j++) {
+                    assert(output[j] == stripes[i].fill);
+                }
+            }
+        }
+
+        assert(tfs_close(fd) != -1);
+
+        const double secs = elapsed(&start, &end);
+        const double bytes = (double)(stripe_len * (size_t)threads * ROUNDS);
+        printf("%d thread(s): %.3f s, %.2f MiB/s\n", threads, secs,
+               bytes / secs / (1024 * 1024));
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
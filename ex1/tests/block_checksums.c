@@ -0,0 +1,66 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+   This test corrupts a data block behind the file system's back and checks
+   that reads of that block (and only that block) fail, that a scrub finds
+   it, and that rewriting the block makes it valid again.
+ */
+
+#define SIZE (3 * BLOCK_SIZE)
+
+int main() {
+    char *path = "/f1";
+    char *small_path = "/f2";
+
+    char input[SIZE];
+    char output[SIZE];
+    for (size_t i = 0; i < SIZE; i++) {
+        input[i] = (char)('A' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, input, SIZE) == SIZE);
+
+    /* Inline files have no blocks to check */
+    int small_fd = tfs_open(small_path, TFS_O_CREAT);
+    assert(small_fd != -1);
+    assert(tfs_write(small_fd, input, 10) == 10);
+
+    assert(tfs_scrub(4) == 0);
+
+    /* Flip one byte of the second block */
+    inode_t *inode = inode_get(tfs_lookup(path));
+    assert(inode != NULL);
+    char *block = data_block_get(inode->i_direct_data_blocks[1]);
+    assert(block != NULL);
+    block[100] ^= 1;
+
+    assert(tfs_pread(fd, output, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    assert(memcmp(input, output, BLOCK_SIZE) == 0);
+    assert(tfs_pread(fd, output, 10, BLOCK_SIZE + 500) == -1);
+    assert(tfs_pread(fd, output, SIZE, 0) == -1);
+    assert(tfs_pread(small_fd, output, 10, 0) == 10);
+
+    assert(tfs_scrub(1) == 1);
+    assert(tfs_scrub(4) == 1);
+
+    /* Rewriting part of the block gives it a new checksum */
+    assert(tfs_pwrite(fd, input + BLOCK_SIZE, 10, BLOCK_SIZE) == 10);
+    assert(tfs_scrub(4) == 0);
+    assert(tfs_pread(fd, output, SIZE, 0) == SIZE);
+    assert(memcmp(input, output, BLOCK_SIZE + 100) == 0);
+    assert(output[BLOCK_SIZE + 100] == (input[BLOCK_SIZE + 100] ^ 1));
+
+    assert(tfs_close(fd) != -1);
+    assert(tfs_close(small_fd) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+   This test writes the same contents to two files with deduplication on and
+   checks that they share their blocks, that changing one of them (in part or
+   in whole, with deduplication on or off) copies the block first, that
+   truncating one leaves the other intact, and that writing contents already
+   indexed takes no new block.
+ */
+
+#define BLOCKS (12)
+#define SIZE (BLOCKS * BLOCK_SIZE)
+
+static char input[SIZE];
+static char output[SIZE];
+
+static int block_of(char const *path, int block) {
+    inode_t *inode = inode_get(tfs_lookup(path));
+    assert(inode != NULL);
+    return get_block_number(inode, block);
+}
+
+static void check_contents(int fd, char const *expected) {
+    assert(tfs_pread(fd, output, SIZE, 0) == SIZE);
+    assert(memcmp(output, expected, SIZE) == 0);
+}
+
+int main() {
+    char *path1 = "/f1";
+    char *path2 = "/f2";
+    char *path3 = "/f3";
+
+    for (size_t i = 0; i < SIZE; i++) {
+        input[i] = (char)('A' + i % 26 + i / BLOCK_SIZE);
+    }
+
+    assert(tfs_init() != -1);
+    tfs_set_dedup(true);
+
+    int fd1 = tfs_open(path1, TFS_O_CREAT);
+    int fd2 = tfs_open(path2, TFS_O_CREAT);
+    assert(fd1 != -1 && fd2 != -1);
+
+    assert(tfs_write(fd1, input, SIZE) == SIZE);
+    /* Unaligned requests still share the blocks they fill as a whole */
+    assert(tfs_write(fd2, input, 100) == 100);
+    assert(tfs_write(fd2, input + 100, SIZE - 100) == SIZE - 100);
+
+    for (int block = 1; block < BLOCKS; block++) {
+        assert(block_of(path1, block) == block_of(path2, block));
+    }
+    check_contents(fd1, input);
+    check_contents(fd2, input);
+
+    /* A partial write copies the shared block, the other file keeps it */
+    char expected[SIZE];
+    memcpy(expected, input, SIZE);
+    memcpy(expected + BLOCK_SIZE + 10, "changed", 7);
+    const int shared = block_of(path2, 1);
+    assert(tfs_pwrite(fd1, "changed", 7, BLOCK_SIZE + 10) == 7);
+    assert(block_of(path1, 1) != shared);
+    assert(block_of(path2, 1) == shared);
+    check_contents(fd1, expected);
+    check_contents(fd2, input);
+    assert(tfs_scrub(1) == 0);
+
+    /* So does a whole block write with deduplication off */
+    tfs_set_dedup(false);
+    char block[BLOCK_SIZE];
+    memset(block, 'z', BLOCK_SIZE);
+    memcpy(expected + 3 * BLOCK_SIZE, block, BLOCK_SIZE);
+    assert(tfs_pwrite(fd1, block, BLOCK_SIZE, 3 * BLOCK_SIZE) == BLOCK_SIZE);
+    check_contents(fd1, expected);
+    check_contents(fd2, input);
+    tfs_set_dedup(true);
+
+    /* Writing back what the other file has shares the block again */
+    assert(tfs_pwrite(fd1, input + BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE) ==
+           BLOCK_SIZE);
+    assert(block_of(path1, 1) == shared);
+
+    /* Truncating a file drops its references only */
+    int fd3 = tfs_open(path3, TFS_O_CREAT);
+    assert(fd3 != -1);
+    assert(tfs_write(fd3, input, SIZE) == SIZE);
+    assert(tfs_close(fd1) != -1);
+    fd1 = tfs_open(path1, TFS_O_TRUNC);
+    assert(fd1 != -1);
+    check_contents(fd2, input);
+    check_contents(fd3, input);
+
+    /* The blocks left are still found by new writes */
+    assert(tfs_write(fd1, input, SIZE) == SIZE);
+    assert(block_of(path1, 5) == block_of(path3, 5));
+    check_contents(fd1, input);
+    assert(tfs_scrub(2) == 0);
+
+    /* With no block free, new blocks with indexed contents are still
+     * written: they are looked up before any block is allocated */
+    static int taken[DATA_BLOCKS];
+    int count = 0;
+    while ((taken[count] = data_block_alloc()) != -1) {
+        count++;
+    }
+    const size_t direct = MAX_DIRECT_DATA_BLOCKS_PER_FILE * BLOCK_SIZE;
+    int fd4 = tfs_open("/f4", TFS_O_CREAT);
+    assert(fd4 != -1);
+    assert(tfs_write(fd4, input, direct) == direct);
+    assert(block_of("/f4", 5) == block_of(path3, 5));
+    assert(data_block_alloc() == -1);
+    for (int i = 0; i < count; i++) {
+        assert(data_block_free(taken[i]) == 0);
+    }
+    assert(tfs_pread(fd4, output, direct, 0) == direct);
+    assert(memcmp(output, input, direct) == 0);
+
+    assert(tfs_close(fd1) != -1);
+    assert(tfs_close(fd2) != -1);
+    assert(tfs_close(fd3) != -1);
+    assert(tfs_close(fd4) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+   This test clones files of every kind (plain with an indirect block, kept
+   in the inode, compressed), onto new and existing files, and checks that
+   clones share the source's blocks, that writes to either file never show
+   in the other, that snapshots keep what they saw, and that every shared
+   block is freed once no file uses it.
+ */
+
+#define SIZE (12 * BLOCK_SIZE)
+#define SMALL (40)
+
+static char original[SIZE];
+static char changed[SIZE];
+static char output[2 * SIZE];
+
+static void check_file(int snapshot, char const *path, char const *expected,
+                       size_t size) {
+    const int fd = snapshot == -1 ? tfs_open(path, 0)
+                                  : tfs_snapshot_open(snapshot, path);
+    assert(fd != -1);
+    assert(tfs_read(fd, output, sizeof(output)) == (ssize_t)size);
+    assert(memcmp(output, expected, size) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+/* Writes to a file at offset, creating it if needed. */
+static void write_file(char const *path, int flags, char const *data,
+                       size_t size, size_t offset) {
+    const int fd = tfs_open(path, TFS_O_CREAT | flags);
+    assert(fd != -1);
+    assert(tfs_pwrite(fd, data, size, offset) == (ssize_t)size);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < SIZE; i++) {
+        original[i] = (char)('a' + i % 26);
+        changed[i] = (char)('A' + i % 13);
+    }
+
+    assert(tfs_init() != -1);
+
+    write_file("/plain", 0, original, SIZE, 0);
+    write_file("/small", 0, original, SMALL, 0);
+    write_file("/compressed", TFS_O_COMPRESS, original, SIZE, 0);
+
+    /* The clone shares the blocks, with its own indirect block */
+    inode_t *plain = inode_get(tfs_lookup("/plain"));
+    const int block = get_block_number(plain, 11);
+    assert(tfs_clone("/plain", "/plain_clone") == 0);
+    inode_t *clone = inode_get(tfs_lookup("/plain_clone"));
+    assert(get_block_number(clone, 11) == block);
+    assert(clone->i_indirect_data_block != plain->i_indirect_data_block);
+
+    assert(tfs_clone("/small", "/small_clone") == 0);
+    assert(tfs_clone("/compressed", "/compressed_clone") == 0);
+    check_file(-1, "/plain_clone", original, SIZE);
+    check_file(-1, "/small_clone", original, SMALL);
+    check_file(-1, "/compressed_clone", original, SIZE);
+
+    /* Cloning a missing file fails, cloning a file onto itself does nothing */
+    assert(tfs_clone("/missing", "/plain_clone") == -1);
+    assert(tfs_clone("/plain", "/plain") == 0);
+    assert(tfs_clone("/plain", "bad") == -1);
+    check_file(-1, "/plain", original, SIZE);
+
+    /* Writes to either file copy the blocks they change */
+    char plain_data[SIZE + BLOCK_SIZE];
+    memcpy(plain_data, original, SIZE);
+    memcpy(plain_data + 11 * BLOCK_SIZE + 3, "changed", 7);
+    memcpy(plain_data + SIZE, changed, BLOCK_SIZE);
+    write_file("/plain", 0, "changed", 7, 11 * BLOCK_SIZE + 3);
+    write_file("/plain", 0, changed, BLOCK_SIZE, SIZE);
+    assert(get_block_number(plain, 11) != block);
+    assert(get_block_number(clone, 11) == block);
+
+    char clone_data[SIZE];
+    memcpy(clone_data, original, SIZE);
+    memcpy(clone_data + 3, "clone", 5);
+    write_file("/plain_clone", 0, "clone", 5, 3);
+    write_file("/small_clone", TFS_O_TRUNC, changed, SMALL, 0);
+    write_file("/compressed", 0, changed, BLOCK_SIZE, BLOCK_SIZE);
+
+    check_file(-1, "/plain", plain_data, SIZE + BLOCK_SIZE);
+    check_file(-1, "/plain_clone", clone_data, SIZE);
+    check_file(-1, "/small", original, SMALL);
+    check_file(-1, "/small_clone", changed, SMALL);
+    check_file(-1, "/compressed_clone", original, SIZE);
+
+    /* Cloning onto an existing file replaces its contents; a snapshot taken
+     * before keeps them */
+    const int snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+    assert(tfs_clone("/compressed_clone", "/plain_clone") == 0);
+    assert(tfs_clone("/plain", "/small_clone") == 0);
+    check_file(-1, "/plain_clone", original, SIZE);
+    check_file(-1, "/small_clone", plain_data, SIZE + BLOCK_SIZE);
+    check_file(snapshot, "/plain_clone", clone_data, SIZE);
+    check_file(snapshot, "/small_clone", changed, SMALL);
+
+    write_file("/small_clone", 0, changed, SIZE, 0);
+    check_file(-1, "/plain", plain_data, SIZE + BLOCK_SIZE);
+    check_file(snapshot, "/plain", plain_data, SIZE + BLOCK_SIZE);
+
+    assert(tfs_snapshot_delete(snapshot) == 0);
+    assert(tfs_scrub(2) == 0);
+
+    /* Every shared block was freed: once the files are emptied, only the
+     * root directory's block is taken */
+    char const *paths[] = {"/plain",       "/small",       "/compressed",
+                           "/plain_clone", "/small_clone", "/compressed_clone"};
+    for (int i = 0; i < 6; i++) {
+        const int fd = tfs_open(paths[i], TFS_O_TRUNC);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+    int free_blocks = 0;
+    while (data_block_alloc() != -1) {
+        free_blocks++;
+    }
+    assert(free_blocks == DATA_BLOCKS - 1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
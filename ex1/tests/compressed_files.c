@@ -0,0 +1,120 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+   This test writes compressed files (text that compresses well and random
+   bytes that don't) at random offsets, overwriting parts of clusters and
+   leaving holes, and checks their contents against a copy kept in memory. It
+   also checks that compressible contents take one block per cluster, and
+   appends to, truncates and scrubs a compressed file.
+ */
+
+#define WRITES 300
+#define MAX_WRITE (3 * CLUSTER_SIZE)
+
+static char expected[MAX_FILE_SIZE];
+static char output[MAX_FILE_SIZE];
+static char text[MAX_FILE_SIZE];
+static char noise[MAX_FILE_SIZE];
+
+static int blocks_used(char const *path) {
+    inode_t *inode = inode_get(tfs_lookup(path));
+    assert(inode != NULL);
+
+    int used = 0;
+    for (int block = 0; block < (int)BLOCK_SIZEOF(inode->i_size); block++) {
+        if (get_block_number(inode, block) >= 0) {
+            used++;
+        }
+    }
+
+    return used;
+}
+
+static void check_contents(int fd, size_t size) {
+    memset(output, 0, sizeof(output));
+    assert(tfs_pread(fd, output, MAX_FILE_SIZE, 0) == (ssize_t)size);
+    assert(memcmp(expected, output, size) == 0);
+}
+
+int main() {
+    char *path = "/f1";
+    char *log_path = "/log";
+
+    srand(24);
+    for (size_t i = 0; i < MAX_FILE_SIZE; i++) {
+        text[i] = "timestamp=1234 level=info msg=\"request done\"\n"[i % 45];
+        noise[i] = (char)rand();
+    }
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(fd != -1);
+
+    /* Random writes, mixing data that compresses with data that doesn't */
+    size_t size = 0;
+    for (int i = 0; i < WRITES; i++) {
+        const size_t offset = (size_t)rand() % (MAX_FILE_SIZE - MAX_WRITE);
+        const size_t len = 1 + (size_t)rand() % MAX_WRITE;
+        char const *source = (i % 3 == 0) ? noise : text;
+
+        assert(tfs_pwrite(fd, source + offset, len, offset) == (ssize_t)len);
+        memcpy(expected + offset, source + offset, len);
+        if (offset + len > size) {
+            size = offset + len;
+        }
+
+        if (i % 50 == 0) {
+            check_contents(fd, size);
+        }
+    }
+    check_contents(fd, size);
+
+    /* Up to the end of the biggest file, whose last cluster is shorter */
+    assert(tfs_pwrite(fd, text, 3000, MAX_FILE_SIZE - 3000) == 3000);
+    memcpy(expected + MAX_FILE_SIZE - 3000, text, 3000);
+    check_contents(fd, MAX_FILE_SIZE);
+    assert(tfs_scrub(2) == 0);
+
+    /* Other handles find the file compressed */
+    int fd2 = tfs_open(path, 0);
+    assert(fd2 != -1);
+    check_contents(fd2, MAX_FILE_SIZE);
+    assert(tfs_close(fd2) != -1);
+
+    /* Truncating frees every cluster and keeps the file compressed */
+    assert(tfs_close(fd) != -1);
+    fd = tfs_open(path, TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_pread(fd, output, 10, 0) == 0);
+
+    assert(tfs_write(fd, text, 64 * BLOCK_SIZE) == 64 * BLOCK_SIZE);
+    assert(blocks_used(path) == 64 / CLUSTER_BLOCKS);
+    memcpy(expected, text, 64 * BLOCK_SIZE);
+    check_contents(fd, 64 * BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    /* Appends in small records */
+    int log_fd =
+        tfs_open(log_path, TFS_O_CREAT | TFS_O_APPEND | TFS_O_COMPRESS);
+    assert(log_fd != -1);
+    for (size_t done = 0; done < 20 * BLOCK_SIZE; done += 45) {
+        assert(tfs_write(log_fd, text, 45) == 45);
+    }
+    const size_t log_size = (20 * BLOCK_SIZE / 45 + 1) * 45;
+    memcpy(expected, text, log_size);
+    check_contents(log_fd, log_size);
+    assert(blocks_used(log_path) ==
+           (int)((log_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE));
+    assert(tfs_close(log_fd) != -1);
+
+    assert(tfs_scrub(2) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+   This test creates files in batches (some existing already, some repeated
+   within the batch, some compressed, and more than the root directory
+   holds) and checks that each name ends up with a single file, that the
+   i-nodes of files that couldn't be created are freed, and that
+   tfs_stat_many reports the files as written.
+ */
+
+#define BATCH (8)
+
+int main() {
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open("/existing", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "hello", 5) == 5);
+    assert(tfs_close(fd) != -1);
+
+    char const *paths[BATCH] = {"/a", "/b", "/existing", "/c",
+                                "/a", "/d", "/e",        "/f"};
+    int inumbers[BATCH];
+    assert(tfs_create_many(paths, BATCH, 0, inumbers) == 0);
+    for (int i = 0; i < BATCH; i++) {
+        assert(inumbers[i] != -1);
+        assert(inumbers[i] == tfs_lookup(paths[i]));
+    }
+    assert(inumbers[0] == inumbers[4]);
+
+    tfs_statfs_t stats;
+    assert(tfs_statfs(&stats) == 0);
+    assert(stats.used_inodes == 1 + 1 + 6);
+
+    /* The files work as if created by tfs_open */
+    fd = tfs_open("/c", TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_write(fd, "contents", 8) == 8);
+    assert(tfs_close(fd) != -1);
+
+    /* Invalid paths fail the whole batch */
+    char const *bad[] = {"/g", "h"};
+    assert(tfs_create_many(bad, 2, 0, inumbers) == -1);
+    assert(tfs_lookup("/g") == -1);
+    assert(tfs_create_many(bad, 0, 0, inumbers) == -1);
+
+    /* Compressed files */
+    char const *compressed[] = {"/z1", "/z2"};
+    assert(tfs_create_many(compressed, 2, TFS_O_COMPRESS, inumbers) == 0);
+
+    tfs_stat_t file_stats[BATCH + 2];
+    char const *stat_paths[BATCH + 2] = {"/a", "/b", "/existing", "/c", "/a",
+                                         "/d", "/e", "/f",        "/z1", "/x"};
+    assert(tfs_stat_many(stat_paths, BATCH + 2, file_stats) == -1);
+    for (int i = 0; i < BATCH + 1; i++) {
+        assert(file_stats[i].st_inumber == tfs_lookup(stat_paths[i]));
+        assert(file_stats[i].st_compressed == (i == BATCH));
+    }
+    assert(file_stats[2].st_size == 5);
+    assert(file_stats[3].st_size == 8);
+    assert(file_stats[0].st_size == 0);
+    assert(file_stats[BATCH + 1].st_inumber == -1);
+    assert(tfs_stat_many(stat_paths, BATCH, file_stats) == 0);
+
+    /* More names than the directory holds: the rest aren't created, and
+     * their i-nodes are freed */
+    char names[MAX_DIR_ENTRIES][16];
+    char const *many[MAX_DIR_ENTRIES];
+    int many_inumbers[MAX_DIR_ENTRIES];
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        snprintf(names[i], sizeof(names[i]), "/many%zu", i);
+        many[i] = names[i];
+    }
+    assert(tfs_create_many(many, MAX_DIR_ENTRIES, 0, many_inumbers) == -1);
+
+    const int files = 1 + 6 + 2;
+    assert(tfs_statfs(&stats) == 0);
+    assert(stats.used_inodes == (int)MAX_DIR_ENTRIES + 1);
+    for (int i = 0; i < (int)MAX_DIR_ENTRIES; i++) {
+        if (i < (int)MAX_DIR_ENTRIES - files) {
+            assert(many_inumbers[i] != -1);
+            assert(many_inumbers[i] == tfs_lookup(many[i]));
+        } else {
+            assert(many_inumbers[i] == -1);
+            assert(tfs_lookup(many[i]) == -1);
+        }
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+   This test writes files a block at a time, in turns, so their blocks end
+   up interleaved, and checks that the defragmenter moves each one it can to
+   a single run (leaving the ones sharing blocks with a clone), both when
+   called and in the background, without changing what the files read, even
+   while they are being written.
+ */
+
+#define FILE_BLOCKS (20)
+#define SIZE (FILE_BLOCKS * BLOCK_SIZE)
+#define FILES (3)
+#define ROUNDS (1000)
+
+static char contents[FILES][SIZE];
+static char output[SIZE];
+
+static char const *paths[FILES] = {"/a", "/b", "/compressed"};
+
+static void check_file(char const *path, char const *expected) {
+    const int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, output, sizeof(output)) == SIZE);
+    assert(memcmp(output, expected, SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+/* Writes the files a block at a time, in turns */
+static void write_interleaved() {
+    int fds[FILES];
+    for (int f = 0; f < FILES; f++) {
+        fds[f] = tfs_open(paths[f], TFS_O_CREAT | TFS_O_TRUNC |
+                                        (f == 2 ? TFS_O_COMPRESS : 0));
+        assert(fds[f] != -1);
+    }
+
+    for (int b = 0; b < FILE_BLOCKS; b++) {
+        for (int f = 0; f < FILES; f++) {
+            assert(tfs_write(fds[f], contents[f] + b * BLOCK_SIZE,
+                             BLOCK_SIZE) == BLOCK_SIZE);
+        }
+    }
+
+    for (int f = 0; f < FILES; f++) {
+        assert(tfs_close(fds[f]) != -1);
+    }
+}
+
+static int fragmented_files() {
+    tfs_fragmentation_t report;
+    assert(tfs_fragmentation(&report) == 0);
+    assert(report.file_runs >= report.files);
+    assert(report.largest_free_run <= report.free_blocks);
+    assert(report.free_runs <= report.free_blocks);
+    return report.fragmented_files;
+}
+
+int main() {
+    /* Contents that barely compress, so compressed clusters take blocks */
+    unsigned int seed = 38;
+    for (int f = 0; f < FILES; f++) {
+        for (size_t i = 0; i < SIZE; i++) {
+            seed = seed * 1103515245 + 12345;
+            contents[f][i] = (char)(seed >> 16);
+        }
+    }
+
+    assert(tfs_init() != -1);
+
+    write_interleaved();
+    assert(tfs_clone("/b", "/b_clone") == 0);
+
+    tfs_fragmentation_t report;
+    assert(tfs_fragmentation(&report) == 0);
+    assert(report.files == 4);
+    assert(report.fragmented_files == 4);
+    assert(report.file_runs > 4 * 2);
+
+    /* The clone and the file it shares blocks with stay as they are */
+    assert(tfs_defragment() == 2);
+    assert(fragmented_files() == 2);
+    for (int f = 0; f < FILES; f++) {
+        check_file(paths[f], contents[f]);
+    }
+    check_file("/b_clone", contents[1]);
+
+    int fd = tfs_open("/b_clone", TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_defragment() == 1);
+    assert(fragmented_files() == 0);
+    assert(tfs_defragment() == 0);
+    check_file("/b", contents[1]);
+    assert(tfs_scrub(1) == 0);
+
+    /* In the background */
+    assert(tfs_defrag_stop() == -1);
+    assert(tfs_defrag_start(1) == 0);
+    assert(tfs_defrag_start(1) == -1);
+
+    write_interleaved();
+    const time_t deadline = time(NULL) + 10;
+    while (fragmented_files() > 0) {
+        assert(time(NULL) < deadline);
+    }
+    assert(tfs_defrag_stop() == 0);
+
+    for (int f = 0; f < FILES; f++) {
+        check_file(paths[f], contents[f]);
+    }
+    assert(tfs_scrub(1) == 0);
+
+    /* Blocks are copied while the files are written: copies of blocks that
+     * changed meanwhile are dropped */
+    assert(tfs_defrag_start(0) == 0);
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int f = 0; f < FILES; f++) {
+            contents[f][round * SIZE / ROUNDS] ^= 1;
+        }
+        write_interleaved();
+        for (int f = 0; f < FILES; f++) {
+            check_file(paths[f], contents[f]);
+        }
+    }
+    assert(tfs_defrag_stop() == 0);
+    assert(tfs_scrub(1) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+   This test has readers go through a file without locking while a writer
+   keeps rewriting it, each time with a single letter, and truncating it:
+   every read must see the whole of one write, never parts of two. Then a
+   few threads read through one shared handle, and together must read every
+   byte of the file exactly once.
+ */
+
+#define READERS 4
+#define ROUNDS 2000
+/* Spans direct and indirect blocks */
+#define SIZE (12 * BLOCK_SIZE + 100)
+#define CHUNK 64
+
+static int fd;
+static bool writing = true;
+
+static void *rewrite(void *arg) {
+    (void)arg;
+    static char input[SIZE];
+
+    for (int i = 0; i < ROUNDS; i++) {
+        memset(input, 'A' + i % 26, SIZE);
+        assert(tfs_pwrite(fd, input, SIZE, 0) == SIZE);
+
+        if (i % 100 == 0) {
+            const int truncated = tfs_open("/f1", TFS_O_TRUNC);
+            assert(truncated != -1);
+            assert(tfs_close(truncated) != -1);
+        }
+    }
+
+    __atomic_store_n(&writing, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *read_whole(void *arg) {
+    (void)arg;
+    char output[SIZE];
+
+    while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+        const ssize_t read = tfs_pread(fd, output, SIZE, 0);
+        assert(read == 0 || read == SIZE);
+        for (ssize_t i = 1; i < read; i++) {
+            assert(output[i] == output[0]);
+        }
+    }
+
+    return NULL;
+}
+
+static int shared_fd;
+static int seen[SIZE / CHUNK];
+
+static void *read_shared(void *arg) {
+    (void)arg;
+    int chunk[CHUNK / sizeof(int)];
+
+    ssize_t read;
+    while ((read = tfs_read(shared_fd, chunk, CHUNK)) > 0) {
+        assert(read == CHUNK);
+        __atomic_fetch_add(&seen[chunk[0]], 1, __ATOMIC_RELAXED);
+    }
+    assert(read == 0);
+
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init() != -1);
+
+    fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+
+    pthread_t writer, readers[READERS];
+    assert(pthread_create(&writer, NULL, rewrite, NULL) == 0);
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_create(&readers[i], NULL, read_whole, NULL) == 0);
+    }
+    assert(pthread_join(writer, NULL) == 0);
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_join(readers[i], NULL) == 0);
+    }
+
+    /* Each chunk starts with its own index */
+    static int numbered[SIZE / sizeof(int)];
+    for (size_t i = 0; i < SIZE / CHUNK; i++) {
+        numbered[i * CHUNK / sizeof(int)] = (int)i;
+    }
+    const size_t size = SIZE / CHUNK * CHUNK;
+    assert(tfs_close(fd) != -1);
+
+    shared_fd = tfs_open("/f1", TFS_O_TRUNC);
+    assert(shared_fd != -1);
+    assert(tfs_write(shared_fd, numbered, size) == size);
+    assert(tfs_close(shared_fd) != -1);
+
+    shared_fd = tfs_open("/f1", 0);
+    assert(shared_fd != -1);
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_create(&readers[i], NULL, read_shared, NULL) == 0);
+    }
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_join(readers[i], NULL) == 0);
+    }
+    for (size_t i = 0; i < SIZE / CHUNK; i++) {
+        assert(seen[i] == 1);
+    }
+    assert(tfs_close(shared_fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
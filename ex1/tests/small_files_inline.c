@@ -0,0 +1,74 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+/**
+   This test writes files small enough to be kept inside their i-node, grows
+   one of them past the inline size (moving its contents to a data block) and
+   truncates it back, checking the contents along the way.
+ */
+
+#define SMALL_FILES 10
+#define BIG_SIZE (3 * BLOCK_SIZE)
+
+int main() {
+    char path[8];
+    char input[BIG_SIZE];
+    char output[BIG_SIZE];
+
+    for (size_t i = 0; i < BIG_SIZE; i++) {
+        input[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    /* Small files written in two steps, still inline */
+    for (int i = 0; i < SMALL_FILES; i++) {
+        snprintf(path, sizeof(path), "/s%d", i);
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, input + i, 10) == 10);
+        assert(tfs_write(fd, input + i + 10, 10) == 10);
+        assert(tfs_close(fd) != -1);
+    }
+
+    for (int i = 0; i < SMALL_FILES; i++) {
+        snprintf(path, sizeof(path), "/s%d", i);
+        int fd = tfs_open(path, 0);
+        assert(fd != -1);
+        assert(tfs_read(fd, output, sizeof(output)) == 20);
+        assert(memcmp(output, input + i, 20) == 0);
+        assert(tfs_close(fd) != -1);
+    }
+
+    /* Writes past the end of an inline file leave zeros behind */
+    int fd = tfs_open("/s0", TFS_O_APPEND);
+    assert(fd != -1);
+    assert(tfs_pwrite(fd, input, 5, INODE_INLINE_DATA_SIZE - 5) == 5);
+    assert(tfs_pread(fd, output, INODE_INLINE_DATA_SIZE, 0) ==
+           INODE_INLINE_DATA_SIZE);
+    assert(memcmp(output, input, 20) == 0);
+    for (size_t i = 20; i < INODE_INLINE_DATA_SIZE - 5; i++) {
+        assert(output[i] == 0);
+    }
+    assert(memcmp(output + INODE_INLINE_DATA_SIZE - 5, input, 5) == 0);
+
+    /* Growing the file moves it to data blocks */
+    assert(tfs_pwrite(fd, input, BIG_SIZE, 0) == BIG_SIZE);
+    assert(tfs_pread(fd, output, BIG_SIZE, 0) == BIG_SIZE);
+    assert(memcmp(output, input, BIG_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+
+    /* Truncating brings it back inside the inode */
+    fd = tfs_open("/s0", TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_read(fd, output, sizeof(output)) == 0);
+    assert(tfs_write(fd, input, 30) == 30);
+    assert(tfs_pread(fd, output, sizeof(output), 0) == 30);
+    assert(memcmp(output, input, 30) == 0);
+    assert(tfs_close(fd) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+   This test takes snapshots while files of every kind (plain, kept in the
+   inode, compressed) change, and checks that each snapshot keeps reading the
+   contents the files had when it was taken, that files created later aren't
+   in it, and that deleting a snapshot keeps the others intact.
+ */
+
+#define SIZE (12 * BLOCK_SIZE)
+#define SMALL (40)
+
+static char original[SIZE];
+static char changed[SIZE];
+static char output[2 * SIZE];
+
+static void check_file(int snapshot, char const *path, char const *expected,
+                       size_t size) {
+    const int fd = snapshot == -1 ? tfs_open(path, 0)
+                                  : tfs_snapshot_open(snapshot, path);
+    assert(fd != -1);
+    assert(tfs_read(fd, output, sizeof(output)) == (ssize_t)size);
+    assert(memcmp(output, expected, size) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+static void write_file(char const *path, int flags, char const *data,
+                       size_t size) {
+    const int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC | flags);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, size) == (ssize_t)size);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < SIZE; i++) {
+        original[i] = (char)('a' + i % 26);
+        changed[i] = (char)('A' + i % 13);
+    }
+
+    assert(tfs_init() != -1);
+
+    write_file("/plain", 0, original, SIZE);
+    write_file("/small", 0, original, SMALL);
+    write_file("/compressed", TFS_O_COMPRESS, original, SIZE);
+
+    const int first = tfs_snapshot_create();
+    assert(first != -1);
+
+    /* Change part of a block past the direct ones, and grow the file */
+    char plain[SIZE + BLOCK_SIZE];
+    memcpy(plain, original, SIZE);
+    memcpy(plain + 11 * BLOCK_SIZE + 3, "changed", 7);
+    memcpy(plain + SIZE, changed, BLOCK_SIZE);
+    int fd = tfs_open("/plain", 0);
+    assert(fd != -1);
+    assert(tfs_pwrite(fd, "changed", 7, 11 * BLOCK_SIZE + 3) == 7);
+    assert(tfs_pwrite(fd, changed, BLOCK_SIZE, SIZE) == BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    write_file("/small", 0, changed, SMALL);
+    write_file("/compressed", TFS_O_COMPRESS, changed, SIZE / 2);
+    write_file("/new", 0, changed, SIZE);
+
+    check_file(first, "/plain", original, SIZE);
+    check_file(first, "/small", original, SMALL);
+    check_file(first, "/compressed", original, SIZE);
+    assert(tfs_snapshot_open(first, "/new") == -1);
+
+    check_file(-1, "/plain", plain, SIZE + BLOCK_SIZE);
+    check_file(-1, "/small", changed, SMALL);
+    check_file(-1, "/compressed", changed, SIZE / 2);
+    check_file(-1, "/new", changed, SIZE);
+
+    /* Files of snapshots are read-only */
+    fd = tfs_snapshot_open(first, "/plain");
+    assert(fd != -1);
+    assert(tfs_write(fd, changed, 10) == -1);
+    assert(tfs_pwrite(fd, changed, 10, 0) == -1);
+    assert(tfs_pread(fd, output, 10, BLOCK_SIZE) == 10);
+    assert(memcmp(output, original + BLOCK_SIZE, 10) == 0);
+
+    /* A second snapshot sees the changes, the first one doesn't */
+    const int second = tfs_snapshot_create();
+    assert(second != -1 && second != first);
+    write_file("/plain", 0, changed, BLOCK_SIZE);
+    write_file("/new", 0, original, SMALL);
+
+    check_file(second, "/plain", plain, SIZE + BLOCK_SIZE);
+    check_file(second, "/new", changed, SIZE);
+    check_file(first, "/plain", original, SIZE);
+    check_file(-1, "/plain", changed, BLOCK_SIZE);
+    check_file(-1, "/new", original, SMALL);
+
+    /* Snapshots with open files can't be deleted */
+    assert(tfs_snapshot_delete(first) == -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_snapshot_delete(first) == 0);
+    assert(tfs_snapshot_open(first, "/plain") == -1);
+
+    check_file(second, "/plain", plain, SIZE + BLOCK_SIZE);
+    check_file(second, "/small", changed, SMALL);
+    check_file(second, "/compressed", changed, SIZE / 2);
+
+    assert(tfs_snapshot_delete(second) == 0);
+    assert(tfs_snapshot_delete(second) == -1);
+    check_file(-1, "/plain", changed, BLOCK_SIZE);
+    assert(tfs_scrub(2) == 0);
+
+    /* Every block the snapshots kept was freed: once the files are emptied,
+     * only the root directory's block is taken */
+    char const *paths[] = {"/plain", "/small", "/compressed", "/new"};
+    for (int i = 0; i < 4; i++) {
+        fd = tfs_open(paths[i], TFS_O_TRUNC);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+
+    int free_blocks = 0;
+    while (data_block_alloc() != -1) {
+        free_blocks++;
+    }
+    assert(free_blocks == DATA_BLOCKS - 1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+   This test checks the statistics tfs_statfs reports, kept by the
+   allocators as blocks and inodes are taken and freed, against what
+   scanning the free blocks finds: after files of several sizes are written
+   in turns, after some of them are truncated (leaving holes that merge as
+   their neighbours are freed), with the volume full and once it is empty
+   again.
+ */
+
+#define FILES (8)
+
+static char data[MAX_FILE_SIZE];
+
+/* Finds the free blocks by taking them all (the allocator takes the first
+ * free one), checks what tfs_statfs reported, and frees them back. */
+static void check_against_scan(tfs_statfs_t const *stats) {
+    static int taken[DATA_BLOCKS];
+    int count = 0;
+    while ((taken[count] = data_block_alloc()) != -1) {
+        count++;
+    }
+
+    int runs = 0, largest = 0, run = 0;
+    int classes[FREE_RUN_CLASSES] = {0};
+    for (int i = 0; i <= count; i++) {
+        if (i < count && (run == 0 || taken[i] == taken[i - 1] + 1)) {
+            run++;
+            continue;
+        }
+
+        if (run > 0) {
+            runs++;
+            largest = run > largest ? run : largest;
+            int run_class = 0;
+            while ((1 << (run_class + 1)) <= run) {
+                run_class++;
+            }
+            classes[run_class]++;
+        }
+        run = 1;
+    }
+
+    assert(stats->free_blocks == count);
+    assert(stats->used_blocks == DATA_BLOCKS - count);
+    assert(stats->free_runs == runs);
+    assert(stats->largest_free_run == largest);
+    assert(memcmp(stats->free_run_classes, classes, sizeof(classes)) == 0);
+
+    tfs_statfs_t full;
+    assert(tfs_statfs(&full) == 0);
+    assert(full.free_blocks == 0 && full.free_runs == 0 &&
+           full.largest_free_run == 0);
+
+    for (int i = 0; i < count; i++) {
+        assert(data_block_free(taken[i]) == 0);
+    }
+
+    tfs_statfs_t again;
+    assert(tfs_statfs(&again) == 0);
+    assert(memcmp(&again, stats, sizeof(again)) == 0);
+}
+
+static void check() {
+    tfs_statfs_t stats;
+    assert(tfs_statfs(&stats) == 0);
+    assert(stats.blocks == DATA_BLOCKS && stats.inodes == INODE_TABLE_SIZE);
+    check_against_scan(&stats);
+}
+
+static void truncate_file(char const *path) {
+    const int fd = tfs_open(path, TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    memset(data, 'x', sizeof(data));
+
+    assert(tfs_init() != -1);
+    assert(tfs_statfs(NULL) == -1);
+
+    /* Only the root directory and its block are taken */
+    tfs_statfs_t stats;
+    assert(tfs_statfs(&stats) == 0);
+    assert(stats.used_blocks == 1 && stats.free_blocks == DATA_BLOCKS - 1);
+    assert(stats.used_inodes == 1 &&
+           stats.free_inodes == INODE_TABLE_SIZE - 1);
+    assert(stats.free_runs == 1 && stats.largest_free_run == DATA_BLOCKS - 1);
+    check();
+
+    /* Files grow in turns, so their blocks interleave */
+    int fds[FILES];
+    char path[16];
+    for (int f = 0; f < FILES; f++) {
+        snprintf(path, sizeof(path), "/f%d", f);
+        fds[f] = tfs_open(path, TFS_O_CREAT);
+        assert(fds[f] != -1);
+    }
+    assert(tfs_statfs(&stats) == 0);
+    assert(stats.used_inodes == FILES + 1);
+
+    for (int b = 0; b < 12; b++) {
+        for (int f = 0; f < FILES; f++) {
+            const ssize_t len = BLOCK_SIZE * (f % 3 + 1);
+            assert(tfs_write(fds[f], data, (size_t)len) == len);
+        }
+    }
+    for (int f = 0; f < FILES; f++) {
+        assert(tfs_close(fds[f]) != -1);
+    }
+    check();
+
+    /* Holes, which merge as the blocks next to them are freed */
+    for (int f = 0; f < FILES; f += 2) {
+        snprintf(path, sizeof(path), "/f%d", f);
+        truncate_file(path);
+        check();
+    }
+
+    /* Full */
+    int fd = tfs_open("/big", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, MAX_FILE_SIZE) == MAX_FILE_SIZE);
+    assert(tfs_close(fd) != -1);
+    for (int f = 0; tfs_statfs(&stats) == 0 && stats.free_blocks > 0; f++) {
+        snprintf(path, sizeof(path), "/fill%d", f);
+        fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        while (tfs_write(fd, data, BLOCK_SIZE) == BLOCK_SIZE) {
+        }
+        assert(tfs_close(fd) != -1);
+    }
+    assert(stats.free_runs == 0 && stats.largest_free_run == 0);
+    check();
+
+    /* Empty again */
+    for (int f = 0; f < INODE_TABLE_SIZE; f++) {
+        snprintf(path, sizeof(path), "/fill%d", f);
+        if (tfs_lookup(path) != -1) {
+            truncate_file(path);
+        }
+        snprintf(path, sizeof(path), "/f%d", f);
+        if (tfs_lookup(path) != -1) {
+            truncate_file(path);
+        }
+    }
+    truncate_file("/big");
+    assert(tfs_statfs(&stats) == 0);
+    assert(stats.free_runs == 1 && stats.largest_free_run == DATA_BLOCKS - 1);
+    check();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
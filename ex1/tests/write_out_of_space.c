@@ -0,0 +1,67 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+   This test fills the volume with files of the largest size until a write
+   runs out of blocks partway, and checks that the write failed as a whole:
+   none of the blocks it took before running out stay taken, so a later
+   write can use every free block.
+ */
+
+static char data[MAX_FILE_SIZE];
+
+/* Counts the free blocks by taking them all, and frees them back. */
+static int count_free_blocks() {
+    static int taken[DATA_BLOCKS];
+    int count = 0;
+    while ((taken[count] = data_block_alloc()) != -1) {
+        count++;
+    }
+
+    for (int i = 0; i < count; i++) {
+        assert(data_block_free(taken[i]) == 0);
+    }
+    return count;
+}
+
+int main() {
+    memset(data, 'A', sizeof(data));
+    assert(tfs_init() != -1);
+
+    char path[MAX_FILE_NAME];
+    int files = 0;
+    int free_blocks;
+    while (true) {
+        free_blocks = count_free_blocks();
+        snprintf(path, sizeof(path), "/f%d", files++);
+        const int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+
+        const ssize_t written = tfs_write(fd, data, sizeof(data));
+        assert(tfs_close(fd) != -1);
+        if (written == -1) {
+            break;
+        }
+        assert(written == sizeof(data));
+    }
+
+    /* The failed write took blocks before it ran out */
+    assert(free_blocks > 0);
+    assert(count_free_blocks() == free_blocks);
+
+    /* And they can all be written */
+    const int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    const size_t fits = (size_t)(free_blocks - 1) * BLOCK_SIZE;
+    assert(tfs_write(fd, data, fits) == fits);
+    assert(count_free_blocks() == 0);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -2,23 +2,40 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "../common/common.h"
+#include "../common/shared.h"
+#include "../common/trace.h"
 #include "tecnicofs_client_errors.h"
 
 int session_id;
 int fclient = -1;
-int fserver;
+/* The server pipe while mounting, then the session's request pipe */
+int fserver = -1;
 char _client_pipe_path[PATHNAME_MAX_SIZE + 1];
+char _request_pipe_path[REQUEST_PIPE_PATH_MAX_SIZE];
+/* The session is a connection to the server socket (fclient == fserver) */
+static bool session_socket = false;
+/* Region shared with the server (see tfs_mount_shared), NULL if none */
+static shared_region_t *shared = NULL;
+static int request_event = -1;
+static int response_event = -1;
+/* The events the reply to a share request came with, as many as there were */
+static int shared_events[2];
+static int shared_event_count = 0;
 
 void *memccpy(void *restrict dest, const void *restrict src, int c,
               size_t count);
@@ -31,20 +48,293 @@ void *memccpy(void *restrict dest, const void *restrict src, int c,
         }                                                                      \
     } while (0)
 
+/* Sends a request of the session with op_code, its header and its body of
+ * size bytes in a single write.
+ * Returns: 0 if successful, -1 otherwise */
+static int request_send(char op_code, int request, void const *body,
+                        size_t size) {
+    char buffer[sizeof(request_header_t) + sizeof(open_request_t)];
+    const request_header_t header = {.version = TFS_PROTOCOL_VERSION,
+                                     .op_code = (uint8_t)op_code,
+                                     .size = (uint16_t)size,
+                                     .session_id = session_id,
+                                     .request_id = request};
+
+    memcpy(buffer, &header, sizeof(header));
+    if (size > 0) {
+        memcpy(buffer + sizeof(header), body, size);
+    }
+    R_FAIL_IF(try_pipe_write(fserver, buffer, sizeof(header) + size) == -1,
+              E_REQUESTS_PIPE_WRITE, -1);
+    return 0;
+}
+
+/* Whether name fits in a request, '\0' included */
+static bool name_fits(char const *name) {
+    return strnlen(name, PATHNAME_MAX_SIZE) < PATHNAME_MAX_SIZE;
+}
+
+/* Replies the client hasn't read yet wait in the client pipe (or the
+ * socket), which holds 64 KiB on Linux: if it filled up, the server would
+ * block writing to it, and stop reading requests, while the client could be
+ * blocked sending one. So the replies a request may still get in flight are
+ * kept under this, waiting for the older ones before submitting it. */
+#define REPLY_BYTES_MAX (16 * 1024)
+
+/*
+ * Request sent and not waited for yet
+ */
+typedef struct {
+    bool in_flight;
+    /* Submitted with tfs_submit_*, rather than sent by a call waiting for it */
+    bool submitted;
+    bool done;
+    int id;
+    char op_code;
+    /* Where the contents a read returns go */
+    void *buffer;
+    size_t len;
+    /* The most bytes its reply can take */
+    size_t reply_size;
+    ssize_t result;
+} request_t;
+
+/* A slot more than can be submitted, for the calls made in the meantime */
+#define REQUEST_SLOTS (TFS_MAX_IN_FLIGHT + 1)
+
+/* The id of a request is its slot plus a multiple of REQUEST_SLOTS that
+ * changes every request, so that old ids don't match. */
+static request_t requests[REQUEST_SLOTS];
+static unsigned generation = 0;
+static int submissions = 0;
+/* Slots of the requests whose replies are still to arrive, in the order the
+ * server sends them: from the oldest, replied, up to sent - 1. */
+static int unreplied[REQUEST_SLOTS];
+static unsigned sent = 0;
+static unsigned replied = 0;
+static size_t reply_bytes = 0;
+
+/* Returns: the slot of request id, NULL if it isn't in flight */
+static request_t *request_find(int id) {
+    if (id < 0) {
+        return NULL;
+    }
+
+    request_t *const request = &requests[id % REQUEST_SLOTS];
+    if (!request->in_flight || request->id != id) {
+        return NULL;
+    }
+    return request;
+}
+
+/* Reads the reply to the oldest request still without one.
+ * Returns: 0 if successful, -1 if the session is broken */
+static int receive_reply() {
+    assert(replied != sent);
+    request_t *const request = &requests[unreplied[replied % REQUEST_SLOTS]];
+
+    int id;
+    ssize_t rc;
+    if (request->op_code == TFS_OP_CODE_SHARE) {
+        /* The events of the shared region come along with the reply */
+        shared_event_count = 2;
+        rc = try_recv_fds(fclient, &id, sizeof(int), shared_events,
+                          &shared_event_count);
+    } else {
+        rc = try_read_all(fclient, &id, sizeof(int));
+    }
+    R_FAIL_IF(rc != sizeof(int) || id != request->id, E_CLIENT_PIPE_READ, -1);
+
+    if (request->op_code != TFS_OP_CODE_READ) {
+        int res;
+        R_FAIL_IF(try_read_all(fclient, &res, sizeof(int)) != sizeof(int),
+                  E_CLIENT_PIPE_READ, -1);
+        request->result = res;
+    } else {
+        /* The contents come in chunks, until one of length 0 */
+        size_t was_read = 0;
+        int chunk;
+        do {
+            R_FAIL_IF(try_read_all(fclient, &chunk, sizeof(int)) !=
+                              sizeof(int) ||
+                          chunk < -1 ||
+                          (chunk > 0 &&
+                           (size_t)chunk > request->len - was_read),
+                      E_CLIENT_PIPE_READ, -1);
+            TRACE_DETAIL(TRACE_CHUNK, request->id, chunk);
+
+            if (chunk > 0) {
+                R_FAIL_IF(try_read_all(fclient,
+                                       (char *)request->buffer + was_read,
+                                       (size_t)chunk) != chunk,
+                          E_CLIENT_PIPE_READ, -1);
+                was_read += (size_t)chunk;
+            }
+        } while (chunk > 0);
+
+        request->result = chunk == -1 ? -1 : (ssize_t)was_read;
+    }
+
+    request->done = true;
+    reply_bytes -= request->reply_size;
+    replied++;
+    return 0;
+}
+
+/* Takes a slot for a request about to be sent, first waiting for the
+ * replies to older ones while there isn't room for its reply.
+ * Returns: its id, -1 if TFS_MAX_IN_FLIGHT requests were submitted and not
+ * waited for yet, or if the session is broken */
+static int request_reserve(char op_code, bool submitted, void *buffer,
+                           size_t len) {
+    if (submitted && submissions == TFS_MAX_IN_FLIGHT) {
+        errno = EBUSY;
+        perror(E_TOO_MANY_REQUESTS);
+        return -1;
+    }
+
+    int slot = 0;
+    while (slot < REQUEST_SLOTS && requests[slot].in_flight) {
+        slot++;
+    }
+    /* Only once the session is broken do calls leave theirs taken */
+    R_FAIL_IF(slot == REQUEST_SLOTS, E_TOO_MANY_REQUESTS, -1);
+
+    /* A shared region takes the contents, and the results, instead */
+    size_t reply_size = 0;
+    if (shared == NULL) {
+        reply_size = REPLY_HEADER_SZ + sizeof(int);
+        if (op_code == TFS_OP_CODE_READ) {
+            /* The contents and the lengths of their chunks */
+            reply_size = len >= REPLY_BYTES_MAX
+                             ? REPLY_BYTES_MAX
+                             : reply_size + len +
+                                   (len + READ_CHUNK_SIZE - 1) /
+                                       READ_CHUNK_SIZE * sizeof(int);
+        }
+        if (reply_size > REPLY_BYTES_MAX) {
+            reply_size = REPLY_BYTES_MAX;
+        }
+
+        while (reply_bytes + reply_size > REPLY_BYTES_MAX) {
+            if (receive_reply() == -1) {
+                return -1;
+            }
+        }
+        unreplied[sent++ % REQUEST_SLOTS] = slot;
+        reply_bytes += reply_size;
+    }
+
+    generation = (generation + 1) % (INT_MAX / REQUEST_SLOTS);
+    requests[slot] = (request_t){
+        .in_flight = true,
+        .submitted = submitted,
+        .id = (int)generation * REQUEST_SLOTS + slot,
+        .op_code = op_code,
+        .buffer = buffer,
+        .len = len,
+        .reply_size = reply_size};
+    submissions += submitted;
+    return requests[slot].id;
+}
+
+/* Completes a request carried out through the shared region. */
+static void request_complete(int id, ssize_t result) {
+    request_t *const request = &requests[id % REQUEST_SLOTS];
+
+    request->done = true;
+    request->result = result;
+}
+
+static int unmount_close_pipes(int res) {
+    /* Requests still in flight are lost with the session */
+    memset(requests, 0, sizeof(requests));
+    submissions = 0;
+    sent = replied = 0;
+    reply_bytes = 0;
+
+    if (shared != NULL) {
+        shared_region_unmap(shared);
+        try_close(request_event);
+        try_close(response_event);
+        shared = NULL;
+        request_event = response_event = -1;
+    }
+
+    if (session_socket) {
+        try_close(fserver);
+        fserver = fclient = -1;
+        session_socket = false;
+        return res;
+    }
+
+    if (fserver != -1)
+        try_close(fserver);
+    fserver = -1;
+
+    if (fclient != -1)
+        try_close(fclient);
+    fclient = -1;
+
+    if ((unlink(_client_pipe_path) != 0 && errno != ENOENT) ||
+        (unlink(_request_pipe_path) != 0 && errno != ENOENT)) {
+        fprintf(stderr, "[ERR]: unlink(%s) failed: %s\n", _client_pipe_path,
+                strerror(errno));
+        return -1;
+    }
+
+    TRACE_OPS(TRACE_RETURN, TFS_OP_CODE_UNMOUNT, res);
+    return res;
+}
+
 static void handle_interr() {
     puts("Interruption!");
-    if (fclient == -1) {
-        /* Open pipe because we may have closed a client in mount between
-         * sending pathname and opening client fifo (which locks the server). */
-        fclient = try_open(_client_pipe_path, O_RDONLY);
-        try_close(fclient);
-    } else {
+    /* Halfway through a mount there's nothing to tell: the server never
+     * waits on a client that is mounting, and notices it's gone */
+    if (session_id != -1 && fserver != -1) {
         tfs_unmount();
     }
     fflush(stdout);
     exit(EXIT_SUCCESS);
 }
 
+/* Mounts through a server listening on a Unix domain socket: the connection
+ * carries both the session's requests and its responses, and the server
+ * unmounts the session as soon as it is closed. */
+static int mount_socket(char const *server_socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(server_socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[ERR]: socket path %s is too long\n",
+                server_socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, server_socket_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    R_FAIL_IF(fd == -1, E_SERVER_SOCKET_CONNECT, -1);
+
+    int rc;
+    do {
+        rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    } while (rc == -1 && errno == EINTR);
+
+    int id = -1;
+    if (rc == -1 || try_read_all(fd, &id, sizeof(int)) != sizeof(int) ||
+        id == -1) {
+        if (rc == -1)
+            perror(E_SERVER_SOCKET_CONNECT);
+        try_close(fd);
+        return -1;
+    }
+
+    fclient = fserver = fd;
+    session_socket = true;
+    session_id = id;
+
+    TRACE_OPS(TRACE_RETURN, TFS_OP_CODE_MOUNT, 0);
+    return 0;
+}
+
 int tfs_mount(char const *client_pipe_path, char const *server_pipe_path) {
     static bool sig = false;
     if (!sig) {
@@ -52,184 +342,433 @@ int tfs_mount(char const *client_pipe_path, char const *server_pipe_path) {
         sig = true;
     }
 
-    printf("mount %d\n", getpid());
+    TRACE_OPS(TRACE_CALL, TFS_OP_CODE_MOUNT, -1);
+
+    struct stat server_stat;
+    if (stat(server_pipe_path, &server_stat) == 0 &&
+        S_ISSOCK(server_stat.st_mode)) {
+        return mount_socket(server_pipe_path);
+    }
 
+    if (!name_fits(client_pipe_path)) {
+        fprintf(stderr, "[ERR]: %s is too long\n", client_pipe_path);
+        return -1;
+    }
     strncpy(_client_pipe_path, client_pipe_path, PATHNAME_MAX_SIZE);
 
-    if (unlink(client_pipe_path) != 0 && errno != ENOENT) {
+    snprintf(_request_pipe_path, sizeof(_request_pipe_path), "%s%s",
+             _client_pipe_path, REQUEST_PIPE_SUFFIX);
+
+    if ((unlink(client_pipe_path) != 0 && errno != ENOENT) ||
+        (unlink(_request_pipe_path) != 0 && errno != ENOENT)) {
         fprintf(stderr, "[ERR]: unlink(%s) failed: %s\n", client_pipe_path,
                 strerror(errno));
         return -1;
     }
-    if (mkfifo(client_pipe_path, 0640) != 0) {
+    if (mkfifo(client_pipe_path, 0640) != 0 ||
+        mkfifo(_request_pipe_path, 0640) != 0) {
         fprintf(stderr, "[ERR]: mkfifo failed: %s\n", strerror(errno));
+        unlink(client_pipe_path);
         return -1;
     }
 
+    /* Not a session's yet */
+    session_id = -1;
+
+    /* Our end of the client pipe is open before we ask to mount, so that the
+     * server never waits for us to open it: it finds a reader, or finds us
+     * gone. Until the server opens its end, reads would see end of file. */
+    fclient = try_open(client_pipe_path, O_RDONLY | O_NONBLOCK);
+    R_FAIL_IF(fclient == -1, E_CLIENT_PIPE_READ, unmount_close_pipes(-1));
+
+    /* The server pipe is only used to mount */
     fserver = try_open(server_pipe_path, O_WRONLY);
+    R_FAIL_IF(fserver == -1, E_REQUESTS_PIPE_WRITE, unmount_close_pipes(-1));
 
-    char buffer[MOUNT_BUFFER_SZ] = {TFS_OP_CODE_MOUNT};
-    memccpy(buffer + sizeof(char), client_pipe_path, 0, PATHNAME_MAX_SIZE);
+    mount_request_t mount = {{0}};
+    memccpy(mount.client_pipe, client_pipe_path, 0, PATHNAME_MAX_SIZE);
+    if (request_send(TFS_OP_CODE_MOUNT, 0, &mount, sizeof(mount)) == -1) {
+        return unmount_close_pipes(-1);
+    }
 
-    R_FAIL_IF(try_pipe_write(fserver, buffer, MOUNT_BUFFER_SZ) == -1,
-              E_REQUESTS_PIPE_WRITE, -1);
+    try_close(fserver);
+    fserver = -1;
 
-    fclient = try_open(client_pipe_path, O_RDONLY);
-    printf("mount past open %d\n", getpid());
+    struct pollfd reply = {.fd = fclient, .events = POLLIN};
+    int rc;
+    do {
+        rc = poll(&reply, 1, -1);
+    } while (rc == -1 && errno == EINTR);
 
     int id;
-    R_FAIL_IF(try_read(fclient, &id, sizeof(int)) == -1, E_CLIENT_PIPE_READ,
-              -1);
+    R_FAIL_IF(rc == -1 || try_set_blocking(fclient, true) == -1 ||
+                  try_read_all(fclient, &id, sizeof(int)) != sizeof(int),
+              E_CLIENT_PIPE_READ, unmount_close_pipes(-1));
+    TRACE_DETAIL(TRACE_MOUNT_REPLY, id, 0);
 
     if (id == -1)
-        return -1;
+        return unmount_close_pipes(-1);
+
+    fserver = try_open(_request_pipe_path, O_WRONLY);
+    R_FAIL_IF(fserver == -1, E_REQUESTS_PIPE_WRITE, unmount_close_pipes(-1));
 
-    printf("session %lu\n", (unsigned long)id);
     session_id = id;
 
-    printf("mount done %d\n", getpid());
+    TRACE_OPS(TRACE_RETURN, TFS_OP_CODE_MOUNT, 0);
     return 0;
 }
 
-static int unmount_close_pipes(int res) {
-    try_close(fserver);
+/* Posts a request without contents in the shared region and waits for its
+ * result. */
+static ssize_t shared_call(shared_request_t const *request) {
+    void *data;
+    shared_request_t *const slot = shared_request_slot(shared, &data);
+    R_FAIL_IF(slot == NULL, E_SHARED_FULL, -1);
+
+    *slot = *request;
+    shared_request_post(shared);
+    R_FAIL_IF(shared_notify(request_event) == -1, E_REQUESTS_PIPE_WRITE, -1);
+
+    ssize_t const *result;
+    while ((result = shared_response_peek(shared, &data)) == NULL) {
+        R_FAIL_IF(shared_wait(response_event, fclient) == -1,
+                  E_CLIENT_PIPE_READ, -1);
+    }
 
-    try_close(fclient);
+    const ssize_t res = *result;
+    shared_response_pop(shared);
+    return res;
+}
 
-    fclient = -1;
+/* Writes (or reads) len bytes with a request per slot, posting as many as
+ * the slots allow before waiting for their results.
+ * Returns: the bytes written (or read) up to the first short request, -1 if
+ * the first one fails */
+static ssize_t shared_stream(char op_code, int fhandle, void *buffer,
+                             size_t len) {
+    /* Even an empty request is sent, for its result */
+    const size_t chunks =
+        len == 0 ? 1
+                 : (len + SHARED_SLOT_DATA_SIZE - 1) / SHARED_SLOT_DATA_SIZE;
+    size_t posted = 0;
+    size_t collected = 0;
+    bool finished = false;
+    ssize_t total = 0;
+
+    while (collected < posted || (!finished && posted < chunks)) {
+        void *data;
+        shared_request_t *slot;
+
+        /* Post chunks while there are free slots */
+        const size_t first = posted;
+        while (!finished && posted < chunks &&
+               (slot = shared_request_slot(shared, &data)) != NULL) {
+            const size_t offset = posted * SHARED_SLOT_DATA_SIZE;
+            const size_t chunk = len - offset < SHARED_SLOT_DATA_SIZE
+                                     ? len - offset
+                                     : SHARED_SLOT_DATA_SIZE;
+
+            *slot = (shared_request_t){
+                .op_code = op_code, .fhandle = fhandle, .len = chunk};
+            if (op_code == TFS_OP_CODE_WRITE) {
+                memcpy(data, (char *)buffer + offset, chunk);
+            }
+            shared_request_post(shared);
+            posted++;
+        }
+        if (posted != first) {
+            R_FAIL_IF(shared_notify(request_event) == -1,
+                      E_REQUESTS_PIPE_WRITE, -1);
+        }
+
+        /* Then collect the oldest result */
+        ssize_t const *result;
+        while ((result = shared_response_peek(shared, &data)) == NULL) {
+            R_FAIL_IF(shared_wait(response_event, fclient) == -1,
+                      E_CLIENT_PIPE_READ, -1);
+        }
+
+        const size_t offset = collected * SHARED_SLOT_DATA_SIZE;
+        const size_t chunk = len - offset < SHARED_SLOT_DATA_SIZE
+                                 ? len - offset
+                                 : SHARED_SLOT_DATA_SIZE;
+        if (finished) {
+            /* Posted after a short one: ignored */
+        } else if (*result == -1) {
+            total = total > 0 ? total : -1;
+            finished = true;
+        } else {
+            if (op_code == TFS_OP_CODE_READ) {
+                memcpy((char *)buffer + offset, data, (size_t)*result);
+            }
+            total += *result;
+            /* The end of the file, or a full file */
+            finished = (size_t)*result < chunk;
+        }
+        shared_response_pop(shared);
+        collected++;
+    }
 
-    if (unlink(_client_pipe_path) != 0 && errno != ENOENT) {
-        fprintf(stderr, "[ERR]: unlink(%s) failed: %s\n", _client_pipe_path,
-                strerror(errno));
+    return total;
+}
+
+int tfs_mount_shared(char const *server_socket_path) {
+    struct stat server_stat;
+    if (stat(server_socket_path, &server_stat) != 0 ||
+        !S_ISSOCK(server_stat.st_mode)) {
+        fprintf(stderr, "[ERR]: %s is not a socket\n", server_socket_path);
         return -1;
     }
 
-    printf("umount done %d\n", getpid());
-    return res;
+    if (tfs_mount(NULL, server_socket_path) == -1) {
+        return -1;
+    }
+
+    int region_fd;
+    shared_region_t *const region = shared_region_create(&region_fd);
+    R_FAIL_IF(region == NULL, E_SHARED_CREATE, unmount_close_pipes(-1));
+
+    const int request = request_reserve(TFS_OP_CODE_SHARE, false, NULL, 0);
+
+    ssize_t res = -1;
+    shared_event_count = 0;
+    if (request_send(TFS_OP_CODE_SHARE, request, NULL, 0) == -1 ||
+        try_send_fds(fserver, "", 1, &region_fd, 1) == -1) {
+        perror(E_REQUESTS_PIPE_WRITE);
+    } else {
+        res = tfs_wait(request);
+    }
+
+    /* The mapping stays valid */
+    try_close(region_fd);
+    if (res == -1 || shared_event_count != 2) {
+        shared_region_unmap(region);
+        for (int i = 0; i < shared_event_count; i++) {
+            try_close(shared_events[i]);
+        }
+        return unmount_close_pipes(-1);
+    }
+
+    shared = region;
+    request_event = shared_events[0];
+    response_event = shared_events[1];
+    return 0;
 }
 
 int tfs_unmount() {
-    printf("umount %d\n", getpid());
-    char buffer[UNMOUNT_BUFFER_SZ] = {TFS_OP_CODE_UNMOUNT};
-
-    memcpy(buffer + sizeof(char), &session_id, sizeof(int));
+    TRACE_OPS(TRACE_CALL, TFS_OP_CODE_UNMOUNT, session_id);
+    if (shared != NULL) {
+        shared_request_t request = {.op_code = TFS_OP_CODE_UNMOUNT};
+        return unmount_close_pipes((int)shared_call(&request));
+    }
 
-    R_FAIL_IF(try_pipe_write(fserver, buffer, UNMOUNT_BUFFER_SZ) == -1,
-              E_REQUESTS_PIPE_WRITE, unmount_close_pipes(-1));
+    const int request = request_reserve(TFS_OP_CODE_UNMOUNT, false, NULL, 0);
+    if (request == -1) {
+        return -1;
+    }
 
-    printf("Reading %d\n", session_id);
-    int res = 0;
-    R_FAIL_IF(try_read_all(fclient, &res, sizeof(int)) == -1,
-              E_CLIENT_PIPE_READ, unmount_close_pipes(-1));
-    printf("Unmount returned %d %d\n", session_id, res);
+    if (request_send(TFS_OP_CODE_UNMOUNT, request, NULL, 0) == -1) {
+        return unmount_close_pipes(-1);
+    }
 
-    return unmount_close_pipes(res);
+    return unmount_close_pipes((int)tfs_wait(request));
 }
 
 int tfs_open(char const *name, int flags) {
-    printf("open %d\n", getpid());
-    char buffer[OPEN_BUFFER_SZ] = {TFS_OP_CODE_OPEN};
-    char *ptr = buffer;
+    TRACE_OPS(TRACE_CALL, TFS_OP_CODE_OPEN, session_id);
+    if (!name_fits(name)) {
+        return -1;
+    }
+    if (shared != NULL) {
+        shared_request_t request = {.op_code = TFS_OP_CODE_OPEN,
+                                    .flags = flags};
+        memccpy(request.name, name, 0, PATHNAME_MAX_SIZE);
+        return (int)shared_call(&request);
+    }
 
-    memcpy(ptr += sizeof(char), &session_id, sizeof(int));
-    memccpy(ptr += sizeof(int), name, 0, PATHNAME_MAX_SIZE);
-    memcpy(ptr += PATHNAME_MAX_SIZE, &flags, sizeof(int));
+    const int request = request_reserve(TFS_OP_CODE_OPEN, false, NULL, 0);
+    if (request == -1) {
+        return -1;
+    }
 
-    R_FAIL_IF(try_pipe_write(fserver, buffer, OPEN_BUFFER_SZ) == -1,
-              E_REQUESTS_PIPE_WRITE, -1);
+    open_request_t open = {.flags = flags};
+    memccpy(open.name, name, 0, PATHNAME_MAX_SIZE);
+    if (request_send(TFS_OP_CODE_OPEN, request, &open, sizeof(open)) == -1) {
+        return -1;
+    }
 
-    int res;
-    R_FAIL_IF(try_read_all(fclient, &res, sizeof(int)) == -1,
-              E_CLIENT_PIPE_READ, -1);
+    const int res = (int)tfs_wait(request);
 
-    printf("open done %d\n", getpid());
+    TRACE_OPS(TRACE_RETURN, TFS_OP_CODE_OPEN, res);
     return res;
 }
 
 int tfs_close(int fhandle) {
-    printf("close %d\n", getpid());
-    char buffer[CLOSE_BUFFER_SZ] = {TFS_OP_CODE_CLOSE};
-    char *ptr = buffer;
+    TRACE_OPS(TRACE_CALL, TFS_OP_CODE_CLOSE, session_id);
+    if (shared != NULL) {
+        shared_request_t request = {.op_code = TFS_OP_CODE_CLOSE,
+                                    .fhandle = fhandle};
+        return (int)shared_call(&request);
+    }
 
-    memcpy(ptr += sizeof(char), &session_id, sizeof(int));
-    memcpy(ptr += sizeof(int), &fhandle, sizeof(int));
+    const int request = request_reserve(TFS_OP_CODE_CLOSE, false, NULL, 0);
+    if (request == -1) {
+        return -1;
+    }
 
-    R_FAIL_IF(try_pipe_write(fserver, buffer, CLOSE_BUFFER_SZ) == -1,
-              E_REQUESTS_PIPE_WRITE, -1);
+    const close_request_t close = {.fhandle = fhandle};
+    if (request_send(TFS_OP_CODE_CLOSE, request, &close, sizeof(close)) ==
+        -1) {
+        return -1;
+    }
 
-    int res;
-    R_FAIL_IF(try_read_all(fclient, &res, sizeof(int)) == -1,
-              E_CLIENT_PIPE_READ, -1);
+    const int res = (int)tfs_wait(request);
 
-    printf("close done %d\n", getpid());
+    TRACE_OPS(TRACE_RETURN, TFS_OP_CODE_CLOSE, res);
     return res;
 }
 
-ssize_t tfs_write(int fhandle, void const *in_buffer, size_t len) {
-    printf("write %d\n", getpid());
-    char buffer[WRITE_BUFFER_SZ] = {TFS_OP_CODE_WRITE};
-    char *ptr = buffer;
-
-    memcpy(ptr += sizeof(char), &session_id, sizeof(int));
-    memcpy(ptr += sizeof(int), &fhandle, sizeof(int));
-    memcpy(ptr += sizeof(int), &len, sizeof(size_t));
-    memcpy(ptr += sizeof(size_t), in_buffer, len * sizeof(char));
+int tfs_submit_write(int fhandle, void const *in_buffer, size_t len) {
+    const int request = request_reserve(TFS_OP_CODE_WRITE, true, NULL, len);
+    if (request == -1) {
+        return -1;
+    }
 
-    R_FAIL_IF(try_pipe_write(fserver, buffer,
-                             WRITE_BUFFER_SZ - BLOCK_SIZE + len) == -1,
-              E_REQUESTS_PIPE_WRITE, -1);
+    if (shared != NULL) {
+        request_complete(request, shared_stream(TFS_OP_CODE_WRITE, fhandle,
+                                                (void *)in_buffer, len));
+        return request;
+    }
 
-    int res;
-    R_FAIL_IF(try_read_all(fclient, &res, sizeof(int)) == -1,
-              E_CLIENT_PIPE_READ, -1);
+    /* Small contents go in the same write as the request */
+    char buffer[sizeof(request_header_t) + sizeof(rw_request_t) + BLOCK_SIZE];
+    const request_header_t header = {.version = TFS_PROTOCOL_VERSION,
+                                     .op_code = TFS_OP_CODE_WRITE,
+                                     .size = sizeof(rw_request_t),
+                                     .session_id = session_id,
+                                     .request_id = request};
+    const rw_request_t write = {.fhandle = fhandle, .len = len};
+    const size_t size = sizeof(header) + sizeof(write);
+
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), &write, sizeof(write));
+
+    if (len <= BLOCK_SIZE) {
+        memcpy(buffer + size, in_buffer, len * sizeof(char));
+        R_FAIL_IF(try_write_all(fserver, buffer, size + len) == -1,
+                  E_REQUESTS_PIPE_WRITE, -1);
+    } else {
+        R_FAIL_IF(try_write_all(fserver, buffer, size) == -1 ||
+                      try_write_all(fserver, in_buffer, len) == -1,
+                  E_REQUESTS_PIPE_WRITE, -1);
+    }
 
-    printf("write done %d\n", getpid());
-    return (ssize_t)res;
+    return request;
 }
 
-ssize_t tfs_read(int fhandle, void *out_buffer, size_t len) {
-    printf("read %d\n", getpid());
-    char buffer[READ_BUFFER_SZ] = {TFS_OP_CODE_READ};
-    char *ptr = buffer;
+int tfs_submit_read(int fhandle, void *out_buffer, size_t len) {
+    const int request =
+        request_reserve(TFS_OP_CODE_READ, true, out_buffer, len);
+    if (request == -1) {
+        return -1;
+    }
 
-    memcpy(ptr += sizeof(char), &session_id, sizeof(int));
-    memcpy(ptr += sizeof(int), &fhandle, sizeof(int));
-    memcpy(ptr += sizeof(int), &len, sizeof(size_t));
+    if (shared != NULL) {
+        request_complete(request, shared_stream(TFS_OP_CODE_READ, fhandle,
+                                                out_buffer, len));
+        return request;
+    }
 
-    R_FAIL_IF(try_pipe_write(fserver, buffer, READ_BUFFER_SZ) == -1,
-              E_REQUESTS_PIPE_WRITE, -1);
+    const rw_request_t read = {.fhandle = fhandle, .len = len};
+    if (request_send(TFS_OP_CODE_READ, request, &read, sizeof(read)) == -1) {
+        return -1;
+    }
+
+    return request;
+}
 
-    int was_read;
-    R_FAIL_IF(try_read_all(fclient, &was_read, sizeof(int)) == -1,
-              E_CLIENT_PIPE_READ, -1);
+ssize_t tfs_wait(int request) {
+    request_t *const entry = request_find(request);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    while (!entry->done) {
+        if (receive_reply() == -1) {
+            return -1;
+        }
+    }
+
+    entry->in_flight = false;
+    submissions -= entry->submitted;
+    return entry->result;
+}
 
-    printf("Was read: %d\n", was_read);
-    if (was_read == -1 || was_read > BLOCK_SIZE) {
+int tfs_poll(int request, ssize_t *result) {
+    request_t *const entry = request_find(request);
+    if (entry == NULL) {
         return -1;
     }
 
-    R_FAIL_IF(try_read_all(fclient, out_buffer, (size_t)was_read) == -1,
-              E_CLIENT_PIPE_READ, -1);
+    /* Only read the replies that have started to arrive */
+    while (!entry->done) {
+        struct pollfd fd = {.fd = fclient, .events = POLLIN};
+        int rc;
+        do {
+            rc = poll(&fd, 1, 0);
+        } while (rc == -1 && errno == EINTR);
+
+        R_FAIL_IF(rc == -1, E_CLIENT_PIPE_READ, -1);
+        if (rc == 0) {
+            return 0;
+        }
+        if (receive_reply() == -1) {
+            return -1;
+        }
+    }
 
-    printf("read done %d\n", getpid());
-    return (ssize_t)was_read;
+    entry->in_flight = false;
+    submissions -= entry->submitted;
+    *result = entry->result;
+    return 1;
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
+    TRACE_OPS(TRACE_CALL, TFS_OP_CODE_WRITE, session_id);
+    const ssize_t res = tfs_wait(tfs_submit_write(fhandle, buffer, len));
+    TRACE_OPS(TRACE_RETURN, TFS_OP_CODE_WRITE, res);
+    return res;
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    TRACE_OPS(TRACE_CALL, TFS_OP_CODE_READ, session_id);
+    const ssize_t res = tfs_wait(tfs_submit_read(fhandle, buffer, len));
+    TRACE_OPS(TRACE_RETURN, TFS_OP_CODE_READ, res);
+    return res;
 }
 
 int tfs_shutdown_after_all_closed() {
-    printf("shutdown %d\n", getpid());
-    char buffer[TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED] = {
-        TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED};
-    char *ptr = buffer;
+    TRACE_OPS(TRACE_CALL, TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED, session_id);
+    if (shared != NULL) {
+        shared_request_t request = {
+            .op_code = TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED};
+        return (int)shared_call(&request);
+    }
 
-    memcpy(ptr += sizeof(char), &session_id, sizeof(int));
+    const int request =
+        request_reserve(TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED, false, NULL,
+                        0);
+    if (request == -1) {
+        return -1;
+    }
 
-    R_FAIL_IF(try_pipe_write(fserver, buffer, SHUTDOWN_BUFFER_SZ) == -1,
-              E_REQUESTS_PIPE_WRITE, -1);
+    if (request_send(TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED, request, NULL,
+                     0) == -1) {
+        return -1;
+    }
 
-    int res;
-    R_FAIL_IF(try_read_all(fclient, &res, sizeof(int)) == -1,
-              E_CLIENT_PIPE_READ, -1);
+    const int res = (int)tfs_wait(request);
 
-    printf("shutdown done %d\n", getpid());
+    TRACE_OPS(TRACE_RETURN, TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED, res);
     return res;
 }
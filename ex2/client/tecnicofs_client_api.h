@@ -10,28 +10,46 @@
 #include <unistd.h>
 
 #define PIPEPATH_MAX_SIZE 40
+/* Requests submitted and not waited for yet a client may have (a power of
+ * two) */
+#define TFS_MAX_IN_FLIGHT 64
 /*
  * Establishes a session with a TecnicoFS server.
  * Input:
  * - client_pipe_path: pathname of a named pipe that will be used for
- *   the client to receive responses. This named pipe will be created (via
+ *   the client to receive responses. This named pipe, and the session's
+ *   request pipe (the same pathname followed by ".req"), will be created (via
  * 	 mkfifo) inside tfs_mount.
  * - server_pipe_path: pathname of the named pipe where the server is listening
- *   for client requests
+ *   for mount requests. If it is a Unix domain socket instead, the session is
+ *   a connection to it, which carries both requests and responses, and
+ *   client_pipe_path is not used.
  * When successful, the new session's identifier (session_id) was
  * saved internally by the client; also, the client process has
- * successfully opened both named pipes (one for reading, the other one for
- * writing, respectively).
+ * successfully opened both of the session's named pipes (one for reading, the
+ * other one for writing, respectively).
  *
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_mount(char const *client_pipe_path, char const *server_pipe_path);
 
+/*
+ * Establishes a session with a TecnicoFS server listening on a Unix domain
+ * socket, like tfs_mount, and then shares a memory region with the server:
+ * from then on, requests and their contents go through the region, which the
+ * file contents are written to and read from in place.
+ * Input:
+ * - server_socket_path: pathname of the server's socket
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mount_shared(char const *server_socket_path);
+
 /*
  * Ends the currently active session.
  * After notifying the server, both named pipes are closed by the client,
- * the client named pipe is deleted (via unlink) and the client's session_id is
- * set to none.
+ * the session's named pipes are deleted (via unlink) and the client's
+ * session_id is set to none.
  *
  * Returns 0 if successful, -1 otherwise.
  */
@@ -78,6 +96,54 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Submits a write to an open file, like tfs_write, without waiting for its
+ * result. The contents are sent by the time it returns, so the buffer may be
+ * reused right away. The requests of a session are carried out in the order
+ * they are submitted (or called).
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ *
+ * Returns the request's id, to wait for it with tfs_wait or tfs_poll, or -1
+ * in case of error (including having TFS_MAX_IN_FLIGHT requests not waited
+ * for yet).
+ */
+int tfs_submit_write(int fhandle, void const *buffer, size_t len);
+
+/* Submits a read from an open file, like tfs_read, without waiting for its
+ * result. The buffer must stay valid until the request completes.
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ *
+ * Returns the request's id, to wait for it with tfs_wait or tfs_poll, or -1
+ * in case of error.
+ */
+int tfs_submit_read(int fhandle, void *buffer, size_t len);
+
+/* Waits for a submitted request to complete.
+ * Input:
+ * 	- request id (obtained from tfs_submit_write or tfs_submit_read)
+ *
+ * Returns what tfs_write (or tfs_read) would have returned, or -1 in case of
+ * error. Afterwards, the request is no longer in flight.
+ */
+ssize_t tfs_wait(int request);
+
+/* Checks whether a submitted request completed, without blocking for the
+ * replies that haven't started to arrive.
+ * Input:
+ * 	- request id (obtained from tfs_submit_write or tfs_submit_read)
+ * 	- where to save its result
+ *
+ * Returns 1 if it completed, saving what tfs_write (or tfs_read) would have
+ * returned in result (and afterwards the request is no longer in flight), 0
+ * if it hasn't yet, or -1 in case of error.
+ */
+int tfs_poll(int request, ssize_t *result);
+
 /*
  * Orders TecnicoFS server to wait until no file is open and then shutdown
  * Returns 0 if successful, -1 otherwise.
@@ -3,5 +3,9 @@
 
 #define E_REQUESTS_PIPE_WRITE ("[ERR] Failed to write to requests pipe")
 #define E_CLIENT_PIPE_READ ("[ERR] Failed to read client pipe")
+#define E_SERVER_SOCKET_CONNECT ("[ERR] Failed to connect to server socket")
+#define E_SHARED_CREATE ("[ERR] Failed to create the shared region")
+#define E_TOO_MANY_REQUESTS ("[ERR] Too many requests not waited for")
+#define E_SHARED_FULL ("[ERR] Every shared request slot is in use")
 
 #endif /* TFS_CLIENT_ERRORS_H */
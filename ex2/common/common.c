@@ -80,6 +80,19 @@ int try_open(const char *pathname, int flags) {
     return -1;
 }
 
+/* Makes reads and writes on fd wait for the other end, or fail with EAGAIN
+ * instead.
+ * Returns: 0 if successful, -1 otherwise */
+int try_set_blocking(int fd, bool blocking) {
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL,
+                 blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
 ssize_t try_pipe_write(int fd, const void *buf, size_t count) {
     ssize_t rc = 0;
 
@@ -100,6 +113,21 @@ ssize_t try_pipe_write(int fd, const void *buf, size_t count) {
     return -1;
 }
 
+ssize_t try_write_all(int fd, const void *buf, size_t count) {
+    size_t bytes = 0;
+
+    while (bytes != count) {
+        const ssize_t rc =
+            try_pipe_write(fd, (const char *)buf + bytes, count - bytes);
+        if (rc == -1)
+            return -1;
+
+        bytes += (size_t)rc;
+    }
+
+    return (ssize_t)bytes;
+}
+
 int r_pipe_inform(int fd, int res) {
     if (try_pipe_write(fd, &res, sizeof(int)) == -1)
         return -1;
@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 /* tfs_open flags */
@@ -21,30 +22,92 @@ enum {
     TFS_OP_CODE_CLOSE = 4,
     TFS_OP_CODE_WRITE = 5,
     TFS_OP_CODE_READ = 6,
-    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7
+    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7,
+    TFS_OP_CODE_SHARE = 8
 };
 
-#define TFS_OP_CODE_AMOUNT 8
+#define TFS_OP_CODE_AMOUNT 9
 #define BLOCK_SIZE (1024)
 
 #define PATHNAME_MAX_SIZE sizeof(char[40])
-#define MOUNT_BUFFER_SZ (sizeof(char) + PATHNAME_MAX_SIZE)
-#define UNMOUNT_BUFFER_SZ (sizeof(char) + sizeof(int))
-#define OPEN_BUFFER_SZ                                                         \
-    (sizeof(char) + sizeof(int) + PATHNAME_MAX_SIZE + sizeof(int))
-#define CLOSE_BUFFER_SZ (sizeof(char) + sizeof(int) + sizeof(int))
-#define WRITE_BUFFER_SZ                                                        \
-    (sizeof(char) + sizeof(int) + sizeof(int) + sizeof(size_t) + BLOCK_SIZE)
-#define READ_BUFFER_SZ                                                         \
-    (sizeof(char) + sizeof(int) + sizeof(int) + sizeof(size_t))
-#define SHUTDOWN_BUFFER_SZ (sizeof(char) + sizeof(int))
+
+/* Version of the layout of the requests below: the server drops the requests
+ * of any other (and the sessions that send them) */
+#define TFS_PROTOCOL_VERSION (2)
+
+/*
+ * Header every request starts with, mounts included. Whatever the version,
+ * it starts with the version and the size of the body that follows, which
+ * the server checks against the op code's (the contents of a write come
+ * after the body, and aren't counted).
+ * The client may send requests before the replies to earlier ones arrive,
+ * which the server sends in the order of the requests, each starting with
+ * the request's id.
+ */
+typedef struct {
+    uint8_t version;
+    uint8_t op_code;
+    uint16_t size;
+    int32_t session_id; /* -1 for a mount */
+    int32_t request_id;
+} request_header_t;
+
+/* Bodies, of fixed size and layout (names must end in '\0'). Unmount,
+ * shutdown and share requests have none. */
+typedef struct {
+    char client_pipe[PATHNAME_MAX_SIZE];
+} mount_request_t;
+
+typedef struct {
+    char name[PATHNAME_MAX_SIZE];
+    int32_t flags;
+} open_request_t;
+
+typedef struct {
+    int32_t fhandle;
+} close_request_t;
+
+/* A write is followed by the len bytes of contents, of any length: the
+ * server writes them a chunk of up to WRITE_CHUNK_SIZE bytes at a time, as
+ * they arrive.
+ * The reply to a read is the contents in chunks of up to READ_CHUNK_SIZE
+ * bytes, each preceded by its (int) length, and then a length of 0 (or -1 if
+ * the read fails). */
+typedef struct {
+    int32_t fhandle;
+    uint32_t reserved; /* 0 */
+    uint64_t len;
+} rw_request_t;
+
+/* A share request is followed by a message of one byte carrying the shared
+ * region (see shared.h). The reply to it carries the region's two eventfds,
+ * which the server creates. */
+
+_Static_assert(sizeof(request_header_t) == 12 &&
+                   sizeof(mount_request_t) == 40 &&
+                   sizeof(open_request_t) == 44 &&
+                   sizeof(close_request_t) == 4 && sizeof(rw_request_t) == 16,
+               "requests must have the same layout on every build");
+
+#define REPLY_HEADER_SZ (sizeof(int32_t))
+
+#define WRITE_CHUNK_SIZE BLOCK_SIZE
+#define READ_CHUNK_SIZE BLOCK_SIZE
+
+/* Requests after the mount go through a pipe of the session's own, named
+ * after the client pipe */
+#define REQUEST_PIPE_SUFFIX ".req"
+#define REQUEST_PIPE_PATH_MAX_SIZE                                             \
+    (PATHNAME_MAX_SIZE + sizeof(REQUEST_PIPE_SUFFIX))
 
 void fail_exit_if(bool arg, const char *msg);
 int try_close(int fd);
 ssize_t try_read(int fd, void *buf, size_t sz);
 ssize_t try_read_all(int fd, void *buf, size_t sz);
 int try_open(const char *pathname, int flags);
+int try_set_blocking(int fd, bool blocking);
 ssize_t try_pipe_write(int fd, const void *buf, size_t count);
+ssize_t try_write_all(int fd, const void *buf, size_t count);
 int r_pipe_inform(int fd, int res);
 
 static inline int to_abort_not_recoverable() {
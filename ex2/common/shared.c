@@ -0,0 +1,233 @@
+/* memfd_create and file seals */
+#define _GNU_SOURCE
+
+#include "shared.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+shared_region_t *shared_region_create(int *fd) {
+    *fd = memfd_create("tfs_shared", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd == -1) {
+        return NULL;
+    }
+
+    /* Sealed so the size the other side checks can't change after */
+    shared_region_t *region = NULL;
+    if (ftruncate(*fd, sizeof(shared_region_t)) == 0 &&
+        fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) ==
+            0) {
+        region = shared_region_map(*fd);
+    }
+    if (region == NULL) {
+        try_close(*fd);
+        return NULL;
+    }
+
+    atomic_init(&region->requests.tail, 0);
+    atomic_init(&region->requests.head, 0);
+    atomic_init(&region->responses.tail, 0);
+    atomic_init(&region->responses.head, 0);
+    return region;
+}
+
+shared_region_t *shared_region_map(int fd) {
+    /* Touching a page the file no longer covers raises SIGBUS, so only a
+     * file that is big enough and can't shrink is mapped */
+    const int seals = fcntl(fd, F_GET_SEALS);
+    struct stat st;
+    if (seals == -1 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) == -1 ||
+        st.st_size < (off_t)sizeof(shared_region_t)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *region = mmap(NULL, sizeof(shared_region_t), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    return region == MAP_FAILED ? NULL : region;
+}
+
+void shared_region_unmap(shared_region_t *region) {
+    munmap(region, sizeof(shared_region_t));
+}
+
+shared_request_t *shared_request_slot(shared_region_t *region, void **data) {
+    const unsigned tail =
+        atomic_load_explicit(&region->requests.tail, memory_order_relaxed);
+    const unsigned freed =
+        atomic_load_explicit(&region->responses.head, memory_order_relaxed);
+
+    if (tail - freed == SHARED_SLOTS) {
+        return NULL;
+    }
+
+    *data = region->data[tail % SHARED_SLOTS];
+    return &region->request_slots[tail % SHARED_SLOTS];
+}
+
+void shared_request_post(shared_region_t *region) {
+    atomic_fetch_add_explicit(&region->requests.tail, 1,
+                              memory_order_release);
+}
+
+ssize_t *shared_response_peek(shared_region_t *region, void **data) {
+    const unsigned head =
+        atomic_load_explicit(&region->responses.head, memory_order_relaxed);
+
+    if (head ==
+        atomic_load_explicit(&region->responses.tail, memory_order_acquire)) {
+        return NULL;
+    }
+
+    *data = region->data[head % SHARED_SLOTS];
+    return &region->response_slots[head % SHARED_SLOTS];
+}
+
+void shared_response_pop(shared_region_t *region) {
+    atomic_fetch_add_explicit(&region->responses.head, 1,
+                              memory_order_release);
+}
+
+shared_request_t *shared_request_next(shared_region_t *region, void **data) {
+    const unsigned head =
+        atomic_load_explicit(&region->requests.head, memory_order_relaxed);
+
+    if (head ==
+        atomic_load_explicit(&region->requests.tail, memory_order_acquire)) {
+        return NULL;
+    }
+
+    *data = region->data[head % SHARED_SLOTS];
+    return &region->request_slots[head % SHARED_SLOTS];
+}
+
+void shared_respond(shared_region_t *region, ssize_t result) {
+    const unsigned head =
+        atomic_load_explicit(&region->requests.head, memory_order_relaxed);
+
+    region->response_slots[head % SHARED_SLOTS] = result;
+    atomic_store_explicit(&region->requests.head, head + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&region->responses.tail, head + 1,
+                          memory_order_release);
+}
+
+int shared_notify(int event_fd) {
+    const uint64_t one = 1;
+    return try_pipe_write(event_fd, &one, sizeof(one)) == sizeof(one) ? 0
+                                                                      : -1;
+}
+
+int shared_wait(int event_fd, int peer_fd) {
+    struct pollfd fds[2] = {{.fd = event_fd, .events = POLLIN},
+                            {.fd = peer_fd, .events = POLLIN}};
+
+    int rc;
+    do {
+        rc = poll(fds, 2, -1);
+    } while (rc == -1 && errno == EINTR);
+
+    /* A peer may answer and close right away: take the answer first */
+    if (rc == -1 || (fds[0].revents == 0 && fds[1].revents != 0)) {
+        return -1;
+    }
+
+    /* Reset the counter: the caller checks the ring before waiting again */
+    uint64_t count;
+    return try_read(event_fd, &count, sizeof(count)) == sizeof(count) ? 0
+                                                                      : -1;
+}
+
+ssize_t try_send_fds(int sock, const void *buf, size_t len, int const *fds,
+                     int count) {
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * 4)];
+    } control;
+
+    if (count > 4) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buffer,
+                         .msg_controllen =
+                             CMSG_SPACE(sizeof(int) * (size_t)count)};
+    /* The control buffer starts with the only header */
+    struct cmsghdr *const cmsg = &control.header;
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)count);
+
+    ssize_t rc;
+    do {
+        rc = sendmsg(sock, &msg, 0);
+    } while (rc == -1 && errno == EINTR);
+
+    return rc;
+}
+
+ssize_t try_recv_fds(int sock, void *buf, size_t len, int *fds, int *count) {
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * 4)];
+    } control;
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+    const int room = *count;
+    *count = 0;
+
+    ssize_t rc;
+    do {
+        rc = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while (rc == -1 && errno == EINTR);
+
+    if (rc == -1) {
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        const size_t passed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < passed; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*count == room) {
+                try_close(fd);
+            } else {
+                fds[(*count)++] = fd;
+            }
+        }
+    }
+
+    /* The descriptors only come with the first bytes */
+    if (rc > 0 && (size_t)rc < len) {
+        const ssize_t rest = try_read_all(sock, (char *)buf + rc,
+                                          len - (size_t)rc);
+        if (rest == -1) {
+            return -1;
+        }
+        rc += rest;
+    }
+    return rc;
+}
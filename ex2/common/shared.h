@@ -0,0 +1,96 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include "common.h"
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Memory region a client shares with the worker of its session (see
+ * tfs_mount_shared). Requests go through a ring of slots, each with room for
+ * the contents the request writes or reads, and their results come back in
+ * order through a second ring. Each side wakes the other up with an eventfd,
+ * both created by the server non-blocking, so that no client can keep a
+ * worker waiting to notify it.
+ */
+
+#define SHARED_SLOTS (8)
+#define SHARED_SLOT_DATA_SIZE (BLOCK_SIZE)
+
+/* Keeps the indexes each side writes in cache lines of their own */
+#define SHARED_CACHE_LINE_SIZE (64)
+
+typedef struct {
+    char op_code;
+    int fhandle;
+    int flags;
+    size_t len;
+    char name[PATHNAME_MAX_SIZE];
+} shared_request_t;
+
+/*
+ * Single producer single consumer ring: entry i is in slot i % SHARED_SLOTS
+ */
+typedef struct {
+    alignas(SHARED_CACHE_LINE_SIZE) atomic_uint tail; /* producer's */
+    alignas(SHARED_CACHE_LINE_SIZE) atomic_uint head; /* consumer's */
+} shared_ring_t;
+
+typedef struct {
+    shared_ring_t requests;
+    shared_ring_t responses;
+    shared_request_t request_slots[SHARED_SLOTS];
+    /* The response to request i is in the same slot */
+    ssize_t response_slots[SHARED_SLOTS];
+    alignas(SHARED_CACHE_LINE_SIZE) char data[SHARED_SLOTS]
+                                             [SHARED_SLOT_DATA_SIZE];
+} shared_region_t;
+
+/* Creates a region and maps it, saving its file descriptor in fd. The file
+ * is sealed at the size of the region.
+ * Returns: the region, NULL on failure */
+shared_region_t *shared_region_create(int *fd);
+/* Maps the region created by the other side, if its file is sealed against
+ * shrinking and holds a whole region.
+ * Returns: the region, NULL on failure */
+shared_region_t *shared_region_map(int fd);
+void shared_region_unmap(shared_region_t *region);
+
+/* Client side: the next free request slot, and its data in *data.
+ * Returns: the slot, NULL if every slot is waiting for its response */
+shared_request_t *shared_request_slot(shared_region_t *region, void **data);
+/* Client side: hands the request in the slot to the server. */
+void shared_request_post(shared_region_t *region);
+/* Client side: the result of the oldest request the server answered, and its
+ * data in *data.
+ * Returns: the result, NULL if there is none */
+ssize_t *shared_response_peek(shared_region_t *region, void **data);
+/* Client side: frees the slot of the oldest response. */
+void shared_response_pop(shared_region_t *region);
+
+/* Server side: the oldest request not answered yet, and its data in *data.
+ * Returns: the request, NULL if there is none */
+shared_request_t *shared_request_next(shared_region_t *region, void **data);
+/* Server side: answers the oldest request. */
+void shared_respond(shared_region_t *region, ssize_t result);
+
+/* Wakes up the other side, waiting on event_fd. */
+int shared_notify(int event_fd);
+/* Waits until event_fd is notified.
+ * Returns: 0 if it was, -1 if peer_fd was closed (or became readable, which
+ * the protocol doesn't allow while the region is in use) or on error */
+int shared_wait(int event_fd, int peer_fd);
+
+/* Sends buf along with count file descriptors over a Unix domain socket. */
+ssize_t try_send_fds(int sock, const void *buf, size_t len, int const *fds,
+                     int count);
+/* Receives len bytes into buf over a Unix domain socket, and the file
+ * descriptors that came with them into fds, which has room for *count of
+ * them (any more are closed). *count is set to how many there were.
+ * Returns: the bytes received, fewer at end of file, -1 on error */
+ssize_t try_recv_fds(int sock, void *buf, size_t len, int *fds, int *count);
+
+#endif /* SHARED_H */
@@ -0,0 +1,260 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct trace_buffer {
+    struct trace_buffer *next;
+    uint32_t thread;
+    /* Records ever appended: only its thread writes it */
+    atomic_uint_fast64_t count;
+    trace_record_t records[TRACE_BUFFER_RECORDS];
+} trace_buffer_t;
+
+/* The calling thread's buffer, made on its first record */
+static _Thread_local trace_buffer_t *own;
+/* Every buffer made, newest first. They are never freed, so that the records
+ * of threads that are gone are still dumped. */
+static _Atomic(trace_buffer_t *) buffers;
+static atomic_uint thread_count;
+static atomic_flag exit_hooked = ATOMIC_FLAG_INIT;
+
+/* Where the process dumps its records, worked out ahead of time since a
+ * signal handler can't */
+static char trace_path[256];
+
+/* A dump is under way, which copies each buffer to dump_copy first. A dump
+ * is only made with calls safe in a signal handler. */
+static atomic_flag dumping = ATOMIC_FLAG_INIT;
+static trace_record_t dump_copy[TRACE_BUFFER_RECORDS];
+
+/* Signals that dump the records: those that stop the process, which then
+ * dies of them as it would have, and TRACE_DUMP_SIGNAL, which doesn't */
+static const int dump_signals[] = {SIGINT, SIGTERM, TRACE_DUMP_SIGNAL};
+#define DUMP_SIGNALS ((int)(sizeof(dump_signals) / sizeof(dump_signals[0])))
+static struct sigaction previous_actions[DUMP_SIGNALS];
+
+static char const *const event_names[TRACE_EVENT_AMOUNT] = {
+    [TRACE_DECODED] = "decoded",
+    [TRACE_SERVE] = "serve",
+    [TRACE_SERVED] = "served",
+    [TRACE_MOUNT_ID] = "mount id",
+    [TRACE_MOUNT] = "mount",
+    [TRACE_MOUNTED] = "mounted",
+    [TRACE_SESSION_FREE] = "session free",
+    [TRACE_CALL] = "call",
+    [TRACE_RETURN] = "return",
+    [TRACE_MOUNT_REPLY] = "mount reply",
+    [TRACE_CHUNK] = "chunk",
+};
+
+char const *trace_event_name(uint32_t event) {
+    return event < TRACE_EVENT_AMOUNT ? event_names[event] : NULL;
+}
+
+static void trace_path_init(void) {
+    char const *const file = getenv(TRACE_FILE_ENV);
+    if (file != NULL) {
+        snprintf(trace_path, sizeof(trace_path), "%s", file);
+    } else {
+        snprintf(trace_path, sizeof(trace_path), TRACE_FILE_FORMAT,
+                 getpid());
+    }
+}
+
+static void trace_dump_at_exit(void) {
+    if (trace_dump(trace_path) == -1) {
+        fprintf(stderr, "[ERR]: could not write the trace to %s\n",
+                trace_path);
+    }
+}
+
+static void trace_dump_on_signal(int signum) {
+    const int saved_errno = errno;
+    trace_dump(trace_path);
+
+    /* Then whatever the signal did before (by default, stop the process),
+     * once this handler returns */
+    for (int i = 0; i < DUMP_SIGNALS; i++) {
+        if (dump_signals[i] == signum && signum != TRACE_DUMP_SIGNAL) {
+            sigaction(signum, &previous_actions[i], NULL);
+            raise(signum);
+        }
+    }
+    errno = saved_errno;
+}
+
+/* Dumps the records when the process gets one of dump_signals, unless it
+ * ignores it. */
+static void trace_hook_signals(void) {
+    struct sigaction action = {.sa_handler = trace_dump_on_signal,
+                               .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+
+    for (int i = 0; i < DUMP_SIGNALS; i++) {
+        if (sigaction(dump_signals[i], NULL, &previous_actions[i]) == 0 &&
+            previous_actions[i].sa_handler != SIG_IGN) {
+            sigaction(dump_signals[i], &action, NULL);
+        }
+    }
+}
+
+/* A forked child starts with no records: those it inherited are its
+ * parent's to dump. */
+static void trace_forget_at_fork(void) {
+    own = NULL;
+    atomic_store(&buffers, NULL);
+    atomic_store(&thread_count, 0);
+    atomic_flag_clear(&dumping);
+    trace_path_init();
+}
+
+static trace_buffer_t *trace_buffer(void) {
+    if (own != NULL) {
+        return own;
+    }
+
+    trace_buffer_t *const buffer = calloc(1, sizeof(trace_buffer_t));
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->thread = atomic_fetch_add(&thread_count, 1);
+    atomic_init(&buffer->count, 0);
+
+    if (!atomic_flag_test_and_set(&exit_hooked)) {
+        trace_path_init();
+        atexit(trace_dump_at_exit);
+        trace_hook_signals();
+        pthread_atfork(NULL, NULL, trace_forget_at_fork);
+    }
+
+    buffer->next = atomic_load_explicit(&buffers, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        &buffers, &buffer->next, buffer, memory_order_release,
+        memory_order_relaxed))
+        ;
+
+    own = buffer;
+    return buffer;
+}
+
+void trace_record(trace_event_t event, int64_t arg0, int64_t arg1) {
+    trace_buffer_t *const buffer = trace_buffer();
+    if (buffer == NULL) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const uint_fast64_t count =
+        atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    trace_record_t *const record =
+        &buffer->records[count % TRACE_BUFFER_RECORDS];
+    record->time =
+        (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    record->thread = buffer->thread;
+    record->event = (uint32_t)event;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+/* Writes size bytes of buf to fd, however many writes that takes.
+ * Returns: 0 if successful, -1 otherwise */
+static int trace_write(int fd, void const *buf, size_t size) {
+    for (size_t done = 0; done < size;) {
+        const ssize_t rc = write(fd, (char const *)buf + done, size - done);
+        if (rc == -1 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            return -1;
+        }
+        done += (size_t)rc;
+    }
+    return 0;
+}
+
+/* Writes the records of buffer, oldest first. Its thread may still be
+ * recording: the records it could have overwritten while they were copied
+ * are left out (with a full ring, the oldest always is).
+ * Returns: how many were written, -1 if it failed */
+static int64_t trace_dump_buffer(trace_buffer_t *buffer, int fd) {
+    const uint_fast64_t before =
+        atomic_load_explicit(&buffer->count, memory_order_acquire);
+    for (size_t i = 0; i < TRACE_BUFFER_RECORDS; i++) {
+        dump_copy[i] = buffer->records[i];
+    }
+    atomic_thread_fence(memory_order_acquire);
+    const uint_fast64_t after =
+        atomic_load_explicit(&buffer->count, memory_order_relaxed);
+
+    /* The records the thread may have written over by now, up to the one
+     * it may be in the middle of, are gone */
+    const uint_fast64_t first = after + 1 > TRACE_BUFFER_RECORDS
+                                    ? after + 1 - TRACE_BUFFER_RECORDS
+                                    : 0;
+
+    /* In at most two runs: up to the end of the ring, and from its start */
+    for (uint_fast64_t i = first; i < before;) {
+        const size_t start = (size_t)(i % TRACE_BUFFER_RECORDS);
+        const size_t run = TRACE_BUFFER_RECORDS - start < before - i
+                               ? TRACE_BUFFER_RECORDS - start
+                               : (size_t)(before - i);
+        if (trace_write(fd, &dump_copy[start], run * sizeof(trace_record_t)) ==
+            -1) {
+            return -1;
+        }
+        i += run;
+    }
+    return first < before ? (int64_t)(before - first) : 0;
+}
+
+int trace_dump(char const *pathname) {
+    /* Interrupting a dump with another, by a signal, would mix up their
+     * copies */
+    if (atomic_flag_test_and_set(&dumping)) {
+        return -1;
+    }
+
+    const int fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd == -1) {
+        atomic_flag_clear(&dumping);
+        return -1;
+    }
+
+    trace_file_header_t header = {.magic = TRACE_FILE_MAGIC,
+                                  .version = TRACE_FILE_VERSION};
+    int res = trace_write(fd, &header, sizeof(header));
+
+    for (trace_buffer_t *buffer =
+             atomic_load_explicit(&buffers, memory_order_acquire);
+         buffer != NULL && res == 0; buffer = buffer->next) {
+        const int64_t written = trace_dump_buffer(buffer, fd);
+        if (written == -1) {
+            res = -1;
+        } else {
+            header.record_count += (uint64_t)written;
+        }
+    }
+
+    /* Now that it's known how many records there are */
+    if (res == 0 && (lseek(fd, 0, SEEK_SET) != 0 ||
+                     trace_write(fd, &header, sizeof(header)) == -1)) {
+        res = -1;
+    }
+
+    if (close(fd) != 0) {
+        res = -1;
+    }
+    atomic_flag_clear(&dumping);
+    return res;
+}
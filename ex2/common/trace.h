@@ -0,0 +1,98 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <signal.h>
+#include <stdint.h>
+
+/*
+ * Tracing: each thread records what it does as fixed-size binary records in
+ * a ring buffer of its own, with no locks and no formatting. On exit, and
+ * when stopped by SIGINT or SIGTERM, the process writes every thread's
+ * records to a file, which tools/trace_dump prints in order of time. It
+ * writes them on TRACE_DUMP_SIGNAL too, and keeps going.
+ *
+ * The TRACE_* macros record only at the level the code is built with (make
+ * TRACE=1 or TRACE=2); below it they compile to nothing, and their arguments
+ * aren't evaluated.
+ */
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL (0)
+#endif
+
+/* Each request served, and each call of the client */
+#define TRACE_LEVEL_OPS (1)
+/* The steps in between: decoding, mounting, chunks read */
+#define TRACE_LEVEL_DETAIL (2)
+
+/* Records kept per thread: the newest overwrite the oldest */
+#define TRACE_BUFFER_RECORDS (4096)
+
+/* Where the records are written: $TFS_TRACE, else this with the pid */
+#define TRACE_FILE_ENV "TFS_TRACE"
+#define TRACE_FILE_FORMAT "/tmp/tfs_trace.%d"
+/* Asks a running process for its records so far */
+#define TRACE_DUMP_SIGNAL (SIGUSR1)
+
+#define TRACE_FILE_MAGIC (0x54465354u) /* "TFST" */
+#define TRACE_FILE_VERSION (1)
+
+typedef enum {
+    /* Server */
+    TRACE_DECODED,      /* op code, session */
+    TRACE_SERVE,        /* op code, session */
+    TRACE_SERVED,       /* op code, session */
+    TRACE_MOUNT_ID,     /* session */
+    TRACE_MOUNT,        /* session */
+    TRACE_MOUNTED,      /* session */
+    TRACE_SESSION_FREE, /* session */
+    /* Client */
+    TRACE_CALL,        /* op code, session */
+    TRACE_RETURN,      /* op code, result */
+    TRACE_MOUNT_REPLY, /* session (-1 if refused) */
+    TRACE_CHUNK,       /* request, length */
+    TRACE_EVENT_AMOUNT
+} trace_event_t;
+
+typedef struct {
+    uint64_t time; /* ns, CLOCK_MONOTONIC */
+    uint32_t thread;
+    uint32_t event;
+    int64_t args[2];
+} trace_record_t;
+
+/* Start of a trace file, followed by record_count records */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t record_count;
+} trace_file_header_t;
+
+/* Appends a record to the calling thread's buffer. */
+void trace_record(trace_event_t event, int64_t arg0, int64_t arg1);
+/* Writes the records of every thread to pathname, with only calls that are
+ * safe in a signal handler.
+ * Returns: 0 if successful, -1 otherwise (or if another dump is under
+ * way) */
+int trace_dump(char const *pathname);
+/* Returns: the name of event, NULL if there's none */
+char const *trace_event_name(uint32_t event);
+
+#define TRACE_RECORD_(event, arg0, arg1)                                      \
+    trace_record((event), (int64_t)(arg0), (int64_t)(arg1))
+#define TRACE_SKIP_(event, arg0, arg1)                                        \
+    ((void)sizeof(event), (void)sizeof(arg0), (void)sizeof(arg1))
+
+#if TRACE_LEVEL >= TRACE_LEVEL_OPS
+#define TRACE_OPS(event, arg0, arg1) TRACE_RECORD_(event, arg0, arg1)
+#else
+#define TRACE_OPS(event, arg0, arg1) TRACE_SKIP_(event, arg0, arg1)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DETAIL
+#define TRACE_DETAIL(event, arg0, arg1) TRACE_RECORD_(event, arg0, arg1)
+#else
+#define TRACE_DETAIL(event, arg0, arg1) TRACE_SKIP_(event, arg0, arg1)
+#endif
+
+#endif /* TRACE_H */
@@ -12,6 +12,9 @@
 
 #define DELAY (5000)
 
+/* Per-object locks are padded to this size to avoid false sharing */
+#define CACHE_LINE_SIZE (64)
+
 #define NORETURN __attribute__((noreturn))
 
 #endif // CONFIG_H
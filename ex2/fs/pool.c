@@ -0,0 +1,193 @@
+/* For syscall, which the futex has no other way to */
+#define _DEFAULT_SOURCE
+
+#include "pool.h"
+#include "config.h"
+#include "tfs_server_essential.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Queue of the sessions handed to a worker, lock free: any thread hands
+ * sessions to it and any worker takes them, the others when they run out of
+ * their own. Each slot counts which turn it's on (as in request_queue_t), so
+ * a session goes in with a compare and swap and a store, and comes out the
+ * same way. As a session is in at most one queue at a time, each holds them
+ * all.
+ */
+typedef struct {
+    atomic_uint turn;
+    size_t session_id;
+} pool_slot_t;
+
+typedef struct {
+    alignas(CACHE_LINE_SIZE) atomic_uint tail;
+    alignas(CACHE_LINE_SIZE) atomic_uint head;
+    pool_slot_t slots[S];
+} pool_queue_t;
+
+static pool_queue_t queues[POOL_MAX_WORKERS];
+static pthread_t workers[POOL_MAX_WORKERS];
+static int worker_count;
+static void (*serve_session)(size_t session_id);
+
+/* Idle workers sleep on a futex until there are sessions queued (a worker
+ * may take a session before it's counted, which leaves the count below 0 for
+ * a while). Handing a session over only makes a system call when some
+ * worker is asleep. */
+static alignas(CACHE_LINE_SIZE) atomic_int queued = 0;
+static alignas(CACHE_LINE_SIZE) atomic_int sleeping = 0;
+static atomic_uint next_queue = 0;
+
+/* Sleeps until woken up, unless *word no longer holds value */
+static void futex_wait(atomic_int *word, int value) {
+    const long rc =
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+    fail_exit_if(rc == -1 && errno != EAGAIN && errno != EINTR,
+                 E_PARK_WORKER);
+}
+
+static void futex_wake(atomic_int *word, int count) {
+    fail_exit_if(syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL,
+                         NULL, 0) == -1,
+                 E_WAKE_WORKER);
+}
+
+/* Slot i starts on turn i, for the session handed over at position i. Once
+ * filled it's on turn i + 1, for a worker to take, and once taken on turn
+ * i + S, for the next lap. */
+
+static void queue_push(pool_queue_t *queue, size_t session_id) {
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    while (true) {
+        pool_slot_t *const slot = &queue->slots[tail % S];
+        const unsigned turn =
+            atomic_load_explicit(&slot->turn, memory_order_acquire);
+
+        /* Behind (a worker still taking the session of the last lap out of
+         * it) only for as long as that takes, since the queue is never
+         * full; ahead if another thread claimed it first */
+        if (turn == tail &&
+            atomic_compare_exchange_weak_explicit(&queue->tail, &tail,
+                                                  tail + 1,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            slot->session_id = session_id;
+            atomic_store_explicit(&slot->turn, tail + 1,
+                                  memory_order_release);
+            return;
+        }
+        if (turn != tail) {
+            tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+}
+
+static bool queue_pop(pool_queue_t *queue, size_t *session_id) {
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    while (true) {
+        pool_slot_t *const slot = &queue->slots[head % S];
+        const unsigned turn =
+            atomic_load_explicit(&slot->turn, memory_order_acquire);
+        const int lag = (int)(turn - (head + 1));
+
+        if (lag < 0) {
+            /* Not filled yet: empty */
+            return false;
+        }
+
+        if (lag == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->head, &head, head + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                *session_id = slot->session_id;
+                atomic_store_explicit(&slot->turn, head + S,
+                                      memory_order_release);
+                return true;
+            }
+        } else {
+            /* Another worker took it first */
+            head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+}
+
+/* Takes the oldest session in the worker's queue or, if it's empty, in the
+ * queue of the next worker that has one. */
+static bool pool_take(int worker, size_t *session_id) {
+    for (int i = 0; i < worker_count; i++) {
+        if (queue_pop(&queues[(worker + i) % worker_count], session_id)) {
+            atomic_fetch_sub(&queued, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *pool_worker(void *arg) {
+    const int worker = (int)(size_t)arg;
+
+    while (true) {
+        size_t session_id;
+        if (pool_take(worker, &session_id)) {
+            serve_session(session_id);
+            continue;
+        }
+
+        /* Announce the nap before checking the count one last time: either
+         * a session handed over after that sees it, or the count changed
+         * and the futex doesn't sleep */
+        atomic_fetch_add(&sleeping, 1);
+        const int count = atomic_load(&queued);
+        if (count <= 0) {
+            futex_wait(&queued, count);
+        }
+        atomic_fetch_sub(&sleeping, 1);
+    }
+
+    return NULL;
+}
+
+int pool_init(void (*serve)(size_t session_id)) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    worker_count = cpus < POOL_MIN_WORKERS   ? POOL_MIN_WORKERS
+                   : cpus > POOL_MAX_WORKERS ? POOL_MAX_WORKERS
+                                             : (int)cpus;
+    serve_session = serve;
+
+    for (int i = 0; i < worker_count; i++) {
+        for (unsigned j = 0; j < S; j++) {
+            atomic_init(&queues[i].slots[j].turn, j);
+        }
+        atomic_init(&queues[i].tail, 0);
+        atomic_init(&queues[i].head, 0);
+    }
+
+    for (size_t i = 0; i < (size_t)worker_count; i++) {
+        fail_exit_if(
+            pthread_create(&workers[i], NULL, pool_worker, (void *)i),
+            E_INIT_WORKER);
+    }
+
+    return worker_count;
+}
+
+void pool_submit(size_t session_id) {
+    queue_push(
+        &queues[atomic_fetch_add(&next_queue, 1) % (unsigned)worker_count],
+        session_id);
+    atomic_fetch_add(&queued, 1);
+    if (atomic_load(&sleeping) > 0) {
+        futex_wake(&queued, 1);
+    }
+}
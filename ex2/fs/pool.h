@@ -0,0 +1,27 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * Pool of worker threads, one per CPU, serving the sessions handed to it.
+ * Each worker has a lock-free queue of its own, which sessions are handed
+ * out to in turn, and once it runs out takes sessions from the queues of the
+ * others: a busy session keeps a core busy, and an idle one keeps none.
+ * Handing a session over takes no lock.
+ * A session must not be handed over again until it has been served, which
+ * keeps its requests in order.
+ */
+
+/* At least two, so that a request blocked for another session (shutting down
+ * waits for every file to be closed) doesn't stop the server. */
+#define POOL_MIN_WORKERS (2)
+#define POOL_MAX_WORKERS (64)
+
+/* Starts the workers, which serve each session handed over with serve.
+ * Returns: how many were started */
+int pool_init(void (*serve)(size_t session_id));
+/* Hands the session to a worker. */
+void pool_submit(size_t session_id);
+
+#endif /* POOL_H */
@@ -0,0 +1,71 @@
+#include "request_queue.h"
+
+/* Slot i starts on turn i, for the producer of position i to fill. Once
+ * filled it's on turn i + 1, for the consumer, and once emptied on turn
+ * i + REQUEST_QUEUE_SIZE, for the producer of the next lap. */
+
+void request_queue_init(request_queue_t *queue) {
+    for (unsigned i = 0; i < REQUEST_QUEUE_SIZE; i++) {
+        atomic_init(&queue->slots[i].turn, i);
+    }
+    atomic_init(&queue->tail, 0);
+    queue->head = 0;
+}
+
+request_t *request_queue_reserve(request_queue_t *queue, unsigned *position) {
+    unsigned tail =
+        atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    while (true) {
+        request_slot_t *const slot =
+            &queue->slots[tail % REQUEST_QUEUE_SIZE];
+        const unsigned turn =
+            atomic_load_explicit(&slot->turn, memory_order_acquire);
+        const int lag = (int)(turn - tail);
+
+        if (lag < 0) {
+            /* The consumer hasn't emptied it since the last lap */
+            return NULL;
+        }
+
+        if (lag == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->tail, &tail, tail + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                *position = tail;
+                return &slot->request;
+            }
+        } else {
+            /* Another producer claimed it first */
+            tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+}
+
+void request_queue_publish(request_queue_t *queue, unsigned position) {
+    atomic_store_explicit(
+        &queue->slots[position % REQUEST_QUEUE_SIZE].turn, position + 1,
+        memory_order_release);
+}
+
+bool request_queue_pop(request_queue_t *queue, request_t *request) {
+    request_slot_t *const slot =
+        &queue->slots[queue->head % REQUEST_QUEUE_SIZE];
+
+    if (atomic_load_explicit(&slot->turn, memory_order_acquire) !=
+        queue->head + 1) {
+        return false;
+    }
+
+    *request = slot->request;
+    atomic_store_explicit(&slot->turn, queue->head + REQUEST_QUEUE_SIZE,
+                          memory_order_release);
+    queue->head++;
+    return true;
+}
+
+bool request_queue_empty(request_queue_t *queue) {
+    return atomic_load_explicit(
+               &queue->slots[queue->head % REQUEST_QUEUE_SIZE].turn,
+               memory_order_acquire) != queue->head + 1;
+}
@@ -0,0 +1,62 @@
+#ifndef REQUEST_QUEUE_H
+#define REQUEST_QUEUE_H
+
+#include "../common/common.h"
+#include "config.h"
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Bounded queue of the requests decoded for a session, lock free: any thread
+ * may add to it (the front end adds mounts, the session's worker the
+ * requests it reads), and only the worker serving the session takes from it.
+ * Each slot counts which turn it's on, so that a producer claims it with a
+ * single compare and swap and the consumer sees it filled with one load.
+ */
+
+/* Must be a power of two */
+#define REQUEST_QUEUE_SIZE (16)
+
+/*
+ * Request, decoded and checked: its header, and its body as header.op_code
+ * says (the contents of a write aren't queued, the worker reads them as
+ * they come from the session's channel)
+ */
+typedef struct {
+    request_header_t header;
+    union {
+        mount_request_t mount;
+        open_request_t open;
+        close_request_t close;
+        rw_request_t rw;
+    } body;
+} request_t;
+
+typedef struct {
+    atomic_uint turn;
+    request_t request;
+} request_slot_t;
+
+typedef struct {
+    alignas(CACHE_LINE_SIZE) atomic_uint tail; /* producers' */
+    alignas(CACHE_LINE_SIZE) unsigned head;    /* consumer's */
+    request_slot_t slots[REQUEST_QUEUE_SIZE];
+} request_queue_t;
+
+/* Empties the queue, which no one may be using. */
+void request_queue_init(request_queue_t *queue);
+/* Producer side: claims the next slot, to fill and then publish.
+ * Returns: the request to fill in, NULL if the queue is full */
+request_t *request_queue_reserve(request_queue_t *queue, unsigned *position);
+/* Producer side: hands the request in the slot claimed to the consumer. */
+void request_queue_publish(request_queue_t *queue, unsigned position);
+/* Consumer side: takes the oldest request out into request.
+ * Returns: true if there was one */
+bool request_queue_pop(request_queue_t *queue, request_t *request);
+/* Consumer side: whether there is a request to take */
+bool request_queue_empty(request_queue_t *queue);
+
+#endif /* REQUEST_QUEUE_H */
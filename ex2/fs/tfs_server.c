@@ -2,72 +2,78 @@
 #include "tecnicofs_client_api.h"
 #include "tfs_server_essential.h"
 #include "thread.h"
+#include "../common/trace.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 char *req_pipe_name;
 
 static inline int get_session_fd(size_t session_id) {
-    fail_exit_if(pthread_mutex_lock(&open_session_locks[session_id]),
+    fail_exit_if(pthread_mutex_lock(&sessions[session_id].lock),
                  E_LOCK_SESSION_TABLE_MUTEX);
-    int rc = open_session_table[session_id];
-    fail_exit_if(pthread_mutex_unlock(&open_session_locks[session_id]),
+    int rc = sessions[session_id].fd;
+    fail_exit_if(pthread_mutex_unlock(&sessions[session_id].lock),
                  E_UNLOCK_SESSION_TABLE_MUTEX);
     return rc;
 }
 
 static inline void set_session_fd(size_t session_id, int fd) {
-    fail_exit_if(pthread_mutex_lock(&open_session_locks[session_id]),
+    fail_exit_if(pthread_mutex_lock(&sessions[session_id].lock),
                  E_LOCK_SESSION_TABLE_MUTEX);
-    open_session_table[session_id] = fd;
-    fail_exit_if(pthread_mutex_unlock(&open_session_locks[session_id]),
+    sessions[session_id].fd = fd;
+    fail_exit_if(pthread_mutex_unlock(&sessions[session_id].lock),
                  E_UNLOCK_SESSION_TABLE_MUTEX);
 }
 
+/* Replies to the request being served with its result.
+ * Returns: 0 if the reply is on its way to the client, -1 otherwise (a
+ * result of -1 is an answer like any other, not a reason to drop the
+ * session) */
 static inline int r_pipe_inform_session(size_t session_id, int res) {
-    return r_pipe_inform(get_session_fd(session_id), res);
+    const int reply[2] = {sessions[session_id].request.header.request_id, res};
+    return thread_reply(session_id, reply, sizeof(reply));
 }
 
 void do_unmount(size_t session_id, bool inform) {
-    int fd = get_session_fd(session_id);
-    if (pthread_mutex_lock(&open_session_locks[session_id]) != 0) {
-        if (inform)
-            r_pipe_inform_session(session_id, -1);
-        perror(E_LOCK_SESSION_TABLE_MUTEX);
-        exit(EXIT_FAILURE);
+    /* The client is told before its channel goes, once it took in every
+     * reply: until then the session takes no more requests */
+    if (inform && r_pipe_inform_session(session_id, 0) == 0 &&
+        thread_replies_pending(session_id)) {
+        sessions[session_id].unmounting = true;
+        return;
     }
 
-    free_open_session_entries[session_id] = FREE;
-
-    fail_exit_if(pthread_mutex_unlock(&open_session_locks[session_id]),
-                 E_UNLOCK_SESSION_TABLE_MUTEX);
+    int fd = get_session_fd(session_id);
 
-    printf("Freeing session %lu\n", session_id);
-    if (inform) {
-        r_pipe_inform(fd, 0);
-    }
+    TRACE_DETAIL(TRACE_SESSION_FREE, session_id, 0);
 
     /* Unmount any files that may be open in case the client died, for example.
      */
-    if (open_files_amount[session_id] != 0) {
+    if (sessions[session_id].open_files_amount != 0) {
         for (size_t i = 0; i < MAX_OPEN_FILES; ++i) {
-            if (open_files[session_id][i] != -1) {
+            if (sessions[session_id].open_files[i] != -1) {
                 // fprintf(stderr, "Closing file %u\n",
-                // open_files[session_id][i]);
-                tfs_close(open_files[session_id][i]);
-                open_files[session_id][i] = -1;
-                --open_files_amount[session_id];
+                // sessions[session_id].open_files[i]);
+                tfs_close(sessions[session_id].open_files[i]);
+                sessions[session_id].open_files[i] = -1;
+                --sessions[session_id].open_files_amount;
             }
         }
     }
@@ -76,7 +82,30 @@ void do_unmount(size_t session_id, bool inform) {
      * if a
      * file descriptor goes unused. We'll just let it abort when the fd table is
      * full... */
+    thread_release_session(session_id);
+    if (sessions[session_id].shared != NULL) {
+        shared_region_unmap(sessions[session_id].shared);
+        try_close(sessions[session_id].request_event);
+        try_close(sessions[session_id].response_event);
+        sessions[session_id].shared = NULL;
+    }
+
     try_close(fd);
+    if (sessions[session_id].req_fd != -1 &&
+        sessions[session_id].req_fd != fd) {
+        try_close(sessions[session_id].req_fd);
+    }
+
+    /* Only now can the main thread hand the session to another client. */
+    fail_exit_if(pthread_mutex_lock(&sessions[session_id].lock),
+                 E_LOCK_SESSION_TABLE_MUTEX);
+
+    sessions[session_id].fd = -1;
+    sessions[session_id].req_fd = -1;
+    sessions[session_id].free = FREE;
+
+    fail_exit_if(pthread_mutex_unlock(&sessions[session_id].lock),
+                 E_UNLOCK_SESSION_TABLE_MUTEX);
 }
 
 static inline void fail_unmount(size_t session_id, const char *msg) {
@@ -84,73 +113,85 @@ static inline void fail_unmount(size_t session_id, const char *msg) {
     do_unmount(session_id, false);
 }
 
-static ssize_t try_pipe_write_session(size_t session_id, const void *buf,
-                                      size_t count) {
-    const int session = get_session_fd(session_id);
-
-    return try_pipe_write(session, buf, count);
-}
-
 static inline int unlock_session_mutex_fail_inform_pipe(int fd) {
     perror("[ERR] FATAL! Could not unlock a session mutex");
     r_pipe_inform(fd, -1);
     return to_abort_not_recoverable();
 }
 
-void server_mount_state(size_t session_id) {
-    char client_pipe_path[PATHNAME_MAX_SIZE + 1];
-
-    if (thread_read_data_cons(client_pipe_path, PATHNAME_MAX_SIZE,
-                              session_id) == -1) {
-        perror(E_READ_PROD_CONS);
+void server_mount_state(size_t session_id, mount_request_t const *request) {
+    /* A connection to the server socket is already the session's channel */
+    const int id = (int)session_id;
+    if (request == NULL) {
+        if (thread_reply(session_id, &id, sizeof(id)) == -1) {
+            do_unmount(session_id, false);
+        }
         return;
     }
 
-    client_pipe_path[PATHNAME_MAX_SIZE] = '\0';
+    char request_pipe_path[REQUEST_PIPE_PATH_MAX_SIZE];
+    snprintf(request_pipe_path, sizeof(request_pipe_path), "%s%s",
+             request->client_pipe, REQUEST_PIPE_SUFFIX);
+
+    /* Neither open waits for the client, which may never get to its end of
+     * either pipe: it opens its reply pipe before asking to mount, so if
+     * there's no reader the client is gone already (ENXIO), and the request
+     * pipe is opened before it has a writer. Its reads stay non-blocking, as
+     * a worker never waits for the rest of a request. */
+    int freq = try_open(request_pipe_path, O_RDONLY | O_NONBLOCK);
+    if (freq == -1) {
+        perror(E_OPEN_SESSION_PIPE);
+        do_unmount(session_id, false);
+        return;
+    }
+    sessions[session_id].req_fd = freq;
 
-    int fclient = try_open(client_pipe_path, O_WRONLY);
+    /* Nor is the reply pipe ever waited on: what the client doesn't take in
+     * right away waits in the session for it to */
+    int fclient = try_open(request->client_pipe, O_WRONLY | O_NONBLOCK);
     if (fclient == -1) {
         perror(E_OPEN_CLIENT_PIPE);
+        do_unmount(session_id, false);
         return;
     }
 
     /* Save the file descriptor. */
     set_session_fd(session_id, fclient);
 
-    if (r_pipe_inform(fclient, (int)session_id) == -1) {
-        do_unmount(session_id, 0);
-        return;
+    /* The client opens its end of the request pipe once it knows the
+     * session id. */
+    if (thread_reply(session_id, &id, sizeof(id)) == -1) {
+        do_unmount(session_id, false);
     }
 }
 
 void server_unmount_state(size_t session_id) { do_unmount(session_id, true); }
 
-void server_open_state(size_t session_id) {
-    char name[PIPEPATH_MAX_SIZE + 1];
+/* Remembers the files the session opens, to close them when it ends. */
+static void session_file_opened(size_t session_id, int fhandle) {
+    sessions[session_id].open_files_amount++;
 
-    if (thread_read_data_cons(name, PIPEPATH_MAX_SIZE, session_id) == -1) {
-        perror(E_READ_PROD_CONS);
-        if (r_pipe_inform_session(session_id, -1) == -1) {
-            do_unmount(session_id, 0);
-            return;
+    for (size_t i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (sessions[session_id].open_files[i] == -1) {
+            sessions[session_id].open_files[i] = fhandle;
+            break;
         }
-        return;
     }
+}
 
-    name[PIPEPATH_MAX_SIZE] = '\0';
-
-    int flags;
-    if (thread_read_data_cons(&flags, sizeof(int), session_id) == -1) {
-        perror(E_READ_PROD_CONS);
-        if (r_pipe_inform_session(session_id, -1) == -1) {
-            do_unmount(session_id, 0);
-            return;
+static void session_file_closed(size_t session_id, int fhandle) {
+    for (size_t i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (sessions[session_id].open_files[i] == fhandle) {
+            sessions[session_id].open_files[i] = -1;
+            sessions[session_id].open_files_amount--;
+            break;
         }
-        return;
     }
+}
 
+void server_open_state(size_t session_id, open_request_t const *request) {
     int fd;
-    if ((fd = tfs_open(name, flags)) == -1) {
+    if ((fd = tfs_open(request->name, request->flags)) == -1) {
         perror(E_TFS_OPEN);
         if (r_pipe_inform_session(session_id, -1) == -1) {
             do_unmount(session_id, 0);
@@ -159,12 +200,7 @@ void server_open_state(size_t session_id) {
         return;
     }
 
-    open_files_amount[session_id]++;
-
-    for (size_t i = 0; i < MAX_OPEN_FILES; ++i) {
-        if (open_files[session_id][i] == -1)
-            open_files[session_id][i] = fd;
-    }
+    session_file_opened(session_id, fd);
 
     if (r_pipe_inform_session(session_id, fd) == -1) {
         do_unmount(session_id, 0);
@@ -172,20 +208,11 @@ void server_open_state(size_t session_id) {
     }
 }
 
-void server_close_state(size_t session_id) {
-    int fhandle;
-
-    if (thread_read_data_cons(&fhandle, sizeof(int), session_id) == -1) {
-        perror(E_READ_PROD_CONS);
-        if (r_pipe_inform_session(session_id, -1) == -1) {
-            do_unmount(session_id, 0);
-            return;
-        }
-        return;
-    }
+void server_close_state(size_t session_id, close_request_t const *request) {
+    const int fhandle = request->fhandle;
 
     if (tfs_close(fhandle) == -1) {
-        perror(E_READ_PROD_CONS);
+        perror(E_TFS_CLOSE);
         if (r_pipe_inform_session(session_id, -1) == -1) {
             do_unmount(session_id, 0);
             return;
@@ -193,12 +220,7 @@ void server_close_state(size_t session_id) {
         return;
     }
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; ++i) {
-        if (open_files[session_id][i] == fhandle) {
-            open_files[session_id][i] = -1;
-            open_files_amount[session_id]--;
-        }
-    }
+    session_file_closed(session_id, fhandle);
 
     if (r_pipe_inform_session(session_id, 0) == -1) {
         do_unmount(session_id, 0);
@@ -206,92 +228,247 @@ void server_close_state(size_t session_id) {
     }
 }
 
-/* We are considering we only use the size provided by the teachers in the
- * filesystem. */
-/* Request is composed by result and file contents. */
-#define READ_BUFFERS_SIZE (sizeof(int) + BLOCK_SIZE)
-
-static char tfs_read_buffers[S][READ_BUFFERS_SIZE];
+/* A chunk of the reply to a read: its length, its contents and, for the last
+ * chunk, the 0 length that ends the reply, after the reply's header for the
+ * first chunk. */
+#define READ_BUFFERS_SIZE                                                      \
+    (REPLY_HEADER_SZ + sizeof(int) + READ_CHUNK_SIZE + sizeof(int))
+
+/* A buffer per worker, rather than per session */
+static _Thread_local char tfs_read_buffer[READ_BUFFERS_SIZE];
+
+void server_read_resume(size_t session_id) {
+    session_t *const session = &sessions[session_id];
+    const int fhandle = session->request.body.rw.fhandle;
+
+    char *const buffer = tfs_read_buffer + REPLY_HEADER_SZ;
+    memcpy(tfs_read_buffer, &session->request.header.request_id,
+           REPLY_HEADER_SZ);
+
+    /* Stream the contents a chunk at a time, as they are read, as long as
+     * the client takes them in: the rest waits for the session to be served
+     * again once it does. */
+    while (session->reading && !thread_replies_held(session_id)) {
+        const size_t len = session->read_left;
+        const size_t to_read = len < READ_CHUNK_SIZE ? len : READ_CHUNK_SIZE;
+        const ssize_t was_read =
+            to_read == 0 ? 0 : tfs_read(fhandle, buffer + sizeof(int), to_read);
+        const int chunk = (int)was_read;
+        size_t size = sizeof(int);
+
+        memcpy(buffer, &chunk, sizeof(int));
+        if (was_read > 0) {
+            size += (size_t)was_read;
+            session->read_left -= (size_t)was_read;
+
+            /* A short read is the end of the file */
+            if (session->read_left == 0 || (size_t)was_read < to_read) {
+                const int end = 0;
+                memcpy(buffer + size, &end, sizeof(int));
+                size += sizeof(int);
+                session->reading = false;
+            }
+        } else {
+            session->reading = false;
+        }
 
-void server_read_state(size_t session_id) {
-    int fhandle;
-    if (thread_read_data_cons(&fhandle, sizeof(int), session_id) == -1) {
-        perror(E_READ_PROD_CONS);
-        if (r_pipe_inform_session(session_id, -1) == -1) {
+        /* The first chunk goes with the reply's header */
+        const bool first = !session->read_started;
+        session->read_started = true;
+        if (thread_reply(session_id, first ? buffer - REPLY_HEADER_SZ : buffer,
+                         first ? REPLY_HEADER_SZ + size : size) == -1) {
             do_unmount(session_id, 0);
             return;
         }
-        return;
     }
+}
 
-    size_t len;
-    if (thread_read_data_cons(&len, sizeof(size_t), session_id) == -1) {
-        perror(E_READ_PROD_CONS);
-        if (r_pipe_inform_session(session_id, -1) == -1) {
+void server_read_state(size_t session_id, rw_request_t const *request) {
+    session_t *const session = &sessions[session_id];
+
+    session->reading = true;
+    session->read_left = (size_t)request->len;
+    session->read_started = false;
+    server_read_resume(session_id);
+}
+
+void server_write_resume(size_t session_id) {
+    session_t *const session = &sessions[session_id];
+    const int fhandle = session->request.body.rw.fhandle;
+
+    /* The contents follow the request: write them a chunk at a time, as they
+     * arrive, and once the file can't take any more just drain the rest. A
+     * chunk not all there yet is waited for by serving the session again. */
+    while (session->write_left > 0) {
+        const size_t chunk = session->write_left < WRITE_CHUNK_SIZE
+                                 ? session->write_left
+                                 : WRITE_CHUNK_SIZE;
+        const int rc = thread_input_fill(session_id, chunk);
+        if (rc == 0) {
+            return;
+        }
+        if (rc == -1) {
+            perror(E_INVALID_REQUEST);
             do_unmount(session_id, 0);
             return;
         }
-        return;
-    }
-
-    char *const buffer = tfs_read_buffers[session_id];
 
-    const unsigned was_read =
-        (unsigned)tfs_read(fhandle, buffer + sizeof(int), len);
+        char const *const contents = session->input + session->input_start;
+        session->input_start += chunk;
+        session->write_left -= chunk;
+        if (session->write_full) {
+            continue;
+        }
 
-    memcpy(buffer, &was_read, sizeof(unsigned));
+        const ssize_t was_written = tfs_write(fhandle, contents, chunk);
+        if (was_written == -1) {
+            session->written = session->written > 0 ? session->written : -1;
+            session->write_full = true;
+        } else {
+            session->written += was_written;
+            session->write_full = (size_t)was_written < chunk;
+        }
+    }
 
-    printf("str rd: %s\n", buffer + sizeof(unsigned));
-    if (try_pipe_write_session(session_id, buffer,
-                               was_read + sizeof(unsigned)) == -1) {
+    session->writing = false;
+    if (r_pipe_inform_session(session_id, session->written > INT_MAX
+                                              ? INT_MAX
+                                              : (int)session->written) ==
+        -1) {
         do_unmount(session_id, 0);
         return;
     }
 }
 
-/* We are considering we only use the size provided by the teachers in the
- * filesystem. */
-#define WRITE_BUFFERS_SIZE (BLOCK_SIZE)
+void server_write_state(size_t session_id, rw_request_t const *request) {
+    session_t *const session = &sessions[session_id];
 
-static char tfs_write_buffers[S][BLOCK_SIZE];
+    session->writing = true;
+    session->write_left = (size_t)request->len;
+    session->written = 0;
+    session->write_full = false;
+    server_write_resume(session_id);
+}
 
-void server_write_state(size_t session_id) {
-    int fhandle;
-    if (thread_read_data_cons(&fhandle, sizeof(int), session_id) == -1) {
-        perror(E_READ_PROD_CONS);
-        if (r_pipe_inform_session(session_id, -1) == -1) {
-            do_unmount(session_id, 0);
-            return;
-        }
+void server_share_state(size_t session_id) {
+    session_t *const session = &sessions[session_id];
+    int region_fd;
+
+    /* Only a connection to the server socket can carry the region, which
+     * comes with the byte right after the request. The reply carries
+     * descriptors, which can't wait in the session: the client took in every
+     * reply before sharing. */
+    if (session->req_fd != session->fd || session->shared != NULL ||
+        thread_replies_pending(session_id) ||
+        thread_input_fill(session_id, 1) != 1 ||
+        thread_take_fds(session_id, &region_fd, 1) == -1) {
+        perror(E_INVALID_REQUEST);
+        do_unmount(session_id, false);
         return;
     }
-
-    size_t len;
-    if (thread_read_data_cons(&len, sizeof(size_t), session_id) == -1) {
-        perror(E_READ_PROD_CONS);
+    session->input_start++;
+
+    /* The events are the server's own, which never wait to be notified: a
+     * client that lets one fill up is dropped (see server_shared_state) */
+    int events[2] = {eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                     eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)};
+    shared_region_t *const region =
+        events[0] == -1 || events[1] == -1 ? NULL
+                                           : shared_region_map(region_fd);
+    try_close(region_fd);
+    if (region == NULL) {
+        perror(E_MAP_SHARED);
+        for (int i = 0; i < 2; i++) {
+            if (events[i] != -1) {
+                try_close(events[i]);
+            }
+        }
         if (r_pipe_inform_session(session_id, -1) == -1) {
-            do_unmount(session_id, 0);
-            return;
+            do_unmount(session_id, false);
         }
         return;
     }
 
-    char *const buffer = tfs_write_buffers[session_id];
-    if (thread_read_data_cons(buffer, len, session_id) == -1) {
-        perror(E_READ_PROD_CONS);
-        if (r_pipe_inform_session(session_id, -1) == -1) {
-            do_unmount(session_id, 0);
-            return;
-        }
-        return;
+    session->shared = region;
+    session->request_event = events[0];
+    session->response_event = events[1];
+
+    /* The client gets the events with the reply, and keeps them open once
+     * they're sent */
+    const int reply[2] = {session->request.header.request_id, 0};
+    if (try_send_fds(session->fd, reply, sizeof(reply), events, 2) !=
+        sizeof(reply)) {
+        do_unmount(session_id, false);
     }
+}
 
-    const int was_written = (int)tfs_write(fhandle, buffer, len);
+/* Serves a request posted in the session's shared region, whose contents are
+ * written and read in place in data. */
+void server_shared_state(size_t session_id, shared_request_t const *slot,
+                         void *data) {
+    session_t *const session = &sessions[session_id];
+    /* The client can write the slot at any time: everything is checked and
+     * used from a copy, which the compiler must not read the slot again for */
+    shared_request_t request_copy;
+    memcpy(&request_copy, slot, sizeof(request_copy));
+    atomic_signal_fence(memory_order_seq_cst);
+    shared_request_t const *const request = &request_copy;
+    const char op_code = request->op_code;
+    ssize_t result = -1;
+
+    switch (op_code) {
+    case TFS_OP_CODE_OPEN: {
+        char name[PATHNAME_MAX_SIZE + 1];
+        memcpy(name, request->name, PATHNAME_MAX_SIZE);
+        name[PATHNAME_MAX_SIZE] = '\0';
+
+        if ((result = tfs_open(name, request->flags)) != -1) {
+            session_file_opened(session_id, (int)result);
+        }
+        break;
+    }
+    case TFS_OP_CODE_CLOSE:
+        if ((result = tfs_close(request->fhandle)) != -1) {
+            session_file_closed(session_id, request->fhandle);
+        }
+        break;
+    /* Larger requests come in a request per slot */
+    case TFS_OP_CODE_WRITE:
+        if (request->len <= SHARED_SLOT_DATA_SIZE) {
+            result = tfs_write(request->fhandle, data, request->len);
+        }
+        break;
+    case TFS_OP_CODE_READ:
+        if (request->len <= SHARED_SLOT_DATA_SIZE) {
+            result = tfs_read(request->fhandle, data, request->len);
+        }
+        break;
+    case TFS_OP_CODE_UNMOUNT:
+        result = 0;
+        break;
+    case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
+        result = tfs_destroy_after_all_closed();
+        break;
+    case TFS_OP_CODE_NO_OP:
+    case TFS_OP_CODE_MOUNT:
+    case TFS_OP_CODE_SHARE:
+    default:
+        perror(E_INVALID_REQUEST);
+        break;
+    }
 
-    if (r_pipe_inform_session(session_id, was_written) == -1) {
-        do_unmount(session_id, 0);
+    shared_respond(session->shared, result);
+    if (shared_notify(session->response_event) == -1 ||
+        op_code == TFS_OP_CODE_UNMOUNT) {
+        do_unmount(session_id, false);
         return;
     }
+
+    if (op_code == TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED) {
+        unlink(req_pipe_name);
+        puts("OYASUMI!~");
+        exit(EXIT_SUCCESS);
+    }
 }
 
 void server_shutdown_after_all_closed_state(size_t session_id) {
@@ -301,14 +478,40 @@ void server_shutdown_after_all_closed_state(size_t session_id) {
     exit(EXIT_SUCCESS);
 }
 
+/* Listens on a Unix domain socket at pathname. */
+static int listen_socket(char const *pathname) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(pathname) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, pathname);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, S) != 0) {
+        try_close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
         printf("Please specify the pathname of the server's pipe.\n");
+        printf("Usage: %s <pathname> [fifo|socket]\n", argv[0]);
         return 1;
     }
 
     char *const pipename = argv[1];
-    printf("Starting TecnicoFS server with pipe called %s\n", pipename);
+    const bool use_socket = argc > 2 && strcmp(argv[2], "socket") == 0;
+    printf("Starting TecnicoFS server with %s called %s\n",
+           use_socket ? "socket" : "pipe", pipename);
 
     // create server pipe
     if (unlink(pipename) != 0 && errno != ENOENT) {
@@ -316,23 +519,51 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    fail_exit_if(mkfifo(pipename, 0640) != 0, E_MKFIFO);
-
-    /* Open pipename in the server so that clients can connect. */
-    fail_exit_if((req_pipe = try_open(pipename, O_RDONLY)) == -1,
-                 E_OPEN_REQUESTS_PIPE);
+    /* The front end never waits on a client: it reads what the server pipe
+     * holds, or accepts a connection, only once epoll reports it there */
+    if (use_socket) {
+        fail_exit_if((req_pipe = listen_socket(pipename)) == -1 ||
+                         try_set_blocking(req_pipe, false) == -1,
+                     E_SOCKET);
+    } else {
+        fail_exit_if(mkfifo(pipename, 0640) != 0, E_MKFIFO);
+
+        /* Open pipename in the server so that clients can connect. */
+        fail_exit_if((req_pipe = try_open(pipename, O_RDONLY | O_NONBLOCK)) ==
+                         -1,
+                     E_OPEN_REQUESTS_PIPE);
+
+        /* Clients close the pipe as soon as they are mounted: keep a writer
+         * of our own so that reads find nothing (EAGAIN) instead of seeing
+         * end of file. */
+        fail_exit_if(try_open(pipename, O_WRONLY) == -1,
+                     E_OPEN_REQUESTS_PIPE);
+    }
 
     fail_exit_if(tfs_init() == -1, "[ERR]: couldn't initialize file system");
 
     signal(SIGPIPE, SIG_IGN);
 
+    /* A session takes up to four descriptors: two pipes, or a connection and
+     * its shared region's two events */
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 &&
+        files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
     req_pipe_name = pipename;
 
     init_threads();
 
     puts("OHAYO!~");
 
-    main_thread_work();
+    if (use_socket) {
+        main_thread_accept();
+    } else {
+        main_thread_work();
+    }
 
     fini_threads();
 
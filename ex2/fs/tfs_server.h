@@ -1,13 +1,18 @@
 #ifndef TFS_SERVER_H
 #define TFS_SERVER_H
 
-void do_unmount(int session_id, bool inform);
-void server_mount_state(size_t session_id);
+void do_unmount(size_t session_id, bool inform);
+void server_mount_state(size_t session_id, mount_request_t const *request);
 void server_unmount_state(size_t session_id);
-void server_open_state(size_t session_id);
-void server_close_state(size_t session_id);
-void server_read_state(size_t session_id);
-void server_write_state(size_t session_id);
+void server_open_state(size_t session_id, open_request_t const *request);
+void server_close_state(size_t session_id, close_request_t const *request);
+void server_read_state(size_t session_id, rw_request_t const *request);
+void server_read_resume(size_t session_id);
+void server_write_state(size_t session_id, rw_request_t const *request);
+void server_write_resume(size_t session_id);
 void server_shutdown_after_all_closed_state(size_t session_id);
+void server_share_state(size_t session_id);
+void server_shared_state(size_t session_id, shared_request_t const *slot,
+                         void *data);
 
 #endif /*TFS_SERVER_H*/
@@ -5,7 +5,8 @@
 
 #include "../common/common.h"
 
-#define S 20
+/* Sessions the server takes at a time (a power of two) */
+#define S 1024
 #define FREE 1
 #define TAKEN 0
 
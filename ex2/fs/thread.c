@@ -3,387 +3,963 @@
 #include "tfs_server.h"
 #include "tfs_server_essential.h"
 
+#include "../common/trace.h"
+#include "pool.h"
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 int req_pipe;
 
-unsigned char free_open_session_entries[S];
-int open_session_table[S];
-pthread_mutex_t open_session_locks[S];
+session_t sessions[S];
 
-static pthread_t threads[S];
-static pthread_mutex_t threads_mutex[S];
-static pthread_cond_t threads_cond[S];
+/* The front end's epoll instance: the server pipe (or socket), and the
+ * channels of every mounted session. A session's channels are one-shot: once
+ * they report an event they stay quiet until its worker re-arms them. */
+static int front_epoll = -1;
 
-static prod_cons_t prod_cons[S];
+/* Size of the body of the requests with each op code */
+static const size_t body_sizes[TFS_OP_CODE_AMOUNT] = {
+    0,
+    sizeof(mount_request_t),
+    0,
+    sizeof(open_request_t),
+    sizeof(close_request_t),
+    sizeof(rw_request_t),
+    sizeof(rw_request_t),
+    0,
+    0};
+
+/* Whether the header is of a request this server knows, with the body its
+ * op code calls for */
+static bool thread_header_valid(request_header_t const *header) {
+    return header->version == TFS_PROTOCOL_VERSION &&
+           header->op_code > TFS_OP_CODE_NO_OP &&
+           header->op_code < TFS_OP_CODE_AMOUNT &&
+           header->size == body_sizes[header->op_code];
+}
 
-int open_files[S][MAX_OPEN_FILES];
-size_t open_files_amount[S] = {0};
+/* Whether the body of a request read whole is well formed, so that serving
+ * it needs no more checks than the file system's own */
+static bool thread_body_valid(request_t const *request) {
+    switch (request->header.op_code) {
+    case TFS_OP_CODE_MOUNT:
+        return memchr(request->body.mount.client_pipe, '\0',
+                      PATHNAME_MAX_SIZE) != NULL;
+    case TFS_OP_CODE_OPEN:
+        return memchr(request->body.open.name, '\0', PATHNAME_MAX_SIZE) !=
+               NULL;
+    case TFS_OP_CODE_WRITE:
+    case TFS_OP_CODE_READ:
+        return request->body.rw.reserved == 0 &&
+               request->body.rw.len <= SSIZE_MAX;
+    default:
+        return true;
+    }
+}
 
-ssize_t thread_read_data_cons(void *dest, size_t n, size_t session_id) {
-    prod_cons_t *const cur_pc = &prod_cons[session_id];
+#define R_FAIL_IF(arg, msg, err)                                               \
+    do {                                                                       \
+        if (arg) {                                                             \
+            perror(msg);                                                       \
+            return err;                                                        \
+        }                                                                      \
+    } while (0)
 
-    printf("Locking prodcons... %lu\n", session_id);
-    fail_exit_if(pthread_mutex_lock(&cur_pc->mutex), E_LOCK_PROD_CONS_MUTEX);
-    printf("Working prodcons... %lu\n", session_id);
+/* Queues a mount request read whole from the server pipe, header and body,
+ * in the session's queue.
+ * Returns 0 if successful, -1 if the request is malformed. */
+static int thread_queue_mount(size_t session_id,
+                              request_header_t const *header,
+                              void const *body) {
+    request_queue_t *const queue = &sessions[session_id].requests;
+    unsigned position;
+    request_t *const request = request_queue_reserve(queue, &position);
+
+    /* A session is mounted with nothing else in its queue */
+    fail_exit_if(request == NULL, E_INVALID_REQUEST);
+
+    request->header = *header;
+    memcpy(&request->body, body, header->size);
+    if (!thread_body_valid(request)) {
+        perror(E_INVALID_REQUEST);
+        request_queue_init(queue);
+        return -1;
+    }
 
-    char *const upper = cur_pc->cons_ptr + (n / sizeof(char));
+    TRACE_DETAIL(TRACE_DECODED, header->op_code, session_id);
+    request_queue_publish(queue, position);
+    return 0;
+}
 
-    if (upper > cur_pc->prod_ptr) {
-        fail_exit_if(pthread_mutex_unlock(&cur_pc->mutex),
-                     E_UNLOCK_PROD_CONS_MUTEX);
+/* Receives what the client sent on the session's channel so far, without
+ * waiting for it to send anything, and keeps the descriptors that came
+ * along.
+ * Returns: the bytes received, 0 at end of file, -1 on error (EAGAIN if
+ * there was nothing to receive) */
+static ssize_t thread_receive(session_t *session, void *buf, size_t len) {
+    /* Only a connection to the server socket carries descriptors. Neither
+     * it nor a request pipe ever waits: both are non-blocking. */
+    if (session->req_fd != session->fd) {
+        return try_read(session->req_fd, buf, len);
+    }
 
-        return -1;
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * SESSION_PASSED_FDS)];
+    } control;
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buffer,
+                         .msg_controllen = sizeof(control.buffer)};
+
+    ssize_t rc;
+    do {
+        rc = recvmsg(session->req_fd, &msg, MSG_DONTWAIT);
+    } while (rc == -1 && errno == EINTR);
+
+    if (rc <= 0) {
+        return rc;
     }
 
-    memcpy(dest, (void *)cur_pc->cons_ptr, n);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
 
-    cur_pc->cons_ptr = upper;
+        const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            /* Nothing takes more than a share request carries */
+            if (session->passed_count == SESSION_PASSED_FDS) {
+                try_close(fd);
+            } else {
+                session->passed_fds[session->passed_count++] = fd;
+            }
+        }
+    }
 
-    fail_exit_if(pthread_mutex_unlock(&cur_pc->mutex),
-                 E_UNLOCK_PROD_CONS_MUTEX);
+    return rc;
+}
 
-    return (ssize_t)n;
+/* Takes in everything the client sent on the session's channel so far,
+ * however many requests that is, so that a busy session costs one read for a
+ * batch of requests. What's left of the input moves to its start first.
+ * Returns: the bytes taken in, 0 at end of file, -1 on error (EAGAIN if
+ * there was nothing to take in) */
+static ssize_t thread_take_in(session_t *session) {
+    const size_t held = session->input_end - session->input_start;
+    memmove(session->input, session->input + session->input_start, held);
+    session->input_start = 0;
+    session->input_end = held;
+
+    const ssize_t rc = thread_receive(session, session->input + held,
+                                      SESSION_INPUT_SIZE - held);
+    if (rc > 0) {
+        session->input_end += (size_t)rc;
+    }
+    return rc;
 }
 
-/* OP_CODE and session ID. */
-#define IPC_ALREADY_READ (sizeof(char) + sizeof(int))
-static size_t ipc_sizes[TFS_OP_CODE_AMOUNT] = {
-    0,
-    MOUNT_BUFFER_SZ - sizeof(char),
-    UNMOUNT_BUFFER_SZ - IPC_ALREADY_READ,
-    OPEN_BUFFER_SZ - IPC_ALREADY_READ,
-    CLOSE_BUFFER_SZ - IPC_ALREADY_READ,
-    WRITE_BUFFER_SZ - IPC_ALREADY_READ,
-    READ_BUFFER_SZ - IPC_ALREADY_READ,
-    SHUTDOWN_BUFFER_SZ - IPC_ALREADY_READ};
-#undef IPC_ALREADY_READ
+/* Makes the session's input hold its next n bytes (at most
+ * SESSION_INPUT_SIZE), taking in what the client sent so far, but never
+ * waiting for the rest: the session is served again once more arrives.
+ * Returns: 1 if it does, 0 if they're still to come, -1 if the client is
+ * gone or the channel fails */
+int thread_input_fill(size_t session_id, size_t n) {
+    session_t *const session = &sessions[session_id];
+
+    while (session->input_end - session->input_start < n) {
+        const ssize_t rc = thread_take_in(session);
+        if (rc == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        if (rc <= 0) {
+            return -1;
+        }
+    }
 
-#define R_FAIL_IF(arg, msg, err)                                               \
-    do {                                                                       \
-        if (arg) {                                                             \
-            perror(msg);                                                       \
-            return err;                                                        \
-        }                                                                      \
-    } while (0)
+    return 1;
+}
 
-void thread_worker_schedule_prod(size_t session_id, char op_code) {
-    printf("OP Code: %hhd Session: %lu\n", op_code, session_id);
-    prod_cons_t *const cur_pc = &prod_cons[session_id];
+/* Takes count of the descriptors that came with the session's requests.
+ * Returns: 0 if there were exactly count, -1 otherwise (closing them) */
+int thread_take_fds(size_t session_id, int *fds, int count) {
+    session_t *const session = &sessions[session_id];
+    const int passed = session->passed_count;
 
-    fail_exit_if(pthread_mutex_lock(&cur_pc->mutex), E_LOCK_PROD_CONS_MUTEX);
+    session->passed_count = 0;
+    if (passed != count) {
+        for (int i = 0; i < passed; i++) {
+            try_close(session->passed_fds[i]);
+        }
+        return -1;
+    }
 
-    /* Reset prod_ptr */
-    cur_pc->prod_ptr = cur_pc->cons_ptr = cur_pc->buffer;
+    memcpy(fds, session->passed_fds, sizeof(int) * (size_t)count);
+    return 0;
+}
 
-    /* Save op_code at start and the info that has yet to be analyzed after. */
-    *cur_pc->prod_ptr++ = op_code;
+/* Sends what the session's channel takes of buf without waiting for the
+ * client to read.
+ * Returns: the bytes sent, -1 if the client is gone */
+static ssize_t thread_send(session_t const *session, void const *buf,
+                           size_t len) {
+    ssize_t rc;
+    do {
+        rc = write(session->fd, buf, len);
+    } while (rc == -1 && errno == EINTR);
+
+    if (rc == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    if (rc == -1) {
+        perror(errno == EPIPE ? E_SIGPIPE_CLIENT_PIPE : E_WRITE_CLIENT_PIPE);
+    }
+    return rc;
+}
 
-    if (op_code == TFS_OP_CODE_UNMOUNT) {
-        fail_exit_if(pthread_mutex_unlock(&cur_pc->mutex),
-                     E_UNLOCK_PROD_CONS_MUTEX);
-        return;
+/* Sends the replies the session holds, as far as the channel takes them.
+ * Returns: 0 if successful (whether or not some are still held), -1 if the
+ * client is gone */
+static int thread_flush(session_t *session) {
+    if (session->output_start == session->output_end) {
+        return 0;
     }
 
-    /* Read all the request and save in the thread buffer. */
-    ssize_t amount;
+    const ssize_t rc =
+        thread_send(session, session->output + session->output_start,
+                    session->output_end - session->output_start);
+    if (rc == -1) {
+        return -1;
+    }
 
-    size_t sz = ipc_sizes[(int)op_code];
-    if (op_code == TFS_OP_CODE_WRITE) {
-        if ((amount = try_read_all(req_pipe, cur_pc->prod_ptr,
-                                   sz - BLOCK_SIZE)) != sz - BLOCK_SIZE) {
-            fail_exit_if(pthread_mutex_unlock(&cur_pc->mutex),
-                         E_UNLOCK_PROD_CONS_MUTEX);
-            fail_exit_if(amount == -1, E_READ_REQUESTS_PIPE);
-            perror(E_INVALID_REQUEST);
-            exit(EXIT_FAILURE);
-        }
-        cur_pc->prod_ptr += ((size_t)amount / sizeof(char));
-        memcpy(&sz, cur_pc->prod_ptr - sizeof(size_t), sizeof(size_t));
-        if ((amount = try_read_all(req_pipe, cur_pc->prod_ptr, sz)) != sz) {
-            fail_exit_if(pthread_mutex_unlock(&cur_pc->mutex),
-                         E_UNLOCK_PROD_CONS_MUTEX);
-            fail_exit_if(amount == -1, E_READ_REQUESTS_PIPE);
-            perror(E_INVALID_REQUEST);
-            exit(EXIT_FAILURE);
+    session->output_start += (size_t)rc;
+    if (session->output_start == session->output_end) {
+        session->output_start = session->output_end = 0;
+    }
+    return 0;
+}
+
+/* Replies to the session's client with len bytes of buf (at most
+ * SESSION_REPLY_MAX). What the channel doesn't take right away, or comes
+ * after replies still held, is held to send once the client reads: a worker
+ * never waits for a client.
+ * Returns: 0 if successful, -1 if the client is gone */
+int thread_reply(size_t session_id, void const *buf, size_t len) {
+    session_t *const session = &sessions[session_id];
+    size_t sent = 0;
+
+    if (session->output_start == session->output_end) {
+        const ssize_t rc = thread_send(session, buf, len);
+        if (rc == -1) {
+            return -1;
         }
+        sent = (size_t)rc;
+    }
+    if (sent == len) {
+        return 0;
+    }
 
-        fail_exit_if(amount == -1, E_READ_REQUESTS_PIPE);
-        cur_pc->prod_ptr += ((size_t)amount / sizeof(char));
+    /* A session is only served while its replies have room for another */
+    if (session->output_end + (len - sent) > SESSION_OUTPUT_SIZE) {
+        const size_t held = session->output_end - session->output_start;
+        memmove(session->output, session->output + session->output_start,
+                held);
+        session->output_start = 0;
+        session->output_end = held;
     }
+    fail_exit_if(session->output_end + (len - sent) > SESSION_OUTPUT_SIZE,
+                 E_REPLY_OVERFLOW);
 
-    else {
-        if ((amount = try_read_all(req_pipe, cur_pc->prod_ptr, sz)) != sz) {
-            fail_exit_if(pthread_mutex_unlock(&cur_pc->mutex),
-                         E_UNLOCK_PROD_CONS_MUTEX);
-            fail_exit_if(amount == -1, E_READ_REQUESTS_PIPE);
-            perror(E_INVALID_REQUEST);
-            exit(EXIT_FAILURE);
+    memcpy(session->output + session->output_end, (char const *)buf + sent,
+           len - sent);
+    session->output_end += len - sent;
+    return 0;
+}
+
+/* Whether the session holds replies its client didn't take in yet */
+bool thread_replies_pending(size_t session_id) {
+    return sessions[session_id].output_start !=
+           sessions[session_id].output_end;
+}
+
+/* Whether the session takes no more requests until its client reads its
+ * replies: it holds too many of them, or it was unmounted */
+bool thread_replies_held(size_t session_id) {
+    session_t const *const session = &sessions[session_id];
+    return session->unmounting ||
+           session->output_end - session->output_start >
+               SESSION_OUTPUT_SIZE - SESSION_REPLY_MAX;
+}
+
+/* Decodes the next request, which the session has taken in whole, into its
+ * queue, and checks it.
+ * Returns: the op code, 0 if the queue is full, or -1 if the client broke
+ * the protocol */
+static int thread_decode_request(size_t session_id) {
+    session_t *const session = &sessions[session_id];
+    request_queue_t *const queue = &session->requests;
+    unsigned position;
+    request_t *const request = request_queue_reserve(queue, &position);
+    if (request == NULL) {
+        return 0;
+    }
+
+    /* A request rejected leaves its slot claimed, but the session is freed,
+     * and its queue emptied, right after. */
+    request_header_t *const header = &request->header;
+    memcpy(header, session->input + session->input_start, sizeof(*header));
+    if (!thread_header_valid(header) ||
+        header->op_code == TFS_OP_CODE_MOUNT ||
+        header->session_id != (int32_t)session_id) {
+        perror(E_INVALID_REQUEST);
+        return -1;
+    }
+
+    memcpy(&request->body,
+           session->input + session->input_start + sizeof(*header),
+           header->size);
+    session->input_start += sizeof(*header) + header->size;
+    if (!thread_body_valid(request)) {
+        perror(E_INVALID_REQUEST);
+        return -1;
+    }
+
+    TRACE_DETAIL(TRACE_DECODED, header->op_code, session_id);
+    request_queue_publish(queue, position);
+    return header->op_code;
+}
+
+/* Whether the session took in a whole request it hasn't decoded yet (or
+ * something that isn't a request at all, for decoding to reject) */
+static bool thread_input_holds_request(session_t const *session) {
+    const size_t held = session->input_end - session->input_start;
+    if (held < sizeof(request_header_t)) {
+        return false;
+    }
+
+    request_header_t header;
+    memcpy(&header, session->input + session->input_start, sizeof(header));
+    if (!thread_header_valid(&header)) {
+        return true;
+    }
+
+    /* A share request's descriptors come with the byte right after it */
+    const size_t trailer = header.op_code == TFS_OP_CODE_SHARE ? 1 : 0;
+    return held >= sizeof(header) + header.size + trailer;
+}
+
+/* Whether the session took in enough to be served again, without its
+ * channel reporting anything more: a request, or the next chunk of the
+ * contents of the write being served */
+static bool thread_input_ready(session_t const *session) {
+    if (!session->writing) {
+        return thread_input_holds_request(session);
+    }
+
+    const size_t chunk = session->write_left < WRITE_CHUNK_SIZE
+                             ? session->write_left
+                             : WRITE_CHUNK_SIZE;
+    return session->input_end - session->input_start >= chunk;
+}
+
+/* Decodes every request the session has taken in whole, as long as its
+ * queue has room, taking in what the client sent so far if there's none.
+ * A request only partly here waits in the input for the rest.
+ * Returns: 0 if successful, -1 if the client is gone or broke the protocol */
+static int thread_decode_requests(size_t session_id) {
+    session_t *const session = &sessions[session_id];
+
+    for (bool decoded = false;; decoded = true) {
+        while (!thread_input_holds_request(session)) {
+            if (decoded) {
+                return 0;
+            }
+
+            const ssize_t rc = thread_take_in(session);
+            if (rc == -1 && errno == EAGAIN) {
+                return 0;
+            }
+            if (rc <= 0) {
+                return -1;
+            }
+        }
+
+        switch (thread_decode_request(session_id)) {
+        case -1:
+            return -1;
+        case 0:
+            return 0;
+        /* A write's contents come next, the descriptors after a share and
+         * nothing after an unmount: they're taken when it's served */
+        case TFS_OP_CODE_WRITE:
+        case TFS_OP_CODE_SHARE:
+        case TFS_OP_CODE_UNMOUNT:
+            return 0;
+        default:
+            break;
         }
-        fail_exit_if(amount == -1, E_READ_REQUESTS_PIPE);
-        cur_pc->prod_ptr += ((size_t)amount / sizeof(char));
     }
+}
+
+/* Whether fd has something to read (or was closed) right now */
+static bool thread_channel_ready(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int rc;
+    do {
+        rc = poll(&pfd, 1, 0);
+    } while (rc == -1 && errno == EINTR);
 
-    fail_exit_if(pthread_mutex_unlock(&cur_pc->mutex),
-                 E_UNLOCK_PROD_CONS_MUTEX);
-    return;
+    return rc > 0;
 }
 
-void *thread_wait(void *arg) {
-    const size_t session_id = (const size_t)arg;
+/* Serves up to SESSION_BATCH requests the client posted in the session's
+ * shared region. */
+static void thread_serve_shared(size_t session_id) {
+    session_t *const session = &sessions[session_id];
+
+    /* The connection carries nothing while the region is in use: if it's
+     * readable, the client died or is misbehaving */
+    if (session->input_start != session->input_end ||
+        thread_channel_ready(session->req_fd)) {
+        do_unmount(session_id, false);
+        return;
+    }
+
+    /* Reset the event before looking at the ring, so that a request posted
+     * from now on makes it readable again */
+    if (thread_channel_ready(session->request_event)) {
+        uint64_t count;
+        try_read(session->request_event, &count, sizeof(count));
+    }
 
-    fail_exit_if(pthread_mutex_lock(&threads_mutex[session_id]),
-                 E_LOCK_SESSION_MUTEX);
+    for (int served = 0; session->shared != NULL; served++) {
+        void *data;
+        shared_request_t const *const request =
+            shared_request_next(session->shared, &data);
+        if (request == NULL) {
+            return;
+        }
 
-    while (true) {
-        fail_exit_if(pthread_cond_wait(&threads_cond[session_id],
-                                       &threads_mutex[session_id]),
-                     E_WAIT_SESSION_CONDVAR);
-        printf("Woke %ld\n", session_id);
+        if (served == SESSION_BATCH) {
+            /* Leave the rest for later, and the other sessions their turn */
+            if (shared_notify(session->request_event) == -1) {
+                do_unmount(session_id, false);
+            }
+            return;
+        }
 
-        char op_code = TFS_OP_CODE_NO_OP;
+        const int op_code = request->op_code;
+        TRACE_OPS(TRACE_SERVE, op_code, session_id);
+        server_shared_state(session_id, request, data);
+        TRACE_OPS(TRACE_SERVED, op_code, session_id);
+    }
+}
+
+/* Serves up to SESSION_BATCH requests of a mounted session, as long as they
+ * are there to be read, and never waits for the rest of one. */
+static void thread_serve_session(size_t session_id) {
+    session_t *const session = &sessions[session_id];
+
+    for (int served = 0; served < SESSION_BATCH; served++) {
+        if (session->req_fd == -1 || session->shared != NULL ||
+            thread_replies_held(session_id)) {
+            return;
+        }
+
+        /* A write whose contents were still coming in, or a read whose
+         * contents the client couldn't take in yet, goes on first */
+        if (session->writing) {
+            server_write_resume(session_id);
+            if (session->writing) {
+                return;
+            }
+            continue;
+        }
+        if (session->reading) {
+            server_read_resume(session_id);
+            if (session->reading) {
+                return;
+            }
+            continue;
+        }
 
-        thread_read_data_cons(&op_code, sizeof(char), session_id);
+        if (request_queue_empty(&session->requests)) {
+            if (thread_decode_requests(session_id) == -1) {
+                /* The client died or is misbehaving */
+                do_unmount(session_id, false);
+                return;
+            }
+        }
 
+        if (!request_queue_pop(&session->requests, &session->request)) {
+            return;
+        }
+        request_t const *const request = &session->request;
+        /* The session may be someone else's once it's unmounted */
+        const uint8_t op_code = request->header.op_code;
+        TRACE_OPS(TRACE_SERVE, op_code, session_id);
         switch (op_code) {
-        case TFS_OP_CODE_NO_OP:
-            break;
-        case TFS_OP_CODE_MOUNT:
-            printf("mount %lu %lu\n", session_id, pthread_self());
-            server_mount_state(session_id);
-            printf("mount done %lu\n", session_id);
-            break;
         case TFS_OP_CODE_UNMOUNT:
-            printf("unmount %lu\n", session_id);
             server_unmount_state(session_id);
-            printf("unmount done %lu\n", session_id);
             break;
         case TFS_OP_CODE_OPEN:
-            printf("open %lu\n", session_id);
-            server_open_state(session_id);
-            printf("open done %lu\n", session_id);
+            server_open_state(session_id, &request->body.open);
             break;
         case TFS_OP_CODE_WRITE:
-            printf("write %lu\n", session_id);
-            server_write_state(session_id);
-            printf("write done %lu\n", session_id);
+            server_write_state(session_id, &request->body.rw);
             break;
         case TFS_OP_CODE_READ:
-            printf("read %lu\n", session_id);
-            server_read_state(session_id);
-            printf("read done %lu\n", session_id);
+            server_read_state(session_id, &request->body.rw);
             break;
         case TFS_OP_CODE_CLOSE:
-            printf("close %lu\n", session_id);
-            server_close_state(session_id);
-            printf("close done %lu\n", session_id);
+            server_close_state(session_id, &request->body.close);
             break;
         case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED:
-            printf("shutdown %lu\n", session_id);
             server_shutdown_after_all_closed_state(session_id);
-            printf("shutdown done %lu\n", session_id);
+            break;
+        case TFS_OP_CODE_SHARE:
+            server_share_state(session_id);
             break;
         default:
             exit(EXIT_FAILURE);
         }
-        printf("Stopping session %lu\n", session_id);
+        TRACE_OPS(TRACE_SERVED, op_code, session_id);
     }
+}
+
+/* Epoll data of the front end's own channel: the server pipe (or socket) */
+#define FRONT_END_LISTEN (UINT64_MAX)
+/* Epoll data of a session's channel: its id, and which of its channels it
+ * is, in the low bits */
+#define FRONT_END_CHANNEL_BITS (2)
+#define FRONT_END_CHANNEL_MASK (((uint64_t)1 << FRONT_END_CHANNEL_BITS) - 1)
+
+typedef enum {
+    CHANNEL_REQUESTS, /* req_fd */
+    CHANNEL_EVENT,    /* the shared region's request_event */
+    CHANNEL_REPLIES,  /* fd, when it's a pipe of its own */
+} channel_t;
+
+/* Registers fd of a session with the front end (or re-arms it), to report
+ * once when it's ready for events or the client hangs up: a channel with no
+ * events only reports the latter. */
+static void thread_watch(size_t session_id, int fd, channel_t channel,
+                         uint32_t events, bool *watched) {
+    struct epoll_event watch = {
+        .events = events | EPOLLET | EPOLLONESHOT,
+        .data.u64 =
+            (uint64_t)session_id << FRONT_END_CHANNEL_BITS | channel};
+
+    fail_exit_if(epoll_ctl(front_epoll,
+                           *watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd,
+                           &watch) == -1,
+                 E_WATCH_SESSION);
+    *watched = true;
+}
 
-    fail_exit_if(pthread_mutex_unlock(&threads_mutex[session_id]),
-                 E_UNLOCK_SESSION_MUTEX);
+static void thread_mount(size_t session_id) {
+    session_t *const session = &sessions[session_id];
+
+    /* Sessions accepted on the server socket have no mount request */
+    if (session->req_fd == -1 &&
+        (!request_queue_pop(&session->requests, &session->request) ||
+         session->request.header.op_code != TFS_OP_CODE_MOUNT)) {
+        exit(EXIT_FAILURE);
+    }
 
-    return NULL;
+    TRACE_DETAIL(TRACE_MOUNT, session_id, 0);
+    server_mount_state(session_id, session->req_fd == -1
+                                       ? &session->request.body.mount
+                                       : NULL);
+    TRACE_OPS(TRACE_MOUNTED, session_id, 0);
+
+    /* A client that dies before it opens its request pipe never hangs it up:
+     * its reply pipe losing its reader tells instead */
+    if (session->fd != -1 && session->fd != session->req_fd) {
+        thread_watch(session_id, session->fd, CHANNEL_REPLIES, 0,
+                     &session->reply_watched);
+    }
 }
 
-static int try_make_pipe_and_send_result(int rc) {
-    char client_pipe_path[PATHNAME_MAX_SIZE];
+/* Hands the session to a worker of the pool, unless one has it already, in
+ * which case that worker serves it again once it's done. */
+static void thread_schedule(size_t session_id) {
+    if (atomic_fetch_add_explicit(&sessions[session_id].wakeups, 1,
+                                  memory_order_acq_rel) == 0) {
+        pool_submit(session_id);
+    }
+}
 
-    fail_exit_if(try_read_all(req_pipe, client_pipe_path, PATHNAME_MAX_SIZE) !=
-                     PATHNAME_MAX_SIZE,
-                 E_INVALID_REQUEST);
+/* Stops watching the session's channels, before they're closed, and drops
+ * whatever it had taken in from them. */
+void thread_release_session(size_t session_id) {
+    session_t *const session = &sessions[session_id];
 
-    int fclient = try_open(client_pipe_path, O_WRONLY);
+    if (session->req_watched) {
+        epoll_ctl(front_epoll, EPOLL_CTL_DEL, session->req_fd, NULL);
+        session->req_watched = false;
+    }
+    if (session->event_watched) {
+        epoll_ctl(front_epoll, EPOLL_CTL_DEL, session->request_event, NULL);
+        session->event_watched = false;
+    }
+    if (session->reply_watched) {
+        epoll_ctl(front_epoll, EPOLL_CTL_DEL, session->fd, NULL);
+        session->reply_watched = false;
+    }
+    session->reply_out = false;
+
+    session->input_start = session->input_end = 0;
+    session->output_start = session->output_end = 0;
+    session->writing = session->reading = false;
+    session->unmounting = false;
+    request_queue_init(&session->requests);
+    int fds[SESSION_PASSED_FDS];
+    thread_take_fds(session_id, fds, 0);
+}
 
-    if (fclient == -1)
-        return -1;
+/* Serves a session handed to a worker of the pool, and then hands it back
+ * to the front end by re-arming its channels. */
+static void thread_serve(size_t session_id) {
+    session_t *const session = &sessions[session_id];
+    const unsigned wakeups =
+        atomic_load_explicit(&session->wakeups, memory_order_acquire);
+
+    if (atomic_exchange_explicit(&session->hangup, false,
+                                 memory_order_relaxed)) {
+        /* Nothing left to serve: reclaim the session right away */
+        if (session->req_fd != -1) {
+            do_unmount(session_id, false);
+        }
+    } else if (session->mount_pending) {
+        session->mount_pending = false;
+        thread_mount(session_id);
+    } else if (thread_flush(session) == -1) {
+        do_unmount(session_id, false);
+    } else if (session->unmounting) {
+        /* The session is freed once the reply to its unmount went out */
+        if (!thread_replies_pending(session_id)) {
+            do_unmount(session_id, false);
+        }
+    } else if (session->shared != NULL) {
+        thread_serve_shared(session_id);
+    } else {
+        thread_serve_session(session_id);
+    }
 
-    return r_pipe_inform(fclient, rc);
+    /* Requests taken in already won't make the channel readable again, but
+     * one that is only partly here waits for it to. None is served, or read,
+     * while the session holds back on them: it waits for its replies to be
+     * taken in instead. */
+    const bool held = thread_replies_held(session_id);
+    if (session->req_fd != -1 && !held &&
+        (thread_input_ready(session) ||
+         !request_queue_empty(&session->requests))) {
+        pool_submit(session_id);
+        return;
+    }
+
+    const uint32_t requests = held ? 0 : EPOLLIN | EPOLLRDHUP;
+    const uint32_t replies = thread_replies_pending(session_id) ? EPOLLOUT : 0;
+    if (session->req_fd != -1 && session->req_fd == session->fd) {
+        /* A connection is both channels at once */
+        thread_watch(session_id, session->req_fd, CHANNEL_REQUESTS,
+                     requests | replies, &session->req_watched);
+    } else if (session->req_fd != -1) {
+        if (!held) {
+            thread_watch(session_id, session->req_fd, CHANNEL_REQUESTS,
+                         requests, &session->req_watched);
+        }
+        /* A reply pipe that reported it takes more is re-armed */
+        if (replies != 0 || session->reply_out) {
+            thread_watch(session_id, session->fd, CHANNEL_REPLIES, replies,
+                         &session->reply_watched);
+            session->reply_out = replies != 0;
+        }
+    }
+    if (session->shared != NULL) {
+        thread_watch(session_id, session->request_event, CHANNEL_EVENT,
+                     EPOLLIN | EPOLLRDHUP, &session->event_watched);
+    }
+
+    /* The channels may have reported again already, and then the session
+     * is still this worker's to serve */
+    if (atomic_fetch_sub_explicit(&session->wakeups, wakeups,
+                                  memory_order_acq_rel) != wakeups) {
+        pool_submit(session_id);
+    }
 }
 
-static void try_make_pipe_and_send_result_fail_exit_if(bool arg,
-                                                       const char *msg) {
-    if (arg) {
-        perror(msg);
-        try_make_pipe_and_send_result(-1);
-        exit(EXIT_FAILURE);
+/* Tells the client of a mount request that no session is free, if it's
+ * still there to be told: the front end never waits to open its pipe, and
+ * gives up on it if it has no reader (ENXIO). */
+static void front_end_refuse(mount_request_t const *request) {
+    char client_pipe_path[PATHNAME_MAX_SIZE + 1];
+    memcpy(client_pipe_path, request->client_pipe, PATHNAME_MAX_SIZE);
+    client_pipe_path[PATHNAME_MAX_SIZE] = '\0';
+
+    const int fclient = try_open(client_pipe_path, O_WRONLY | O_NONBLOCK);
+    if (fclient == -1) {
+        return;
     }
+
+    r_pipe_inform(fclient, -1);
+    try_close(fclient);
 }
 
 static int decide_mount() {
-    // fprintf(stderr, "trying %lu\n", pthread_self());
     for (int i = 0; i < S; i++) {
-        try_make_pipe_and_send_result_fail_exit_if(
-            pthread_mutex_lock(&open_session_locks[i]) != 0,
-            E_LOCK_SESSION_TABLE_MUTEX);
+        fail_exit_if(pthread_mutex_lock(&sessions[i].lock) != 0,
+                     E_LOCK_SESSION_TABLE_MUTEX);
 
-        if (free_open_session_entries[i] == FREE) {
-            printf("Mount decided id: %d %lu\n", i, pthread_self());
-            free_open_session_entries[i] = TAKEN;
+        /* Dead clients are noticed by the front end, which sees them hang
+         * up and hands their sessions to a worker to free. A session stays
+         * out until that worker is done with it. */
+        if (sessions[i].free == FREE &&
+            atomic_load_explicit(&sessions[i].wakeups,
+                                 memory_order_acquire) == 0) {
+            TRACE_DETAIL(TRACE_MOUNT_ID, i, 0);
+            sessions[i].free = TAKEN;
 
-            try_make_pipe_and_send_result_fail_exit_if(
-                pthread_mutex_unlock(&open_session_locks[i]) != 0,
-                E_UNLOCK_SESSION_TABLE_MUTEX);
+            fail_exit_if(pthread_mutex_unlock(&sessions[i].lock) != 0,
+                         E_UNLOCK_SESSION_TABLE_MUTEX);
 
             /* We found an available entry! */
             return i;
         }
 
-        else /*if (free_open_session_entries[i] == TAKEN)*/ {
-            /* We poll to check if the session is dead. */
-            /* In case a client dies between 2 requests... */
-            const int cur_fd = open_session_table[i];
-
-            /* Invalid fd (look inside to understand) */
-            if (cur_fd != -1) {
-                struct pollfd p;
-                p.fd = cur_fd;
-                p.events = POLLOUT;
-                p.revents = 0;
-
-                try_make_pipe_and_send_result_fail_exit_if(
-                    poll(&p, 1, -1) == -1, E_POLL);
-
-                if (p.revents & POLLERR) {
-                    try_make_pipe_and_send_result_fail_exit_if(
-                        pthread_mutex_unlock(&open_session_locks[i]) != 0,
-                        E_UNLOCK_SESSION_TABLE_MUTEX);
-
-                    /* The session's fd is dead. Now we make sure it sleeps by
-                     * locking the condvar mutex. */
-                    try_make_pipe_and_send_result_fail_exit_if(
-                        pthread_mutex_lock(&threads_mutex[i]),
-                        E_LOCK_SESSION_MUTEX);
-
-                    /* We should close the unused file descriptor. */
-                    try_close(cur_fd);
-
-                    /* Set back to TAKEN in case it was set to FREE meanwhile.
-                     */
-                    free_open_session_entries[i] = TAKEN;
-
-                    try_make_pipe_and_send_result_fail_exit_if(
-                        pthread_mutex_lock(&open_session_locks[i]) != 0,
-                        E_LOCK_SESSION_TABLE_MUTEX);
-
-                    /* Invalidate saved file descriptor. */
-                    open_session_table[i] = -1;
-
-                    try_make_pipe_and_send_result_fail_exit_if(
-                        pthread_mutex_unlock(&open_session_locks[i]) != 0,
-                        E_UNLOCK_SESSION_TABLE_MUTEX);
-
-                    try_make_pipe_and_send_result_fail_exit_if(
-                        pthread_mutex_unlock(&threads_mutex[i]),
-                        E_UNLOCK_SESSION_MUTEX);
-
-                    /* We found an available entry! */
-                    return i;
-                }
-            }
-        }
-
-        try_make_pipe_and_send_result_fail_exit_if(
-            pthread_mutex_unlock(&open_session_locks[i]) != 0,
-            E_UNLOCK_SESSION_TABLE_MUTEX);
+        fail_exit_if(pthread_mutex_unlock(&sessions[i].lock) != 0,
+                     E_UNLOCK_SESSION_TABLE_MUTEX);
     }
 
     /* We return -1 for error... */
-    // fprintf(stderr, "not found %lu\n", pthread_self());
-    return try_make_pipe_and_send_result(-1);
+    return -1;
 }
 
-void main_thread_work() {
-    while (true) {
-        ssize_t sz;
-        char op_code;
+/* What the front end read from the server pipe and hasn't handled yet: it
+ * never waits for the rest of a request that is only partly there */
+static char front_input[SESSION_INPUT_SIZE];
+static size_t front_input_end = 0;
+/* Bytes of the body of a request that won't be served still to skip */
+static size_t front_skip = 0;
+
+/* Takes in a mount request read whole from the server pipe */
+static void front_end_take_mount(request_header_t const *header,
+                                 void const *body) {
+    const int session_id = decide_mount();
+    if (session_id == -1) {
+        front_end_refuse(body);
+        return;
+    }
 
-        do {
-            fail_exit_if((sz = try_read(req_pipe, &op_code, sizeof(char))) ==
-                             -1,
-                         E_READ_REQUESTS_PIPE);
-        } while (sz == 0);
+    session_t *const session = &sessions[session_id];
+    if (thread_queue_mount((size_t)session_id, header, body) == -1) {
+        fail_exit_if(pthread_mutex_lock(&session->lock),
+                     E_LOCK_SESSION_TABLE_MUTEX);
+        session->free = FREE;
+        fail_exit_if(pthread_mutex_unlock(&session->lock),
+                     E_UNLOCK_SESSION_TABLE_MUTEX);
+        return;
+    }
+
+    session->mount_pending = true;
+    thread_schedule((size_t)session_id);
+}
+
+/* Reads the mount requests on the server pipe, which only carries mount
+ * requests: every other request goes through the pipe the session sets up at
+ * mount time. */
+static void front_end_mount() {
+    const ssize_t rc =
+        try_read(req_pipe, front_input + front_input_end,
+                 sizeof(front_input) - front_input_end);
+    if (rc == -1 && errno == EAGAIN) {
+        return;
+    }
+    fail_exit_if(rc <= 0, E_READ_REQUESTS_PIPE);
+    front_input_end += (size_t)rc;
 
-        ssize_t session_id;
+    size_t start = 0;
+    while (true) {
+        size_t held = front_input_end - start;
+        const size_t skipped = front_skip < held ? front_skip : held;
+        start += skipped;
+        held -= skipped;
+        front_skip -= skipped;
+
+        request_header_t header;
+        if (held < sizeof(header)) {
+            break;
+        }
+        memcpy(&header, front_input + start, sizeof(header));
 
-        if (op_code == TFS_OP_CODE_NO_OP)
+        if (!thread_header_valid(&header) ||
+            header.op_code != TFS_OP_CODE_MOUNT) {
+            if (header.op_code != TFS_OP_CODE_NO_OP) {
+                perror(E_INVALID_REQUEST);
+            }
+            start += sizeof(header);
+            front_skip = header.size;
             continue;
+        }
 
-        if (op_code == TFS_OP_CODE_MOUNT) {
-            if ((session_id = decide_mount()) == -1)
-                continue;
+        if (held < sizeof(header) + header.size) {
+            break;
         }
+        front_end_take_mount(&header, front_input + start + sizeof(header));
+        start += sizeof(header) + header.size;
+    }
 
-        else {
-            ssize_t data = 0;
-            fail_exit_if(
-                (data = try_read_all(req_pipe, &session_id, sizeof(int))) == -1,
-                E_READ_REQUESTS_PIPE);
-            if (data != sizeof(int) || session_id < 0 || session_id >= S)
-                continue;
+    memmove(front_input, front_input + start, front_input_end - start);
+    front_input_end -= start;
+}
+
+/* With the socket transport, each connection accepted on the server socket is
+ * a mount, and becomes the session's channel for requests and responses. */
+static void front_end_accept() {
+    int conn;
+    do {
+        conn = accept(req_pipe, NULL, NULL);
+    } while (conn == -1 && errno == EINTR);
+
+    if (conn == -1) {
+        /* The client may have given up before we got to it */
+        if (errno != EAGAIN) {
+            perror(E_ACCEPT);
         }
+        return;
+    }
 
-        thread_worker_schedule_prod((unsigned)session_id, op_code);
-        printf("Waking session %lu\n", session_id);
-        fail_exit_if(pthread_mutex_lock(&threads_mutex[session_id]),
-                     E_LOCK_SESSION_MUTEX);
-        fail_exit_if(pthread_cond_signal(&threads_cond[session_id]),
-                     E_SIGNAL_SESSION_CONDVAR);
-        fail_exit_if(pthread_mutex_unlock(&threads_mutex[session_id]),
-                     E_UNLOCK_SESSION_MUTEX);
+    /* The connection is never waited on, not even for a reply: what the
+     * client doesn't take in right away waits in the session for it to */
+    if (try_set_blocking(conn, false) == -1) {
+        perror(E_ACCEPT);
+        try_close(conn);
+        return;
+    }
+
+    const int session_id = decide_mount();
+    if (session_id == -1) {
+        r_pipe_inform(conn, -1);
+        try_close(conn);
+        return;
     }
+
+    session_t *const session = &sessions[session_id];
+    fail_exit_if(pthread_mutex_lock(&session->lock),
+                 E_LOCK_SESSION_TABLE_MUTEX);
+    session->fd = conn;
+    fail_exit_if(pthread_mutex_unlock(&session->lock),
+                 E_UNLOCK_SESSION_TABLE_MUTEX);
+    session->req_fd = conn;
+
+    session->mount_pending = true;
+    thread_schedule((size_t)session_id);
 }
 
-void init_threads() {
-    for (int i = 0; i < S; ++i) {
-        fail_exit_if(pthread_mutex_init(&threads_mutex[i], NULL),
-                     E_INIT_SESSION_MUTEX);
-        prod_cons_t *const cur_pc = &prod_cons[i];
+/* Events the front end takes in per epoll_wait */
+#define FRONT_END_EVENTS (64)
 
-        fail_exit_if(pthread_mutex_init(&cur_pc->mutex, NULL),
-                     E_INIT_PROD_CONS_MUTEX);
+/* Waits on every channel, handing the sessions with requests (or whose
+ * clients hung up) to the pool and taking in the mounts with mount. */
+static void front_end_run(void (*mount)()) {
+    struct epoll_event listen = {.events = EPOLLIN,
+                                 .data.u64 = FRONT_END_LISTEN};
+    fail_exit_if(epoll_ctl(front_epoll, EPOLL_CTL_ADD, req_pipe, &listen) ==
+                     -1,
+                 E_EPOLL);
 
-        cur_pc->prod_ptr = cur_pc->cons_ptr = cur_pc->buffer;
-        fail_exit_if(pthread_cond_init(&threads_cond[i], NULL),
-                     E_INIT_SESSION_CONDVAR);
+    struct epoll_event events[FRONT_END_EVENTS];
+    while (true) {
+        int count;
+        do {
+            count = epoll_wait(front_epoll, events, FRONT_END_EVENTS, -1);
+        } while (count == -1 && errno == EINTR);
+        fail_exit_if(count == -1, E_EPOLL);
+
+        bool listen_ready = false;
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u64 == FRONT_END_LISTEN) {
+                listen_ready = true;
+                continue;
+            }
 
-        fail_exit_if(pthread_mutex_init(&open_session_locks[i], NULL),
+            /* A client that hung up with requests still to read is served
+             * until its worker reads end of file, but one that stopped
+             * reading its replies is gone for good */
+            const size_t session_id =
+                (size_t)(events[i].data.u64 >> FRONT_END_CHANNEL_BITS);
+            const channel_t channel =
+                (channel_t)(events[i].data.u64 & FRONT_END_CHANNEL_MASK);
+            const uint32_t hung_up = EPOLLHUP | EPOLLERR | EPOLLRDHUP;
+            if ((channel == CHANNEL_REPLIES &&
+                 (events[i].events & (EPOLLHUP | EPOLLERR))) ||
+                (channel == CHANNEL_REQUESTS && (events[i].events & hung_up) &&
+                 !(events[i].events & EPOLLIN))) {
+                atomic_store_explicit(&sessions[session_id].hangup, true,
+                                      memory_order_relaxed);
+            }
+            thread_schedule(session_id);
+        }
+
+        if (listen_ready) {
+            mount();
+        }
+    }
+}
+
+void main_thread_work() { front_end_run(front_end_mount); }
+
+void main_thread_accept() { front_end_run(front_end_accept); }
+
+void init_threads() {
+    for (int i = 0; i < S; ++i) {
+        fail_exit_if(pthread_mutex_init(&sessions[i].lock, NULL),
                      E_INIT_SESSION_TABLE_MUTEX);
-        free_open_session_entries[i] = FREE;
+        sessions[i].free = FREE;
+        sessions[i].fd = -1;
+        sessions[i].req_fd = -1;
+        sessions[i].shared = NULL;
+        sessions[i].request_event = sessions[i].response_event = -1;
+        atomic_init(&sessions[i].wakeups, 0);
+        sessions[i].mount_pending = false;
+        atomic_init(&sessions[i].hangup, false);
+        sessions[i].req_watched = sessions[i].event_watched = false;
+        sessions[i].reply_watched = sessions[i].reply_out = false;
+        sessions[i].writing = sessions[i].reading = false;
+        sessions[i].unmounting = false;
+        sessions[i].input_start = sessions[i].input_end = 0;
+        sessions[i].output_start = sessions[i].output_end = 0;
+        sessions[i].passed_count = 0;
+        request_queue_init(&sessions[i].requests);
 
         for (int j = 0; j < MAX_OPEN_FILES; ++j)
-            open_files[i][j] = -1;
+            sessions[i].open_files[j] = -1;
+        sessions[i].open_files_amount = 0;
     }
 
-    for (size_t i = 0; i < S; ++i)
-        fail_exit_if(pthread_create(&threads[i], NULL, thread_wait, (void *)i),
-                     E_INIT_SESSION_THREAD);
+    fail_exit_if((front_epoll = epoll_create1(0)) == -1, E_EPOLL);
+
+    printf("Serving with %d workers\n", pool_init(thread_serve));
 }
 
 void fini_threads() {
-    for (int i = 0; i < S; ++i)
-        fail_exit_if(pthread_join(threads[i], NULL), E_JOIN_SESSION_THREAD);
-
     for (int i = 0; i < S; ++i) {
-        fail_exit_if(pthread_mutex_destroy(&threads_mutex[i]),
-                     E_FINI_SESSION_MUTEX);
-        fail_exit_if(pthread_mutex_destroy(&prod_cons[i].mutex),
-                     E_FINI_PROD_CONS_MUTEX);
-        fail_exit_if(pthread_cond_destroy(&threads_cond[i]),
-                     E_FINI_SESSION_CONDVAR);
-        fail_exit_if(pthread_mutex_destroy(&open_session_locks[i]),
+        fail_exit_if(pthread_mutex_destroy(&sessions[i].lock),
                      E_FINI_SESSION_TABLE_MUTEX);
     }
+    try_close(front_epoll);
 }
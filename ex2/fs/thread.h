@@ -2,40 +2,126 @@
 #define THREAD_H
 
 #include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 
+#include "../common/shared.h"
 #include "config.h"
+#include "request_queue.h"
 #include "tfs_server_macros.h"
 
 extern int req_pipe;
 extern char *req_pipe_name;
-extern int open_session_table[S];
 extern int thread_exit;
 
-extern pthread_mutex_t open_session_locks[S];
-extern unsigned char free_open_session_entries[S];
+/* Bytes a worker takes in from a session's channel at once, which may hold
+ * several requests */
+#define SESSION_INPUT_SIZE (4096)
+/* Descriptors a share request carries: its region */
+#define SESSION_PASSED_FDS (1)
+/* Bytes of replies a session holds for a client that isn't reading them */
+#define SESSION_OUTPUT_SIZE (4096)
+/* The most a request adds to them at once: a chunk of a read's contents with
+ * the reply's header, its length and the length that ends it. A session is
+ * only served while they have room for it. */
+#define SESSION_REPLY_MAX (REPLY_HEADER_SZ + 2 * sizeof(int) + READ_CHUNK_SIZE)
 
-extern int open_files[S][MAX_OPEN_FILES];
-extern size_t open_files_amount[S];
-
-/* tfs_write is the most expensive request */
-/* We are considering we only use the size provided by the teachers in the
- * filesystem. */
-/* (char) op_code | (int) session_id | (int) fhandle | (size_t) len | contents
+/*
+ * Session table entry: everything the main thread and the session's worker
+ * touch for one session, padded to whole cache lines so that sessions never
+ * share one.
  */
-#define PROD_CONS_SIZE                                                         \
-    (sizeof(char) + sizeof(int) + sizeof(int) + sizeof(size_t) + BLOCK_SIZE)
-
 typedef struct {
-    pthread_mutex_t mutex;
-    char buffer[PROD_CONS_SIZE];
-    char *prod_ptr;
-    char *cons_ptr;
-} prod_cons_t;
-
-ssize_t thread_read_data_cons(void *dest, size_t n, size_t session_id);
-void thread_worker_schedule_prod(size_t session_id, char op_code);
-void *thread_wait(void *arg);
+    /* Guards fd and free. */
+    alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    int fd;
+    unsigned char free;
+
+    /* The session's own request pipe, read only by its worker (-1 while the
+     * session isn't mounted). With the socket transport, both this and fd
+     * are the session's connection. */
+    int req_fd;
+
+    /* Region the client posts its requests in instead, once it shares one
+     * (NULL until then), and the eventfds each side wakes the other with. */
+    shared_region_t *shared;
+    int request_event;
+    int response_event;
+
+    /* Events the front end saw for the session that no worker took in yet.
+     * While there are any, a worker of the pool is serving the session (or
+     * is about to), and nothing else touches it. */
+    atomic_uint wakeups;
+    /* The next time the session is served, it's to complete its mount */
+    bool mount_pending;
+    /* The client hung up and left nothing to read: the session is to be
+     * reclaimed. Set by the front end. */
+    atomic_bool hangup;
+    /* req_fd, request_event and fd (when it's a pipe of its own) are
+     * registered with the front end's epoll instance. Only the worker
+     * serving the session touches these. */
+    bool req_watched;
+    bool event_watched;
+    bool reply_watched;
+    /* fd is registered to report when it takes more replies, rather than
+     * only when its reader is gone */
+    bool reply_out;
+
+    int open_files[MAX_OPEN_FILES];
+    size_t open_files_amount;
+
+    /* The requests decoded and not served yet, and the one being served,
+     * whose id its reply starts with */
+    request_queue_t requests;
+    request_t request;
+
+    /* Set while the contents of the write being served are still coming in
+     * (see server_write_resume): how many, and what became of the others */
+    bool writing;
+    size_t write_left;
+    ssize_t written;
+    bool write_full;
+
+    /* Set while the contents of the read being served are still to be sent
+     * (see server_read_resume): how many are left to read, and whether the
+     * reply's header went out already */
+    bool reading;
+    size_t read_left;
+    bool read_started;
+
+    /* The session replied to its unmount, and is freed once the client took
+     * in every reply */
+    bool unmounting;
+
+    /* What the worker read from req_fd but hasn't used yet, between
+     * input_start and input_end, and the descriptors that came with it. A
+     * request only partly here waits in it for the rest. */
+    size_t input_start;
+    size_t input_end;
+    int passed_fds[SESSION_PASSED_FDS];
+    int passed_count;
+    char input[SESSION_INPUT_SIZE];
+
+    /* Replies the channel didn't take without waiting, between output_start
+     * and output_end, sent once the client reads the ones before. */
+    size_t output_start;
+    size_t output_end;
+    char output[SESSION_OUTPUT_SIZE];
+} session_t;
+
+/* Requests a worker serves in a row from a session before moving on */
+#define SESSION_BATCH (16)
+
+extern session_t sessions[S];
+
+int thread_input_fill(size_t session_id, size_t n);
+int thread_take_fds(size_t session_id, int *fds, int count);
+int thread_reply(size_t session_id, void const *buf, size_t len);
+bool thread_replies_pending(size_t session_id);
+bool thread_replies_held(size_t session_id);
+void thread_release_session(size_t session_id);
 void main_thread_work();
+void main_thread_accept();
 void init_threads();
 void fini_threads();
 
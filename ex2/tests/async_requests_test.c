@@ -0,0 +1,102 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*  This test keeps TFS_MAX_IN_FLIGHT writes, and then reads, in flight on a
+    session, waiting for them out of order, and checks that a request
+    called in between is carried out after them. If the server listens on a
+    socket, the test runs again through a shared region. */
+
+#define CLIENT_PIPE "/tmp/tfs_c_async"
+#define PIECE (BLOCK_SIZE / TFS_MAX_IN_FLIGHT)
+
+static char data[BLOCK_SIZE];
+static char buffer[TFS_MAX_IN_FLIGHT][PIECE];
+
+static void run_test(int (*mount)(char const *), char const *server_path) {
+    char *path = "/f1";
+    int requests[TFS_MAX_IN_FLIGHT];
+    ssize_t result;
+
+    assert(mount(server_path) == 0);
+
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+
+    for (int i = 0; i < TFS_MAX_IN_FLIGHT; i++) {
+        requests[i] = tfs_submit_write(f, data + i * PIECE, PIECE);
+        assert(requests[i] != -1);
+    }
+
+    /* Every slot is taken until a request is waited for */
+    assert(tfs_submit_write(f, data, PIECE) == -1);
+
+    for (int i = TFS_MAX_IN_FLIGHT - 1; i >= 0; i--) {
+        assert(tfs_wait(requests[i]) == PIECE);
+    }
+    /* Each request is waited for once */
+    assert(tfs_wait(requests[0]) == -1);
+
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+
+    memset(buffer, 0, sizeof(buffer));
+    for (int i = 0; i < TFS_MAX_IN_FLIGHT; i++) {
+        requests[i] = tfs_submit_read(f, buffer[i], PIECE);
+        assert(requests[i] != -1);
+    }
+
+    /* The reads are carried out before the close */
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < TFS_MAX_IN_FLIGHT; i += 2) {
+        assert(tfs_poll(requests[i], &result) == 1);
+        assert(result == PIECE);
+        assert(tfs_poll(requests[i], &result) == -1);
+    }
+    for (int i = 1; i < TFS_MAX_IN_FLIGHT; i += 2) {
+        assert(tfs_wait(requests[i]) == PIECE);
+    }
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+
+    /* Past the end of the file */
+    f = tfs_open(path, TFS_O_APPEND);
+    assert(f != -1);
+    const int request = tfs_submit_read(f, buffer[0], PIECE);
+    assert(request != -1);
+    assert(tfs_wait(request) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+}
+
+static int mount_pipe(char const *server_path) {
+    return tfs_mount(CLIENT_PIPE, server_path);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+
+    run_test(mount_pipe, argv[1]);
+
+    struct stat st;
+    if (stat(argv[1], &st) == 0 && S_ISSOCK(st.st_mode)) {
+        run_test(tfs_mount_shared, argv[1]);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+   This benchmark starts a server and times a client filling a file with
+   small writes, each waited for before the next one, against submitting
+   TFS_MAX_IN_FLIGHT of them at a time and only then waiting for them.
+   Run it from the root of the project (it starts fs/tfs_server) or give it
+   the pathname of the server, and optionally the transport to use.
+ */
+
+#define ROUNDS 500
+#define PIECE (BLOCK_SIZE / TFS_MAX_IN_FLIGHT)
+#define SERVER_PATH "/tmp/tfs_bench_server"
+#define CLIENT_PIPE "/tmp/tfs_bench_client"
+
+static char data[BLOCK_SIZE];
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void pause_briefly() {
+    const struct timespec delay = {0, 10 * 1000 * 1000};
+    nanosleep(&delay, NULL);
+}
+
+static pid_t start_server(char const *server, char const *transport) {
+    unlink(SERVER_PATH);
+
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        /* The server logs every request */
+        const int null = open("/dev/null", O_WRONLY);
+        assert(null != -1);
+        dup2(null, STDOUT_FILENO);
+        execl(server, server, SERVER_PATH, transport, (char *)NULL);
+        perror(server);
+        _exit(EXIT_FAILURE);
+    }
+
+    /* Wait for the server to listen */
+    struct stat st;
+    while (stat(SERVER_PATH, &st) != 0) {
+        pause_briefly();
+    }
+    return pid;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    unlink(SERVER_PATH);
+}
+
+static void fill_waiting() {
+    for (int i = 0; i < ROUNDS; i++) {
+        const int fd = tfs_open("/f", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(fd != -1);
+        for (int j = 0; j < TFS_MAX_IN_FLIGHT; j++) {
+            assert(tfs_write(fd, data + j * PIECE, PIECE) == PIECE);
+        }
+        assert(tfs_close(fd) != -1);
+    }
+}
+
+static void fill_pipelined() {
+    int requests[TFS_MAX_IN_FLIGHT];
+
+    for (int i = 0; i < ROUNDS; i++) {
+        const int fd = tfs_open("/f", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(fd != -1);
+        for (int j = 0; j < TFS_MAX_IN_FLIGHT; j++) {
+            requests[j] = tfs_submit_write(fd, data + j * PIECE, PIECE);
+            assert(requests[j] != -1);
+        }
+        for (int j = 0; j < TFS_MAX_IN_FLIGHT; j++) {
+            assert(tfs_wait(requests[j]) == PIECE);
+        }
+        assert(tfs_close(fd) != -1);
+    }
+}
+
+/* Mean time per write, in microseconds */
+static double measure(void (*fill)()) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fill();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return elapsed(&start, &end) * 1e6 / (ROUNDS * TFS_MAX_IN_FLIGHT);
+}
+
+int main(int argc, char **argv) {
+    char const *server = argc > 1 ? argv[1] : "fs/tfs_server";
+    char const *transport = argc > 2 ? argv[2] : "fifo";
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)rand();
+    }
+
+    const pid_t pid = start_server(server, transport);
+
+    /* The client library logs every request too */
+    fflush(stdout);
+    const int out = dup(STDOUT_FILENO);
+    const int null = open("/dev/null", O_WRONLY);
+    assert(out != -1 && null != -1);
+    dup2(null, STDOUT_FILENO);
+
+    /* A socket may take a moment to accept connections once it exists */
+    int tries = 100;
+    while (tfs_mount(CLIENT_PIPE, SERVER_PATH) != 0) {
+        assert(--tries > 0);
+        pause_briefly();
+    }
+
+    const double waiting = measure(fill_waiting);
+    const double pipelined = measure(fill_pipelined);
+
+    assert(tfs_unmount() == 0);
+
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    close(null);
+
+    stop_server(pid);
+
+    printf("%s: %d rounds of %d writes of %d bytes\n", transport, ROUNDS,
+           TFS_MAX_IN_FLIGHT, PIECE);
+    printf("waiting for each:    %.2f us per write\n", waiting);
+    printf("%d in flight:        %.2f us per write\n", TFS_MAX_IN_FLIGHT,
+           pipelined);
+
+    return 0;
+}
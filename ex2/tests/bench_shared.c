@@ -0,0 +1,141 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+   This benchmark starts a server and has a client write whole files and read
+   them back, over and over, through the server pipe, the server socket and a
+   region shared with the server, and compares the bandwidth of each.
+   Run it from the root of the project (it starts fs/tfs_server) or give it
+   the pathname of the server.
+ */
+
+#define ROUNDS 5000
+#define SERVER_PATH "/tmp/tfs_bench_server"
+#define CLIENT_PIPE "/tmp/tfs_bench_client"
+
+static char data[BLOCK_SIZE];
+static char buffer[BLOCK_SIZE];
+
+typedef enum { PIPE, SOCKET, SHARED } transport_t;
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void pause_briefly() {
+    const struct timespec delay = {0, 10 * 1000 * 1000};
+    nanosleep(&delay, NULL);
+}
+
+static pid_t start_server(char const *server, char const *transport) {
+    unlink(SERVER_PATH);
+
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        /* The server logs every request */
+        const int null = open("/dev/null", O_WRONLY);
+        assert(null != -1);
+        dup2(null, STDOUT_FILENO);
+        execl(server, server, SERVER_PATH, transport, (char *)NULL);
+        perror(server);
+        _exit(EXIT_FAILURE);
+    }
+
+    /* Wait for the server to listen */
+    struct stat st;
+    while (stat(SERVER_PATH, &st) != 0) {
+        pause_briefly();
+    }
+    return pid;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    unlink(SERVER_PATH);
+}
+
+static int mount(transport_t transport) {
+    return transport == SHARED ? tfs_mount_shared(SERVER_PATH)
+                               : tfs_mount(CLIENT_PIPE, SERVER_PATH);
+}
+
+static void transfers() {
+    for (int i = 0; i < ROUNDS; i++) {
+        int fd = tfs_open("/f", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(fd != -1);
+        assert(tfs_write(fd, data, sizeof(data)) == sizeof(data));
+        assert(tfs_close(fd) != -1);
+
+        fd = tfs_open("/f", 0);
+        assert(fd != -1);
+        assert(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(fd) != -1);
+    }
+}
+
+/* Returns: the bandwidth, in MiB/s */
+static double measure(char const *server, transport_t transport) {
+    const pid_t pid =
+        start_server(server, transport == PIPE ? "fifo" : "socket");
+
+    /* The client library logs every request too */
+    fflush(stdout);
+    const int out = dup(STDOUT_FILENO);
+    const int null = open("/dev/null", O_WRONLY);
+    assert(out != -1 && null != -1);
+    dup2(null, STDOUT_FILENO);
+
+    /* A socket may take a moment to accept connections once it exists */
+    int tries = 100;
+    while (mount(transport) != 0) {
+        assert(--tries > 0);
+        pause_briefly();
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    transfers();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    assert(tfs_unmount() == 0);
+
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    close(null);
+
+    stop_server(pid);
+
+    return 2.0 * ROUNDS * sizeof(data) / elapsed(&start, &end) /
+           (1024 * 1024);
+}
+
+int main(int argc, char **argv) {
+    char const *server = argc > 1 ? argv[1] : "fs/tfs_server";
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)rand();
+    }
+
+    printf("%d rounds of writing and reading back a file of %d bytes\n",
+           ROUNDS, BLOCK_SIZE);
+    printf("pipe:   %.1f MiB/s\n", measure(server, PIPE));
+    printf("socket: %.1f MiB/s\n", measure(server, SOCKET));
+    printf("shared: %.1f MiB/s\n", measure(server, SHARED));
+
+    return 0;
+}
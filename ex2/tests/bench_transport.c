@@ -0,0 +1,156 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+   This benchmark starts a server with each transport and times the requests
+   of a client that creates a file, writes a block, closes it, opens it again,
+   reads the block back and closes it, over and over, and the mounts and
+   unmounts of a client.
+   Run it from the root of the project (it starts fs/tfs_server) or give it
+   the pathname of the server.
+ */
+
+#define ROUNDS 2000
+#define MOUNTS 200
+#define REQUESTS_PER_ROUND 6
+#define SERVER_PATH "/tmp/tfs_bench_server"
+#define CLIENT_PIPE "/tmp/tfs_bench_client"
+
+static char data[BLOCK_SIZE];
+static char buffer[BLOCK_SIZE];
+
+static double elapsed(struct timespec const *start,
+                      struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void pause_briefly() {
+    const struct timespec delay = {0, 10 * 1000 * 1000};
+    nanosleep(&delay, NULL);
+}
+
+static pid_t start_server(char const *server, char const *transport) {
+    unlink(SERVER_PATH);
+
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        /* The server logs every request */
+        const int null = open("/dev/null", O_WRONLY);
+        assert(null != -1);
+        dup2(null, STDOUT_FILENO);
+        execl(server, server, SERVER_PATH, transport, (char *)NULL);
+        perror(server);
+        _exit(EXIT_FAILURE);
+    }
+
+    /* Wait for the server to listen */
+    struct stat st;
+    while (stat(SERVER_PATH, &st) != 0) {
+        pause_briefly();
+    }
+    return pid;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    unlink(SERVER_PATH);
+}
+
+static void round_trips() {
+    for (int i = 0; i < ROUNDS; i++) {
+        int fd = tfs_open("/f", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(fd != -1);
+        assert(tfs_write(fd, data, sizeof(data)) == sizeof(data));
+        assert(tfs_close(fd) != -1);
+
+        fd = tfs_open("/f", 0);
+        assert(fd != -1);
+        assert(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(fd) != -1);
+    }
+}
+
+/* Mean latencies, in microseconds */
+typedef struct {
+    double request;
+    double mount;
+} latency_t;
+
+static latency_t measure(char const *server, char const *transport) {
+    const pid_t pid = start_server(server, transport);
+
+    /* The client library logs every request too */
+    fflush(stdout);
+    const int out = dup(STDOUT_FILENO);
+    const int null = open("/dev/null", O_WRONLY);
+    assert(out != -1 && null != -1);
+    dup2(null, STDOUT_FILENO);
+
+    /* A socket may take a moment to accept connections once it exists */
+    int tries = 100;
+    while (tfs_mount(CLIENT_PIPE, SERVER_PATH) != 0) {
+        assert(--tries > 0);
+        pause_briefly();
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    round_trips();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    assert(tfs_unmount() == 0);
+
+    latency_t latency;
+    latency.request =
+        elapsed(&start, &end) * 1e6 / (ROUNDS * REQUESTS_PER_ROUND);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < MOUNTS; i++) {
+        assert(tfs_mount(CLIENT_PIPE, SERVER_PATH) == 0);
+        assert(tfs_unmount() == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    latency.mount = elapsed(&start, &end) * 1e6 / MOUNTS;
+
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    close(null);
+
+    stop_server(pid);
+
+    return latency;
+}
+
+int main(int argc, char **argv) {
+    char const *server = argc > 1 ? argv[1] : "fs/tfs_server";
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)rand();
+    }
+
+    const latency_t fifo = measure(server, "fifo");
+    const latency_t socket = measure(server, "socket");
+
+    printf("%d rounds of open/write/close/open/read/close, %d mounts\n",
+           ROUNDS, MOUNTS);
+    printf("fifo:   %.1f us per request, %.1f us per mount and unmount\n",
+           fifo.request, fifo.mount);
+    printf("socket: %.1f us per request, %.1f us per mount and unmount\n",
+           socket.request, socket.mount);
+
+    return 0;
+}
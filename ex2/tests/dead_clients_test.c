@@ -0,0 +1,145 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  This test has more clients than the server has sessions mount, open a
+    file and die without closing it or unmounting, a wave at a time. The
+    server must notice each of them hang up and free its session and its open
+    file, or the later waves run out of both. Before them, as many clients die
+    halfway through mounting, which must neither keep the server's workers
+    waiting for them nor keep their sessions. */
+
+/* More than the server has sessions */
+#define CLIENT_COUNT 1200
+#define WAVE_SIZE 100
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_d%d"
+#define HALF_PIPE_NAME_FORMAT "/tmp/tfs_h%d"
+
+static void pause_briefly() {
+    const struct timespec delay = {0, 1000 * 1000};
+    nanosleep(&delay, NULL);
+}
+
+static void run_client(char const *server_pipe, int client_id) {
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    /* The sessions of the previous wave may not all be free yet */
+    while (tfs_mount(client_pipe, server_pipe) != 0) {
+        pause_briefly();
+    }
+
+    /* Only a few files can be open at a time */
+    while (tfs_open("/dead", TFS_O_CREAT) == -1) {
+        pause_briefly();
+    }
+
+    /* Die without a word */
+    _exit(0);
+}
+
+/* Asks the server to mount by hand, and dies without opening its pipes or,
+ * for odd ids, once it knows its session id but before it opens its request
+ * pipe. Like a client that crashed, it leaves its pipes behind. */
+static void run_half_mount(char const *server_pipe, int client_id) {
+    char client_pipe[40];
+    char request_pipe[48];
+    sprintf(client_pipe, HALF_PIPE_NAME_FORMAT, client_id);
+    sprintf(request_pipe, "%s%s", client_pipe, REQUEST_PIPE_SUFFIX);
+    unlink(client_pipe);
+    unlink(request_pipe);
+    assert(mkfifo(client_pipe, 0640) == 0 && mkfifo(request_pipe, 0640) == 0);
+
+    const bool wait_reply = client_id % 2 == 1;
+    const int fclient =
+        wait_reply ? open(client_pipe, O_RDONLY | O_NONBLOCK) : -1;
+
+    struct {
+        request_header_t header;
+        mount_request_t body;
+    } mount = {{.version = TFS_PROTOCOL_VERSION,
+                .op_code = TFS_OP_CODE_MOUNT,
+                .size = sizeof(mount_request_t),
+                .session_id = -1},
+               {{0}}};
+    strcpy(mount.body.client_pipe, client_pipe);
+
+    const int fserver = open(server_pipe, O_WRONLY);
+    assert(fserver != -1);
+    assert(write(fserver, &mount, sizeof(mount)) == sizeof(mount));
+
+    if (wait_reply) {
+        struct pollfd reply = {.fd = fclient, .events = POLLIN};
+        assert(poll(&reply, 1, -1) == 1);
+    }
+
+    _exit(0);
+}
+
+/* Runs CLIENT_COUNT children with run, a wave at a time */
+static void run_waves(char const *server_pipe,
+                      void (*run)(char const *, int)) {
+    for (int wave = 0; wave < CLIENT_COUNT; wave += WAVE_SIZE) {
+        pid_t child_pids[WAVE_SIZE];
+        for (int i = 0; i < WAVE_SIZE; ++i) {
+            child_pids[i] = fork();
+            assert(child_pids[i] >= 0);
+            if (child_pids[i] == 0) {
+                run(server_pipe, wave + i);
+            }
+        }
+
+        for (int i = 0; i < WAVE_SIZE; ++i) {
+            int result;
+            waitpid(child_pids[i], &result, 0);
+            assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    /* Only the server pipe takes mount requests */
+    struct stat server_stat;
+    assert(stat(argv[1], &server_stat) == 0);
+    if (!S_ISSOCK(server_stat.st_mode)) {
+        run_waves(argv[1], run_half_mount);
+    }
+    run_waves(argv[1], run_client);
+
+    /* Everything the dead clients held is free again */
+    char const *str = "AAA!";
+    char buffer[40];
+    while (tfs_mount("/tmp/tfs_d_last", argv[1]) != 0) {
+        pause_briefly();
+    }
+
+    int f = tfs_open("/dead", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, str, strlen(str)) == strlen(str));
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/dead", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == strlen(str));
+    assert(memcmp(buffer, str, strlen(str)) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
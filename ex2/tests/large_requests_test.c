@@ -0,0 +1,78 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*  This test writes and reads more than a block in a single request. The
+    file system keeps a block per file, so a write stores the first block and
+    the rest of the contents are drained, after which the session must still
+    be in step with the server. If the server listens on a socket, the test
+    runs again through a shared region. */
+
+#define CLIENT_PIPE "/tmp/tfs_c_large"
+#define LARGE (64 * BLOCK_SIZE + 17)
+
+static char data[LARGE];
+static char buffer[LARGE];
+
+static void run_test(int (*mount)(char const *), char const *server_path) {
+    char *path = "/f1";
+
+    assert(mount(server_path) == 0);
+
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+
+    assert(tfs_write(f, data, sizeof(data)) == BLOCK_SIZE);
+    assert(tfs_write(f, "x", 1) == 0);
+
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+
+    memset(buffer, 0, sizeof(buffer));
+    assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE);
+    assert(memcmp(buffer, data, BLOCK_SIZE) == 0);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 0);
+
+    assert(tfs_close(f) != -1);
+
+    /* An invalid file handle fails without breaking the session */
+    assert(tfs_write(-1, data, sizeof(data)) == -1);
+    assert(tfs_read(-1, buffer, sizeof(buffer)) == -1);
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+}
+
+static int mount_pipe(char const *server_path) {
+    return tfs_mount(CLIENT_PIPE, server_path);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+
+    run_test(mount_pipe, argv[1]);
+
+    struct stat st;
+    if (stat(argv[1], &st) == 0 && S_ISSOCK(st.st_mode)) {
+        run_test(tfs_mount_shared, argv[1]);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
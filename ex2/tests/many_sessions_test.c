@@ -0,0 +1,86 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  This test mounts many more sessions than the server has workers, all at
+    the same time, each of them then writing and reading a file a few times
+    before unmounting. */
+
+#define CLIENT_COUNT 200
+/* The root directory only takes a few files */
+#define FILE_COUNT 16
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_m%d"
+
+static void run_client(char const *server_pipe, int client_id, int mounted,
+                       int go) {
+    char client_pipe[40];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    assert(tfs_mount(client_pipe, server_pipe) == 0);
+
+    /* Wait until every client is mounted */
+    char byte = 0;
+    assert(write(mounted, &byte, 1) == 1);
+    assert(read(go, &byte, 1) == 1);
+
+    char path[40];
+    char buffer[40];
+    sprintf(path, "/f%d", client_id % FILE_COUNT);
+
+    for (int i = 0; i < 10; i++) {
+        int f;
+        /* Only a few files can be open at a time */
+        while ((f = tfs_open(path, TFS_O_CREAT)) == -1) {
+            const struct timespec delay = {0, 1000 * 1000};
+            nanosleep(&delay, NULL);
+        }
+        assert(tfs_write(f, client_pipe, strlen(client_pipe)) != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    assert(tfs_unmount() == 0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    int mounted[2], go[2];
+    assert(pipe(mounted) == 0 && pipe(go) == 0);
+
+    pid_t child_pids[CLIENT_COUNT];
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        child_pids[i] = fork();
+        assert(child_pids[i] >= 0);
+        if (child_pids[i] == 0) {
+            run_client(argv[1], i, mounted[1], go[0]);
+            exit(0);
+        }
+    }
+
+    char byte;
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        assert(read(mounted[0], &byte, 1) == 1);
+    }
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        assert(write(go[1], &byte, 1) == 1);
+    }
+
+    for (int i = 0; i < CLIENT_COUNT; ++i) {
+        int result;
+        waitpid(child_pids[i], &result, 0);
+        assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,294 @@
+#include "client/tecnicofs_client_api.h"
+#include "common/common.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  This test has more clients than the server has workers send requests in
+    two pieces, waiting in between: a close cut short in its header, and a
+    write whose contents stop halfway. While they wait, another client must
+    still be served, and once they send the rest, each gets its replies and
+    the files written their contents. With the server pipe, a mount request
+    sent in two pieces must not keep mounted sessions from being served
+    either. */
+
+/* More than the server has workers */
+#define CLIENT_COUNT 80
+/* Clients that write a file of their own */
+#define FILE_COUNT 8
+#define CONTENTS_SIZE (3 * WRITE_CHUNK_SIZE + 100)
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_p%d"
+#define CHECK_PIPE "/tmp/tfs_p_check"
+
+static bool use_socket;
+
+/* A session mounted by hand, to send it requests a byte at a time */
+typedef struct {
+    int id;
+    int requests;
+    int replies;
+} raw_session_t;
+
+static void write_all(int fd, void const *buf, size_t size) {
+    assert(write(fd, buf, size) == (ssize_t)size);
+}
+
+static void read_all(int fd, void *buf, size_t size) {
+    for (size_t done = 0; done < size;) {
+        const ssize_t rc = read(fd, (char *)buf + done, size - done);
+        assert(rc > 0);
+        done += (size_t)rc;
+    }
+}
+
+/* Mounts a session through the server pipe, sending the mount request in two
+ * pieces if split, or through the server socket. */
+static raw_session_t raw_mount(char const *server, int client_id,
+                               bool split) {
+    raw_session_t session;
+
+    if (use_socket) {
+        struct sockaddr_un address = {.sun_family = AF_UNIX};
+        strncpy(address.sun_path, server, sizeof(address.sun_path) - 1);
+        session.requests = session.replies = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(session.requests != -1);
+        assert(connect(session.requests, (struct sockaddr *)&address,
+                       sizeof(address)) == 0);
+        read_all(session.replies, &session.id, sizeof(session.id));
+        assert(session.id != -1);
+        return session;
+    }
+
+    char client_pipe[40];
+    char request_pipe[48];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    sprintf(request_pipe, "%s%s", client_pipe, REQUEST_PIPE_SUFFIX);
+    unlink(client_pipe);
+    unlink(request_pipe);
+    assert(mkfifo(client_pipe, 0640) == 0 && mkfifo(request_pipe, 0640) == 0);
+    session.replies = open(client_pipe, O_RDONLY | O_NONBLOCK);
+    assert(session.replies != -1);
+
+    struct {
+        request_header_t header;
+        mount_request_t body;
+    } mount = {{.version = TFS_PROTOCOL_VERSION,
+                .op_code = TFS_OP_CODE_MOUNT,
+                .size = sizeof(mount_request_t),
+                .session_id = -1},
+               {{0}}};
+    strcpy(mount.body.client_pipe, client_pipe);
+
+    const int fserver = open(server, O_WRONLY);
+    assert(fserver != -1);
+    if (split) {
+        write_all(fserver, &mount, sizeof(mount.header) / 2);
+
+        /* A session mounted before is served in the meantime */
+        const int f = tfs_open("/check", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+
+        write_all(fserver, (char *)&mount + sizeof(mount.header) / 2,
+                  sizeof(mount) - sizeof(mount.header) / 2);
+    } else {
+        write_all(fserver, &mount, sizeof(mount));
+    }
+    close(fserver);
+
+    struct pollfd reply = {.fd = session.replies, .events = POLLIN};
+    assert(poll(&reply, 1, -1) == 1);
+    assert(fcntl(session.replies, F_SETFL, 0) == 0);
+    read_all(session.replies, &session.id, sizeof(session.id));
+    assert(session.id != -1);
+
+    session.requests = open(request_pipe, O_WRONLY);
+    assert(session.requests != -1);
+    return session;
+}
+
+/* Reads the reply to request, and returns its result */
+static int raw_reply(raw_session_t const *session, int request) {
+    int32_t reply[2];
+    read_all(session->replies, reply, sizeof(reply));
+    assert(reply[0] == request);
+    return reply[1];
+}
+
+static request_header_t raw_header(raw_session_t const *session, int op_code,
+                                   size_t size, int request) {
+    const request_header_t header = {.version = TFS_PROTOCOL_VERSION,
+                                     .op_code = (uint8_t)op_code,
+                                     .size = (uint16_t)size,
+                                     .session_id = session->id,
+                                     .request_id = request};
+    return header;
+}
+
+/* Waits for the parent to close its end of go */
+static void wait_go(int go) {
+    char byte;
+    assert(read(go, &byte, sizeof(byte)) == 0);
+}
+
+static void run_client(char const *server, int client_id, int ready,
+                       int const go[2]) {
+    raw_session_t session = raw_mount(server, client_id, false);
+    char contents[CONTENTS_SIZE];
+    memset(contents, 'a' + client_id % 26, sizeof(contents));
+
+    /* Only a few files can be open at a time: the other clients write to a
+     * handle that isn't open, which fails once the contents are all in */
+    int f = -1;
+    if (client_id < FILE_COUNT) {
+        struct {
+            request_header_t header;
+            open_request_t body;
+        } open_request = {raw_header(&session, TFS_OP_CODE_OPEN,
+                                     sizeof(open_request_t), 1),
+                          {{0}, TFS_O_CREAT}};
+        sprintf(open_request.body.name, "/p%d", client_id);
+        write_all(session.requests, &open_request, sizeof(open_request));
+        f = raw_reply(&session, 1);
+        assert(f != -1);
+    }
+
+    /* Half of the header of a close, then the rest */
+    struct {
+        request_header_t header;
+        close_request_t body;
+    } close_request = {raw_header(&session, TFS_OP_CODE_CLOSE,
+                                  sizeof(close_request_t), 2),
+                       {-1}};
+    write_all(session.requests, &close_request, sizeof(request_header_t) / 2);
+    write_all(ready, "", 1);
+    wait_go(go[0]);
+    write_all(session.requests,
+              (char *)&close_request + sizeof(request_header_t) / 2,
+              sizeof(close_request) - sizeof(request_header_t) / 2);
+    assert(raw_reply(&session, 2) == -1);
+
+    /* The whole write request, and half of its contents */
+    const request_header_t write_header =
+        raw_header(&session, TFS_OP_CODE_WRITE, sizeof(rw_request_t), 3);
+    const rw_request_t write_body = {f, 0, sizeof(contents)};
+    char write_request[sizeof(write_header) + sizeof(write_body)];
+    memcpy(write_request, &write_header, sizeof(write_header));
+    memcpy(write_request + sizeof(write_header), &write_body,
+           sizeof(write_body));
+    write_all(session.requests, write_request, sizeof(write_request));
+    write_all(session.requests, contents, sizeof(contents) / 2);
+    write_all(ready, "", 1);
+    wait_go(go[1]);
+    write_all(session.requests, contents + sizeof(contents) / 2,
+              sizeof(contents) - sizeof(contents) / 2);
+    /* A file only holds a block */
+    assert(raw_reply(&session, 3) == (f == -1 ? -1 : BLOCK_SIZE));
+
+    /* Files still open are closed with the session */
+    const request_header_t unmount =
+        raw_header(&session, TFS_OP_CODE_UNMOUNT, 0, 4);
+    write_all(session.requests, &unmount, sizeof(unmount));
+    assert(raw_reply(&session, 4) == 0);
+
+    _exit(0);
+}
+
+/* Waits for every client to signal it's halfway through a request, and
+ * checks that another client is served meanwhile */
+static void check_served(char const *server, int ready) {
+    for (int i = 0; i < CLIENT_COUNT; i++) {
+        char byte;
+        assert(read(ready, &byte, sizeof(byte)) == 1);
+    }
+
+    assert(tfs_mount(CHECK_PIPE, server) == 0);
+    const int f = tfs_open("/check", TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, "check", 5) == 5);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    struct stat server_stat;
+    assert(stat(argv[1], &server_stat) == 0);
+    use_socket = S_ISSOCK(server_stat.st_mode);
+
+    /* Only the server pipe takes mount requests */
+    if (!use_socket) {
+        assert(tfs_mount(CHECK_PIPE, argv[1]) == 0);
+        raw_session_t session = raw_mount(argv[1], CLIENT_COUNT, true);
+        const request_header_t unmount =
+            raw_header(&session, TFS_OP_CODE_UNMOUNT, 0, 1);
+        write_all(session.requests, &unmount, sizeof(unmount));
+        assert(raw_reply(&session, 1) == 0);
+        close(session.requests);
+        close(session.replies);
+        assert(tfs_unmount() == 0);
+    }
+
+    int ready[2], go[2][2];
+    assert(pipe(ready) == 0 && pipe(go[0]) == 0 && pipe(go[1]) == 0);
+
+    pid_t child_pids[CLIENT_COUNT];
+    for (int i = 0; i < CLIENT_COUNT; i++) {
+        child_pids[i] = fork();
+        assert(child_pids[i] >= 0);
+        if (child_pids[i] == 0) {
+            close(ready[0]);
+            close(go[0][1]);
+            close(go[1][1]);
+            const int go_read[2] = {go[0][0], go[1][0]};
+            run_client(argv[1], i, ready[1], go_read);
+        }
+    }
+    close(ready[1]);
+
+    /* Each time, every client is waiting halfway through a request */
+    check_served(argv[1], ready[0]);
+    close(go[0][1]);
+    check_served(argv[1], ready[0]);
+    close(go[1][1]);
+
+    for (int i = 0; i < CLIENT_COUNT; i++) {
+        int result;
+        waitpid(child_pids[i], &result, 0);
+        assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+    }
+
+    assert(tfs_mount(CHECK_PIPE, argv[1]) == 0);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char name[40];
+        char contents[BLOCK_SIZE + 1];
+        sprintf(name, "/p%d", i);
+        const int f = tfs_open(name, 0);
+        assert(f != -1);
+        assert(tfs_read(f, contents, sizeof(contents)) == BLOCK_SIZE);
+        for (size_t j = 0; j < BLOCK_SIZE; j++) {
+            assert(contents[j] == 'a' + i % 26);
+        }
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include "client/tecnicofs_client_api.h"
+#include "common/common.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*  This test sends the server requests of another version of the protocol,
+    and of the wrong size: a mount is skipped without a word, and a session
+    that sends one is dropped, while every other client is still served.
+    With the socket transport, mounts carry no request, so only sessions are
+    tried. */
+
+#define CLIENT_PIPE "/tmp/tfs_version_client"
+
+static void check_served(char const *server_pipe) {
+    assert(tfs_mount(CLIENT_PIPE, server_pipe) == 0);
+    const int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+}
+
+/* A connection that sends a request of a later version is dropped */
+static void check_socket_version(char const *server_socket) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, server_socket, sizeof(address.sun_path) - 1);
+    const int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(conn != -1);
+    assert(connect(conn, (struct sockaddr *)&address, sizeof(address)) == 0);
+
+    int32_t id;
+    assert(read(conn, &id, sizeof(id)) == sizeof(id) && id != -1);
+
+    const request_header_t header = {.version = TFS_PROTOCOL_VERSION + 1,
+                                     .op_code = TFS_OP_CODE_UNMOUNT,
+                                     .session_id = id};
+    assert(write(conn, &header, sizeof(header)) == sizeof(header));
+
+    char reply;
+    assert(read(conn, &reply, sizeof(reply)) == 0);
+    close(conn);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    /* Requests to a dropped session fail instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    struct stat server_stat;
+    assert(stat(argv[1], &server_stat) == 0);
+    if (S_ISSOCK(server_stat.st_mode)) {
+        check_socket_version(argv[1]);
+        check_served(argv[1]);
+        printf("Successful test.\n");
+        return 0;
+    }
+
+    /* A mount of a later version: its body is skipped, and the mount after
+     * it is read right */
+    const int server = open(argv[1], O_WRONLY);
+    assert(server != -1);
+    struct {
+        request_header_t header;
+        char body[64];
+    } mount = {.header = {.version = TFS_PROTOCOL_VERSION + 1,
+                          .op_code = TFS_OP_CODE_MOUNT,
+                          .size = 64,
+                          .session_id = -1}};
+    assert(write(server, &mount, sizeof(mount)) == sizeof(mount));
+    close(server);
+
+    check_served(argv[1]);
+
+    /* A session that sends a request of the wrong size is dropped */
+    assert(tfs_mount(CLIENT_PIPE, argv[1]) == 0);
+    const int f = tfs_open("/f1", 0);
+    assert(f != -1);
+
+    const int session = open(CLIENT_PIPE ".req", O_WRONLY);
+    assert(session != -1);
+    const request_header_t close_header = {.version = TFS_PROTOCOL_VERSION,
+                                           .op_code = TFS_OP_CODE_CLOSE,
+                                           .size = 2 * sizeof(int32_t),
+                                           .session_id = 0};
+    char request[sizeof(close_header) + 2 * sizeof(int32_t)] = {0};
+    memcpy(request, &close_header, sizeof(close_header));
+    assert(write(session, request, sizeof(request)) == sizeof(request));
+    close(session);
+
+    assert(tfs_close(f) == -1);
+    tfs_unmount();
+
+    check_served(argv[1]);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include "fs/request_queue.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+/*  This test has a few threads add requests to a queue at the same time,
+    while another takes them out, and checks every request comes out once,
+    whole, and in the order its thread added it. */
+
+#define PRODUCER_COUNT 4
+#define REQUESTS_PER_PRODUCER 50000
+
+static request_queue_t queue;
+
+static void *produce(void *arg) {
+    const int producer = (int)(size_t)arg;
+
+    for (int i = 0; i < REQUESTS_PER_PRODUCER; i++) {
+        unsigned position;
+        request_t *request;
+        while ((request = request_queue_reserve(&queue, &position)) == NULL) {
+            /* Full: let the consumer catch up */
+            sched_yield();
+        }
+
+        request->header.session_id = producer;
+        request->header.request_id = i;
+        request->header.size = sizeof(close_request_t);
+        request->body.close.fhandle = i;
+        request_queue_publish(&queue, position);
+    }
+
+    return NULL;
+}
+
+int main() {
+    request_queue_init(&queue);
+
+    pthread_t producers[PRODUCER_COUNT];
+    for (size_t i = 0; i < PRODUCER_COUNT; i++) {
+        assert(pthread_create(&producers[i], NULL, produce, (void *)i) == 0);
+    }
+
+    int next[PRODUCER_COUNT] = {0};
+    for (int taken = 0; taken < PRODUCER_COUNT * REQUESTS_PER_PRODUCER;) {
+        request_t request;
+        if (!request_queue_pop(&queue, &request)) {
+            sched_yield();
+            continue;
+        }
+        taken++;
+
+        const int producer = request.header.session_id;
+        assert(producer >= 0 && producer < PRODUCER_COUNT);
+        assert(request.header.request_id == next[producer]);
+        assert(request.header.size == sizeof(close_request_t));
+        assert(request.body.close.fhandle == next[producer]);
+        next[producer]++;
+    }
+
+    for (int i = 0; i < PRODUCER_COUNT; i++) {
+        assert(pthread_join(producers[i], NULL) == 0);
+        assert(next[i] == REQUESTS_PER_PRODUCER);
+    }
+    assert(request_queue_empty(&queue));
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include "client/tecnicofs_client_api.h"
+#include "common/shared.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*  This test is like client_server_simple_test, with the requests and file
+    contents going through a region shared with the server. The server must
+    be listening on a socket ('tfs_server <path> socket'). First, it checks
+    that a file that could be shrunk under the mapping is never mapped. Last,
+    more clients than the server has workers fill up the event the server
+    notifies them with before posting a request: each is dropped, and the
+    other clients are still served. */
+
+/* More than the server has workers */
+#define FLOODED_COUNT 80
+
+/* Shares a region with the server by hand, fills up the event it notifies
+ * the answers with, and posts a request.
+ * Returns: the session's connection */
+static int flood_session(char const *server) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, server, sizeof(address.sun_path) - 1);
+    const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(sock != -1);
+    assert(connect(sock, (struct sockaddr *)&address, sizeof(address)) == 0);
+    int id;
+    assert(read(sock, &id, sizeof(id)) == sizeof(id) && id != -1);
+
+    int region_fd;
+    shared_region_t *const region = shared_region_create(&region_fd);
+    assert(region != NULL);
+    const request_header_t share = {.version = TFS_PROTOCOL_VERSION,
+                                    .op_code = TFS_OP_CODE_SHARE,
+                                    .session_id = id,
+                                    .request_id = 1};
+    assert(write(sock, &share, sizeof(share)) == sizeof(share));
+    assert(try_send_fds(sock, "", 1, &region_fd, 1) == 1);
+    assert(close(region_fd) == 0);
+
+    int reply[2];
+    int events[2];
+    int count = 2;
+    assert(try_recv_fds(sock, reply, sizeof(reply), events, &count) ==
+           sizeof(reply));
+    assert(reply[0] == 1 && reply[1] == 0 && count == 2);
+
+    /* The most an eventfd holds */
+    const uint64_t full = UINT64_MAX - 1;
+    assert(write(events[1], &full, sizeof(full)) == sizeof(full));
+
+    void *data;
+    shared_request_t *const slot = shared_request_slot(region, &data);
+    assert(slot != NULL);
+    *slot = (shared_request_t){.op_code = TFS_OP_CODE_CLOSE, .fhandle = -1};
+    shared_request_post(region);
+    assert(shared_notify(events[0]) == 0);
+
+    shared_region_unmap(region);
+    assert(close(events[0]) == 0 && close(events[1]) == 0);
+    return sock;
+}
+
+int main(int argc, char **argv) {
+
+    char *str = "AAA!";
+    char *path = "/f1";
+    char buffer[40];
+    char block[BLOCK_SIZE];
+
+    int f;
+    ssize_t r;
+
+    if (argc < 2) {
+        printf("You must provide the following arguments: "
+               "'server_socket_path'\n");
+        return 1;
+    }
+
+    /* Neither an empty file nor one without seals is mapped */
+    FILE *const unsealed = tmpfile();
+    assert(unsealed != NULL);
+    assert(shared_region_map(fileno(unsealed)) == NULL);
+    assert(ftruncate(fileno(unsealed), sizeof(shared_region_t)) == 0);
+    assert(shared_region_map(fileno(unsealed)) == NULL);
+    fclose(unsealed);
+
+    int fd;
+    shared_region_t *const region = shared_region_create(&fd);
+    assert(region != NULL);
+    assert(ftruncate(fd, 0) == -1);
+    shared_region_t *const again = shared_region_map(fd);
+    assert(again != NULL);
+    shared_region_unmap(again);
+    shared_region_unmap(region);
+    assert(close(fd) == 0);
+
+    assert(tfs_mount_shared(argv[1]) == 0);
+
+    f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+
+    r = tfs_write(f, str, strlen(str));
+    assert(r == strlen(str));
+
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+
+    r = tfs_read(f, buffer, sizeof(buffer) - 1);
+    assert(r == strlen(str));
+
+    buffer[r] = '\0';
+    assert(strcmp(buffer, str) == 0);
+
+    assert(tfs_close(f) != -1);
+
+    /* A whole block */
+    memset(block, 'B', sizeof(block));
+    f = tfs_open(path, TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+    assert(tfs_close(f) != -1);
+
+    memset(block, 0, sizeof(block));
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, block, sizeof(block)) == sizeof(block));
+    for (size_t i = 0; i < sizeof(block); i++) {
+        assert(block[i] == 'B');
+    }
+    assert(tfs_close(f) != -1);
+
+    /* A closed file handle fails like it does through the pipes */
+    assert(tfs_close(f) == -1);
+
+    assert(tfs_unmount() == 0);
+
+    /* The session was freed */
+    assert(tfs_mount_shared(argv[1]) == 0);
+    assert(tfs_unmount() == 0);
+
+    int flooded[FLOODED_COUNT];
+    for (int i = 0; i < FLOODED_COUNT; i++) {
+        flooded[i] = flood_session(argv[1]);
+    }
+
+    assert(tfs_mount_shared(argv[1]) == 0);
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, 4) == 4);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+
+    for (int i = 0; i < FLOODED_COUNT; i++) {
+        char byte;
+        assert(read(flooded[i], &byte, sizeof(byte)) == 0);
+        assert(close(flooded[i]) == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
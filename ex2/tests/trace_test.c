@@ -0,0 +1,156 @@
+#include "common/trace.h"
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  This test has a few threads record events at the same time, one of them
+    more than its buffer holds, dumps them and reads the file back: every
+    thread's records are there in the order it recorded them, and the one that
+    overflowed kept its newest. Then a child process dumps its records when
+    asked to, and again when it's stopped by SIGTERM. */
+
+#define THREAD_COUNT 4
+#define RECORDS_PER_THREAD 1000
+#define TRACE_FILE "/tmp/tfs_trace_test"
+#define SIGNAL_TRACE_FILE "/tmp/tfs_trace_test_signal"
+#define SIGNAL_RECORDS 10
+
+static void *record(void *arg) {
+    const int64_t thread = (int64_t)(size_t)arg;
+    const int64_t count =
+        thread == 0 ? 3 * TRACE_BUFFER_RECORDS : RECORDS_PER_THREAD;
+
+    for (int64_t i = 0; i < count; i++) {
+        trace_record(TRACE_SERVE, thread, i);
+    }
+
+    return NULL;
+}
+
+/* Returns how many records the file at pathname holds */
+static uint64_t count_records(char const *pathname) {
+    FILE *const file = fopen(pathname, "rb");
+    assert(file != NULL);
+    trace_file_header_t header;
+    assert(fread(&header, sizeof(header), 1, file) == 1);
+    assert(header.magic == TRACE_FILE_MAGIC);
+    for (uint64_t i = 0; i < header.record_count; i++) {
+        trace_record_t record;
+        assert(fread(&record, sizeof(record), 1, file) == 1);
+        assert(record.event == TRACE_CALL);
+        assert(record.args[0] == (int64_t)i);
+    }
+    assert(fgetc(file) == EOF);
+    fclose(file);
+    return header.record_count;
+}
+
+/* Has a child record in two goes, dumping when asked after the first, and
+ * stops it with SIGTERM after the second */
+static void check_signals(void) {
+    /* The child works out where to dump when it's forked */
+    assert(setenv(TRACE_FILE_ENV, SIGNAL_TRACE_FILE, 1) == 0);
+    unlink(SIGNAL_TRACE_FILE);
+
+    int ready[2];
+    assert(pipe(ready) == 0);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        close(ready[0]);
+        for (int64_t i = 0; i < SIGNAL_RECORDS; i++) {
+            trace_record(TRACE_CALL, i, 0);
+        }
+        assert(raise(TRACE_DUMP_SIGNAL) == 0);
+        assert(count_records(SIGNAL_TRACE_FILE) == SIGNAL_RECORDS);
+
+        for (int64_t i = SIGNAL_RECORDS; i < 2 * SIGNAL_RECORDS; i++) {
+            trace_record(TRACE_CALL, i, 0);
+        }
+        assert(write(ready[1], "", 1) == 1);
+        while (true) {
+            pause();
+        }
+    }
+
+    close(ready[1]);
+    char byte;
+    assert(read(ready[0], &byte, sizeof(byte)) == 1);
+    close(ready[0]);
+    assert(kill(pid, SIGTERM) == 0);
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM);
+    assert(count_records(SIGNAL_TRACE_FILE) == 2 * SIGNAL_RECORDS);
+    unlink(SIGNAL_TRACE_FILE);
+}
+
+int main() {
+    /* Where the records are dumped again on exit */
+    assert(setenv(TRACE_FILE_ENV, TRACE_FILE, 1) == 0);
+
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, record, (void *)i) == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    assert(trace_dump(TRACE_FILE) == 0);
+
+    FILE *const file = fopen(TRACE_FILE, "rb");
+    assert(file != NULL);
+    trace_file_header_t header;
+    assert(fread(&header, sizeof(header), 1, file) == 1);
+    assert(header.magic == TRACE_FILE_MAGIC);
+    assert(header.version == TRACE_FILE_VERSION);
+
+    int64_t next[THREAD_COUNT] = {0};
+    uint64_t last_time[THREAD_COUNT] = {0};
+    uint32_t thread_of[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        thread_of[i] = UINT32_MAX;
+    }
+
+    for (uint64_t i = 0; i < header.record_count; i++) {
+        trace_record_t record;
+        assert(fread(&record, sizeof(record), 1, file) == 1);
+        assert(record.event == TRACE_SERVE);
+
+        const int64_t thread = record.args[0];
+        assert(thread >= 0 && thread < THREAD_COUNT);
+        if (thread_of[thread] == UINT32_MAX) {
+            thread_of[thread] = record.thread;
+            /* Only the newest records of the thread that overflowed */
+            next[thread] = record.args[1];
+            assert(thread == 0 ? next[thread] > 0 : next[thread] == 0);
+        }
+        assert(record.thread == thread_of[thread]);
+        assert(record.args[1] == next[thread]);
+        assert(record.time >= last_time[thread]);
+        last_time[thread] = record.time;
+        next[thread]++;
+    }
+    assert(fgetc(file) == EOF);
+    fclose(file);
+
+    assert(next[0] == 3 * TRACE_BUFFER_RECORDS);
+    for (int i = 1; i < THREAD_COUNT; i++) {
+        assert(next[i] == RECORDS_PER_THREAD);
+    }
+    assert(trace_event_name(TRACE_SERVE) != NULL);
+    assert(trace_event_name(TRACE_EVENT_AMOUNT) == NULL);
+
+    check_signals();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
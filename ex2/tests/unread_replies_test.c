@@ -0,0 +1,298 @@
+#include "client/tecnicofs_client_api.h"
+#include "common/common.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*  This test has more clients than the server has workers pipeline reads of
+    a byte, without reading any of the replies, for as long as the server
+    takes them in. Meanwhile, another client must still be served. Then each
+    client reads its replies, which must all be there, in order, and the
+    server must serve the rest of its requests. */
+
+/* More than the server has workers */
+#define CLIENT_COUNT 80
+/* Clients that read the file: the others read a handle that isn't open */
+#define FILE_COUNT 8
+/* Reads a client sends at most */
+#define READ_COUNT 50000
+/* How long a client waits for the server to take in more before it stops */
+#define STALL_MS 300
+#define CLIENT_PIPE_NAME_FORMAT "/tmp/tfs_u%d"
+#define CHECK_PIPE "/tmp/tfs_u_check"
+#define FILE_NAME "/unread"
+
+/* A read request, header and body, as it goes on the wire */
+#define READ_REQUEST_SIZE (sizeof(request_header_t) + sizeof(rw_request_t))
+
+static bool use_socket;
+
+/* A session mounted by hand, to send it requests it doesn't read the replies
+ * to */
+typedef struct {
+    int id;
+    int requests;
+    int replies;
+} raw_session_t;
+
+static void write_all(int fd, void const *buf, size_t size) {
+    for (size_t done = 0; done < size;) {
+        const ssize_t rc = write(fd, (char const *)buf + done, size - done);
+        assert(rc > 0);
+        done += (size_t)rc;
+    }
+}
+
+static void read_all(int fd, void *buf, size_t size) {
+    for (size_t done = 0; done < size;) {
+        const ssize_t rc = read(fd, (char *)buf + done, size - done);
+        assert(rc > 0);
+        done += (size_t)rc;
+    }
+}
+
+/* Mounts a session through the server pipe or the server socket */
+static raw_session_t raw_mount(char const *server, int client_id) {
+    raw_session_t session;
+
+    if (use_socket) {
+        struct sockaddr_un address = {.sun_family = AF_UNIX};
+        strncpy(address.sun_path, server, sizeof(address.sun_path) - 1);
+        session.requests = session.replies = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert(session.requests != -1);
+        assert(connect(session.requests, (struct sockaddr *)&address,
+                       sizeof(address)) == 0);
+        read_all(session.replies, &session.id, sizeof(session.id));
+        assert(session.id != -1);
+        return session;
+    }
+
+    char client_pipe[40];
+    char request_pipe[48];
+    sprintf(client_pipe, CLIENT_PIPE_NAME_FORMAT, client_id);
+    sprintf(request_pipe, "%s%s", client_pipe, REQUEST_PIPE_SUFFIX);
+    unlink(client_pipe);
+    unlink(request_pipe);
+    assert(mkfifo(client_pipe, 0640) == 0 && mkfifo(request_pipe, 0640) == 0);
+    session.replies = open(client_pipe, O_RDONLY | O_NONBLOCK);
+    assert(session.replies != -1);
+
+    struct {
+        request_header_t header;
+        mount_request_t body;
+    } mount = {{.version = TFS_PROTOCOL_VERSION,
+                .op_code = TFS_OP_CODE_MOUNT,
+                .size = sizeof(mount_request_t),
+                .session_id = -1},
+               {{0}}};
+    strcpy(mount.body.client_pipe, client_pipe);
+
+    const int fserver = open(server, O_WRONLY);
+    assert(fserver != -1);
+    write_all(fserver, &mount, sizeof(mount));
+    close(fserver);
+
+    struct pollfd reply = {.fd = session.replies, .events = POLLIN};
+    assert(poll(&reply, 1, -1) == 1);
+    assert(fcntl(session.replies, F_SETFL, 0) == 0);
+    read_all(session.replies, &session.id, sizeof(session.id));
+    assert(session.id != -1);
+
+    session.requests = open(request_pipe, O_WRONLY);
+    assert(session.requests != -1);
+    return session;
+}
+
+static request_header_t raw_header(raw_session_t const *session, int op_code,
+                                   size_t size, int request) {
+    const request_header_t header = {.version = TFS_PROTOCOL_VERSION,
+                                     .op_code = (uint8_t)op_code,
+                                     .size = (uint16_t)size,
+                                     .session_id = session->id,
+                                     .request_id = request};
+    return header;
+}
+
+/* Sends as much of buf as the channel takes in, until it stops taking in
+ * more for a while.
+ * Returns: the bytes sent */
+static size_t send_until_stalled(int fd, char const *buf, size_t size) {
+    assert(fcntl(fd, F_SETFL, O_NONBLOCK) == 0);
+
+    size_t sent = 0;
+    while (sent < size) {
+        const ssize_t rc = write(fd, buf + sent, size - sent);
+        if (rc > 0) {
+            sent += (size_t)rc;
+            continue;
+        }
+        assert(rc == -1 && errno == EAGAIN);
+
+        struct pollfd channel = {.fd = fd, .events = POLLOUT};
+        if (poll(&channel, 1, STALL_MS) == 0) {
+            break;
+        }
+    }
+
+    assert(fcntl(fd, F_SETFL, 0) == 0);
+    return sent;
+}
+
+/* Reads the reply to the read with id request, and checks it holds the
+ * expected length, and the byte if it's 1 */
+static void read_reply(raw_session_t const *session, int request,
+                       int expected) {
+    int32_t id;
+    int chunk;
+    read_all(session->replies, &id, sizeof(id));
+    read_all(session->replies, &chunk, sizeof(chunk));
+    assert(id == request);
+    assert(chunk == expected);
+
+    if (chunk == 1) {
+        char byte;
+        int end;
+        read_all(session->replies, &byte, sizeof(byte));
+        read_all(session->replies, &end, sizeof(end));
+        assert(byte == 'u' && end == 0);
+    }
+}
+
+static void run_client(char const *server, int client_id, int ready,
+                       int go) {
+    raw_session_t session = raw_mount(server, client_id);
+    int32_t reply[2];
+
+    int f = -1;
+    if (client_id < FILE_COUNT) {
+        struct {
+            request_header_t header;
+            open_request_t body;
+        } open_request = {
+            raw_header(&session, TFS_OP_CODE_OPEN, sizeof(open_request_t), 0),
+            {FILE_NAME, 0}};
+        write_all(session.requests, &open_request, sizeof(open_request));
+        read_all(session.replies, reply, sizeof(reply));
+        assert(reply[0] == 0 && reply[1] != -1);
+        f = reply[1];
+    }
+
+    /* Reads of a byte, each the next of the file, until it ends */
+    char *const requests = malloc(READ_COUNT * READ_REQUEST_SIZE);
+    assert(requests != NULL);
+    for (int i = 0; i < READ_COUNT; i++) {
+        const request_header_t header = raw_header(
+            &session, TFS_OP_CODE_READ, sizeof(rw_request_t), i + 1);
+        const rw_request_t body = {f, 0, 1};
+        char *const request = requests + (size_t)i * READ_REQUEST_SIZE;
+        memcpy(request, &header, sizeof(header));
+        memcpy(request + sizeof(header), &body, sizeof(body));
+    }
+
+    const size_t sent = send_until_stalled(
+        session.requests, requests, READ_COUNT * READ_REQUEST_SIZE);
+    /* The server stops taking requests in well before they're all sent */
+    assert(sent < READ_COUNT * READ_REQUEST_SIZE);
+    write_all(ready, "", 1);
+    char byte;
+    assert(read(go, &byte, sizeof(byte)) == 0);
+
+    /* The replies to the requests sent whole, then the rest of the one sent
+     * in part */
+    const int whole = (int)(sent / READ_REQUEST_SIZE);
+    for (int i = 0; i <= whole; i++) {
+        if (i == whole) {
+            if (sent % READ_REQUEST_SIZE == 0) {
+                break;
+            }
+            write_all(session.requests, requests + sent,
+                      READ_REQUEST_SIZE - sent % READ_REQUEST_SIZE);
+        }
+        read_reply(&session, i + 1, f == -1 ? -1 : i < BLOCK_SIZE);
+    }
+    free(requests);
+
+    const request_header_t unmount =
+        raw_header(&session, TFS_OP_CODE_UNMOUNT, 0, READ_COUNT + 1);
+    write_all(session.requests, &unmount, sizeof(unmount));
+    read_all(session.replies, reply, sizeof(reply));
+    assert(reply[0] == READ_COUNT + 1 && reply[1] == 0);
+
+    _exit(0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(
+            "You must provide the following arguments: 'server_pipe_path'\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    struct stat server_stat;
+    assert(stat(argv[1], &server_stat) == 0);
+    use_socket = S_ISSOCK(server_stat.st_mode);
+
+    char contents[BLOCK_SIZE];
+    memset(contents, 'u', sizeof(contents));
+    assert(tfs_mount(CHECK_PIPE, argv[1]) == 0);
+    int f = tfs_open(FILE_NAME, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+
+    int ready[2], go[2];
+    assert(pipe(ready) == 0 && pipe(go) == 0);
+
+    pid_t child_pids[CLIENT_COUNT];
+    for (int i = 0; i < CLIENT_COUNT; i++) {
+        child_pids[i] = fork();
+        assert(child_pids[i] >= 0);
+        if (child_pids[i] == 0) {
+            close(ready[0]);
+            close(go[1]);
+            run_client(argv[1], i, ready[1], go[0]);
+        }
+    }
+    close(ready[1]);
+    close(go[0]);
+
+    for (int i = 0; i < CLIENT_COUNT; i++) {
+        char byte;
+        assert(read(ready[0], &byte, sizeof(byte)) == 1);
+    }
+
+    /* Every client stopped reading its replies, and this one is served all
+     * the same, without waiting for them */
+    alarm(10);
+    assert(tfs_mount(CHECK_PIPE, argv[1]) == 0);
+    f = tfs_open(FILE_NAME, 0);
+    assert(f != -1);
+    assert(tfs_read(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+    alarm(0);
+    close(go[1]);
+
+    for (int i = 0; i < CLIENT_COUNT; i++) {
+        int result;
+        waitpid(child_pids[i], &result, 0);
+        assert(WIFEXITED(result) && WEXITSTATUS(result) == 0);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include "common/common.h"
+#include "common/trace.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*  Prints the records of a trace file, written by a server or client built
+    with make TRACE=1 (or 2), in order of time: microseconds since the first
+    record, the thread, the event and its arguments. */
+
+static char const *const op_names[TFS_OP_CODE_AMOUNT] = {
+    "no-op", "mount", "unmount", "open", "close",
+    "write", "read",  "shutdown", "share"};
+
+static int compare_records(void const *a, void const *b) {
+    const uint64_t time_a = ((trace_record_t const *)a)->time;
+    const uint64_t time_b = ((trace_record_t const *)b)->time;
+    return (time_a > time_b) - (time_a < time_b);
+}
+
+/* Whether the first argument of event is an op code */
+static bool takes_op_code(uint32_t event) {
+    return event == TRACE_DECODED || event == TRACE_SERVE ||
+           event == TRACE_SERVED || event == TRACE_CALL ||
+           event == TRACE_RETURN;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *const file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    trace_file_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != TRACE_FILE_MAGIC ||
+        header.version != TRACE_FILE_VERSION) {
+        fprintf(stderr, "[ERR]: %s is not a trace file\n", argv[1]);
+        return 1;
+    }
+
+    trace_record_t *const records =
+        malloc(header.record_count * sizeof(trace_record_t) + 1);
+    if (records == NULL ||
+        fread(records, sizeof(trace_record_t), header.record_count, file) !=
+            header.record_count) {
+        fprintf(stderr, "[ERR]: could not read the records of %s\n",
+                argv[1]);
+        return 1;
+    }
+    fclose(file);
+
+    qsort(records, header.record_count, sizeof(trace_record_t),
+          compare_records);
+
+    for (uint64_t i = 0; i < header.record_count; i++) {
+        trace_record_t const *const record = &records[i];
+        char const *const name = trace_event_name(record->event);
+        printf("%12.3f %3" PRIu32 " %-12s ",
+               (double)(record->time - records[0].time) / 1000.0,
+               record->thread, name != NULL ? name : "?");
+
+        if (takes_op_code(record->event) && record->args[0] >= 0 &&
+            record->args[0] < TFS_OP_CODE_AMOUNT) {
+            printf("%-8s", op_names[record->args[0]]);
+        } else {
+            printf("%-8" PRId64, record->args[0]);
+        }
+        printf(" %" PRId64 "\n", record->args[1]);
+    }
+
+    free(records);
+    return 0;
+}